@@ -0,0 +1,667 @@
+#include "file_protection.h"
+
+#include <sys/mount.h>
+#include <sys/wait.h>
+
+// End-to-end load test: starts the daemon on a scratch tree, enables
+// protection and then creates, modifies, renames and deletes files across the
+// tree as fast as it can. Mixed into the churn are probes: a protected file
+// created (which the daemon must remove) or a protected file tampered with
+// (which the daemon must protect again). A separate inotify watcher sees the
+// daemon's reaction, so each probe measures the delay from our syscall to the
+// enforcement action. Results, including throughput, overflows and the
+// daemon's CPU time and peak RSS, are written as JSON.
+
+#define PROBE_TIMEOUT_S 10.0
+#define PROBE_EVERY 8 // One probe per this many churn files
+
+typedef enum
+{
+    PROBE_CREATE, // Create a protected file; done when the daemon deletes it
+    PROBE_MODIFY, // Write a protected file; done when the daemon makes it immutable again
+} ProbeKind;
+
+typedef struct
+{
+    ProbeKind kind;
+    int dir;
+    int fd; // PROBE_MODIFY: kept open to poll the immutable flag
+    atomic_int state; // 0 waiting for our own event, 1 seen, 2 enforced
+    _Atomic double start;
+    double latency;
+} Probe;
+
+typedef struct
+{
+    const char *scratch;
+    const char *daemon;
+    const char *output;
+    char **daemon_args;
+    int files;
+    int depth;
+    int fanout;
+    int image_mb;
+} StormOptions;
+
+static char **directories = NULL;
+static int directory_count = 0;
+static Probe *probes = NULL;
+static int probe_count = 0;
+static atomic_int probes_done = 0;
+static int observer_fd = -1;
+static int *observer_wds = NULL;
+static atomic_int observer_running = 1;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [options] [-- daemon options]\n", program);
+    printf("  --dir PATH      Scratch directory (default /tmp/file_protection_bench)\n");
+    printf("  --daemon PATH   Daemon binary (default bin/file_protection)\n");
+    printf("  --files N       Files to churn through (default 4000)\n");
+    printf("  --depth N       Directory tree depth (default 2)\n");
+    printf("  --fanout N      Subdirectories per directory (default 4)\n");
+    printf("  --image MB      Run inside a loop-mounted ext4 image of this size\n");
+    printf("  --output PATH   JSON results file (default bench_results.json)\n");
+}
+
+static int run_command(const char *format, ...)
+{
+    char command[MAX_PATH_LEN * 2];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(command, sizeof(command), format, args);
+    va_end(args);
+    return system(command);
+}
+
+static void add_directory(const char *path)
+{
+    directories = realloc(directories, (size_t)(directory_count + 1) * sizeof(char *));
+    directories[directory_count++] = strdup(path);
+}
+
+static int build_tree(const char *path, int depth, int fanout)
+{
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+    add_directory(path);
+    if (depth == 0)
+        return 0;
+    for (int i = 0; i < fanout; i++)
+    {
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/d%d", path, i);
+        if (build_tree(child, depth - 1, fanout) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void probe_path(int index, char *path, size_t size)
+{
+    snprintf(path, size, "%s/p%06d.key", directories[probes[index].dir], index);
+}
+
+static int probe_from_name(const char *name)
+{
+    int index;
+    char suffix[8];
+    if (sscanf(name, "p%06d.%7s", &index, suffix) != 2 || strcmp(suffix, "key") != 0 || index < 0 ||
+        index >= probe_count)
+        return -1;
+    return index;
+}
+
+static void probe_enforced(Probe *probe, double now)
+{
+    probe->latency = now - atomic_load(&probe->start);
+    atomic_store(&probe->state, 2);
+    atomic_fetch_add(&probes_done, 1);
+}
+
+// Setting the immutable flag raises no inotify event, so tampered probes
+// whose write has been seen are polled for the flag instead
+static void poll_modify_probes(void)
+{
+    double now = now_seconds();
+    for (int i = 0; i < probe_count; i++)
+    {
+        Probe *probe = &probes[i];
+        int flags = 0;
+        if (probe->kind == PROBE_MODIFY && atomic_load(&probe->state) == 1 &&
+            ioctl(probe->fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_IMMUTABLE_FL))
+        {
+            probe_enforced(probe, now);
+        }
+    }
+}
+
+// Watch the daemon's reaction to each probe from outside
+static void *observer_main(void *arg)
+{
+    (void)arg;
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (atomic_load(&observer_running))
+    {
+        poll_modify_probes();
+        ssize_t length = read(observer_fd, buffer, sizeof(buffer));
+        double now = now_seconds();
+        if (length <= 0)
+        {
+            if (length < 0 && errno != EINTR && errno != EAGAIN)
+                break;
+            struct timespec pause = {0, 100000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        for (ssize_t i = 0; i < length;)
+        {
+            struct inotify_event *event = (struct inotify_event *)&buffer[i];
+            i += EVENT_SIZE + event->len;
+            int index = event->len ? probe_from_name(event->name) : -1;
+            if (index < 0)
+                continue;
+
+            Probe *probe = &probes[index];
+            int state = atomic_load(&probe->state);
+            if (state == 2)
+                continue; // Later events come from the daemon's own follow-up work
+            if (probe->kind == PROBE_CREATE)
+            {
+                if (state == 0 && (event->mask & IN_CREATE))
+                    atomic_store(&probe->state, 1);
+                else if (state == 1 && (event->mask & IN_DELETE))
+                    probe_enforced(probe, now);
+            }
+            else if (state == 0 && (event->mask & IN_MODIFY))
+            {
+                atomic_store(&probe->state, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int set_immutable_flag(int fd, int on)
+{
+    int flags = 0;
+    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0)
+        return -1;
+    flags = on ? (flags | FS_IMMUTABLE_FL) : (flags & ~FS_IMMUTABLE_FL);
+    return ioctl(fd, FS_IOC_SETFLAGS, &flags);
+}
+
+static void run_probe(int index)
+{
+    char path[MAX_PATH_LEN];
+    probe_path(index, path, sizeof(path));
+    Probe *probe = &probes[index];
+
+    if (probe->kind == PROBE_CREATE)
+    {
+        atomic_store(&probe->start, now_seconds());
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // The file is protected by the enable sweep; lift the flag and write
+    set_immutable_flag(probe->fd, 0);
+    atomic_store(&probe->start, now_seconds());
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        if (write(fd, "x", 1) < 0)
+            perror("write");
+        close(fd);
+    }
+}
+
+// One unprotected file through its life: create, modify, rename, delete
+static void churn_file(int index)
+{
+    const char *dir = directories[index % directory_count];
+    char path[MAX_PATH_LEN], renamed[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/c%06d.tmp", dir, index);
+    snprintf(renamed, sizeof(renamed), "%s/c%06d.old", dir, index);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, "churn\n", 6) < 0)
+        perror("write");
+    close(fd);
+    rename(path, renamed);
+    unlink(renamed);
+}
+
+static int wait_for_output(const char *path, const char *needle, double timeout)
+{
+    double deadline = now_seconds() + timeout;
+    while (now_seconds() < deadline)
+    {
+        FILE *file = fopen(path, "r");
+        if (file != NULL)
+        {
+            char line[1024];
+            while (fgets(line, sizeof(line), file) != NULL)
+            {
+                if (strstr(line, needle) != NULL)
+                {
+                    fclose(file);
+                    return 0;
+                }
+            }
+            fclose(file);
+        }
+        struct timespec pause = {0, 20000000};
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+// Function to pull one counter out of the daemon's status output
+static unsigned long scan_output(const char *path, const char *format)
+{
+    unsigned long value = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned long parsed;
+        if (sscanf(line, format, &parsed) == 1)
+            value = parsed; // Keep the last status printed
+    }
+    fclose(file);
+    return value;
+}
+
+static void process_usage(pid_t pid, double *cpu_seconds, long *peak_rss_kb)
+{
+    char path[64], line[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        if (fgets(line, sizeof(line), file) != NULL)
+        {
+            // Fields after the parenthesised command name; utime and stime are 14 and 15
+            char *p = strrchr(line, ')');
+            unsigned long utime = 0, stime = 0;
+            if (p != NULL &&
+                sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+            {
+                *cpu_seconds = (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+            }
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    file = fopen(path, "r");
+    if (file != NULL)
+    {
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            sscanf(line, "VmHWM: %ld kB", peak_rss_kb);
+        }
+        fclose(file);
+    }
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p)
+{
+    if (count == 0)
+        return 0.0;
+    int index = (int)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static pid_t start_daemon(const StormOptions *opts, const char *work, int *command_fd)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char out_path[MAX_PATH_LEN + 32]; // work and a file name
+        snprintf(out_path, sizeof(out_path), "%s/daemon.out", work);
+        int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(pipe_fds[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(pipe_fds[1]);
+        if (chdir(work) < 0)
+            _exit(127);
+
+        int extra = 0;
+        while (opts->daemon_args[extra] != NULL)
+            extra++;
+        char **argv = calloc((size_t)extra + 2, sizeof(char *));
+        argv[0] = (char *)opts->daemon;
+        for (int i = 0; i < extra; i++)
+            argv[i + 1] = opts->daemon_args[i];
+        execv(opts->daemon, argv);
+        _exit(127);
+    }
+    close(pipe_fds[0]);
+    *command_fd = pipe_fds[1];
+    return pid;
+}
+
+static void send_command(int fd, const char *command)
+{
+    if (write(fd, command, strlen(command)) < 0)
+        perror("write");
+}
+
+// Function to remove the scratch tree, lifting immutable flags left behind
+static void clear_tree(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    DIR *dir = fdopendir(fd);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (entry->d_type == DT_DIR)
+        {
+            clear_tree(child);
+            rmdir(child);
+            continue;
+        }
+        int file_fd = openat(fd, entry->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (file_fd >= 0)
+        {
+            set_immutable_flag(file_fd, 0);
+            close(file_fd);
+        }
+        unlink(child);
+    }
+    if (dir != NULL)
+        closedir(dir);
+}
+
+static int parse_options(int argc, char *argv[], StormOptions *opts)
+{
+    static char *no_args[] = {NULL};
+    *opts = (StormOptions){
+        .scratch = "/tmp/file_protection_bench",
+        .daemon = "bin/file_protection",
+        .output = "bench_results.json",
+        .daemon_args = no_args,
+        .files = 4000,
+        .depth = 2,
+        .fanout = 4,
+        .image_mb = 0,
+    };
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--") == 0)
+        {
+            opts->daemon_args = &argv[i + 1];
+            break;
+        }
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (value == NULL)
+        {
+            usage(argv[0]);
+            return -1;
+        }
+        if (strcmp(argv[i], "--dir") == 0)
+            opts->scratch = value;
+        else if (strcmp(argv[i], "--daemon") == 0)
+            opts->daemon = value;
+        else if (strcmp(argv[i], "--output") == 0)
+            opts->output = value;
+        else if (strcmp(argv[i], "--files") == 0)
+            opts->files = atoi(value);
+        else if (strcmp(argv[i], "--depth") == 0)
+            opts->depth = atoi(value);
+        else if (strcmp(argv[i], "--fanout") == 0)
+            opts->fanout = atoi(value);
+        else if (strcmp(argv[i], "--image") == 0)
+            opts->image_mb = atoi(value);
+        else
+        {
+            usage(argv[0]);
+            return -1;
+        }
+        i++;
+    }
+    if (opts->files <= 0 || opts->depth < 0 || opts->fanout <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    StormOptions opts;
+    int parsed = parse_options(argc, argv, &opts);
+    if (parsed != 0)
+        return parsed < 0 ? 1 : 0;
+
+    char daemon_path[PATH_MAX];
+    if (realpath(opts.daemon, daemon_path) == NULL)
+    {
+        fprintf(stderr, "Daemon binary not found: %s\n", opts.daemon);
+        return 1;
+    }
+    opts.daemon = daemon_path;
+
+    // Scratch layout: <dir>/work holds the daemon's files, <dir>/tree is protected
+    char work[MAX_PATH_LEN], tree[MAX_PATH_LEN];
+    mkdir(opts.scratch, 0755);
+    if (snprintf(work, sizeof(work), "%s/work", opts.scratch) >= (int)sizeof(work) ||
+        snprintf(tree, sizeof(tree), "%s/tree", opts.scratch) >= (int)sizeof(tree))
+    {
+        fprintf(stderr, "Scratch directory path too long: %s\n", opts.scratch);
+        return 1;
+    }
+    clear_tree(tree);
+    rmdir(tree);
+    mkdir(work, 0755);
+    mkdir(tree, 0755);
+
+    int mounted = 0;
+    if (opts.image_mb > 0)
+    {
+        if (run_command("truncate -s %dM '%s/image.img' && mkfs.ext4 -q -F '%s/image.img' && "
+                        "mount -o loop '%s/image.img' '%s'",
+                        opts.image_mb, opts.scratch, opts.scratch, opts.scratch, tree) != 0)
+        {
+            fprintf(stderr, "Could not loop-mount an image at %s\n", tree);
+            return 1;
+        }
+        mounted = 1;
+    }
+
+    if (build_tree(tree, opts.depth, opts.fanout) < 0)
+    {
+        perror("build tree");
+        return 1;
+    }
+
+    // Probes alternate between protected files to create and to tamper with
+    probe_count = opts.files / PROBE_EVERY + 1;
+    probes = calloc((size_t)probe_count, sizeof(Probe));
+    for (int i = 0; i < probe_count; i++)
+    {
+        probes[i].kind = i % 2 == 0 ? PROBE_CREATE : PROBE_MODIFY;
+        probes[i].dir = (i * 7) % directory_count;
+        if (probes[i].kind == PROBE_MODIFY)
+        {
+            char path[MAX_PATH_LEN];
+            probe_path(i, path, sizeof(path));
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd >= 0)
+                close(fd);
+            probes[i].fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+    }
+
+    char template_path[MAX_PATH_LEN + 32];
+    snprintf(template_path, sizeof(template_path), "%s/%s", work, TEMPLATE_FILE);
+    FILE *template = fopen(template_path, "w");
+    if (template == NULL)
+    {
+        perror("template");
+        return 1;
+    }
+    fprintf(template, "%s\n%s\n*.key\n", crypt("bench", "fp"), tree);
+    fclose(template);
+    char out_path[MAX_PATH_LEN + 32];
+    snprintf(out_path, sizeof(out_path), "%s/daemon.out", work);
+    unlink(out_path); // Do not wait on the previous run's output
+
+    int command_fd;
+    pid_t pid = start_daemon(&opts, work, &command_fd);
+    if (pid < 0 || wait_for_output(out_path, "File protection system started", 30.0) < 0)
+    {
+        fprintf(stderr, "Daemon did not start; see %s\n", out_path);
+        return 1;
+    }
+    send_command(command_fd, "enable\n");
+    if (wait_for_output(out_path, "Protection sweep (protect) finished", 60.0) < 0)
+    {
+        fprintf(stderr, "Enable sweep did not finish; see %s\n", out_path);
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    observer_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    observer_wds = calloc((size_t)directory_count, sizeof(int));
+    for (int i = 0; i < directory_count; i++)
+    {
+        observer_wds[i] = inotify_add_watch(observer_fd, directories[i], IN_CREATE | IN_DELETE | IN_MODIFY);
+    }
+    pthread_t observer;
+    pthread_create(&observer, NULL, observer_main, NULL);
+
+    double cpu_before = 0.0, cpu_after = 0.0;
+    long peak_rss_kb = 0;
+    process_usage(pid, &cpu_before, &peak_rss_kb);
+
+    printf("Storm: %d files over %d directories, %d probes\n", opts.files, directory_count, probe_count);
+    double start = now_seconds();
+    int next_probe = 0;
+    for (int i = 0; i < opts.files; i++)
+    {
+        churn_file(i);
+        if (i % PROBE_EVERY == 0 && next_probe < probe_count)
+            run_probe(next_probe++);
+    }
+    while (next_probe < probe_count)
+        run_probe(next_probe++);
+    double generated = now_seconds();
+
+    while (atomic_load(&probes_done) < probe_count && now_seconds() - generated < PROBE_TIMEOUT_S)
+    {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+    double finished = now_seconds();
+
+    send_command(command_fd, "status\n");
+    wait_for_output(out_path, "Log queue:", 5.0);
+    struct timespec settle = {0, 300000000};
+    nanosleep(&settle, NULL);
+    process_usage(pid, &cpu_after, &peak_rss_kb);
+    unsigned long events = scan_output(out_path, "Event pipeline: %lu events");
+    unsigned long overflows = scan_output(out_path, "Queue overflows: %lu");
+
+    // Stop observing first: shutdown unprotects files, which is not enforcement
+    atomic_store(&observer_running, 0);
+    pthread_join(observer, NULL);
+    close(observer_fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(command_fd);
+
+    double *latencies = malloc((size_t)probe_count * sizeof(double));
+    int completed = 0;
+    for (int i = 0; i < probe_count; i++)
+    {
+        if (atomic_load(&probes[i].state) == 2)
+            latencies[completed++] = probes[i].latency * 1e6;
+    }
+    qsort(latencies, (size_t)completed, sizeof(double), compare_double);
+
+    double elapsed = finished - start;
+    double cpu = cpu_after - cpu_before;
+    FILE *json = fopen(opts.output, "w");
+    if (json == NULL)
+    {
+        perror(opts.output);
+        return 1;
+    }
+    fprintf(json, "{\n");
+    fprintf(json, "  \"benchmark\": \"event_storm\",\n");
+    fprintf(json, "  \"config\": {\"files\": %d, \"directories\": %d, \"depth\": %d, \"fanout\": %d, "
+                  "\"loop_image_mb\": %d},\n",
+            opts.files, directory_count, opts.depth, opts.fanout, opts.image_mb);
+    fprintf(json, "  \"generate_seconds\": %.6f,\n", generated - start);
+    fprintf(json, "  \"elapsed_seconds\": %.6f,\n", elapsed);
+    fprintf(json, "  \"events_handled\": %lu,\n", events);
+    fprintf(json, "  \"events_per_second\": %.1f,\n", elapsed > 0 ? (double)events / elapsed : 0.0);
+    fprintf(json, "  \"probes\": {\"total\": %d, \"enforced\": %d, \"timed_out\": %d},\n", probe_count, completed,
+            probe_count - completed);
+    fprintf(json, "  \"enforcement_latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n",
+            percentile(latencies, completed, 0.50), percentile(latencies, completed, 0.99),
+            percentile(latencies, completed, 0.999), completed ? latencies[completed - 1] : 0.0);
+    fprintf(json, "  \"overflows\": %lu,\n", overflows);
+    fprintf(json, "  \"daemon_cpu_seconds\": %.3f,\n", cpu);
+    fprintf(json, "  \"daemon_cpu_percent\": %.1f,\n", elapsed > 0 ? 100.0 * cpu / elapsed : 0.0);
+    fprintf(json, "  \"daemon_peak_rss_kb\": %ld\n", peak_rss_kb);
+    fprintf(json, "}\n");
+    fclose(json);
+
+    printf("%lu events in %.3fs (%.0f/s), %d/%d probes enforced, latency p50 %.0fus p99 %.0fus p999 %.0fus, "
+           "%lu overflows, daemon CPU %.2fs, peak RSS %ld kB\n",
+           events, elapsed, elapsed > 0 ? (double)events / elapsed : 0.0, completed, probe_count,
+           percentile(latencies, completed, 0.50), percentile(latencies, completed, 0.99),
+           percentile(latencies, completed, 0.999), overflows, cpu, peak_rss_kb);
+    printf("Results written to %s\n", opts.output);
+
+    clear_tree(tree);
+    if (mounted)
+    {
+        // Inotify marks on the image are released lazily after the daemon exits
+        if (umount(tree) < 0 && umount2(tree, MNT_DETACH) < 0)
+            fprintf(stderr, "Could not unmount %s: %s\n", tree, strerror(errno));
+        run_command("rm -f '%s/image.img'", opts.scratch);
+    }
+    free(latencies);
+    return completed == probe_count ? 0 : 2;
+}
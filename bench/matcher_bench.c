@@ -0,0 +1,204 @@
+#include "file_protection.h"
+
+// Microbenchmark: compiled template matcher versus the fnmatch loop that
+// is_protected used to run. Every name is checked with both, so the run also
+// fails loudly if the two ever disagree.
+
+#define BENCH_NAMES 20000
+#define BENCH_ROUNDS 5
+
+static const char *extensions[] = {"txt", "doc", "docx", "pdf", "c", "h", "key", "pem", "tar.gz", "log", "conf", "json"};
+#define EXTENSION_COUNT (sizeof(extensions) / sizeof(extensions[0]))
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void random_word(char *out, int len)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+    for (int i = 0; i < len; i++)
+    {
+        out[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    out[len] = '\0';
+}
+
+// A mix of the shapes found in real template files
+static char *random_pattern(int i)
+{
+    char word[32], buf[MAX_FILENAME_LEN];
+    random_word(word, 3 + rand() % 6);
+    switch (i % 6)
+    {
+    case 0:
+        snprintf(buf, sizeof(buf), "%s.%s", word, extensions[rand() % EXTENSION_COUNT]);
+        break;
+    case 1:
+        snprintf(buf, sizeof(buf), "*.%s%d", word, i);
+        break;
+    case 2:
+        snprintf(buf, sizeof(buf), "%s*.%s", word, extensions[rand() % EXTENSION_COUNT]);
+        break;
+    case 3:
+        snprintf(buf, sizeof(buf), "*%s?[0-9]*", word);
+        break;
+    case 4:
+        snprintf(buf, sizeof(buf), "[!.]%s[a-f]*.b\\ak", word);
+        break;
+    default:
+        snprintf(buf, sizeof(buf), "%s_??.%s", word, extensions[rand() % EXTENSION_COUNT]);
+        break;
+    }
+    return strdup(buf);
+}
+
+static void random_name(char *out, char **patterns, int pattern_count)
+{
+    // Roughly a quarter of the names are derived from patterns so both hit
+    // and miss paths are exercised
+    if (pattern_count > 0 && rand() % 4 == 0)
+    {
+        const char *p = patterns[rand() % pattern_count];
+        char *o = out;
+        for (; *p && o - out < MAX_FILENAME_LEN - 8; p++)
+        {
+            if (*p == '*')
+                o += sprintf(o, "%s", rand() % 2 ? "x1" : "");
+            else if (*p == '?')
+                *o++ = 'q';
+            else if (*p == '[')
+            {
+                const char *close = strchr(p + 1, ']');
+                *o++ = (char)('a' + rand() % 8);
+                p = close ? close : p;
+            }
+            else if (*p != '\\')
+                *o++ = *p;
+        }
+        *o = '\0';
+        return;
+    }
+
+    char word[32];
+    random_word(word, 3 + rand() % 10);
+    sprintf(out, "%s.%s", word, extensions[rand() % EXTENSION_COUNT]);
+}
+
+static int run(int pattern_count)
+{
+    char **patterns = malloc((size_t)pattern_count * sizeof(char *));
+    for (int i = 0; i < pattern_count; i++)
+    {
+        patterns[i] = random_pattern(i);
+    }
+
+    static char names[BENCH_NAMES][MAX_FILENAME_LEN];
+    for (int i = 0; i < BENCH_NAMES; i++)
+    {
+        random_name(names[i], patterns, pattern_count);
+    }
+
+    double t0 = now_seconds();
+    TemplateMatcher *matcher = matcher_compile(patterns, pattern_count);
+    double compile_time = now_seconds() - t0;
+    if (matcher == NULL)
+    {
+        fprintf(stderr, "matcher_compile failed for %d patterns\n", pattern_count);
+        return -1;
+    }
+
+    static int expected[BENCH_NAMES];
+    long hits = 0;
+    t0 = now_seconds();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+        for (int i = 0; i < BENCH_NAMES; i++)
+        {
+            int match = 0;
+            for (int p = 0; p < pattern_count; p++)
+            {
+                if (fnmatch(patterns[p], names[i], 0) == 0)
+                {
+                    match = 1;
+                    break;
+                }
+            }
+            expected[i] = match;
+            hits += match;
+        }
+    }
+    double fnmatch_time = now_seconds() - t0;
+
+    // The first round also builds the lazy DFA; later rounds reuse it
+    int mismatches = 0;
+    double cold_time = 0.0;
+    t0 = now_seconds();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+        for (int i = 0; i < BENCH_NAMES; i++)
+        {
+            if (matcher_match(matcher, names[i]) != expected[i])
+            {
+                if (mismatches++ < 5)
+                    fprintf(stderr, "mismatch: name '%s' expected %d\n", names[i], expected[i]);
+            }
+        }
+        if (r == 0)
+            cold_time = now_seconds() - t0;
+    }
+    double matcher_time = now_seconds() - t0;
+    double warm_time = (matcher_time - cold_time) / (BENCH_ROUNDS - 1);
+
+    MatcherStats stats;
+    matcher_get_stats(matcher, &stats);
+    double lookups = (double)BENCH_NAMES * BENCH_ROUNDS;
+    printf("%8d %10.1f %11.1f %10.1f %10.1f %8.1fx %6.1f%% %6zu %6zu %6zu %6zu\n",
+           pattern_count, compile_time * 1e3, fnmatch_time / lookups * 1e9,
+           cold_time / BENCH_NAMES * 1e9, warm_time / BENCH_NAMES * 1e9,
+           fnmatch_time / matcher_time, 100.0 * (double)hits / lookups,
+           stats.exact, stats.suffixes, stats.globs, stats.dfa_states);
+
+    matcher_free(matcher);
+    for (int i = 0; i < pattern_count; i++)
+    {
+        free(patterns[i]);
+    }
+    free(patterns);
+    return mismatches == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int default_sizes[] = {10, 100, 1000, 5000};
+    srand(42);
+
+    printf("%8s %10s %11s %10s %10s %9s %7s %6s %6s %6s %6s\n",
+           "patterns", "compile_ms", "fnmatch_ns", "cold_ns", "warm_ns", "speedup", "hits", "exact", "ext", "globs", "dfa");
+
+    int failed = 0;
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            failed |= run(atoi(argv[i])) < 0;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]); i++)
+        {
+            failed |= run(default_sizes[i]) < 0;
+        }
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "matcher and fnmatch disagree\n");
+        return 1;
+    }
+    return 0;
+}
@@ -20,51 +20,791 @@
 #include <dirent.h>
 #include <libgen.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + 16))
+#define EVENT_BUF_MAX_LEN (1024 * 1024) // Largest adaptive read buffer
 #define TEMPLATE_FILE "template.tbl"
 #define MAX_FILENAME_LEN 256
-#define MAX_TEMPLATES 100
+#define TEMPLATE_INITIAL_CAPACITY 64
+#define MATCHER_DFA_MAX_STATES 16384
 #define LOG_FILE "file_protection.log"
 #define MAX_PATH_LEN 4096
-#define MAX_WATCHES 1000
+#define LOG_MESSAGE_MAX (MAX_PATH_LEN + 128)
+#define LOG_BATCH_MAX 256
+#define LOG_DEFAULT_FLUSH_INTERVAL_MS 50
+#define LOG_DEFAULT_QUEUE_CAPACITY 1024
+#define FANOTIFY_BUF_LEN 8192
+#define FANOTIFY_POLL_TIMEOUT_MS 200
+#define FANOTIFY_VERDICT_CACHE_SIZE 4096
+#define FANOTIFY_MAX_IGNORE_MARKS 65536
+#define TREE_WALK_BUF_LEN (256 * 1024)
+#define TREE_WALK_MAX_OPEN_FDS 512
+#define TREE_WALK_MAX_THREADS 16
+#define TREE_WALK_PROGRESS_MS 500
+#define TREE_WALK_POLL_MS 10
+#define TREE_WALK_FILE_BATCH 256
+#define TREE_WALK_IDLE_NS 50000
+#define WATCH_EVENT_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+#define WATCH_TABLE_MIN_CAPACITY 64
+#define WATCH_TABLE_INITIAL_CAPACITY 1024
+#define WATCH_TABLE_MAX_LOAD_PERCENT 70
+#define DIR_TREE_CHUNK_SIZE (64 * 1024) // Arena chunk for interned directory names; a power of two
+#define WATCH_DIR_FD_RESERVE 1024 // Descriptors left free for walks, snapshots and clients
+#define WATCH_MOVE_PENDING_MAX 256 // Directory renames waiting for their other half
+#define WATCH_MOVE_PAIR_MS 500     // An IN_MOVED_FROM left unpaired this long moved out of the tree
+#define INOTIFY_MAX_ROOT_INSTANCES 16 // Per protected root
+#define INOTIFY_MAX_INSTANCES (POLICY_MAX_ROOTS * INOTIFY_MAX_ROOT_INSTANCES) // Every root slot at the maximum
+#define EVENT_LOOP_MAX_EVENTS 64
+#define PIPELINE_MAX_WORKERS 8
+#define PIPELINE_QUEUE_CAPACITY 4096 // Events per worker queue; a power of two
+#define PIPELINE_BACKLOG_WARN_PERCENT 75
+#define PIPELINE_BACKLOG_CHECK_MS 1000
+#define LOG_WRITER_NICE 5
+#define RESYNC_HOT_DIRECTORIES 64 // Busiest directories per instance rescanned first after an overflow
+#define COALESCE_MAX_PENDING 1024
+#define COALESCE_DEFAULT_WINDOW_US 1000
+#define SELF_EVENT_TABLE_SIZE 1024 // Expected self-generated events; a power of two
+#define SELF_EVENT_MAX_LOAD_PERCENT 75
+#define SELF_EVENT_TTL_MS 2000
+#define STATE_INDEX_FILE "file_protection.idx"
+#define STATE_INDEX_MIN_CAPACITY 1024
+#define SNAPSHOT_STORE_DIR "file_protection.snapshots"
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN (SHA256_DIGEST_LEN * 2)
+#define CONTENT_HASH_CHUNK (64 * 1024)
+#define CONTROL_SOCKET_FILE "file_protection.sock"
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_INPUT_MAX 1024
+#define CONTROL_OUTPUT_MAX (256 * 1024) // Unread output after which a control client is dropped
+#define PASSWORD_MAX_LEN 256
+#define AUDIT_LOG_DIR "file_protection.audit"
+#define AUDIT_MAGIC "FPAUDIT1"
+#define AUDIT_VERSION 1
+#define AUDIT_SEGMENT_RECORDS (1 << 20) // Records per segment before rotating; 32 MB
+#define AUDIT_INDEX_BLOCK 256           // Records summarised by one sparse index entry
+#define AUDIT_INDEX_BLOOM_WORDS 32      // 2048-bit filter of the path IDs in a block, about 5% false positives
+#define AUDIT_BLOOM_BIT(id, k) \
+    ((unsigned)((((uint64_t)(id) * 0x9E3779B97F4A7C15ULL) >> ((k) ? 16 : 40)) % (AUDIT_INDEX_BLOOM_WORDS * 64)))
+#define AUDIT_BUFFER_RECORDS 256        // Records held in memory between writes
+#define VERIFY_MANIFEST_FILE "file_protection.manifest"
+#define VERIFY_READ_CHUNK (1024 * 1024) // Bytes read and hashed at a time
+#define VERIFY_DEFAULT_MBPS 64          // Read rate limit across all verify threads
+#define METRICS_FILE "file_protection.prom"
+#define METRICS_FILE_INTERVAL_MS 5000
+#define METRICS_MAX_THREADS 32
+#define METRICS_SUB_BUCKET_BITS 4 // 16 histogram buckets per power of two, about 6% precision
+#define METRICS_MAX_EXPONENT 40   // Latencies up to 2^40 ns (about 18 minutes)
+#define METRICS_HISTOGRAM_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS)
+#define POLICY_MAX_READERS 64
+#define POLICY_MAX_ROOTS 8
+#define POLICY_GRACE_POLL_US 50
 
-extern char *templates[MAX_TEMPLATES];
-extern int template_count;
-extern int protection_enabled;
-extern char protected_directory[MAX_PATH_LEN];
+// Flags of a state index entry
+#define STATE_ENTRY_DIRECTORY 0x1 // Watched directory
+#define STATE_ENTRY_FILE 0x2      // Protected file
+#define STATE_ENTRY_ROOT 0x4      // The protected directory itself
+#define STATE_ENTRY_IMMUTABLE 0x8 // Immutable flag was applied
 
-// File operations
+// A protected file recorded in the state index, as listed for a rescan
+typedef struct
+{
+    uint64_t parent_dev;
+    uint64_t parent_ino;
+    uint64_t dev;
+    uint64_t ino;
+    char *name;
+} StateIndexFile;
+
+// Interned directory path (see dir_tree.c)
+typedef struct DirNode DirNode;
+
+// Directory tree memory use for the status command
+typedef struct
+{
+    size_t nodes;
+    size_t name_bytes;
+    size_t arena_bytes;
+    size_t table_bytes;
+} DirTreeStats;
+
+// Directory node for an inotify watch descriptor
+typedef struct
+{
+    int wd; // 0 marks an empty table slot; inotify numbers watches from 1
+    int inside_root; // Canonical location verified inside the protected directory
+    int dir_fd;      // O_PATH descriptor for enforcing relative to the directory, or -1
+    dev_t dev;
+    ino_t ino;
+    DirNode *dir; // Path of the directory; read it with dir_tree_path
+} WatchInfo;
+
+// Open-addressed hash map from watch descriptor to directory node
+typedef struct
+{
+    WatchInfo *slots;
+    size_t capacity;
+    size_t count;
+} WatchTable;
+
+// One inotify instance and the directories it watches. Watches are spread
+// over instances by directory inode, and each instance is read on its own.
+typedef struct
+{
+    int fd;
+    int root; // Slot of the protected root whose directories this instance watches
+    WatchTable watches;
+    pthread_rwlock_t lock; // Enforcement workers read, watch installation writes
+} InotifyShard;
+
+// Callbacks for walk_tree. visit_directory runs once per directory (return
+// -1 to skip its subtree); visit_files receives batches of regular files.
+typedef struct
+{
+    const char *label;
+    int (*visit_directory)(void *ctx, int dir_fd, const char *path, const struct stat *st);
+    void (*visit_files)(void *ctx, int dir_fd, const char *path, const char **names, size_t count);
+    void *ctx;
+    atomic_int *cancel; // Optional; set to stop the walk early
+    const char *root;   // Containment boundary; NULL means any root of the current policy
+} TreeVisitor;
+
+typedef struct
+{
+    long directories;
+    long entries;
+    long failures;
+    int threads;
+    int cancelled;
+    double elapsed;
+} TreeWalkStats;
+
+// Direction of a bulk protection sweep
+typedef enum
+{
+    SWEEP_PROTECT,
+    SWEEP_UNPROTECT,
+} SweepMode;
+
+typedef struct
+{
+    SweepMode mode;
+    int running;
+    int cancelled;
+    long matched;
+    long changed;
+    long unchanged;
+    long failed;
+    double elapsed;
+} SweepStatus;
+
+// What a verify run does with drifted files
+typedef enum
+{
+    VERIFY_REPORT,  // Report them; the baseline keeps the old contents
+    VERIFY_RESTORE, // Restore them from the snapshot store
+    VERIFY_ACCEPT,  // Take their current contents as the new baseline
+} VerifyMode;
+
+typedef struct
+{
+    VerifyMode mode;
+    int running;
+    int cancelled;
+    long files;
+    long hashed;    // Read and hashed: new, or size, mtime or ctime changed
+    long unchanged; // Contents match the baseline, whether hashed or not
+    long added;     // Not in the baseline yet
+    long drifted;
+    long missing;
+    long restored;
+    long failed;
+    unsigned long long bytes;
+    double elapsed;
+} VerifyStatus;
+
+// Per-worker event coalescing state (see event_coalescer.c)
+typedef struct Coalescer Coalescer;
+
+// Event pipeline counters for the status command
+typedef struct
+{
+    int workers;
+    unsigned long events; // Read from inotify by the reader thread
+    unsigned long reads;
+    unsigned long stalls; // Times the reader waited on a full worker queue
+    size_t read_buffer;   // Current size of the adaptive read buffer
+    size_t max_backlog;   // Largest FIONREAD backlog seen, in bytes
+    size_t depth[PIPELINE_MAX_WORKERS];
+    size_t high_water[PIPELINE_MAX_WORKERS];
+    unsigned long processed[PIPELINE_MAX_WORKERS];
+    unsigned long coalesced_events;
+    unsigned long merged;
+    unsigned long cancelled;
+    unsigned long dispatched;
+} PipelineStats;
+
+// Self-generated event counters
+typedef struct
+{
+    unsigned long expected;
+    unsigned long suppressed;
+    unsigned long expired; // Expected but never seen in time
+    unsigned long dropped; // Not recorded because the table was full
+    size_t pending;
+} SelfEventStats;
+
+// Directory rename and removal counters
+typedef struct
+{
+    unsigned long paired;     // IN_MOVED_FROM and IN_MOVED_TO matched by cookie
+    unsigned long reparented; // Moved in place without a rescan
+    unsigned long rescanned;  // New location walked instead
+    unsigned long moved_out;
+    unsigned long retired; // Watches removed because their directory moved away
+    unsigned long deleted;
+    int pending;
+} WatchLifecycleStats;
+
+// Overflow recovery counters
+typedef struct
+{
+    int running;
+    unsigned long overflows;
+    unsigned long resyncs;
+    long directories;
+    long restored;
+    long failed;
+    long new_subtrees;
+    long stale_watches;
+    long removed;   // Protected names created while events were lost
+    long recreated; // Protected files deleted while events were lost
+    double last_duration;
+    double longest_duration;
+    double total_duration;
+} ResyncStats;
+
+// Incremental SHA-256 state (see content_hash.c)
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t buffered;
+} Sha256;
+
+// Snapshot store counters
+typedef struct
+{
+    unsigned long captured;
+    unsigned long deduplicated; // Captures whose contents were already stored
+    unsigned long reflinked;    // Copies done as FICLONE reflinks
+    unsigned long copied;       // Copies done with copy_file_range or sendfile
+    unsigned long restored;
+    unsigned long failed;
+    unsigned long long bytes; // Size of objects written
+} SnapshotStats;
+
+// Audited enforcement actions
+typedef enum
+{
+    AUDIT_BLOCK_CREATE = 1,
+    AUDIT_RESTORE_DELETE,
+    AUDIT_RESTORE_MOVE_FROM,
+    AUDIT_RESTORE_MOVE_TO,
+    AUDIT_BLOCK_MODIFY,
+    AUDIT_VERIFY_DRIFT,   // Contents differ from the verified baseline, or the file is gone
+    AUDIT_VERIFY_RESTORE, // Drifted file restored from its snapshot
+    AUDIT_ACTION_COUNT,
+} AuditAction;
+
+#define AUDIT_FLAG_FAILED 0x1 // The action was attempted and failed
+
+// Audit log segments. NNNNNNNN.rec holds an AuditSegmentHeader and then
+// fixed-size AuditRecords; NNNNNNNN.paths holds each path the segment's
+// records refer to once, as an AuditPathEntry followed by its bytes, in ID
+// order; NNNNNNNN.idx holds one AuditIndexEntry per AUDIT_INDEX_BLOCK
+// records. All three are only ever appended to.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t created_wall_ms;
+    uint64_t sequence;
+} AuditSegmentHeader;
+
+typedef struct
+{
+    uint64_t wall_ms; // CLOCK_REALTIME, milliseconds since the epoch
+    uint64_t mono_ns; // CLOCK_MONOTONIC; orders records when the wall clock steps
+    uint32_t path_id; // Index into the segment's path table
+    uint16_t action;  // AuditAction
+    uint16_t flags;   // AUDIT_FLAG_* bits
+    uint32_t count;   // Coalesced events handled by this action
+    uint16_t root;    // Slot of the protected directory
+    uint16_t reserved;
+} AuditRecord;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t len; // Path bytes that follow, without a terminator
+} AuditPathEntry;
+
+typedef struct
+{
+    uint64_t first_record;
+    uint64_t min_wall_ms;
+    uint64_t max_wall_ms;
+    uint64_t bloom[AUDIT_INDEX_BLOOM_WORDS]; // Path IDs present in the block
+} AuditIndexEntry;
+
+_Static_assert(sizeof(AuditSegmentHeader) == sizeof(AuditRecord), "segment header must keep records aligned");
+_Static_assert(sizeof(AuditRecord) == 32, "audit record layout changed");
+
+// Audit log counters
+typedef struct
+{
+    int active;
+    unsigned long long sequence; // Current segment
+    unsigned long records;       // In the current segment
+    unsigned long paths;         // Interned in the current segment
+    unsigned long total_records;
+    unsigned long segments;
+    unsigned long failed_writes;
+} AuditStats;
+
+// Runtime counters (see metrics.c)
+typedef enum
+{
+    METRIC_EVENTS_READ,
+    METRIC_EVENT_CREATE,
+    METRIC_EVENT_DELETE,
+    METRIC_EVENT_MODIFY,
+    METRIC_EVENT_MOVED_FROM,
+    METRIC_EVENT_MOVED_TO,
+    METRIC_EVENT_MOVE_SELF,
+    METRIC_EVENT_DELETE_SELF,
+    METRIC_EVENT_IGNORED,
+    METRIC_EVENT_OVERFLOW,
+    METRIC_MATCHER_HIT,
+    METRIC_MATCHER_MISS,
+    METRIC_PROTECT_OK,
+    METRIC_PROTECT_FAILED,
+    METRIC_UNLINK_OK,
+    METRIC_UNLINK_FAILED,
+    METRIC_RESTORE_SNAPSHOT, // Rebuilt with its contents from the snapshot store
+    METRIC_RESTORE_EMPTY,    // Recreated empty
+    METRIC_RESTORE_FAILED,
+    METRIC_COUNTER_COUNT,
+} MetricCounter;
+
+// Latency histograms (see metrics.c)
+typedef enum
+{
+    METRIC_LATENCY_QUEUE,   // Event read to pickup by an enforcement worker
+    METRIC_LATENCY_ENFORCE, // Event read to enforcement action done
+    METRIC_LATENCY_PROTECT, // One protect_file call
+    METRIC_LATENCY_RESTORE, // Rebuilding one deleted or moved protected file
+    METRIC_HISTOGRAM_COUNT,
+} MetricHistogram;
+
+typedef struct
+{
+    unsigned long count;
+    double sum_us;
+    double p50_us;
+    double p90_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+} LatencySummary;
+
+// Per-root totals for the status command
+typedef struct
+{
+    unsigned long events;
+    unsigned long actions;
+    LatencySummary enforce; // Delay from reading an event to its enforcement action
+} RootStats;
+
+// Where a command session is in a multi-line command
+typedef enum
+{
+    SESSION_COMMAND,          // Waiting for a command
+    SESSION_DISABLE_PASSWORD, // disable: waiting for the password
+    SESSION_CHANGE_OLD,       // change: waiting for the old password
+    SESSION_CHANGE_NEW,       // change: waiting for the new password
+    SESSION_ACCEPT_PASSWORD,  // verify accept: waiting for the password
+    SESSION_AUTHENTICATING,   // Password handed to the auth thread; input is held
+} SessionState;
+
+typedef enum
+{
+    AUTH_DISABLE,
+    AUTH_CHANGE,
+    AUTH_VERIFY_ACCEPT,
+} AuthKind;
+
+// One source of commands: standard input or a control socket client
+typedef struct
+{
+    int id;
+    int fd;
+    int is_socket;
+    int closing; // Input ended; close once pending work is done
+    SessionState state;
+    char input[CONTROL_INPUT_MAX];
+    size_t input_len;
+    int discarding; // Skipping the rest of an overlong line
+    char old_password[PASSWORD_MAX_LEN];
+    char *output; // Socket output the client has not read yet
+    size_t output_len;
+} CommandSession;
+
+// Compiled template patterns (see template_matcher.c)
+typedef struct TemplateMatcher TemplateMatcher;
+
+// Compiled path patterns and exclusions (see path_rules.c)
+typedef struct PathRules PathRules;
+
+typedef struct
+{
+    int match_all;
+    size_t exact;
+    size_t suffixes;
+    size_t globs;
+    size_t fallback;
+    size_t nfa_states;
+    size_t byte_classes;
+    size_t dfa_states;
+} MatcherStats;
+
+// One protected directory and the templates that apply inside it
+typedef struct
+{
+    char path[MAX_PATH_LEN]; // Canonical protected directory
+    char **patterns;
+    int pattern_count;
+    TemplateMatcher *matcher; // Name patterns
+    PathRules *rules;         // Path patterns and exclusions; NULL if there are none
+    int name_patterns;        // Patterns left to the name matcher
+    int artifacts;            // The daemon's own files lie inside; checked by path
+    int slot; // Stable across reloads; selects the root's inotify instances and workers
+} PolicyRoot;
+
+// One version of the protection policy read from the template file. A
+// published policy is never modified; a reload publishes a new one.
+typedef struct
+{
+    PolicyRoot roots[POLICY_MAX_ROOTS]; // Disjoint trees
+    int root_count;
+    unsigned long generation;
+} Policy;
+
+// Policy reload counters
+typedef struct
+{
+    unsigned long generation;
+    unsigned long reloads;
+    unsigned long unchanged; // Reloads that found the same root and templates
+    unsigned long failed;    // Reloads that kept the old policy
+    int running;
+    long protected_files;   // Files protected by the last reload
+    long unprotected_files; // Files unprotected by the last reload
+    long failed_files;
+    long watches_added;
+    long watches_removed;
+    double last_duration;
+} PolicyStats;
+
+// What log_message does when the log queue is full
+typedef enum
+{
+    LOG_POLICY_DROP,  // Count and discard the message; the writer reports the gap
+    LOG_POLICY_BLOCK, // Wait for the writer to free a slot
+} LogPolicy;
+
+// Enforcement backend selected at startup
+typedef enum
+{
+    BACKEND_INOTIFY,  // Repair protected files after the fact
+    BACKEND_FANOTIFY, // Also deny opens of protected files before they happen
+} ProtectionBackend;
+
+// Runtime options set from the command line
+typedef struct
+{
+    ProtectionBackend backend;
+    int walk_threads; // 0 means one per online CPU
+    unsigned int log_flush_interval_ms;
+    size_t log_queue_capacity;
+    LogPolicy log_policy;
+    const char *state_index_path; // NULL disables the persistent state index
+    const char *snapshot_dir;     // NULL disables the snapshot store
+    const char *metrics_path;     // NULL disables the Prometheus metrics file
+    const char *audit_dir;        // NULL disables the binary audit log
+    const char *manifest_path;    // NULL disables the verify command
+    unsigned int verify_mbps;     // 0 reads as fast as the disks allow
+    const char *control_socket;   // NULL disables the control socket
+    unsigned int coalesce_window_us; // 0 dispatches every event immediately
+    int inotify_instances;
+    int workers; // Enforcement workers; 0 means one per online CPU
+} ProtectionConfig;
+
+extern ProtectionConfig config;
+extern atomic_int protection_enabled;
+extern atomic_int stop_requested; // Set by the stop command; the main loop shuts down
+extern InotifyShard inotify_shards[INOTIFY_MAX_INSTANCES];
+extern atomic_int inotify_shard_count;
+
+// Configuration
+int parse_command_line(int argc, char *argv[]);
+void print_usage(const char *program);
+
+// Logging
 void log_message(const char *message);
-int load_templates();
-int is_subdirectory(const char *parent, const char *sub);
-int is_protected(const char *filename);
+void console_message(const char *message);
+int logger_start(void);
+void logger_stop(void);
+void logger_get_stats(size_t *depth, size_t *capacity, unsigned long *dropped, unsigned long *written);
+
+// File operations
+Policy *load_templates(void);
+int is_path_within(const char *parent, const char *sub);
+int policy_protects_name(const PolicyRoot *root, const char *dir, const char *name);
+int policy_prunes_directory(const PolicyRoot *root, const char *path);
+int is_protected_name(int slot, const char *dir, const char *name);
+int is_pruned_directory(int slot, const char *path);
+int is_protected_in(int slot, const DirNode *dir, const char *name);
 void handle_event(int fd, struct inotify_event *event);
+void handle_event_count(int fd, struct inotify_event *event, unsigned int count);
 void protect_file(const char *path);
+void protect_file_at(int dir_fd, const char *name, const char *path);
+int set_protection_state_at(int dir_fd, const char *name, int protect);
+int recreate_watched_file(int fd, int wd, const char *name, const char *path);
 void set_immutable(const char *path);
 void clear_immutable_flag(const char *path);
 void restore_permissions(const char *path);
 void create_log_buffer(char *buffer, size_t buffer_size, const char *format, ...);
 FILE *safe_fopen(const char *path, const char *mode);
 void safe_fclose(FILE *file, const char *path);
-void add_watch_recursive(int fd, const char *path);
+
+// Directory traversal
+int walk_tree(const char *path, const TreeVisitor *visitor, int threads, int report_progress, TreeWalkStats *stats);
+int tree_walk_threads(void);
+int resolve_directory_fd(int dir_fd, const char *path, char *resolved);
+int watch_directory_at(int dir_fd, const char *path, const struct stat *st);
+void add_watch_recursive(const char *path);
+void add_watch_tree(const char *path);
+
+// Directory tree
+DirNode *dir_tree_intern(const char *path);
+DirNode *dir_tree_lookup(const char *path);
+int dir_tree_move(DirNode *node, const char *new_path);
+int dir_tree_is_within(const DirNode *node, const DirNode *ancestor);
+void dir_tree_release(DirNode *node);
+int dir_tree_path(const DirNode *node, char *buffer, size_t size);
+int dir_tree_file_path(const DirNode *node, const char *name, char *buffer, size_t size);
+void dir_tree_get_stats(DirTreeStats *stats);
+
+// Watch table
+int watch_table_init(WatchTable *table, size_t initial_capacity);
+void watch_table_destroy(WatchTable *table);
+WatchInfo *watch_table_find(const WatchTable *table, int wd);
+WatchInfo *watch_table_insert(WatchTable *table, int wd, const char *path);
+int watch_table_remove(WatchTable *table, int wd);
+double watch_table_load_factor(const WatchTable *table);
+void watch_dir_fds_init(void);
+int watch_dir_fd_open(int dir_fd);
+void watch_dir_fd_close(int fd);
+void watch_dir_fds_get_stats(long *open, long *limit);
+
+// fanotify backend
+int fanotify_backend_start(void);
+void fanotify_backend_stop(void);
+int fanotify_backend_active(void);
+void fanotify_backend_add_directory(int dir_fd, const char *path);
+void fanotify_backend_forget(const char *path);
+void fanotify_backend_invalidate(void);
+void fanotify_backend_get_stats(unsigned long *events, unsigned long *denied, unsigned long *cache_hits,
+                                unsigned long *ignore_marks);
+
+// Event coalescing
+Coalescer *coalescer_create(void);
+void coalescer_destroy(Coalescer *c);
+void coalescer_submit(Coalescer *c, int fd, struct inotify_event *event);
+void coalescer_flush_expired(Coalescer *c);
+void coalescer_flush_all(Coalescer *c);
+long coalescer_next_timeout_us(Coalescer *c);
+void coalescer_get_stats(const Coalescer *c, unsigned long *events, unsigned long *merged, unsigned long *cancelled,
+                         unsigned long *actions);
+
+// Self-generated events
+void self_event_expect(int fd, int wd, const char *name, uint32_t mask);
+void self_event_cancel(int fd, int wd, const char *name, uint32_t mask);
+int self_event_consume(int fd, const struct inotify_event *event);
+void self_event_get_stats(SelfEventStats *stats);
+
+// Directory renames and removals
+void watch_moved_from(InotifyShard *shard, const struct inotify_event *event);
+int watch_moved_to(InotifyShard *shard, const struct inotify_event *event, const char *path);
+void watch_moves_expire(void);
+void watch_subdir_removed(InotifyShard *shard, const struct inotify_event *event);
+void watch_deleted(InotifyShard *shard, int wd);
+void watch_lifecycle_get_stats(WatchLifecycleStats *stats);
+
+// Event pipeline
+int pipeline_start(void);
+void pipeline_stop(void);
+void pipeline_add_shard(int index);
+int pipeline_root_workers(int root);
+void pipeline_check_backlog(void);
+void pipeline_get_stats(PipelineStats *stats);
+
+// Overflow recovery
+int resync_start(void);
+void resync_stop(void);
+void resync_request(int index, const int *hot, size_t hot_count);
+void resync_get_stats(ResyncStats *stats);
+
+// Metrics
+uint64_t metrics_now_ns(void);
+void metrics_count(MetricCounter counter);
+void metrics_count_event(uint32_t mask);
+void metrics_record(MetricHistogram histogram, uint64_t ns);
+void metrics_set_event_time(uint64_t read_ns);
+uint64_t metrics_event_time(void);
+unsigned long metrics_counter_total(MetricCounter counter);
+void metrics_get_latency(MetricHistogram histogram, LatencySummary *summary);
+void metrics_count_root_event(int root);
+void metrics_record_root(int root, uint64_t ns);
+void metrics_reset_root(int root);
+void metrics_get_root(int root, RootStats *stats);
+int metrics_write_file(const char *path);
+
+// Protection policy
+int policy_init(void);
+void policy_shutdown(void);
+void policy_free(Policy *policy);
+void policy_read_lock(void);
+void policy_read_unlock(void);
+const Policy *policy_current(void);
+const PolicyRoot *policy_root_for_path(const Policy *policy, const char *path);
+const PolicyRoot *policy_root_for_slot(const Policy *policy, int slot);
+int policy_copy_roots(char roots[][MAX_PATH_LEN], int *slots);
+void policy_lock_changes(void);
+int policy_trylock_changes(void);
+void policy_unlock_changes(void);
+int policy_reload_start(int epoll_fd);
+void policy_reload_stop(void);
+void policy_request_reload(const char *reason);
+int policy_watch_handle(int fd);
+void policy_get_stats(PolicyStats *stats);
+
+// Persistent state index
+int state_index_open(const char *path);
+void state_index_close(void);
+int state_index_warm_start(void);
+int state_index_set_roots(void);
+void state_index_record_directory(int dir_fd, const char *path, const struct stat *st);
+void state_index_record_file(int dir_fd, const char *name, const struct stat *st, int immutable, int protect);
+void state_index_record_path(const char *path);
+void state_index_forget(dev_t dev, ino_t ino);
+int state_index_has_file(dev_t parent_dev, ino_t parent_ino, const char *name, const struct stat *st);
+int state_index_list_files(StateIndexFile **files, size_t *count);
+void state_index_free_files(StateIndexFile *files, size_t count);
+void state_index_get_stats(size_t *count, size_t *capacity);
+
+// Content hashing
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_DIGEST_LEN]);
+int content_hash_fd(int fd, off_t size, unsigned char digest[SHA256_DIGEST_LEN]);
+void content_hash_hex(const unsigned char digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN + 1]);
+const char *sha256_implementation(void);
+
+// Snapshot store
+int snapshot_store_open(const char *path);
+void snapshot_store_close(void);
+int snapshot_store_active(void);
+int snapshot_capture_at(int dir_fd, const char *name, const char *path);
+int snapshot_restore(const char *path);
+int snapshot_available(const char *path);
+void snapshot_get_stats(SnapshotStats *stats);
+
+// Audit log
+int audit_log_open(const char *path);
+void audit_log_close(void);
+void audit_record(AuditAction action, int failed, int root, const char *path, unsigned int count);
+void audit_log_flush(void);
+void audit_log_get_stats(AuditStats *stats);
+
+// Protection sweeps
+int sweep_start(SweepMode mode);
+void sweep_cancel(void);
+void sweep_wait(void);
+int sweep_get_status(SweepStatus *status);
+int sweep_protected_all(void);
+
+// Integrity verification
+int verify_start(VerifyMode mode);
+void verify_cancel(void);
+void verify_wait(void);
+int verify_get_status(VerifyStatus *status);
+
+// Template matcher
+TemplateMatcher *matcher_compile(char **patterns, int count);
+int matcher_match(TemplateMatcher *matcher, const char *name);
+void matcher_get_stats(TemplateMatcher *matcher, MatcherStats *stats);
+void matcher_free(TemplateMatcher *matcher);
+
+// Path rules
+int path_rules_handles(const char *pattern);
+PathRules *path_rules_compile(char **patterns, int count, int *failed);
+void path_rules_free(PathRules *rules);
+int path_rules_match(const PathRules *rules, const char *relative, const char *name, int name_match);
+int path_rules_prune(const PathRules *rules, const char *relative, int name_patterns);
+void path_rules_get_stats(const PathRules *rules, size_t *includes, size_t *exclusions, size_t *nodes);
 
 // User interface
-void print_help();
+void print_help(FILE *out);
 int check_password(const char *password);
 int change_password(const char *old_password, const char *new_password);
-void handle_user_input();
-int authenticate_user();
-void change_password_interactive();
-void print_status();
-void disable_protection();
-void remove_protection_recursive(const char *path);
+void handle_command(CommandSession *session, const char *line, FILE *out);
+void handle_auth_result(CommandSession *session, AuthKind kind, int result, FILE *out);
+void print_status(FILE *out);
+void print_stats(FILE *out);
+void enable_protection(FILE *out);
+void disable_protection(FILE *out);
+
+// Command server
+int command_server_start(int epoll_fd);
+void command_server_stop(void);
+int command_server_handle(int fd, uint32_t events);
+int auth_submit(const CommandSession *session, AuthKind kind, const char *old_password, const char *new_password);
 
 // System initialization and cleanup
 int initialize_protection_system();
 void cleanup_protection_system();
 int run_protection_system();
-void handle_file_events(int fd, char *buffer);
+int inotify_shards_add_root(int slot);
+void inotify_shards_destroy(void);
+InotifyShard *inotify_shard_for_fd(int fd);
+int inotify_shard_lookup(InotifyShard *shard, int wd, WatchInfo *out, char *path);
+int inotify_shard_file_path(InotifyShard *shard, int wd, const char *name, char *path);
+int inotify_shard_protects(InotifyShard *shard, int wd, const char *name);
+InotifyShard *inotify_shard_for_directory(int slot, const struct stat *st);
+int inotify_shard_find_directory(InotifyShard *shard, const struct stat *st);
 
 #endif
\ No newline at end of file
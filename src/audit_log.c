@@ -0,0 +1,410 @@
+#include "file_protection.h"
+
+#include <dirent.h>
+
+// Binary audit log of enforcement actions, written beside the text log so
+// that "what happened under this path on that day" can be answered without
+// reading every message ever logged. Each action is a fixed 32-byte record
+// with wall-clock and monotonic timestamps and the ID of its path in the
+// segment's path table, so a path repeated a million times is stored once.
+//
+// Segments are numbered; a new one is started at every startup and after
+// AUDIT_SEGMENT_RECORDS records, so every segment is self-contained. Every
+// AUDIT_INDEX_BLOCK records a sparse index entry records the block's time
+// range and a small Bloom filter of its path IDs, which lets the query tool
+// skip whole blocks. Records are buffered and written by whichever worker
+// fills the buffer, or by the main loop's tick; path table bytes are always
+// written before the records that refer to them, and index entries after.
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t id;
+    char *path; // NULL marks an empty slot
+} AuditPath;
+
+static pthread_mutex_t audit_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int audit_active = 0;
+static int audit_dir_fd = -1;
+static int rec_fd = -1;
+static int paths_fd = -1;
+static int idx_fd = -1;
+static unsigned long long segment_sequence = 0;
+static uint64_t segment_records = 0; // Written and buffered
+
+static AuditPath *path_table = NULL;
+static size_t path_capacity = 0;
+static uint32_t path_count = 0;
+
+static AuditRecord record_buffer[AUDIT_BUFFER_RECORDS];
+static size_t records_buffered = 0;
+static char *path_buffer = NULL; // Path table bytes not yet written
+static size_t path_buffer_len = 0;
+static size_t path_buffer_capacity = 0;
+static AuditIndexEntry index_buffer[AUDIT_BUFFER_RECORDS / AUDIT_INDEX_BLOCK + 1];
+static size_t index_buffered = 0;
+static AuditIndexEntry current_block;
+
+static unsigned long total_records = 0;
+static unsigned long segments_written = 0;
+static unsigned long failed_writes = 0;
+
+static uint32_t audit_path_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void path_table_clear(void)
+{
+    for (size_t i = 0; i < path_capacity; i++)
+    {
+        free(path_table[i].path);
+        path_table[i].path = NULL;
+    }
+    path_count = 0;
+}
+
+static int path_table_grow(void)
+{
+    size_t new_capacity = path_capacity ? path_capacity * 2 : 1024;
+    AuditPath *table = calloc(new_capacity, sizeof(AuditPath));
+    if (table == NULL)
+        return -1;
+    for (size_t i = 0; i < path_capacity; i++)
+    {
+        if (path_table[i].path == NULL)
+            continue;
+        size_t slot = path_table[i].hash & (new_capacity - 1);
+        while (table[slot].path != NULL)
+        {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        table[slot] = path_table[i];
+    }
+    free(path_table);
+    path_table = table;
+    path_capacity = new_capacity;
+    return 0;
+}
+
+// Function to append bytes of the path table to the pending buffer
+static int path_buffer_append(const void *data, size_t len)
+{
+    if (path_buffer_len + len > path_buffer_capacity)
+    {
+        size_t new_capacity = path_buffer_capacity ? path_buffer_capacity : 16 * 1024;
+        while (new_capacity < path_buffer_len + len)
+        {
+            new_capacity *= 2;
+        }
+        char *grown = realloc(path_buffer, new_capacity);
+        if (grown == NULL)
+            return -1;
+        path_buffer = grown;
+        path_buffer_capacity = new_capacity;
+    }
+    memcpy(path_buffer + path_buffer_len, data, len);
+    path_buffer_len += len;
+    return 0;
+}
+
+// Function to find the ID of a path in the current segment, adding it to
+// the segment's path table the first time. Returns -1 on allocation failure.
+static long path_intern(const char *path)
+{
+    size_t len = strlen(path);
+    uint32_t hash = audit_path_hash(path, len);
+    if ((path_count + 1) * 10 > path_capacity * 7 && path_table_grow() < 0)
+        return -1;
+
+    size_t slot = hash & (path_capacity - 1);
+    while (path_table[slot].path != NULL)
+    {
+        if (path_table[slot].hash == hash && strcmp(path_table[slot].path, path) == 0)
+            return path_table[slot].id;
+        slot = (slot + 1) & (path_capacity - 1);
+    }
+
+    char *copy = strdup(path);
+    AuditPathEntry entry = {path_count, (uint32_t)len};
+    if (copy == NULL || path_buffer_append(&entry, sizeof(entry)) < 0)
+    {
+        free(copy);
+        return -1;
+    }
+    if (path_buffer_append(path, len) < 0)
+    {
+        // Keep the pending table well formed
+        path_buffer_len -= sizeof(entry);
+        free(copy);
+        return -1;
+    }
+    path_table[slot] = (AuditPath){hash, path_count, copy};
+    return path_count++;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        ssize_t written = write(fd, p, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+// Function to write everything buffered, paths first so that no record on
+// disk refers to a path that is not
+static void flush_locked(void)
+{
+    int failed = 0;
+    if (path_buffer_len > 0)
+    {
+        failed |= write_all(paths_fd, path_buffer, path_buffer_len) < 0;
+        path_buffer_len = 0;
+    }
+    if (records_buffered > 0)
+    {
+        failed |= write_all(rec_fd, record_buffer, records_buffered * sizeof(AuditRecord)) < 0;
+        records_buffered = 0;
+    }
+    if (index_buffered > 0)
+    {
+        failed |= write_all(idx_fd, index_buffer, index_buffered * sizeof(AuditIndexEntry)) < 0;
+        index_buffered = 0;
+    }
+
+    if (failed && failed_writes++ == 0)
+    {
+        char log_buf[100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to write audit segment %08llu: %s", segment_sequence,
+                 strerror(errno));
+        log_message(log_buf);
+    }
+}
+
+static void segment_close(void)
+{
+    flush_locked();
+    if (rec_fd >= 0)
+        close(rec_fd);
+    if (paths_fd >= 0)
+        close(paths_fd);
+    if (idx_fd >= 0)
+        close(idx_fd);
+    rec_fd = paths_fd = idx_fd = -1;
+}
+
+// Function to start segment number sequence
+static int segment_open(unsigned long long sequence)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%08llu.rec", sequence);
+    rec_fd = openat(audit_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    snprintf(name, sizeof(name), "%08llu.paths", sequence);
+    paths_fd = openat(audit_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    snprintf(name, sizeof(name), "%08llu.idx", sequence);
+    idx_fd = openat(audit_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    AuditSegmentHeader header = {0};
+    memcpy(header.magic, AUDIT_MAGIC, sizeof(header.magic));
+    header.version = AUDIT_VERSION;
+    header.record_size = sizeof(AuditRecord);
+    header.created_wall_ms = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+    header.sequence = sequence;
+    if (rec_fd < 0 || paths_fd < 0 || idx_fd < 0 || write_all(rec_fd, &header, sizeof(header)) < 0)
+    {
+        char log_buf[100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot create audit segment %08llu: %s", sequence, strerror(errno));
+        log_message(log_buf);
+        segment_close();
+        return -1;
+    }
+
+    segment_sequence = sequence;
+    segment_records = 0;
+    path_table_clear();
+    segments_written++;
+    return 0;
+}
+
+// Function to add a record to the sparse index block it falls in
+static void index_add(const AuditRecord *record)
+{
+    uint64_t position = segment_records % AUDIT_INDEX_BLOCK;
+    if (position == 0)
+    {
+        memset(&current_block, 0, sizeof(current_block));
+        current_block.first_record = segment_records;
+        current_block.min_wall_ms = record->wall_ms;
+        current_block.max_wall_ms = record->wall_ms;
+    }
+    if (record->wall_ms < current_block.min_wall_ms)
+        current_block.min_wall_ms = record->wall_ms;
+    if (record->wall_ms > current_block.max_wall_ms)
+        current_block.max_wall_ms = record->wall_ms;
+    for (int k = 0; k < 2; k++)
+    {
+        unsigned bit = AUDIT_BLOOM_BIT(record->path_id, k);
+        current_block.bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+    if (position == AUDIT_INDEX_BLOCK - 1)
+    {
+        index_buffer[index_buffered++] = current_block;
+    }
+}
+
+// Function to open (creating if needed) the audit log directory and start a
+// new segment after the last one found there
+int audit_log_open(const char *path)
+{
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot create audit log directory %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        return -1;
+    }
+    audit_dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int list_fd = audit_dir_fd >= 0 ? dup(audit_dir_fd) : -1;
+    DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    if (dir == NULL)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot open audit log directory %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        if (list_fd >= 0)
+            close(list_fd);
+        if (audit_dir_fd >= 0)
+            close(audit_dir_fd);
+        audit_dir_fd = -1;
+        return -1;
+    }
+
+    unsigned long long last = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        unsigned long long sequence = strtoull(entry->d_name, &end, 10);
+        if (end != entry->d_name && strcmp(end, ".rec") == 0 && sequence > last)
+            last = sequence;
+    }
+    closedir(dir);
+
+    pthread_mutex_lock(&audit_lock);
+    int ret = segment_open(last + 1);
+    pthread_mutex_unlock(&audit_lock);
+    if (ret < 0)
+    {
+        close(audit_dir_fd);
+        audit_dir_fd = -1;
+        return -1;
+    }
+    atomic_store(&audit_active, 1);
+
+    char log_buf[MAX_PATH_LEN + 100];
+    snprintf(log_buf, sizeof(log_buf), "Audit log opened: %s (segment %08llu)", path, last + 1);
+    log_message(log_buf);
+    return 0;
+}
+
+void audit_log_close(void)
+{
+    if (!atomic_exchange(&audit_active, 0))
+        return;
+    pthread_mutex_lock(&audit_lock);
+    segment_close();
+    path_table_clear();
+    free(path_table);
+    path_table = NULL;
+    path_capacity = 0;
+    free(path_buffer);
+    path_buffer = NULL;
+    path_buffer_capacity = 0;
+    close(audit_dir_fd);
+    audit_dir_fd = -1;
+    pthread_mutex_unlock(&audit_lock);
+}
+
+// Function to record one enforcement action on path
+void audit_record(AuditAction action, int failed, int root, const char *path, unsigned int count)
+{
+    if (!atomic_load_explicit(&audit_active, memory_order_relaxed))
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    AuditRecord record = {0};
+    record.wall_ms = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+    record.mono_ns = metrics_now_ns();
+    record.action = (uint16_t)action;
+    record.flags = failed ? AUDIT_FLAG_FAILED : 0;
+    record.count = count;
+    record.root = (uint16_t)root;
+
+    pthread_mutex_lock(&audit_lock);
+    long id = rec_fd >= 0 ? path_intern(path) : -1;
+    if (id < 0)
+    {
+        failed_writes++;
+        pthread_mutex_unlock(&audit_lock);
+        return;
+    }
+    record.path_id = (uint32_t)id;
+    index_add(&record);
+    record_buffer[records_buffered++] = record;
+    segment_records++;
+    total_records++;
+
+    if (segment_records == AUDIT_SEGMENT_RECORDS)
+    {
+        unsigned long long next = segment_sequence + 1;
+        segment_close();
+        segment_open(next);
+    }
+    else if (records_buffered == AUDIT_BUFFER_RECORDS)
+    {
+        flush_locked();
+    }
+    pthread_mutex_unlock(&audit_lock);
+}
+
+// Function to write out buffered records; called from the main loop's tick
+void audit_log_flush(void)
+{
+    if (!atomic_load_explicit(&audit_active, memory_order_relaxed))
+        return;
+    pthread_mutex_lock(&audit_lock);
+    if (rec_fd >= 0)
+        flush_locked();
+    pthread_mutex_unlock(&audit_lock);
+}
+
+void audit_log_get_stats(AuditStats *stats)
+{
+    pthread_mutex_lock(&audit_lock);
+    stats->active = atomic_load(&audit_active) && rec_fd >= 0;
+    stats->sequence = segment_sequence;
+    stats->records = (unsigned long)segment_records;
+    stats->paths = path_count;
+    stats->total_records = total_records;
+    stats->segments = segments_written;
+    stats->failed_writes = failed_writes;
+    pthread_mutex_unlock(&audit_lock);
+}
@@ -0,0 +1,555 @@
+#include "file_protection.h"
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Command input for the main loop. Standard input and every client of the
+// Unix control socket is a session: bytes are read only when epoll reports
+// them, split into lines, and fed to the command state machine in
+// user_interface.c, so a half-typed password prompt never holds up the loop.
+// Password checks and changes read template.tbl and run crypt, which takes
+// tens of milliseconds, so they go to an auth thread; the session holds
+// further input until the result comes back through an eventfd.
+
+typedef struct AuthRequest
+{
+    int session_id;
+    AuthKind kind;
+    int result;
+    char old_password[PASSWORD_MAX_LEN];
+    char new_password[PASSWORD_MAX_LEN];
+    struct AuthRequest *next;
+} AuthRequest;
+
+static CommandSession *sessions[CONTROL_MAX_CLIENTS + 1]; // Slot 0 is standard input
+static int next_session_id = 1;
+static int server_epoll_fd = -1;
+static int listen_fd = -1;
+static int auth_event_fd = -1;
+
+static pthread_t auth_thread;
+static int auth_thread_valid = 0;
+static pthread_mutex_t auth_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t auth_cond = PTHREAD_COND_INITIALIZER;
+static AuthRequest *auth_queue = NULL; // Waiting for the auth thread, oldest first
+static AuthRequest *auth_done = NULL;  // Finished, waiting for the main loop
+static int auth_stopping = 0;
+
+static AuthRequest **list_tail(AuthRequest **list)
+{
+    while (*list != NULL)
+        list = &(*list)->next;
+    return list;
+}
+
+static void *auth_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&auth_lock);
+    for (;;)
+    {
+        while (auth_queue == NULL && !auth_stopping)
+            pthread_cond_wait(&auth_cond, &auth_lock);
+        if (auth_queue == NULL)
+            break;
+        AuthRequest *request = auth_queue;
+        auth_queue = request->next;
+        pthread_mutex_unlock(&auth_lock);
+
+        if (request->kind == AUTH_CHANGE)
+            request->result = change_password(request->old_password, request->new_password);
+        else
+            request->result = check_password(request->old_password);
+        explicit_bzero(request->old_password, sizeof(request->old_password));
+        explicit_bzero(request->new_password, sizeof(request->new_password));
+
+        pthread_mutex_lock(&auth_lock);
+        request->next = NULL;
+        *list_tail(&auth_done) = request;
+        uint64_t one = 1;
+        if (write(auth_event_fd, &one, sizeof(one)) < 0)
+            perror("eventfd write");
+    }
+    pthread_mutex_unlock(&auth_lock);
+    return NULL;
+}
+
+// Function to queue a password check or change for a session; the result
+// arrives through handle_auth_result on the main loop
+int auth_submit(const CommandSession *session, AuthKind kind, const char *old_password, const char *new_password)
+{
+    AuthRequest *request = calloc(1, sizeof(AuthRequest));
+    if (request == NULL)
+    {
+        log_message("Memory allocation failed for password request");
+        return -1;
+    }
+    request->session_id = session->id;
+    request->kind = kind;
+    request->result = -1;
+    snprintf(request->old_password, sizeof(request->old_password), "%s", old_password);
+    if (new_password != NULL)
+        snprintf(request->new_password, sizeof(request->new_password), "%s", new_password);
+
+    pthread_mutex_lock(&auth_lock);
+    *list_tail(&auth_queue) = request;
+    pthread_cond_signal(&auth_cond);
+    pthread_mutex_unlock(&auth_lock);
+    return 0;
+}
+
+static CommandSession *session_by_fd(int fd)
+{
+    for (int i = 0; i <= CONTROL_MAX_CLIENTS; i++)
+    {
+        if (sessions[i] != NULL && sessions[i]->fd == fd)
+            return sessions[i];
+    }
+    return NULL;
+}
+
+static CommandSession *session_by_id(int id)
+{
+    for (int i = 0; i <= CONTROL_MAX_CLIENTS; i++)
+    {
+        if (sessions[i] != NULL && sessions[i]->id == id)
+            return sessions[i];
+    }
+    return NULL;
+}
+
+// Function to choose what epoll reports for a session: input unless it is
+// waiting on the auth thread, and writability while socket output is queued.
+// A session whose input has ended leaves epoll altogether when it has
+// nothing to send, since a hung-up descriptor is reported whatever we ask.
+static void session_update_interest(CommandSession *session)
+{
+    struct epoll_event ev = {0};
+    if (!session->closing && session->state != SESSION_AUTHENTICATING)
+        ev.events |= EPOLLIN;
+    if (session->output_len > 0)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = session->fd;
+    if (session->closing && ev.events == 0)
+        epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    else
+        epoll_ctl(server_epoll_fd, EPOLL_CTL_MOD, session->fd, &ev);
+}
+
+static void session_close(CommandSession *session)
+{
+    for (int i = 0; i <= CONTROL_MAX_CLIENTS; i++)
+    {
+        if (sessions[i] == session)
+            sessions[i] = NULL;
+    }
+    epoll_ctl(server_epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    if (session->is_socket)
+    {
+        close(session->fd);
+        log_message("Control client disconnected");
+    }
+    else if (session->closing)
+    {
+        log_message("Standard input closed; interactive commands disabled");
+    }
+    explicit_bzero(session->old_password, sizeof(session->old_password));
+    explicit_bzero(session->input, sizeof(session->input));
+    free(session->output);
+    free(session);
+}
+
+// Function to send queued socket output without blocking; -1 drops the client
+static int session_flush(CommandSession *session)
+{
+    while (session->output_len > 0)
+    {
+        ssize_t sent = send(session->fd, session->output, session->output_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        }
+        memmove(session->output, session->output + sent, session->output_len - (size_t)sent);
+        session->output_len -= (size_t)sent;
+    }
+    return session->output_len > CONTROL_OUTPUT_MAX ? -1 : 0;
+}
+
+// Command output goes straight to stdout for standard input, and through a
+// memory stream into the session's queue for socket clients
+static FILE *session_output_begin(CommandSession *session, char **buffer, size_t *length)
+{
+    *buffer = NULL;
+    *length = 0;
+    return session->is_socket ? open_memstream(buffer, length) : stdout;
+}
+
+static int session_output_end(CommandSession *session, FILE *out, char **buffer_out, size_t *length_out)
+{
+    if (!session->is_socket)
+    {
+        fflush(stdout);
+        return 0;
+    }
+    fclose(out); // Sets the buffer and its final length
+    char *buffer = *buffer_out;
+    size_t length = *length_out;
+    if (length == 0)
+    {
+        free(buffer);
+        return session_flush(session);
+    }
+    char *grown = realloc(session->output, session->output_len + length);
+    if (grown == NULL)
+    {
+        free(buffer);
+        return -1;
+    }
+    session->output = grown;
+    memcpy(session->output + session->output_len, buffer, length);
+    session->output_len += length;
+    free(buffer);
+    return session_flush(session);
+}
+
+// Function to run every complete line in a session's input, stopping while
+// a password is with the auth thread
+static int session_run_lines(CommandSession *session)
+{
+    char *buffer;
+    size_t length;
+    FILE *out = session_output_begin(session, &buffer, &length);
+    if (out == NULL)
+        return -1;
+
+    size_t start = 0;
+    while (session->state != SESSION_AUTHENTICATING && !atomic_load(&stop_requested))
+    {
+        char *newline = memchr(session->input + start, '\n', session->input_len - start);
+        if (newline == NULL)
+            break;
+        *newline = '\0';
+        char *line = session->input + start;
+        start = (size_t)(newline - session->input) + 1;
+        if (session->discarding)
+        {
+            session->discarding = 0;
+            continue;
+        }
+        line[strcspn(line, "\r")] = '\0';
+        handle_command(session, line, out);
+    }
+    explicit_bzero(session->input, start);
+    memmove(session->input, session->input + start, session->input_len - start);
+    session->input_len -= start;
+    if (session->input_len == CONTROL_INPUT_MAX)
+    {
+        // No command is this long; drop it up to its newline
+        session->discarding = 1;
+        session->input_len = 0;
+    }
+    return session_output_end(session, out, &buffer, &length);
+}
+
+// Function to finish a session's turn: drop it on error or once its input
+// has ended and nothing is pending, otherwise update what epoll watches
+static void session_settle(CommandSession *session, int ret)
+{
+    if (ret < 0 || (session->closing && session->state != SESSION_AUTHENTICATING && session->output_len == 0))
+    {
+        session_close(session);
+        return;
+    }
+    session_update_interest(session);
+}
+
+static void session_read(CommandSession *session)
+{
+    ssize_t n = read(session->fd, session->input + session->input_len, CONTROL_INPUT_MAX - session->input_len);
+    if (n < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN)
+            session_settle(session, -1);
+        return;
+    }
+    if (n == 0)
+    {
+        // A last line without a newline still counts, as it did with fgets
+        session->closing = 1;
+        if (session->input_len > 0 && session->input_len < CONTROL_INPUT_MAX)
+            session->input[session->input_len++] = '\n';
+    }
+    session->input_len += (size_t)n;
+    session_settle(session, session_run_lines(session));
+}
+
+static CommandSession *session_create(int fd, int is_socket)
+{
+    int slot = is_socket ? -1 : 0;
+    for (int i = 1; is_socket && i <= CONTROL_MAX_CLIENTS; i++)
+    {
+        if (sessions[i] == NULL)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0)
+        return NULL;
+
+    CommandSession *session = calloc(1, sizeof(CommandSession));
+    if (session == NULL)
+        return NULL;
+    session->id = next_session_id++;
+    session->fd = fd;
+    session->is_socket = is_socket;
+    session->state = SESSION_COMMAND;
+
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = fd;
+    if (epoll_ctl(server_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        free(session);
+        return NULL;
+    }
+    sessions[slot] = session;
+    return session;
+}
+
+static void accept_client(void)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    CommandSession *session = session_create(fd, 1);
+    if (session == NULL)
+    {
+        static const char busy[] = "Too many control clients.\n";
+        if (send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        {
+            // Nothing more to tell a client that cannot be served
+        }
+        close(fd);
+        log_message("Rejected control client: too many clients");
+        return;
+    }
+    log_message("Control client connected");
+
+    char *buffer;
+    size_t length;
+    FILE *out = session_output_begin(session, &buffer, &length);
+    if (out != NULL)
+    {
+        print_help(out);
+        session_settle(session, session_output_end(session, out, &buffer, &length));
+    }
+}
+
+// Function to deliver finished password requests to their sessions
+static void auth_collect(void)
+{
+    uint64_t count;
+    if (read(auth_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    pthread_mutex_lock(&auth_lock);
+    AuthRequest *done = auth_done;
+    auth_done = NULL;
+    pthread_mutex_unlock(&auth_lock);
+
+    while (done != NULL)
+    {
+        AuthRequest *request = done;
+        done = request->next;
+        // A client that went away no longer gets its disable carried out
+        CommandSession *session = session_by_id(request->session_id);
+        if (session != NULL)
+        {
+            char *buffer;
+            size_t length;
+            FILE *out = session_output_begin(session, &buffer, &length);
+            int ret = -1;
+            if (out != NULL)
+            {
+                handle_auth_result(session, request->kind, request->result, out);
+                ret = session_output_end(session, out, &buffer, &length);
+            }
+            if (ret == 0)
+                ret = session_run_lines(session);
+            session_settle(session, ret);
+        }
+        free(request);
+    }
+}
+
+// Function to create the control socket, refusing to take over the socket
+// of an instance that is still running
+static int control_socket_open(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode) || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path); // Left behind by an instance that did not shut down
+    }
+
+    mode_t old_mask = umask(077); // Only the owner may send commands
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret < 0 || listen(fd, CONTROL_MAX_CLIENTS) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to start the auth thread and register standard input and the
+// control socket with the main loop's epoll
+int command_server_start(int epoll_fd)
+{
+    server_epoll_fd = epoll_fd;
+    auth_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = auth_event_fd;
+    if (auth_event_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, auth_event_fd, &ev) < 0)
+    {
+        log_message("Failed to set up password handling");
+        return -1;
+    }
+    auth_stopping = 0;
+    if (pthread_create(&auth_thread, NULL, auth_main, NULL) != 0)
+    {
+        log_message("Failed to start password thread");
+        close(auth_event_fd);
+        auth_event_fd = -1;
+        return -1;
+    }
+    auth_thread_valid = 1;
+
+    if (session_create(STDIN_FILENO, 0) == NULL)
+    {
+        // Regular files and /dev/null cannot be polled; run without commands
+        log_message("Standard input cannot be polled; interactive commands disabled");
+    }
+
+    if (config.control_socket != NULL)
+    {
+        listen_fd = control_socket_open(config.control_socket);
+        ev.data.fd = listen_fd;
+        if (listen_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        {
+            char log_buf[MAX_PATH_LEN + 100];
+            snprintf(log_buf, sizeof(log_buf), "Control socket unavailable at %s: %s", config.control_socket,
+                     strerror(errno));
+            console_message(log_buf);
+            if (listen_fd >= 0)
+                close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+    return 0;
+}
+
+// Function to close every session and the control socket and stop the auth
+// thread; password requests still queued are abandoned. Output already
+// queued for a client gets one last attempt without blocking.
+void command_server_stop(void)
+{
+    for (int i = 0; i <= CONTROL_MAX_CLIENTS; i++)
+    {
+        if (sessions[i] != NULL)
+        {
+            if (sessions[i]->is_socket)
+                session_flush(sessions[i]);
+            session_close(sessions[i]);
+        }
+    }
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(config.control_socket);
+        listen_fd = -1;
+    }
+
+    if (auth_thread_valid)
+    {
+        pthread_mutex_lock(&auth_lock);
+        auth_stopping = 1;
+        while (auth_queue != NULL)
+        {
+            AuthRequest *request = auth_queue;
+            auth_queue = request->next;
+            explicit_bzero(request, sizeof(*request));
+            free(request);
+        }
+        pthread_cond_signal(&auth_cond);
+        pthread_mutex_unlock(&auth_lock);
+        pthread_join(auth_thread, NULL);
+        auth_thread_valid = 0;
+    }
+    while (auth_done != NULL)
+    {
+        AuthRequest *request = auth_done;
+        auth_done = request->next;
+        free(request);
+    }
+    if (auth_event_fd >= 0)
+    {
+        close(auth_event_fd);
+        auth_event_fd = -1;
+    }
+}
+
+// Function to handle an epoll event on one of the server's descriptors;
+// returns 0 if the descriptor is not ours
+int command_server_handle(int fd, uint32_t events)
+{
+    if (fd == auth_event_fd)
+    {
+        auth_collect();
+        return 1;
+    }
+    if (fd == listen_fd)
+    {
+        accept_client();
+        return 1;
+    }
+
+    CommandSession *session = session_by_fd(fd);
+    if (session == NULL)
+        return 0;
+    if (events & EPOLLOUT)
+    {
+        session_settle(session, session_flush(session));
+        session = session_by_fd(fd);
+    }
+    if (session != NULL && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        session_read(session);
+    }
+    return 1;
+}
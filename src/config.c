@@ -0,0 +1,233 @@
+#include "file_protection.h"
+
+#include <getopt.h>
+
+ProtectionConfig config = {
+    .backend = BACKEND_INOTIFY,
+    .walk_threads = 0,
+    .log_flush_interval_ms = LOG_DEFAULT_FLUSH_INTERVAL_MS,
+    .log_queue_capacity = LOG_DEFAULT_QUEUE_CAPACITY,
+    .log_policy = LOG_POLICY_DROP,
+    .state_index_path = STATE_INDEX_FILE,
+    .snapshot_dir = SNAPSHOT_STORE_DIR,
+    .metrics_path = METRICS_FILE,
+    .audit_dir = AUDIT_LOG_DIR,
+    .manifest_path = VERIFY_MANIFEST_FILE,
+    .verify_mbps = VERIFY_DEFAULT_MBPS,
+    .control_socket = CONTROL_SOCKET_FILE,
+    .coalesce_window_us = COALESCE_DEFAULT_WINDOW_US,
+    .inotify_instances = 1,
+    .workers = 0,
+};
+
+void print_usage(const char *program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("Options:\n");
+    printf("  --backend BACKEND     Enforcement backend: inotify or fanotify (default inotify)\n");
+    printf("  --walk-threads N      Threads used to install watches at startup (default: one per CPU, max %d)\n", TREE_WALK_MAX_THREADS);
+    printf("  --log-flush-ms N      Log writer flush interval in milliseconds (default %d)\n", LOG_DEFAULT_FLUSH_INTERVAL_MS);
+    printf("  --log-queue N         Log queue capacity in messages (default %d)\n", LOG_DEFAULT_QUEUE_CAPACITY);
+    printf("  --log-policy POLICY   What to do when the log queue is full: drop or block (default drop)\n");
+    printf("  --inotify-instances N Number of inotify instances per protected directory (default 1, max %d)\n", INOTIFY_MAX_ROOT_INSTANCES);
+    printf("  --workers N           Event enforcement worker threads (default: one per CPU, max %d)\n", PIPELINE_MAX_WORKERS);
+    printf("  --coalesce-us N       Window for merging repeated events on one file, 0 to disable (default %d)\n", COALESCE_DEFAULT_WINDOW_US);
+    printf("  --state-index PATH    Persistent state index for fast restarts, or 'none' (default %s)\n", STATE_INDEX_FILE);
+    printf("  --snapshot-dir PATH   Store for protected file contents used to restore them, or 'none' (default %s)\n", SNAPSHOT_STORE_DIR);
+    printf("  --audit-dir PATH      Binary audit log of enforcement actions, or 'none' (default %s)\n", AUDIT_LOG_DIR);
+    printf("  --manifest PATH       Content manifest kept by the verify command, or 'none' (default %s)\n", VERIFY_MANIFEST_FILE);
+    printf("  --verify-mbps N       Read limit for the verify command in MB/s, 0 for none (default %d)\n", VERIFY_DEFAULT_MBPS);
+    printf("  --control-socket PATH Unix socket accepting the interactive commands, or 'none' (default %s)\n", CONTROL_SOCKET_FILE);
+    printf("  --metrics-file PATH   Prometheus text file rewritten every %d s, or 'none' (default %s)\n", METRICS_FILE_INTERVAL_MS / 1000, METRICS_FILE);
+    printf("  -h, --help            Show this message\n");
+}
+
+// Parse a positive integer option value, rejecting trailing garbage
+static int parse_positive(const char *value, long max, long *out)
+{
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || parsed <= 0 || parsed > max)
+    {
+        return -1;
+    }
+    *out = parsed;
+    return 0;
+}
+
+// Function to parse command line options into the global configuration
+int parse_command_line(int argc, char *argv[])
+{
+    enum
+    {
+        OPT_BACKEND = 256,
+        OPT_WALK_THREADS,
+        OPT_LOG_FLUSH_MS,
+        OPT_LOG_QUEUE,
+        OPT_LOG_POLICY,
+        OPT_STATE_INDEX,
+        OPT_SNAPSHOT_DIR,
+        OPT_METRICS_FILE,
+        OPT_AUDIT_DIR,
+        OPT_MANIFEST,
+        OPT_VERIFY_MBPS,
+        OPT_CONTROL_SOCKET,
+        OPT_COALESCE_US,
+        OPT_INOTIFY_INSTANCES,
+        OPT_WORKERS,
+    };
+    static const struct option long_options[] = {
+        {"backend", required_argument, NULL, OPT_BACKEND},
+        {"walk-threads", required_argument, NULL, OPT_WALK_THREADS},
+        {"log-flush-ms", required_argument, NULL, OPT_LOG_FLUSH_MS},
+        {"log-queue", required_argument, NULL, OPT_LOG_QUEUE},
+        {"log-policy", required_argument, NULL, OPT_LOG_POLICY},
+        {"state-index", required_argument, NULL, OPT_STATE_INDEX},
+        {"snapshot-dir", required_argument, NULL, OPT_SNAPSHOT_DIR},
+        {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+        {"audit-dir", required_argument, NULL, OPT_AUDIT_DIR},
+        {"manifest", required_argument, NULL, OPT_MANIFEST},
+        {"verify-mbps", required_argument, NULL, OPT_VERIFY_MBPS},
+        {"control-socket", required_argument, NULL, OPT_CONTROL_SOCKET},
+        {"coalesce-us", required_argument, NULL, OPT_COALESCE_US},
+        {"inotify-instances", required_argument, NULL, OPT_INOTIFY_INSTANCES},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    long value;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_BACKEND:
+            if (strcmp(optarg, "inotify") == 0)
+            {
+                config.backend = BACKEND_INOTIFY;
+            }
+            else if (strcmp(optarg, "fanotify") == 0)
+            {
+                config.backend = BACKEND_FANOTIFY;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid --backend value: %s (expected inotify or fanotify)\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_WALK_THREADS:
+            if (parse_positive(optarg, TREE_WALK_MAX_THREADS, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --walk-threads value: %s (expected 1-%d)\n", optarg, TREE_WALK_MAX_THREADS);
+                return -1;
+            }
+            config.walk_threads = (int)value;
+            break;
+        case OPT_LOG_FLUSH_MS:
+            if (parse_positive(optarg, 60000, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --log-flush-ms value: %s\n", optarg);
+                return -1;
+            }
+            config.log_flush_interval_ms = (unsigned int)value;
+            break;
+        case OPT_LOG_QUEUE:
+            if (parse_positive(optarg, 1L << 20, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --log-queue value: %s\n", optarg);
+                return -1;
+            }
+            config.log_queue_capacity = (size_t)value;
+            break;
+        case OPT_LOG_POLICY:
+            if (strcmp(optarg, "drop") == 0)
+            {
+                config.log_policy = LOG_POLICY_DROP;
+            }
+            else if (strcmp(optarg, "block") == 0)
+            {
+                config.log_policy = LOG_POLICY_BLOCK;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid --log-policy value: %s (expected drop or block)\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_STATE_INDEX:
+            config.state_index_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case OPT_SNAPSHOT_DIR:
+            config.snapshot_dir = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case OPT_METRICS_FILE:
+            config.metrics_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case OPT_AUDIT_DIR:
+            config.audit_dir = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case OPT_MANIFEST:
+            config.manifest_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case OPT_VERIFY_MBPS:
+            if (strcmp(optarg, "0") == 0)
+            {
+                config.verify_mbps = 0;
+            }
+            else if (parse_positive(optarg, 100000, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --verify-mbps value: %s\n", optarg);
+                return -1;
+            }
+            else
+            {
+                config.verify_mbps = (unsigned int)value;
+            }
+            break;
+        case OPT_CONTROL_SOCKET:
+            config.control_socket = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case OPT_COALESCE_US:
+            if (strcmp(optarg, "0") == 0)
+            {
+                config.coalesce_window_us = 0;
+            }
+            else if (parse_positive(optarg, 10000000, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --coalesce-us value: %s\n", optarg);
+                return -1;
+            }
+            else
+            {
+                config.coalesce_window_us = (unsigned int)value;
+            }
+            break;
+        case OPT_INOTIFY_INSTANCES:
+            if (parse_positive(optarg, INOTIFY_MAX_ROOT_INSTANCES, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --inotify-instances value: %s (expected 1-%d)\n", optarg, INOTIFY_MAX_ROOT_INSTANCES);
+                return -1;
+            }
+            config.inotify_instances = (int)value;
+            break;
+        case OPT_WORKERS:
+            if (parse_positive(optarg, PIPELINE_MAX_WORKERS, &value) < 0)
+            {
+                fprintf(stderr, "Invalid --workers value: %s (expected 1-%d)\n", optarg, PIPELINE_MAX_WORKERS);
+                return -1;
+            }
+            config.workers = (int)value;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 1;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,416 @@
+#include "file_protection.h"
+
+// Interned directory tree. Every watched directory is a node holding a
+// pointer to its parent and its own name, so a path component shared by many
+// watches (the protected root, a deep common prefix) is stored once and a
+// watch costs the bytes of its last name instead of a full path buffer. Full
+// paths are built on demand by walking up to the filesystem root.
+//
+// Nodes are reference counted: a watch holds one reference and each child
+// holds one on its parent, so a directory stays interned while anything
+// below it is watched. Nodes are found again by (parent, name) through an
+// open-addressed hash set with backward-shift deletion.
+//
+// A renamed directory keeps its node: the node is moved under its new parent
+// with its new name, so every path below it follows without touching the
+// descendants.
+//
+// Nodes and names are bump-allocated from chunks aligned to their size, so
+// an allocation finds its chunk by masking its address. Each chunk counts its
+// live allocations and is freed when the last one goes; space freed inside a
+// chunk that still has live allocations is not reused.
+
+struct DirNode
+{
+    DirNode *parent;
+    const char *name; // In the arena; replaced when the directory is renamed
+    uint32_t refs;
+    uint32_t hash;
+    uint16_t len;
+};
+
+typedef struct
+{
+    size_t used; // Bytes handed out, including this header
+    size_t live; // Allocations not yet freed
+} ArenaChunk;
+
+static DirNode dir_tree_root = {NULL, "", 1, 0, 0}; // "/"; never freed
+static DirNode **dir_slots = NULL;
+static size_t dir_capacity = 0;
+static size_t dir_count = 0;
+static size_t dir_name_bytes = 0;
+static ArenaChunk *arena_current = NULL;
+static size_t arena_chunks = 0;
+static pthread_rwlock_t dir_tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define ARENA_HEADER ((sizeof(ArenaChunk) + 7) & ~(size_t)7)
+
+static uint32_t dir_node_hash(const DirNode *parent, const char *name, size_t len)
+{
+    // FNV-1a over the name, seeded with the parent's address
+    uint64_t seed = (uint64_t)(uintptr_t)parent;
+    uint32_t h = (2166136261u ^ (uint32_t)seed ^ (uint32_t)(seed >> 32)) * 16777619u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static size_t dir_slot_home(uint32_t hash)
+{
+    return (size_t)((uint64_t)hash * 0x9E3779B97F4A7C15ULL >> 32) & (dir_capacity - 1);
+}
+
+static ArenaChunk *arena_chunk_of(const void *p)
+{
+    return (ArenaChunk *)((uintptr_t)p & ~(uintptr_t)(DIR_TREE_CHUNK_SIZE - 1));
+}
+
+static void *arena_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    if (arena_current == NULL || arena_current->used + size > DIR_TREE_CHUNK_SIZE)
+    {
+        ArenaChunk *chunk = aligned_alloc(DIR_TREE_CHUNK_SIZE, DIR_TREE_CHUNK_SIZE);
+        if (chunk == NULL)
+            return NULL;
+        chunk->used = ARENA_HEADER;
+        chunk->live = 0;
+        if (arena_current != NULL && arena_current->live == 0)
+        {
+            free(arena_current);
+            arena_chunks--;
+        }
+        arena_current = chunk;
+        arena_chunks++;
+    }
+    void *p = (char *)arena_current + arena_current->used;
+    arena_current->used += size;
+    arena_current->live++;
+    return p;
+}
+
+static void arena_free(const void *p)
+{
+    ArenaChunk *chunk = arena_chunk_of(p);
+    if (--chunk->live == 0 && chunk != arena_current)
+    {
+        free(chunk);
+        arena_chunks--;
+    }
+}
+
+static int dir_slots_resize(size_t capacity)
+{
+    DirNode **slots = calloc(capacity, sizeof(DirNode *));
+    if (slots == NULL)
+        return -1;
+    DirNode **old_slots = dir_slots;
+    size_t old_capacity = dir_capacity;
+    dir_slots = slots;
+    dir_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i] == NULL)
+            continue;
+        size_t slot = dir_slot_home(old_slots[i]->hash);
+        while (dir_slots[slot] != NULL)
+        {
+            slot = (slot + 1) & (dir_capacity - 1);
+        }
+        dir_slots[slot] = old_slots[i];
+    }
+    free(old_slots);
+    return 0;
+}
+
+static void dir_slot_insert(DirNode *node)
+{
+    size_t slot = dir_slot_home(node->hash);
+    while (dir_slots[slot] != NULL)
+    {
+        slot = (slot + 1) & (dir_capacity - 1);
+    }
+    dir_slots[slot] = node;
+}
+
+static DirNode *dir_node_find(const DirNode *parent, const char *name, size_t len, uint32_t hash)
+{
+    if (dir_capacity == 0)
+        return NULL;
+    size_t slot = dir_slot_home(hash);
+    while (dir_slots[slot] != NULL)
+    {
+        DirNode *node = dir_slots[slot];
+        if (node->hash == hash && node->parent == parent && node->len == len && memcmp(node->name, name, len) == 0)
+            return node;
+        slot = (slot + 1) & (dir_capacity - 1);
+    }
+    return NULL;
+}
+
+// Function to find or create the child of a node. A new child takes a
+// reference on its parent and starts with none of its own.
+static DirNode *dir_node_child(DirNode *parent, const char *name, size_t len)
+{
+    uint32_t hash = dir_node_hash(parent, name, len);
+    DirNode *existing = dir_node_find(parent, name, len, hash);
+    if (existing != NULL)
+        return existing;
+
+    if ((dir_count + 1) * 100 > dir_capacity * WATCH_TABLE_MAX_LOAD_PERCENT &&
+        dir_slots_resize(dir_capacity ? dir_capacity * 2 : WATCH_TABLE_INITIAL_CAPACITY) < 0)
+        return NULL;
+
+    DirNode *node = arena_alloc(sizeof(DirNode));
+    char *copy = node != NULL ? arena_alloc(len + 1) : NULL;
+    if (copy == NULL)
+    {
+        if (node != NULL)
+            arena_free(node);
+        return NULL;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    node->parent = parent;
+    node->name = copy;
+    node->refs = 0;
+    node->hash = hash;
+    node->len = (uint16_t)len;
+    parent->refs++;
+
+    dir_slot_insert(node);
+    dir_count++;
+    dir_name_bytes += len;
+    return node;
+}
+
+static void dir_slot_remove(DirNode *node)
+{
+    const size_t mask = dir_capacity - 1;
+    size_t slot = dir_slot_home(node->hash);
+    while (dir_slots[slot] != node)
+    {
+        slot = (slot + 1) & mask;
+    }
+    dir_slots[slot] = NULL;
+
+    // Backward-shift the rest of the probe run so no lookup chain is broken
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+    while (dir_slots[next] != NULL)
+    {
+        size_t home = dir_slot_home(dir_slots[next]->hash);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            dir_slots[hole] = dir_slots[next];
+            dir_slots[next] = NULL;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Function to free a node nothing refers to any more, and then each
+// ancestor that this leaves unused
+static void dir_node_prune(DirNode *node)
+{
+    while (node != &dir_tree_root && node->refs == 0)
+    {
+        DirNode *parent = node->parent;
+        dir_slot_remove(node);
+        dir_count--;
+        dir_name_bytes -= node->len;
+        arena_free(node->name);
+        arena_free(node);
+        parent->refs--;
+        node = parent;
+    }
+}
+
+// Function to find the node of an absolute path, creating the missing ones
+// when create is set, and take a reference to it. The caller holds the
+// write lock.
+static DirNode *dir_tree_walk(const char *path, size_t path_len, int create)
+{
+    if (path_len == 0 || path[0] != '/')
+        return NULL;
+
+    DirNode *node = &dir_tree_root;
+    size_t i = 0;
+    while (i < path_len)
+    {
+        size_t len = 0;
+        while (i + len < path_len && path[i + len] != '/')
+            len++;
+        if (len > 0)
+        {
+            DirNode *child = NULL;
+            if (len <= NAME_MAX)
+            {
+                child = create ? dir_node_child(node, path + i, len)
+                               : dir_node_find(node, path + i, len, dir_node_hash(node, path + i, len));
+            }
+            if (child == NULL)
+            {
+                dir_node_prune(node);
+                return NULL;
+            }
+            node = child;
+        }
+        i += len + 1;
+    }
+    node->refs++;
+    return node;
+}
+
+// Function to intern an absolute directory path and take a reference to its
+// node. Returns NULL if the path is not absolute or memory runs out.
+DirNode *dir_tree_intern(const char *path)
+{
+    pthread_rwlock_wrlock(&dir_tree_lock);
+    DirNode *node = dir_tree_walk(path, strlen(path), 1);
+    pthread_rwlock_unlock(&dir_tree_lock);
+    return node;
+}
+
+// Function to take a reference to the node of a path that is already
+// interned. Returns NULL if it is not.
+DirNode *dir_tree_lookup(const char *path)
+{
+    pthread_rwlock_wrlock(&dir_tree_lock);
+    DirNode *node = dir_tree_walk(path, strlen(path), 0);
+    pthread_rwlock_unlock(&dir_tree_lock);
+    return node;
+}
+
+// Function to rename an interned directory. Its node moves under the node of
+// the new parent with the new name, so every path below it follows. Returns
+// -1 if the new path is already interned, lies inside the node itself, or
+// memory runs out.
+int dir_tree_move(DirNode *node, const char *new_path)
+{
+    const char *slash = strrchr(new_path, '/');
+    if (slash == NULL || slash[1] == '\0' || strlen(slash + 1) > NAME_MAX)
+        return -1;
+    const char *name = slash + 1;
+    size_t len = strlen(name);
+
+    pthread_rwlock_wrlock(&dir_tree_lock);
+    // The reference taken here becomes the node's reference on its parent
+    DirNode *parent = dir_tree_walk(new_path, slash == new_path ? 1 : (size_t)(slash - new_path), 1);
+    int ret = -1;
+    char *copy = NULL;
+    if (parent != NULL)
+    {
+        int inside = 0;
+        for (const DirNode *n = parent; n != NULL; n = n->parent)
+        {
+            inside |= n == node;
+        }
+        uint32_t hash = dir_node_hash(parent, name, len);
+        DirNode *existing = dir_node_find(parent, name, len, hash);
+        if (existing == node)
+        {
+            ret = 0;
+        }
+        else if (!inside && existing == NULL && (copy = arena_alloc(len + 1)) != NULL)
+        {
+            memcpy(copy, name, len + 1);
+            dir_slot_remove(node);
+            DirNode *old_parent = node->parent;
+            arena_free(node->name);
+            dir_name_bytes = dir_name_bytes - node->len + len;
+            node->parent = parent;
+            node->name = copy;
+            node->len = (uint16_t)len;
+            node->hash = hash;
+            dir_slot_insert(node);
+            old_parent->refs--;
+            dir_node_prune(old_parent);
+            pthread_rwlock_unlock(&dir_tree_lock);
+            return 0;
+        }
+        parent->refs--;
+        dir_node_prune(parent);
+    }
+    pthread_rwlock_unlock(&dir_tree_lock);
+    return ret;
+}
+
+// Function to check whether a node is an ancestor of another, or the same
+int dir_tree_is_within(const DirNode *node, const DirNode *ancestor)
+{
+    pthread_rwlock_rdlock(&dir_tree_lock);
+    const DirNode *n = node;
+    while (n != NULL && n != ancestor)
+    {
+        n = n->parent;
+    }
+    pthread_rwlock_unlock(&dir_tree_lock);
+    return n != NULL;
+}
+
+void dir_tree_release(DirNode *node)
+{
+    if (node == NULL)
+        return;
+    pthread_rwlock_wrlock(&dir_tree_lock);
+    node->refs--;
+    dir_node_prune(node);
+    pthread_rwlock_unlock(&dir_tree_lock);
+}
+
+// Function to write a node's full path into buffer. Returns its length, or
+// -1 if it does not fit.
+int dir_tree_path(const DirNode *node, char *buffer, size_t size)
+{
+    pthread_rwlock_rdlock(&dir_tree_lock);
+    size_t length = 0;
+    for (const DirNode *n = node; n != &dir_tree_root; n = n->parent)
+    {
+        length += n->len + 1;
+    }
+    if (length == 0)
+        length = 1; // The filesystem root itself
+    if (length + 1 > size)
+    {
+        pthread_rwlock_unlock(&dir_tree_lock);
+        return -1;
+    }
+
+    // Fill from the end, walking up the same chain again
+    buffer[length] = '\0';
+    buffer[0] = '/';
+    size_t end = length;
+    for (const DirNode *n = node; n != &dir_tree_root; n = n->parent)
+    {
+        end -= n->len;
+        memcpy(buffer + end, n->name, n->len);
+        buffer[--end] = '/';
+    }
+    pthread_rwlock_unlock(&dir_tree_lock);
+    return (int)length;
+}
+
+// Function to build the path of a file in an interned directory
+int dir_tree_file_path(const DirNode *node, const char *name, char *buffer, size_t size)
+{
+    int length = dir_tree_path(node, buffer, size);
+    if (length < 0)
+        return -1;
+    int written = snprintf(buffer + length, size - (size_t)length, "%s%s", length > 1 ? "/" : "", name);
+    return written < 0 || (size_t)written >= size - (size_t)length ? -1 : length + written;
+}
+
+void dir_tree_get_stats(DirTreeStats *stats)
+{
+    pthread_rwlock_rdlock(&dir_tree_lock);
+    stats->nodes = dir_count;
+    stats->name_bytes = dir_name_bytes;
+    stats->arena_bytes = arena_chunks * (size_t)DIR_TREE_CHUNK_SIZE;
+    stats->table_bytes = dir_capacity * sizeof(DirNode *);
+    pthread_rwlock_unlock(&dir_tree_lock);
+}
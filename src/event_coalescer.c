@@ -0,0 +1,340 @@
+#include "file_protection.h"
+
+// Coalescing stage between event delivery and handle_event. Each enforcement
+// worker owns one Coalescer; events are partitioned by directory, so all
+// events for one (wd, name) reach the same coalescer. Repeated
+// events for the same (wd, name) that arrive within config.coalesce_window_us
+// of the first one are merged into a single enforcement action carrying an
+// occurrence count, so a large write to a protected file costs one
+// protect_file and one log line instead of one per IN_MODIFY. A CREATE
+// followed by a DELETE of the same name inside the window cancels out, since
+// the file is already gone.
+//
+// Only file CREATE/DELETE/MODIFY events for protected names are held back.
+// Everything else is dispatched at once, after flushing whatever is pending
+// for the same name (or for everything, for watch lifecycle events) so the
+// enforcement order matches the event order.
+
+#define COALESCE_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY)
+
+typedef struct
+{
+    int fd; // inotify instance the wd belongs to
+    int wd;
+    uint32_t mask;
+    unsigned int count;
+    int used;
+    uint64_t seq; // Identifies this use of the slot in the FIFO
+    uint64_t deadline_us;
+    uint64_t read_ns; // When the first merged event was read; lag counts from it
+    uint32_t hash;
+    char name[NAME_MAX + 1];
+} PendingEvent;
+
+typedef struct
+{
+    int index;
+    uint64_t seq;
+} PendingRef;
+
+struct Coalescer
+{
+    PendingEvent pending[COALESCE_MAX_PENDING];
+    int slots[COALESCE_MAX_PENDING * 2]; // Hash of (fd, wd, name) -> pending index, -1 if empty
+    PendingRef fifo[COALESCE_MAX_PENDING]; // Entries in arrival (= deadline) order
+    size_t fifo_head;
+    size_t fifo_count;
+    int free_list[COALESCE_MAX_PENDING];
+    size_t free_count;
+    uint64_t next_seq;
+
+    unsigned long events;
+    unsigned long merged;
+    unsigned long cancelled;
+    unsigned long actions;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static uint32_t pending_hash(int fd, int wd, const char *name)
+{
+    // FNV-1a over the name, seeded with the instance and watch descriptor
+    uint32_t h = (2166136261u ^ (uint32_t)wd) * 16777619u ^ (uint32_t)fd;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+// Function to create an empty coalescer; each pipeline worker owns one
+Coalescer *coalescer_create(void)
+{
+    Coalescer *c = calloc(1, sizeof(Coalescer));
+    if (c == NULL)
+    {
+        log_message("Memory allocation failed for event coalescer");
+        return NULL;
+    }
+    for (size_t i = 0; i < COALESCE_MAX_PENDING * 2; i++)
+    {
+        c->slots[i] = -1;
+    }
+    for (int i = COALESCE_MAX_PENDING - 1; i >= 0; i--)
+    {
+        c->free_list[c->free_count++] = i;
+    }
+    c->next_seq = 1;
+    return c;
+}
+
+void coalescer_destroy(Coalescer *c)
+{
+    free(c);
+}
+
+static size_t slot_mask(void)
+{
+    return COALESCE_MAX_PENDING * 2 - 1;
+}
+
+static int pending_find(Coalescer *c, int fd, int wd, const char *name, uint32_t hash)
+{
+    size_t slot = hash & slot_mask();
+    while (c->slots[slot] >= 0)
+    {
+        PendingEvent *entry = &c->pending[c->slots[slot]];
+        if (entry->hash == hash && entry->wd == wd && entry->fd == fd && strcmp(entry->name, name) == 0)
+            return c->slots[slot];
+        slot = (slot + 1) & slot_mask();
+    }
+    return -1;
+}
+
+// Drop an entry from the hash, using backward-shift deletion as the watch
+// table does. Its FIFO reference goes stale and is skipped lazily.
+static void pending_release(Coalescer *c, int index)
+{
+    PendingEvent *entry = &c->pending[index];
+    size_t mask = slot_mask();
+    size_t slot = entry->hash & mask;
+    while (c->slots[slot] != index)
+    {
+        slot = (slot + 1) & mask;
+    }
+    c->slots[slot] = -1;
+
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+    while (c->slots[next] >= 0)
+    {
+        size_t home = c->pending[c->slots[next]].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            c->slots[hole] = c->slots[next];
+            c->slots[next] = -1;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    entry->used = 0;
+    c->free_list[c->free_count++] = index;
+}
+
+static void pending_dispatch(Coalescer *c, int index)
+{
+    PendingEvent *entry = &c->pending[index];
+    int fd = entry->fd;
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event = (struct inotify_event *)buffer;
+    size_t name_len = strlen(entry->name);
+    event->wd = entry->wd;
+    event->mask = entry->mask;
+    event->cookie = 0;
+    event->len = (uint32_t)(name_len + 1);
+    memcpy(event->name, entry->name, name_len + 1);
+
+    unsigned int count = entry->count;
+    uint64_t read_ns = entry->read_ns;
+    pending_release(c, index);
+    c->actions++;
+    uint64_t current_ns = metrics_event_time();
+    metrics_set_event_time(read_ns);
+    handle_event_count(fd, event, count);
+    metrics_set_event_time(current_ns);
+}
+
+static int fifo_live(const Coalescer *c, const PendingRef *ref)
+{
+    return c->pending[ref->index].used && c->pending[ref->index].seq == ref->seq;
+}
+
+// Dispatch the oldest pending entry; returns 0 once nothing is pending
+
+static int pending_dispatch_oldest(Coalescer *c, uint64_t now, int expired_only)
+{
+    while (c->fifo_count > 0)
+    {
+        PendingRef ref = c->fifo[c->fifo_head];
+        int live = fifo_live(c, &ref);
+        if (live && expired_only && c->pending[ref.index].deadline_us > now)
+            return 0;
+        c->fifo_head = (c->fifo_head + 1) % COALESCE_MAX_PENDING;
+        c->fifo_count--;
+        if (live)
+        {
+            pending_dispatch(c, ref.index);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to dispatch every pending event whose window has closed
+void coalescer_flush_expired(Coalescer *c)
+{
+    uint64_t now = now_us();
+    while (pending_dispatch_oldest(c, now, 1))
+        ;
+}
+
+// Function to dispatch every pending event regardless of its window
+void coalescer_flush_all(Coalescer *c)
+{
+    while (pending_dispatch_oldest(c, 0, 0))
+        ;
+}
+
+// Function to report how long the worker may sleep before the next deadline;
+// returns -1 if nothing is pending
+long coalescer_next_timeout_us(Coalescer *c)
+{
+    while (c->fifo_count > 0 && !fifo_live(c, &c->fifo[c->fifo_head]))
+    {
+        c->fifo_head = (c->fifo_head + 1) % COALESCE_MAX_PENDING;
+        c->fifo_count--;
+    }
+    if (c->fifo_count == 0)
+        return -1;
+
+    uint64_t deadline = c->pending[c->fifo[c->fifo_head].index].deadline_us;
+    uint64_t now = now_us();
+    return deadline > now ? (long)(deadline - now) : 0;
+}
+
+static int coalescable(int fd, const struct inotify_event *event)
+{
+    if (config.coalesce_window_us == 0 || !protection_enabled || event->len == 0 || (event->mask & IN_ISDIR) ||
+        (event->mask & ~COALESCE_EVENTS) != 0 || (event->mask & COALESCE_EVENTS) == 0)
+        return 0;
+
+    InotifyShard *shard = inotify_shard_for_fd(fd);
+    return shard != NULL && inotify_shard_protects(shard, event->wd, event->name) > 0;
+}
+
+// Function to pass one inotify event through the coalescing stage
+void coalescer_submit(Coalescer *c, int fd, struct inotify_event *event)
+{
+    c->events++;
+
+    if (!coalescable(fd, event))
+    {
+        // Lifecycle events may invalidate a wd with work still pending
+        if (event->len == 0 || (event->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF | IN_Q_OVERFLOW)))
+        {
+            coalescer_flush_all(c);
+        }
+        else
+        {
+            int index = pending_find(c, fd, event->wd, event->name, pending_hash(fd, event->wd, event->name));
+            if (index >= 0)
+            {
+                pending_dispatch(c, index);
+            }
+        }
+        handle_event(fd, event);
+        return;
+    }
+
+    uint32_t hash = pending_hash(fd, event->wd, event->name);
+    int index = pending_find(c, fd, event->wd, event->name, hash);
+    if (index >= 0)
+    {
+        PendingEvent *entry = &c->pending[index];
+        if ((event->mask & IN_DELETE) && (entry->mask & IN_CREATE))
+        {
+            // Created and deleted within the window: nothing is left to enforce
+            pending_release(c, index);
+            c->cancelled++;
+            return;
+        }
+        if ((event->mask & IN_MODIFY) && !(entry->mask & IN_DELETE))
+        {
+            // Writes after a create, or repeated writes, need one action
+            entry->mask |= IN_MODIFY;
+            entry->count++;
+            c->merged++;
+            return;
+        }
+        if ((event->mask & IN_DELETE) && entry->mask == IN_MODIFY)
+        {
+            // Modified then deleted: only the restore matters
+            entry->mask = IN_DELETE;
+            entry->count++;
+            c->merged++;
+            return;
+        }
+        // Any other sequence keeps its order: enforce what is pending first
+        pending_dispatch(c, index);
+    }
+
+    if (c->free_count == 0 || c->fifo_count == COALESCE_MAX_PENDING)
+    {
+        // Table full: make room by enforcing the oldest entry now
+        pending_dispatch_oldest(c, 0, 0);
+        if (c->free_count == 0 || c->fifo_count == COALESCE_MAX_PENDING)
+        {
+            handle_event(fd, event);
+            return;
+        }
+    }
+
+    index = c->free_list[--c->free_count];
+    PendingEvent *entry = &c->pending[index];
+    entry->fd = fd;
+    entry->wd = event->wd;
+    entry->mask = event->mask;
+    entry->count = 1;
+    entry->used = 1;
+    entry->seq = c->next_seq++;
+    entry->hash = hash;
+    entry->deadline_us = now_us() + config.coalesce_window_us;
+    entry->read_ns = metrics_event_time();
+    strncpy(entry->name, event->name, NAME_MAX);
+    entry->name[NAME_MAX] = '\0';
+
+    size_t slot = hash & slot_mask();
+    while (c->slots[slot] >= 0)
+    {
+        slot = (slot + 1) & slot_mask();
+    }
+    c->slots[slot] = index;
+    c->fifo[(c->fifo_head + c->fifo_count) % COALESCE_MAX_PENDING] = (PendingRef){.index = index, .seq = entry->seq};
+    c->fifo_count++;
+}
+
+// Function to add this coalescer's counters to the totals
+void coalescer_get_stats(const Coalescer *c, unsigned long *events, unsigned long *merged, unsigned long *cancelled,
+                         unsigned long *actions)
+{
+    *events += c->events;
+    *merged += c->merged;
+    *cancelled += c->cancelled;
+    *actions += c->actions;
+}
@@ -0,0 +1,595 @@
+#include "file_protection.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+// Multi-threaded event pipeline. A dedicated reader thread does nothing but
+// drain the inotify instances and hand each event to an enforcement worker
+// through that worker's lock-free single-producer/single-consumer ring. The
+// worker is chosen by hashing the event's directory (instance, wd), so every
+// event for a given path is handled by one worker, in order, while different
+// directories are enforced in parallel. Slow enforcement (an ioctl on a busy
+// file, say) only delays its own worker's queue; the reader keeps pulling
+// from the kernel so its queue does not overflow. Console output from the
+// workers goes through the logger thread, which runs at lower priority.
+// With several protected roots the workers are split into groups and each
+// root slot is served by one group, so a storm in one tree queues behind its
+// own workers rather than everyone's. The reader is still shared: a full ring
+// in one group holds up reading for all roots until that worker catches up.
+// IN_Q_OVERFLOW is not queued: the reader hands the overflowed instance to
+// the resync thread (overflow_resync.c) instead.
+
+typedef struct
+{
+    int fd;
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    uint32_t len;
+    uint64_t read_ns; // When the reader took the event from the kernel
+    char name[NAME_MAX + 1];
+} QueuedEvent;
+
+typedef struct
+{
+    _Alignas(64) atomic_size_t head; // Next slot the worker reads
+    _Alignas(64) atomic_size_t tail; // Next slot the reader writes
+    _Alignas(64) atomic_int sleeping;
+    QueuedEvent *slots;
+    int wake_fd; // eventfd the reader writes when the worker sleeps
+    pthread_t thread;
+    int index;
+    Coalescer *coalescer;
+    pthread_mutex_t stats_lock; // Guards the coalescer counters for status
+    atomic_ulong processed;
+    atomic_size_t high_water;
+} PipelineWorker;
+
+static PipelineWorker *workers = NULL;
+static int worker_count = 0;
+static int worker_groups = 1; // Worker i serves root slots s with s % worker_groups == i % worker_groups
+static pthread_t reader_thread;
+static int reader_epoll_fd = -1;
+static int reader_wake_fd = -1;
+static atomic_int pipeline_running = 0;
+static atomic_ulong reader_events = 0;
+static atomic_ulong reader_reads = 0;
+static atomic_ulong reader_stalls = 0;
+
+static size_t queue_depth(PipelineWorker *worker)
+{
+    return atomic_load_explicit(&worker->tail, memory_order_acquire) -
+           atomic_load_explicit(&worker->head, memory_order_acquire);
+}
+
+// Function to count the workers in the group that serves a root slot
+static int group_size(int group)
+{
+    return (worker_count - group + worker_groups - 1) / worker_groups;
+}
+
+static PipelineWorker *worker_for(int root, int fd, int wd)
+{
+    uint64_t h = ((uint64_t)(uint32_t)fd << 32 | (uint32_t)wd) * 0x9E3779B97F4A7C15ULL;
+    int group = root % worker_groups;
+    return &workers[group + worker_groups * (int)((h >> 32) % (uint64_t)group_size(group))];
+}
+
+// Function to count the workers that enforce a root slot's events
+int pipeline_root_workers(int root)
+{
+    return worker_count > 0 ? group_size(root % worker_groups) : 0;
+}
+
+static void worker_wake(PipelineWorker *worker)
+{
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("eventfd write");
+    }
+}
+
+// Reader side: publish one event. A full ring makes the reader wait for
+// that worker rather than drop events.
+static void pipeline_push(int root, int fd, const struct inotify_event *event, uint64_t read_ns)
+{
+    PipelineWorker *worker = worker_for(root, fd, event->wd);
+    size_t tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&worker->head, memory_order_acquire) == PIPELINE_QUEUE_CAPACITY)
+    {
+        atomic_fetch_add_explicit(&reader_stalls, 1, memory_order_relaxed);
+        worker_wake(worker);
+        while (tail - atomic_load_explicit(&worker->head, memory_order_acquire) == PIPELINE_QUEUE_CAPACITY)
+        {
+            sched_yield();
+        }
+    }
+
+    QueuedEvent *slot = &worker->slots[tail & (PIPELINE_QUEUE_CAPACITY - 1)];
+    slot->fd = fd;
+    slot->wd = event->wd;
+    slot->mask = event->mask;
+    slot->cookie = event->cookie;
+    slot->len = event->len;
+    slot->read_ns = read_ns;
+    if (event->len > 0)
+    {
+        strncpy(slot->name, event->name, NAME_MAX);
+        slot->name[NAME_MAX] = '\0';
+    }
+    else
+    {
+        slot->name[0] = '\0';
+    }
+    atomic_store_explicit(&worker->tail, tail + 1, memory_order_seq_cst);
+
+    size_t depth = tail + 1 - atomic_load_explicit(&worker->head, memory_order_relaxed);
+    if (depth > atomic_load_explicit(&worker->high_water, memory_order_relaxed))
+    {
+        atomic_store_explicit(&worker->high_water, depth, memory_order_relaxed);
+    }
+    // Pairs with the worker's store to sleeping before its final re-check
+    if (atomic_load_explicit(&worker->sleeping, memory_order_seq_cst))
+    {
+        worker_wake(worker);
+    }
+}
+
+// Rough per-instance count of the busiest directories, kept by the reader
+// alone: a direct-mapped table where a colliding wd wears the current entry
+// down before replacing it, so directories with sustained traffic stay in.
+typedef struct
+{
+    int wd;
+    unsigned int hits;
+} HotDirectory;
+
+static HotDirectory hot_directories[INOTIFY_MAX_INSTANCES][RESYNC_HOT_DIRECTORIES];
+static char *read_buffer = NULL;
+static size_t read_buffer_len = 0;
+static atomic_size_t read_buffer_size = 0;
+static atomic_size_t max_backlog = 0;
+
+static void hot_directory_hit(int index, int wd)
+{
+    HotDirectory *entry = &hot_directories[index][((uint32_t)wd * 2654435761u) % RESYNC_HOT_DIRECTORIES];
+    if (entry->wd == wd)
+    {
+        entry->hits++;
+    }
+    else if (entry->hits == 0)
+    {
+        entry->wd = wd;
+        entry->hits = 1;
+    }
+    else
+    {
+        entry->hits--;
+    }
+}
+
+static int hot_directory_compare(const void *a, const void *b)
+{
+    const HotDirectory *x = a, *y = b;
+    return (x->hits < y->hits) - (x->hits > y->hits);
+}
+
+// Function to hand an overflowed instance to the resync thread, busiest
+// directories first
+static void reader_overflow(int index)
+{
+    HotDirectory sorted[RESYNC_HOT_DIRECTORIES];
+    memcpy(sorted, hot_directories[index], sizeof(sorted));
+    qsort(sorted, RESYNC_HOT_DIRECTORIES, sizeof(HotDirectory), hot_directory_compare);
+
+    int hot[RESYNC_HOT_DIRECTORIES];
+    size_t hot_count = 0;
+    for (size_t i = 0; i < RESYNC_HOT_DIRECTORIES && sorted[i].hits > 0; i++)
+    {
+        hot[hot_count++] = sorted[i].wd;
+    }
+    // Let older traffic fade so the next overflow reflects recent activity
+    for (size_t i = 0; i < RESYNC_HOT_DIRECTORIES; i++)
+    {
+        hot_directories[index][i].hits /= 2;
+    }
+
+    char log_buf[128];
+    snprintf(log_buf, sizeof(log_buf), "inotify queue overflowed on instance %d; events were lost, resyncing", index);
+    console_message(log_buf);
+    resync_request(index, hot, hot_count);
+}
+
+// Function to grow the read buffer to hold a backlog, within EVENT_BUF_MAX_LEN
+static void reader_fit_backlog(int fd)
+{
+    int pending = 0;
+    if (ioctl(fd, FIONREAD, &pending) < 0 || pending <= 0)
+        return;
+    if ((size_t)pending > atomic_load_explicit(&max_backlog, memory_order_relaxed))
+    {
+        atomic_store_explicit(&max_backlog, (size_t)pending, memory_order_relaxed);
+    }
+    if ((size_t)pending <= read_buffer_len || read_buffer_len >= EVENT_BUF_MAX_LEN)
+        return;
+
+    size_t len = read_buffer_len;
+    while (len < (size_t)pending && len < EVENT_BUF_MAX_LEN)
+    {
+        len <<= 1;
+    }
+    char *buffer = aligned_alloc(__alignof__(struct inotify_event), len);
+    if (buffer == NULL)
+        return; // Keep draining with the current buffer
+    free(read_buffer);
+    read_buffer = buffer;
+    read_buffer_len = len;
+    atomic_store_explicit(&read_buffer_size, len, memory_order_relaxed);
+}
+
+// Drain one inotify instance until EAGAIN; its fd is edge-triggered. A read
+// that fills the buffer means a backlog, so the buffer is sized to it from
+// FIONREAD before the next read.
+static void reader_drain(int index)
+{
+    int fd = inotify_shards[index].fd;
+    int root = inotify_shards[index].root;
+    for (;;)
+    {
+        ssize_t length = read(fd, read_buffer, read_buffer_len);
+        if (length < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                log_message("Error reading inotify events");
+            }
+            return;
+        }
+        if (length == 0)
+            return;
+
+        atomic_fetch_add_explicit(&reader_reads, 1, memory_order_relaxed);
+        uint64_t read_ns = metrics_now_ns();
+        for (ssize_t i = 0; i < length;)
+        {
+            struct inotify_event *event = (struct inotify_event *)&read_buffer[i];
+            metrics_count_event(event->mask);
+            metrics_count_root_event(root);
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                reader_overflow(index);
+            }
+            else if (self_event_consume(fd, event))
+            {
+                // Caused by our own unlink or restore; nothing to enforce
+            }
+            else
+            {
+                hot_directory_hit(index, event->wd);
+                pipeline_push(root, fd, event, read_ns);
+            }
+            atomic_fetch_add_explicit(&reader_events, 1, memory_order_relaxed);
+            i += EVENT_SIZE + event->len;
+        }
+
+        if ((size_t)length + EVENT_SIZE + NAME_MAX + 1 > read_buffer_len)
+        {
+            reader_fit_backlog(fd);
+        }
+    }
+}
+
+static void *reader_main(void *arg)
+{
+    (void)arg;
+    while (atomic_load_explicit(&pipeline_running, memory_order_acquire))
+    {
+        struct epoll_event events[INOTIFY_MAX_INSTANCES + 1];
+        int ready = epoll_wait(reader_epoll_fd, events, INOTIFY_MAX_INSTANCES + 1, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_message("Event reader epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.u32 < (uint32_t)atomic_load(&inotify_shard_count))
+            {
+                reader_drain((int)events[i].data.u32);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Worker side: take one event off the ring, if any
+static int pipeline_pop(PipelineWorker *worker, char *buffer)
+{
+    size_t head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&worker->tail, memory_order_acquire))
+        return 0;
+
+    QueuedEvent *slot = &worker->slots[head & (PIPELINE_QUEUE_CAPACITY - 1)];
+    struct inotify_event *event = (struct inotify_event *)buffer;
+    int fd = slot->fd;
+    event->wd = slot->wd;
+    event->mask = slot->mask;
+    event->cookie = slot->cookie;
+    event->len = slot->len;
+    if (slot->len > 0)
+    {
+        memcpy(event->name, slot->name, strlen(slot->name) + 1);
+    }
+    uint64_t read_ns = slot->read_ns;
+    atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+    metrics_record(METRIC_LATENCY_QUEUE, metrics_now_ns() - read_ns);
+
+    pthread_mutex_lock(&worker->stats_lock);
+    metrics_set_event_time(read_ns);
+    coalescer_submit(worker->coalescer, fd, event);
+    metrics_set_event_time(0);
+    pthread_mutex_unlock(&worker->stats_lock);
+    atomic_fetch_add_explicit(&worker->processed, 1, memory_order_relaxed);
+    return 1;
+}
+
+static void *worker_main(void *arg)
+{
+    PipelineWorker *worker = arg;
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        while (pipeline_pop(worker, buffer))
+        {
+        }
+
+        pthread_mutex_lock(&worker->stats_lock);
+        coalescer_flush_expired(worker->coalescer);
+        long wait_us = coalescer_next_timeout_us(worker->coalescer);
+        pthread_mutex_unlock(&worker->stats_lock);
+
+        if (!atomic_load_explicit(&pipeline_running, memory_order_acquire) && queue_depth(worker) == 0)
+            break;
+
+        // Announce the sleep, then re-check so a concurrent push is not missed
+        atomic_store_explicit(&worker->sleeping, 1, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (queue_depth(worker) == 0 && atomic_load_explicit(&pipeline_running, memory_order_acquire))
+        {
+            struct pollfd pfd = {.fd = worker->wake_fd, .events = POLLIN};
+            struct timespec timeout = {.tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000};
+            if (ppoll(&pfd, 1, wait_us >= 0 ? &timeout : NULL, NULL) > 0)
+            {
+                uint64_t wakeups;
+                if (read(worker->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                {
+                    perror("eventfd read");
+                }
+            }
+        }
+        atomic_store_explicit(&worker->sleeping, 0, memory_order_relaxed);
+    }
+
+    // Everything queued has been handled; enforce what is still held back
+    pthread_mutex_lock(&worker->stats_lock);
+    coalescer_flush_all(worker->coalescer);
+    pthread_mutex_unlock(&worker->stats_lock);
+    return NULL;
+}
+
+// Function to choose the number of enforcement workers from the configuration
+static int pipeline_worker_count(void)
+{
+    int count = config.workers;
+    if (count <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+        if (count > PIPELINE_MAX_WORKERS)
+            count = PIPELINE_MAX_WORKERS;
+    }
+    return count;
+}
+
+static void pipeline_free_workers(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        close(workers[i].wake_fd);
+        coalescer_destroy(workers[i].coalescer);
+        free(workers[i].slots);
+        pthread_mutex_destroy(&workers[i].stats_lock);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+// Function to start the reader thread and the enforcement workers
+int pipeline_start(void)
+{
+    int count = pipeline_worker_count();
+    workers = aligned_alloc(64, ((size_t)count * sizeof(PipelineWorker) + 63) & ~(size_t)63);
+    if (workers == NULL)
+    {
+        log_message("Memory allocation failed for event pipeline");
+        return -1;
+    }
+    memset(workers, 0, (size_t)count * sizeof(PipelineWorker));
+
+    for (int i = 0; i < count; i++)
+    {
+        PipelineWorker *worker = &workers[i];
+        worker->index = i;
+        worker->slots = malloc(PIPELINE_QUEUE_CAPACITY * sizeof(QueuedEvent));
+        worker->coalescer = coalescer_create();
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&worker->stats_lock, NULL);
+        if (worker->slots == NULL || worker->coalescer == NULL || worker->wake_fd < 0)
+        {
+            log_message("Failed to set up event pipeline worker");
+            pipeline_free_workers(i + 1);
+            return -1;
+        }
+    }
+    worker_count = count;
+
+    // Roots that exist at startup each get workers of their own where there
+    // are enough; roots added by a reload share the groups
+    policy_read_lock();
+    int roots = policy_current()->root_count;
+    policy_read_unlock();
+    worker_groups = roots < count ? (roots > 0 ? roots : 1) : count;
+
+    reader_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reader_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reader_epoll_fd < 0 || reader_wake_fd < 0)
+    {
+        log_message("Failed to set up event reader");
+        pipeline_free_workers(count);
+        return -1;
+    }
+    read_buffer = aligned_alloc(__alignof__(struct inotify_event), EVENT_BUF_LEN);
+    if (read_buffer == NULL)
+    {
+        log_message("Memory allocation failed for inotify read buffer");
+        close(reader_epoll_fd);
+        close(reader_wake_fd);
+        pipeline_free_workers(count);
+        return -1;
+    }
+    read_buffer_len = EVENT_BUF_LEN;
+    atomic_store(&read_buffer_size, read_buffer_len);
+
+    // Events carry the instance index; the wake eventfd uses an out-of-range one
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.u32 = UINT32_MAX;
+    epoll_ctl(reader_epoll_fd, EPOLL_CTL_ADD, reader_wake_fd, &ev);
+    int shard_count = atomic_load(&inotify_shard_count);
+    for (int i = 0; i < shard_count; i++)
+    {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(reader_epoll_fd, EPOLL_CTL_ADD, inotify_shards[i].fd, &ev);
+    }
+
+    atomic_store(&pipeline_running, 1);
+    int started = 0;
+    for (; started < count; started++)
+    {
+        if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0)
+            break;
+    }
+    if (started < count || pthread_create(&reader_thread, NULL, reader_main, NULL) != 0)
+    {
+        atomic_store(&pipeline_running, 0);
+        for (int i = 0; i < started; i++)
+        {
+            worker_wake(&workers[i]);
+            pthread_join(workers[i].thread, NULL);
+        }
+        close(reader_epoll_fd);
+        close(reader_wake_fd);
+        free(read_buffer);
+        read_buffer = NULL;
+        pipeline_free_workers(count);
+        log_message("Failed to start event pipeline threads");
+        return -1;
+    }
+
+    char log_buf[100];
+    snprintf(log_buf, sizeof(log_buf), "Event pipeline started with %d enforcement worker(s) in %d group(s)", count,
+             worker_groups);
+    log_message(log_buf);
+    return 0;
+}
+
+// Function to have the reader drain an inotify instance added while running.
+// The instance is set up and counted before this, so its events are routed
+// as soon as the reader sees them.
+void pipeline_add_shard(int index)
+{
+    if (!atomic_load(&pipeline_running))
+        return;
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET};
+    ev.data.u32 = (uint32_t)index;
+    if (epoll_ctl(reader_epoll_fd, EPOLL_CTL_ADD, inotify_shards[index].fd, &ev) < 0)
+    {
+        log_message("Failed to add inotify instance to the event reader");
+    }
+}
+
+// Function to stop the reader, then let the workers finish what is queued
+void pipeline_stop(void)
+{
+    if (!atomic_exchange(&pipeline_running, 0))
+        return;
+
+    uint64_t one = 1;
+    if (write(reader_wake_fd, &one, sizeof(one)) < 0)
+    {
+        perror("eventfd write");
+    }
+    pthread_join(reader_thread, NULL);
+    for (int i = 0; i < worker_count; i++)
+    {
+        worker_wake(&workers[i]);
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    close(reader_epoll_fd);
+    close(reader_wake_fd);
+    reader_epoll_fd = -1;
+    reader_wake_fd = -1;
+    free(read_buffer);
+    read_buffer = NULL;
+    read_buffer_len = 0;
+    pipeline_free_workers(worker_count);
+    log_message("Event pipeline stopped");
+}
+
+// Function to log workers whose queue is filling up; run periodically
+void pipeline_check_backlog(void)
+{
+    for (int i = 0; i < worker_count; i++)
+    {
+        size_t depth = queue_depth(&workers[i]);
+        if (depth * 100 >= PIPELINE_QUEUE_CAPACITY * PIPELINE_BACKLOG_WARN_PERCENT)
+        {
+            char log_buf[128];
+            snprintf(log_buf, sizeof(log_buf), "Enforcement worker %d is falling behind: %zu/%d events queued", i,
+                     depth, PIPELINE_QUEUE_CAPACITY);
+            log_message(log_buf);
+        }
+    }
+}
+
+void pipeline_get_stats(PipelineStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->workers = worker_count;
+    stats->events = atomic_load_explicit(&reader_events, memory_order_relaxed);
+    stats->reads = atomic_load_explicit(&reader_reads, memory_order_relaxed);
+    stats->stalls = atomic_load_explicit(&reader_stalls, memory_order_relaxed);
+    stats->read_buffer = atomic_load_explicit(&read_buffer_size, memory_order_relaxed);
+    stats->max_backlog = atomic_load_explicit(&max_backlog, memory_order_relaxed);
+    for (int i = 0; i < worker_count && i < PIPELINE_MAX_WORKERS; i++)
+    {
+        PipelineWorker *worker = &workers[i];
+        stats->depth[i] = queue_depth(worker);
+        stats->high_water[i] = atomic_load_explicit(&worker->high_water, memory_order_relaxed);
+        stats->processed[i] = atomic_load_explicit(&worker->processed, memory_order_relaxed);
+        pthread_mutex_lock(&worker->stats_lock);
+        coalescer_get_stats(worker->coalescer, &stats->coalesced_events, &stats->merged, &stats->cancelled,
+                            &stats->dispatched);
+        pthread_mutex_unlock(&worker->stats_lock);
+    }
+}
@@ -0,0 +1,259 @@
+#include "file_protection.h"
+
+#include <poll.h>
+#include <sys/fanotify.h>
+
+// fanotify permission-event enforcement. Every watched directory also gets a
+// fanotify mark for FAN_OPEN_PERM/FAN_ACCESS_PERM on its children, and a
+// dedicated thread answers each request before the open or read proceeds:
+// protected files are denied, everything else is allowed. The inotify path
+// keeps running alongside to restore deletions and renames, which fanotify
+// cannot veto.
+//
+// Two verdict caches keep unprotected files cheap:
+//   - a direct-mapped (dev, ino) cache in this thread, tagged with a policy
+//     generation that namespace changes and enable/disable bump;
+//   - kernel ignore marks on unprotected inodes, so later opens of those
+//     files never reach userspace at all.
+
+#define FANOTIFY_PERM_EVENTS (FAN_OPEN_PERM | FAN_ACCESS_PERM)
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    unsigned int generation;
+    int deny;
+    int used;
+} VerdictEntry;
+
+static int fan_fd = -1;
+static pthread_t fan_thread;
+static atomic_int fan_running = 0;
+static atomic_uint fan_generation = 1;
+static VerdictEntry verdict_cache[FANOTIFY_VERDICT_CACHE_SIZE];
+
+static atomic_ulong fan_events = 0;
+static atomic_ulong fan_denied = 0;
+static atomic_ulong fan_cache_hits = 0;
+static atomic_ulong fan_ignore_marks = 0;
+
+int fanotify_backend_active(void)
+{
+    return atomic_load_explicit(&fan_running, memory_order_acquire);
+}
+
+static VerdictEntry *verdict_slot(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t)dev * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)ino * 0xC2B2AE3D27D4EB4FULL);
+    return &verdict_cache[(h >> 20) & (FANOTIFY_VERDICT_CACHE_SIZE - 1)];
+}
+
+// Decide whether the open or read behind a permission event may proceed
+static int fanotify_should_deny(const struct fanotify_event_metadata *metadata)
+{
+    // Our own enforcement and restore paths must never block on themselves
+    if (metadata->pid == getpid() || !protection_enabled)
+        return 0;
+
+    struct stat st;
+    if (fstat(metadata->fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+
+    unsigned int generation = atomic_load_explicit(&fan_generation, memory_order_acquire);
+    VerdictEntry *entry = verdict_slot(st.st_dev, st.st_ino);
+    if (entry->used && entry->dev == st.st_dev && entry->ino == st.st_ino && entry->generation == generation)
+    {
+        atomic_fetch_add_explicit(&fan_cache_hits, 1, memory_order_relaxed);
+        return entry->deny;
+    }
+
+    char proc_path[64];
+    char path[MAX_PATH_LEN];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", metadata->fd);
+    ssize_t len = readlink(proc_path, path, sizeof(path) - 1);
+    if (len <= 0)
+        return 0;
+    path[len] = '\0';
+
+    char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        return 0;
+    *slash = '\0';
+    const char *dir = slash == path ? "/" : path;
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_path(policy_current(), dir);
+    int deny = root != NULL && policy_protects_name(root, dir, slash + 1);
+    policy_read_unlock();
+
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->generation = generation;
+    entry->deny = deny;
+    entry->used = 1;
+
+    // Single-link unprotected files can be ignored by the kernel from now on;
+    // a file with several names might be protected under another one
+    if (!deny && st.st_nlink == 1 &&
+        atomic_load_explicit(&fan_ignore_marks, memory_order_relaxed) < FANOTIFY_MAX_IGNORE_MARKS)
+    {
+        if (fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_IGNORED_MASK | FAN_MARK_IGNORED_SURV_MODIFY,
+                          FANOTIFY_PERM_EVENTS, metadata->fd, NULL) == 0)
+        {
+            atomic_fetch_add_explicit(&fan_ignore_marks, 1, memory_order_relaxed);
+        }
+    }
+    return deny;
+}
+
+static void fanotify_handle_events(void)
+{
+    char buffer[FANOTIFY_BUF_LEN] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t length = read(fan_fd, buffer, sizeof(buffer));
+    if (length <= 0)
+        return;
+
+    struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *)buffer;
+    for (; FAN_EVENT_OK(metadata, length); metadata = FAN_EVENT_NEXT(metadata, length))
+    {
+        if (metadata->vers != FANOTIFY_METADATA_VERSION)
+        {
+            log_message("fanotify metadata version mismatch; stopping fanotify backend");
+            atomic_store(&fan_running, 0);
+            return;
+        }
+        if (metadata->fd < 0)
+            continue;
+
+        if (metadata->mask & FANOTIFY_PERM_EVENTS)
+        {
+            atomic_fetch_add_explicit(&fan_events, 1, memory_order_relaxed);
+            int deny = fanotify_should_deny(metadata);
+
+            struct fanotify_response response = {
+                .fd = metadata->fd,
+                .response = deny ? FAN_DENY : FAN_ALLOW,
+            };
+            if (write(fan_fd, &response, sizeof(response)) < 0)
+            {
+                perror("fanotify response");
+            }
+
+            if (deny)
+            {
+                atomic_fetch_add_explicit(&fan_denied, 1, memory_order_relaxed);
+                char proc_path[64];
+                char path[MAX_PATH_LEN];
+                snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", metadata->fd);
+                ssize_t len = readlink(proc_path, path, sizeof(path) - 1);
+                path[len > 0 ? len : 0] = '\0';
+                char log_buf[MAX_PATH_LEN + 100];
+                snprintf(log_buf, sizeof(log_buf), "Denied %s of protected file by pid %d: %s",
+                         (metadata->mask & FAN_OPEN_PERM) ? "open" : "read", (int)metadata->pid, path);
+                log_message(log_buf);
+            }
+        }
+        close(metadata->fd);
+    }
+}
+
+static void *fanotify_thread(void *arg)
+{
+    (void)arg;
+    struct pollfd pfd = {.fd = fan_fd, .events = POLLIN};
+
+    while (atomic_load_explicit(&fan_running, memory_order_acquire))
+    {
+        int ret = poll(&pfd, 1, FANOTIFY_POLL_TIMEOUT_MS);
+        if (ret < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (ret > 0 && (pfd.revents & POLLIN))
+        {
+            fanotify_handle_events();
+        }
+    }
+    return NULL;
+}
+
+int fanotify_backend_start(void)
+{
+    fan_fd = fanotify_init(FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fan_fd < 0)
+    {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf), "fanotify permission events unavailable: %s", strerror(errno));
+        log_message(log_buf);
+        return -1;
+    }
+
+    memset(verdict_cache, 0, sizeof(verdict_cache));
+    atomic_store(&fan_running, 1);
+    if (pthread_create(&fan_thread, NULL, fanotify_thread, NULL) != 0)
+    {
+        atomic_store(&fan_running, 0);
+        close(fan_fd);
+        fan_fd = -1;
+        log_message("Failed to start fanotify thread");
+        return -1;
+    }
+
+    log_message("fanotify permission-event enforcement started");
+    return 0;
+}
+
+void fanotify_backend_stop(void)
+{
+    if (!atomic_exchange(&fan_running, 0))
+        return;
+
+    pthread_join(fan_thread, NULL);
+    // Closing the group lets any still-pending requests through
+    close(fan_fd);
+    fan_fd = -1;
+    log_message("fanotify permission-event enforcement stopped");
+}
+
+// Function to subscribe to permission events for a watched directory's children
+void fanotify_backend_add_directory(int dir_fd, const char *path)
+{
+    if (!fanotify_backend_active())
+        return;
+
+    if (fanotify_mark(fan_fd, FAN_MARK_ADD, FANOTIFY_PERM_EVENTS | FAN_EVENT_ON_CHILD, dir_fd, NULL) < 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to add fanotify mark for %s: %s", path, strerror(errno));
+        log_message(log_buf);
+    }
+}
+
+// Function to drop any cached allow verdict for a path that may now be protected
+void fanotify_backend_forget(const char *path)
+{
+    if (!fanotify_backend_active())
+        return;
+
+    if (fanotify_mark(fan_fd, FAN_MARK_REMOVE | FAN_MARK_IGNORED_MASK, FANOTIFY_PERM_EVENTS, AT_FDCWD, path) == 0)
+    {
+        atomic_fetch_sub_explicit(&fan_ignore_marks, 1, memory_order_relaxed);
+    }
+    fanotify_backend_invalidate();
+}
+
+// Function to invalidate the in-process verdict cache after a policy change
+void fanotify_backend_invalidate(void)
+{
+    atomic_fetch_add_explicit(&fan_generation, 1, memory_order_release);
+}
+
+void fanotify_backend_get_stats(unsigned long *events, unsigned long *denied, unsigned long *cache_hits,
+                                unsigned long *ignore_marks)
+{
+    *events = atomic_load_explicit(&fan_events, memory_order_relaxed);
+    *denied = atomic_load_explicit(&fan_denied, memory_order_relaxed);
+    *cache_hits = atomic_load_explicit(&fan_cache_hits, memory_order_relaxed);
+    *ignore_marks = atomic_load_explicit(&fan_ignore_marks, memory_order_relaxed);
+}
@@ -1,50 +1,175 @@
 #include "file_protection.h"
 
-char *templates[MAX_TEMPLATES];
-int template_count = 0;
-int protection_enabled = 0;
-char protected_directory[MAX_PATH_LEN] = {0};
+atomic_int protection_enabled = 0;
+
+// The daemon's own files, by default relative to the directory it runs in.
+// Run from inside a protected directory, it would otherwise enforce against
+// its own log, index, metrics, manifest, socket, snapshots and audit log.
+#define ARTIFACT_MAX 8
 
-// New structure to store watch descriptors
 typedef struct
 {
-    int wd;
-    char path[MAX_PATH_LEN];
-} WatchInfo;
+    char path[MAX_PATH_LEN]; // Parent resolved; the file itself may not exist yet
+    int is_directory;        // Everything below it is excluded
+} Artifact;
 
-WatchInfo watches[MAX_WATCHES];
-int watch_count = 0;
+static Artifact artifacts[ARTIFACT_MAX];
+static int artifact_count = 0;
+static pthread_once_t artifacts_once = PTHREAD_ONCE_INIT;
 
-void log_message(const char *message)
+static void artifact_add(const char *path, int is_directory)
 {
-    FILE *log_file = fopen(LOG_FILE, "a");
-    if (log_file == NULL)
+    if (path == NULL || artifact_count == ARTIFACT_MAX)
+        return;
+
+    char parent[MAX_PATH_LEN];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *slash = strrchr(parent, '/');
+    const char *name = path;
+    if (slash != NULL)
     {
-        perror("Error opening log file");
+        name = path + (slash - parent) + 1;
+        *slash = '\0';
+    }
+    char *resolved = realpath(slash == NULL ? "." : parent[0] ? parent : "/", NULL);
+    if (resolved == NULL)
         return;
+    Artifact *artifact = &artifacts[artifact_count];
+    if (snprintf(artifact->path, sizeof(artifact->path), "%s/%s", strcmp(resolved, "/") == 0 ? "" : resolved,
+                 name) < (int)sizeof(artifact->path))
+    {
+        artifact->is_directory = is_directory;
+        artifact_count++;
+    }
+    free(resolved);
+}
+
+// The configuration does not change after startup, so this runs once
+static void artifacts_init(void)
+{
+    artifact_add(LOG_FILE, 0);
+    artifact_add(config.state_index_path, 0);
+    artifact_add(config.metrics_path, 0);
+    artifact_add(config.manifest_path, 0);
+    artifact_add(config.control_socket, 0);
+    artifact_add(config.snapshot_dir, 1);
+    artifact_add(config.audit_dir, 1);
+}
+
+// Function to check if a file is one of the daemon's own, or the temporary
+// name one is written under
+static int is_artifact_file(const char *dir, const char *name)
+{
+    char path[MAX_PATH_LEN];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+        return 0;
+    for (int i = 0; i < artifact_count; i++)
+    {
+        size_t len = strlen(artifacts[i].path);
+        if (artifacts[i].is_directory ? is_path_within(artifacts[i].path, dir)
+                                      : strncmp(path, artifacts[i].path, len) == 0 &&
+                                            (path[len] == '\0' || strcmp(path + len, ".tmp") == 0))
+            return 1;
+    }
+    return 0;
+}
+
+static int is_artifact_directory(const char *path)
+{
+    for (int i = 0; i < artifact_count; i++)
+    {
+        if (artifacts[i].is_directory && is_path_within(artifacts[i].path, path))
+            return 1;
+    }
+    return 0;
+}
+
+// Function to start the next protected root of the template file. Roots
+// must be directories and must not overlap. Returns NULL on error.
+static PolicyRoot *policy_add_root(Policy *policy, const char *line)
+{
+    if (policy->root_count == POLICY_MAX_ROOTS)
+    {
+        char log_buf[128];
+        snprintf(log_buf, sizeof(log_buf), "Too many protected directories (at most %d)", POLICY_MAX_ROOTS);
+        log_message(log_buf);
+        return NULL;
+    }
+
+    // Resolve and set the absolute path of the protected directory
+    char *resolved_path = realpath(line, NULL);
+    if (resolved_path == NULL)
+    {
+        char error_buf[MAX_PATH_LEN + 100];
+        snprintf(error_buf, sizeof(error_buf), "Error resolving protected directory path '%s': %s", line, strerror(errno));
+        log_message(error_buf);
+        return NULL;
     }
-    time_t now = time(NULL);
-    char *time_str = ctime(&now);
-    time_str[strlen(time_str) - 1] = '\0'; // Remove newline
-    fprintf(log_file, "[%s] %s\n", time_str, message);
-    fclose(log_file);
+    PolicyRoot *root = &policy->roots[policy->root_count];
+    strncpy(root->path, resolved_path, MAX_PATH_LEN - 1);
+    root->path[MAX_PATH_LEN - 1] = '\0';
+    free(resolved_path);
+
+    char log_buf[2 * MAX_PATH_LEN + 100];
+    struct stat st;
+    if (stat(root->path, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        snprintf(log_buf, sizeof(log_buf), "Protected path is not a directory: %s", root->path);
+        log_message(log_buf);
+        return NULL;
+    }
+    for (int i = 0; i < policy->root_count; i++)
+    {
+        if (is_path_within(policy->roots[i].path, root->path) || is_path_within(root->path, policy->roots[i].path))
+        {
+            snprintf(log_buf, sizeof(log_buf), "Protected directories overlap: %s and %s", policy->roots[i].path,
+                     root->path);
+            log_message(log_buf);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < artifact_count; i++)
+    {
+        root->artifacts |= is_path_within(root->path, artifacts[i].path);
+    }
+    root->slot = policy->root_count++;
+    snprintf(log_buf, sizeof(log_buf), "Protected directory set to: %s", root->path);
+    log_message(log_buf);
+    return root;
 }
 
-// Function to load templates and protected directory from the template file
-int load_templates()
+// Function to load the protected directories and templates from the template
+// file and compile them into a new policy. The second line names the first
+// protected directory; any later line starting with '/' starts another one,
+// and each pattern applies to the directory above it. Patterns with a '/' or
+// a leading '!' are path patterns relative to that directory (path_rules.c).
+// Returns NULL on error.
+Policy *load_templates(void)
 {
     log_message("Loading templates");
+    pthread_once(&artifacts_once, artifacts_init);
     FILE *file = fopen(TEMPLATE_FILE, "r");
     if (file == NULL)
     {
         char error_buf[256];
         snprintf(error_buf, sizeof(error_buf), "Error opening template file: %s", strerror(errno));
         log_message(error_buf);
-        return -1;
+        return NULL;
+    }
+
+    Policy *policy = calloc(1, sizeof(Policy));
+    if (policy == NULL)
+    {
+        log_message("Memory allocation failed while loading templates");
+        fclose(file);
+        return NULL;
     }
 
-    char line[MAX_FILENAME_LEN];
+    char line[MAX_PATH_LEN];
     int line_count = 0;
+    int template_capacity[POLICY_MAX_ROOTS] = {0};
+    PolicyRoot *root = NULL;
     while (fgets(line, sizeof(line), file))
     {
         line[strcspn(line, "\n")] = 0; // Remove newline
@@ -54,237 +179,461 @@ int load_templates()
             line_count++;
             continue;
         }
-        if (line_count == 1)
+        if (line_count == 1 || line[0] == '/')
         {
-            // Resolve and set the absolute path of the protected directory
-            char *resolved_path = realpath(line, NULL);
-            if (resolved_path == NULL)
+            root = policy_add_root(policy, line);
+            if (root == NULL)
             {
-                char error_buf[MAX_PATH_LEN + 100];
-                snprintf(error_buf, sizeof(error_buf), "Error resolving protected directory path '%s': %s", line, strerror(errno));
-                log_message(error_buf);
                 fclose(file);
-                return -1;
+                policy_free(policy);
+                return NULL;
             }
-            strncpy(protected_directory, resolved_path, MAX_PATH_LEN - 1);
-            protected_directory[MAX_PATH_LEN - 1] = '\0';
-            free(resolved_path);
-
-            char log_buf[MAX_PATH_LEN + 50];
-            snprintf(log_buf, sizeof(log_buf), "Protected directory set to: %s", protected_directory);
-            log_message(log_buf);
+            line_count++;
+            continue;
+        }
+        if (strcmp(line, "!") == 0)
+        {
+            log_message("Ignoring empty exclusion template");
             line_count++;
             continue;
         }
         // Load template patterns
-        templates[template_count] = strdup(line);
-        char log_buf[MAX_FILENAME_LEN + 30];
-        snprintf(log_buf, sizeof(log_buf), "Loaded template: %s", templates[template_count]);
+        int *capacity = &template_capacity[root->slot];
+        if (root->pattern_count == *capacity)
+        {
+            int new_capacity = *capacity ? *capacity * 2 : TEMPLATE_INITIAL_CAPACITY;
+            char **new_templates = realloc(root->patterns, (size_t)new_capacity * sizeof(char *));
+            if (new_templates == NULL)
+            {
+                log_message("Memory allocation failed while loading templates");
+                fclose(file);
+                policy_free(policy);
+                return NULL;
+            }
+            root->patterns = new_templates;
+            *capacity = new_capacity;
+        }
+        root->patterns[root->pattern_count] = strdup(line);
+        if (root->patterns[root->pattern_count] == NULL)
+        {
+            log_message("Memory allocation failed while loading templates");
+            fclose(file);
+            policy_free(policy);
+            return NULL;
+        }
+        char log_buf[MAX_PATH_LEN + 30];
+        snprintf(log_buf, sizeof(log_buf), "Loaded template: %s", root->patterns[root->pattern_count]);
         log_message(log_buf);
-        template_count++;
+        root->pattern_count++;
         line_count++;
-        if (template_count >= MAX_TEMPLATES)
-            break;
     }
 
     fclose(file);
-    log_message("Templates loaded successfully");
-    return 0;
-}
 
-// add_watch_recursive function to add a watch recursively
-void add_watch_recursive(int fd, const char *path)
-{
-    DIR *dir;
-    struct dirent *entry;
-
-    dir = opendir(path);
-    if (dir == NULL)
+    if (policy->root_count == 0)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to open directory for watching: %s", path);
-        log_message(log_buf);
-        return;
+        log_message("Template file has no protected directory line");
+        policy_free(policy);
+        return NULL;
     }
 
-    int wd = inotify_add_watch(fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY);
-    if (wd < 0)
+    for (int i = 0; i < policy->root_count; i++)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to add watch for %s: %s", path, strerror(errno));
-        log_message(log_buf);
-    }
-    else
-    {
-        if (watch_count < MAX_WATCHES)
+        root = &policy->roots[i];
+        int failed;
+        root->matcher = matcher_compile(root->patterns, root->pattern_count);
+        root->rules = path_rules_compile(root->patterns, root->pattern_count, &failed);
+        if (root->matcher == NULL || failed)
         {
-            watches[watch_count].wd = wd;
-            strncpy(watches[watch_count].path, path, MAX_PATH_LEN);
-            watch_count++;
+            log_message("Failed to compile templates");
+            policy_free(policy);
+            return NULL;
         }
-        else
+        for (int j = 0; j < root->pattern_count; j++)
         {
-            log_message("Maximum number of watches reached");
+            root->name_patterns += !path_rules_handles(root->patterns[j]);
         }
+
+        MatcherStats stats;
+        matcher_get_stats(root->matcher, &stats);
+        size_t includes, exclusions, nodes;
+        path_rules_get_stats(root->rules, &includes, &exclusions, &nodes);
+        char log_buf[MAX_PATH_LEN + 256];
+        snprintf(log_buf, sizeof(log_buf),
+                 "Templates compiled for %s: %zu exact, %zu extensions, %zu globs (%zu NFA states), %zu fnmatch "
+                 "fallbacks%s, %zu path patterns and %zu exclusions (%zu trie nodes)",
+                 root->path, stats.exact, stats.suffixes, stats.globs, stats.nfa_states, stats.fallback,
+                 stats.match_all ? ", match-all" : "", includes, exclusions, nodes);
+        log_message(log_buf);
     }
+    log_message("Templates loaded successfully");
+    return policy;
+}
 
-    while ((entry = readdir(dir)) != NULL)
+// Function to check if a canonical path lies within a canonical directory
+int is_path_within(const char *parent, const char *sub)
+{
+    size_t parent_len = strlen(parent);
+    if (parent_len == 1 && parent[0] == '/')
     {
-        if (entry->d_type == DT_DIR)
-        {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            {
-                continue;
-            }
-            char full_path[MAX_PATH_LEN];
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-            add_watch_recursive(fd, full_path);
-        }
+        return sub[0] == '/';
     }
-
-    closedir(dir);
+    return strncmp(parent, sub, parent_len) == 0 &&
+           (sub[parent_len] == '/' || sub[parent_len] == '\0');
 }
 
-// Function to check if a directory is a subdirectory of another
-int is_subdirectory(const char *parent, const char *sub)
+// Function to get a directory's path relative to its protected root, or
+// NULL if it lies outside
+static const char *policy_relative_path(const PolicyRoot *root, const char *dir)
 {
-    char parent_real[MAX_PATH_LEN];
-    char sub_real[MAX_PATH_LEN];
+    if (!is_path_within(root->path, dir))
+        return NULL;
+    const char *relative = dir + strlen(root->path);
+    return *relative == '/' ? relative + 1 : relative;
+}
 
-    if (realpath(parent, parent_real) == NULL || realpath(sub, sub_real) == NULL)
+// Function to check if a file in a directory of a protected root matches its
+// templates: a name pattern or a path pattern, and no exclusion. dir is only
+// read when the root has path templates or holds the daemon's own files.
+int policy_protects_name(const PolicyRoot *root, const char *dir, const char *name)
+{
+    // Don't protect the log file, the state index or any other file of ours
+    if (strcmp(name, LOG_FILE) == 0 || strcmp(name, STATE_INDEX_FILE) == 0 ||
+        (root->artifacts && is_artifact_file(dir, name)))
     {
         return 0;
     }
+    int name_match = matcher_match(root->matcher, name);
+    if (root->rules == NULL)
+        return name_match;
 
-    size_t parent_len = strlen(parent_real);
-    return strncmp(parent_real, sub_real, parent_len) == 0 &&
-           (sub_real[parent_len] == '/' || sub_real[parent_len] == '\0');
+    const char *relative = policy_relative_path(root, dir);
+    return relative != NULL && path_rules_match(root->rules, relative, name, name_match);
 }
 
-// Function to check if a file is protected based on its name and location
-int is_protected(const char *filename)
+// Function to check if a directory of a protected root can be left unwatched
+// because no file below it can be protected
+int policy_prunes_directory(const PolicyRoot *root, const char *path)
 {
-    // Don't protect the log file
-    if (strcmp(basename((char *)filename), LOG_FILE) == 0)
-    {
+    if (root->artifacts && is_artifact_directory(path))
+        return 1;
+    if (root->rules == NULL)
         return 0;
+    const char *relative = policy_relative_path(root, path);
+    return relative != NULL && path_rules_prune(root->rules, relative, root->name_patterns > 0);
+}
+
+// Function to check a file against the current templates of one root
+int is_protected_name(int slot, const char *dir, const char *name)
+{
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_slot(policy_current(), slot);
+    int protected_name = root != NULL && policy_protects_name(root, dir, name);
+    policy_read_unlock();
+    return protected_name;
+}
+
+// Function to check a directory against the current templates of one root
+int is_pruned_directory(int slot, const char *path)
+{
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_slot(policy_current(), slot);
+    int pruned = root != NULL && policy_prunes_directory(root, path);
+    policy_read_unlock();
+    return pruned;
+}
+
+// Function to check if a file in a watched directory is protected. The
+// directory's path is only built when the root has path templates or the
+// daemon's own files, so a name-only check makes no syscalls and no
+// allocations.
+int is_protected_in(int slot, const DirNode *dir, const char *name)
+{
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_slot(policy_current(), slot);
+    int protected_name = 0;
+    if (root != NULL && root->rules == NULL && !root->artifacts)
+    {
+        protected_name = policy_protects_name(root, NULL, name);
     }
+    else if (root != NULL)
+    {
+        char path[MAX_PATH_LEN];
+        protected_name = dir_tree_path(dir, path, sizeof(path)) >= 0 && policy_protects_name(root, path, name);
+    }
+    policy_read_unlock();
+    return protected_name;
+}
+
+// Function to log and print an enforcement action, folding in how many
+// coalesced events it stands for. Printing is left to the log writer so the
+// enforcement workers never wait on the terminal.
+static void report_blocked(const InotifyShard *shard, AuditAction audit, const char *action, const char *path,
+                           unsigned int count)
+{
+    audit_record(audit, 0, shard->root, path, count);
+    uint64_t read_ns = metrics_event_time();
+    uint64_t latency_ns = read_ns != 0 ? metrics_now_ns() - read_ns : 0;
+    if (read_ns != 0)
+    {
+        metrics_record(METRIC_LATENCY_ENFORCE, latency_ns);
+    }
+    metrics_record_root(shard->root, latency_ns);
 
-    char *file_copy = strdup(filename);
-    if (file_copy == NULL)
+    char log_buf[MAX_PATH_LEN + 100];
+    if (count > 1)
     {
-        log_message("Memory allocation failed in is_protected");
-        return 0;
+        snprintf(log_buf, sizeof(log_buf), "Blocked %s protected file: %s (%u events)", action, path, count);
     }
+    else
+    {
+        snprintf(log_buf, sizeof(log_buf), "Blocked %s protected file: %s", action, path);
+    }
+    console_message(log_buf);
+}
 
-    char *dir_name = dirname(file_copy);
-    if (!is_subdirectory(protected_directory, dir_name))
+// Function to count the outcome and duration of rebuilding a protected file
+static void count_restore(uint64_t start_ns, int from_snapshot, int recreated)
+{
+    metrics_record(METRIC_LATENCY_RESTORE, metrics_now_ns() - start_ns);
+    metrics_count(from_snapshot ? METRIC_RESTORE_SNAPSHOT : recreated ? METRIC_RESTORE_EMPTY : METRIC_RESTORE_FAILED);
+}
+
+// Function to put a deleted or moved-away protected file back, from its
+// snapshot or else empty. Its IN_CREATE is expected only while this call can
+// be the one to create the name; if another process took the name first,
+// the expectation is withdrawn so their file's own event is still handled.
+// Returns 1 if restored from the snapshot, 0 if recreated empty, -1 if not.
+int recreate_watched_file(int fd, int wd, const char *name, const char *path)
+{
+    self_event_expect(fd, wd, name, IN_CREATE);
+    if (snapshot_restore(path) == 0)
+        return 1;
+    int file = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0666);
+    if (file >= 0)
     {
-        free(file_copy);
+        close(file);
         return 0;
     }
+    self_event_cancel(fd, wd, name, IN_CREATE);
+    return -1;
+}
 
-    char *base_name = basename(file_copy);
-    int is_prot = 0;
-    for (int i = 0; i < template_count; i++)
+// Function to protect a file in a watched directory through the directory's
+// descriptor. The read lock keeps the descriptor from being closed by a
+// watch removal meanwhile; directories without one fall back to the path.
+static void protect_watched_file(InotifyShard *shard, int wd, const char *name, const char *path)
+{
+    pthread_rwlock_rdlock(&shard->lock);
+    const WatchInfo *watch = watch_table_find(&shard->watches, wd);
+    if (watch != NULL && watch->dir_fd >= 0)
     {
-        if (fnmatch(templates[i], base_name, 0) == 0)
-        {
-            is_prot = 1;
-            break;
-        }
+        protect_file_at(watch->dir_fd, name, path);
+        pthread_rwlock_unlock(&shard->lock);
+        return;
     }
+    pthread_rwlock_unlock(&shard->lock);
+    protect_file(path);
+}
 
-    free(file_copy);
-    return is_prot;
+// Function to unlink a file in a watched directory, relative to it if possible
+static int unlink_watched_file(InotifyShard *shard, int wd, const char *name, const char *path)
+{
+    pthread_rwlock_rdlock(&shard->lock);
+    const WatchInfo *watch = watch_table_find(&shard->watches, wd);
+    if (watch != NULL && watch->dir_fd >= 0)
+    {
+        int ret = unlinkat(watch->dir_fd, name, 0);
+        pthread_rwlock_unlock(&shard->lock);
+        return ret;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return unlink(path);
 }
 
 // Function to handle file system events
 void handle_event(int fd, struct inotify_event *event)
 {
-    if (event->len && protection_enabled)
+    handle_event_count(fd, event, 1);
+}
+
+// Function to handle one file system event, or several coalesced into one.
+// The checks below run in a fixed order, so a merged mask such as
+// IN_CREATE | IN_MODIFY is enforced by its first applicable action.
+static void dispatch_event(int fd, struct inotify_event *event, unsigned int count)
+{
+    InotifyShard *shard = inotify_shard_for_fd(fd);
+    if (shard == NULL)
+        return;
+
+    if (event->mask & IN_IGNORED)
+    {
+        // The kernel dropped this watch; release its table slot and index entry
+        pthread_rwlock_wrlock(&shard->lock);
+        WatchInfo *watch = watch_table_find(&shard->watches, event->wd);
+        if (watch != NULL)
+        {
+            state_index_forget(watch->dev, watch->ino);
+        }
+        watch_table_remove(&shard->watches, event->wd);
+        pthread_rwlock_unlock(&shard->lock);
+        return;
+    }
+
+    if (event->mask & IN_DELETE_SELF)
+    {
+        watch_deleted(shard, event->wd);
+        return;
+    }
+
+    if (event->mask & IN_MOVE_SELF)
     {
-        char *watch_path = NULL;
-        for (int i = 0; i < watch_count; i++)
+        // Directories below a root are renamed through their parent's
+        // IN_MOVED_FROM and IN_MOVED_TO. A protected root has no watched
+        // parent, so when it is renamed this is the only event there is.
+        WatchInfo watch;
+        char path[MAX_PATH_LEN];
+        if (inotify_shard_lookup(shard, event->wd, &watch, path) == 0 && watch.inside_root)
         {
-            if (watches[i].wd == event->wd)
+            policy_read_lock();
+            const PolicyRoot *root = policy_root_for_slot(policy_current(), shard->root);
+            int is_root = root != NULL && strcmp(root->path, path) == 0;
+            policy_read_unlock();
+
+            struct stat st;
+            if (is_root && !(stat(path, &st) == 0 && st.st_dev == watch.dev && st.st_ino == watch.ino))
             {
-                watch_path = watches[i].path;
-                break;
+                watch_deleted(shard, event->wd);
+                char log_buf[MAX_PATH_LEN + 100];
+                snprintf(log_buf, sizeof(log_buf), "Protected directory moved away: %s", path);
+                log_message(log_buf);
             }
         }
+        return;
+    }
 
-        if (watch_path == NULL)
+    // The watch tree follows directory changes whether or not protection is
+    // enabled, so it is current when protection is turned on. Renamed
+    // subdirectories keep their watches; new or moved-in ones are watched
+    // whatever their name.
+    if (event->len && (event->mask & IN_ISDIR) && (event->mask & IN_DELETE))
+    {
+        watch_subdir_removed(shard, event);
+        return;
+    }
+    if (event->len && (event->mask & IN_ISDIR) && (event->mask & IN_MOVED_FROM))
+    {
+        fanotify_backend_invalidate();
+        watch_moved_from(shard, event);
+        return;
+    }
+    if (event->len && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        fanotify_backend_invalidate();
+        WatchInfo watch;
+        char dir_path[PATH_MAX];
+        if (inotify_shard_lookup(shard, event->wd, &watch, NULL) == 0 && watch.inside_root &&
+            inotify_shard_file_path(shard, event->wd, event->name, dir_path) == 0 &&
+            !((event->mask & IN_MOVED_TO) && watch_moved_to(shard, event, dir_path)))
+        {
+            add_watch_recursive(dir_path);
+        }
+        return;
+    }
+
+    if (event->len && protection_enabled)
+    {
+        if (strcmp(event->name, LOG_FILE) == 0)
         {
-            log_message("Unrecognized watch descriptor");
             return;
         }
 
+        // Names changed in this directory; cached fanotify verdicts may be stale
+        if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+        {
+            fanotify_backend_invalidate();
+        }
+
+        // The file's full path is only built once there is something to do
         char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", watch_path, event->name);
 
-        if (strcmp(event->name, LOG_FILE) == 0)
+        int protected_name = inotify_shard_protects(shard, event->wd, event->name);
+        if (protected_name < 0)
         {
+            log_message("Unrecognized watch descriptor");
             return;
         }
+        metrics_count(protected_name ? METRIC_MATCHER_HIT : METRIC_MATCHER_MISS);
 
-        if (is_protected(full_path))
+        if (protected_name && inotify_shard_file_path(shard, event->wd, event->name, full_path) == 0)
         {
             char log_buf[MAX_PATH_LEN + 100];
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            {
+                // An inode the kernel was told to ignore may now carry a protected name
+                fanotify_backend_forget(full_path);
+            }
             if (event->mask & IN_CREATE)
             {
-                if (event->mask & IN_ISDIR)
+                // Block creation of protected files. The unlink's own
+                // IN_DELETE is dropped by the reader, not restored.
+                self_event_expect(fd, event->wd, event->name, IN_DELETE);
+                if (unlink_watched_file(shard, event->wd, event->name, full_path) == 0)
                 {
-                    add_watch_recursive(fd, full_path);
+                    metrics_count(METRIC_UNLINK_OK);
+                    report_blocked(shard, AUDIT_BLOCK_CREATE, "creation of", full_path, count);
                 }
                 else
                 {
-                    // Block creation of protected files
-                    if (unlink(full_path) == 0)
-                    {
-                        snprintf(log_buf, sizeof(log_buf), "Blocked creation of protected file: %s", full_path);
-                        log_message(log_buf);
-                        printf("Blocked creation of protected file: %s\n", full_path);
-                    }
-                    else
-                    {
-                        snprintf(log_buf, sizeof(log_buf), "Failed to block creation of protected file: %s", full_path);
-                        log_message(log_buf);
-                    }
+                    self_event_cancel(fd, event->wd, event->name, IN_DELETE);
+                    metrics_count(METRIC_UNLINK_FAILED);
+                    audit_record(AUDIT_BLOCK_CREATE, 1, shard->root, full_path, count);
+                    snprintf(log_buf, sizeof(log_buf), "Failed to block creation of protected file: %s", full_path);
+                    log_message(log_buf);
                 }
             }
             else if (event->mask & IN_DELETE)
             {
-                // Restore deleted protected files
-                FILE *file = fopen(full_path, "a");
-                if (file != NULL)
+                // Restore deleted protected files, with their contents if snapshotted
+                uint64_t restore_start = metrics_now_ns();
+                int restored = recreate_watched_file(fd, event->wd, event->name, full_path);
+                count_restore(restore_start, restored == 1, restored == 0);
+                if (restored >= 0)
                 {
-                    fclose(file);
-                    protect_file(full_path);
-                    snprintf(log_buf, sizeof(log_buf), "Blocked deletion of protected file: %s", full_path);
-                    log_message(log_buf);
-                    printf("Blocked deletion of protected file: %s\n", full_path);
+                    protect_watched_file(shard, event->wd, event->name, full_path);
+                    report_blocked(shard, AUDIT_RESTORE_DELETE, "deletion of", full_path, count);
                 }
                 else
                 {
+                    audit_record(AUDIT_RESTORE_DELETE, 1, shard->root, full_path, count);
                     snprintf(log_buf, sizeof(log_buf), "Failed to restore protected file: %s", full_path);
                     log_message(log_buf);
                 }
             }
             else if (event->mask & IN_MOVED_FROM || event->mask & IN_MOVED_TO)
             {
-                // Block move operations on protected files
-                FILE *file = fopen(full_path, "a");
-                if (file != NULL)
+                // Block move operations on protected files. A file moved away
+                // is rebuilt from its snapshot; one moved in keeps its contents.
+                uint64_t restore_start = metrics_now_ns();
+                AuditAction audit = (event->mask & IN_MOVED_FROM) ? AUDIT_RESTORE_MOVE_FROM : AUDIT_RESTORE_MOVE_TO;
+                int restored = 0;
+                if (event->mask & IN_MOVED_FROM)
                 {
-                    fclose(file);
-                    protect_file(full_path);
-                    snprintf(log_buf, sizeof(log_buf), "Blocked move operation on protected file: %s", full_path);
-                    log_message(log_buf);
-                    printf("Blocked move operation on protected file: %s\n", full_path);
+                    restored = recreate_watched_file(fd, event->wd, event->name, full_path);
+                    count_restore(restore_start, restored == 1, restored == 0);
+                }
+                else if (faccessat(AT_FDCWD, full_path, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+                {
+                    restored = -1;
+                }
+                if (restored >= 0)
+                {
+                    protect_watched_file(shard, event->wd, event->name, full_path);
+                    report_blocked(shard, audit, "move operation on", full_path, count);
                 }
                 else
                 {
+                    audit_record(audit, 1, shard->root, full_path, count);
                     snprintf(log_buf, sizeof(log_buf), "Failed to restore moved protected file: %s", full_path);
                     log_message(log_buf);
                 }
@@ -292,62 +641,140 @@ void handle_event(int fd, struct inotify_event *event)
             else if (event->mask & IN_MODIFY)
             {
                 // Block modifications to protected files
-                protect_file(full_path);
-                snprintf(log_buf, sizeof(log_buf), "Blocked modification of protected file: %s", full_path);
-                log_message(log_buf);
-                printf("Blocked modification of protected file: %s\n", full_path);
+                protect_watched_file(shard, event->wd, event->name, full_path);
+                report_blocked(shard, AUDIT_BLOCK_MODIFY, "modification of", full_path, count);
             }
         }
     }
 }
 
+// Every decision for one event is made against a single policy, so a reload
+// that lands in the middle of it cannot mix old and new templates
+void handle_event_count(int fd, struct inotify_event *event, unsigned int count)
+{
+    policy_read_lock();
+    dispatch_event(fd, event, count);
+    policy_read_unlock();
+}
+
 // Function to protect a file by setting it as immutable and read-only
 void protect_file(const char *path)
 {
-    // Set the immutable attribute
-    int fd = open(path, O_RDONLY);
-    if (fd < 0)
+    char dir_path[MAX_PATH_LEN];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    char *slash = strrchr(dir_path, '/');
+    int dir_fd = -1;
+    if (slash != NULL && slash[1] != '\0')
+    {
+        *slash = '\0';
+        dir_fd = open(dir_path[0] ? dir_path : "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (dir_fd < 0)
     {
         char log_buf[MAX_PATH_LEN + 100];
         snprintf(log_buf, sizeof(log_buf), "Failed to open file for protection: %s", path);
         log_message(log_buf);
+        metrics_count(METRIC_PROTECT_FAILED);
         return;
     }
+    protect_file_at(dir_fd, slash + 1, path);
+    close(dir_fd);
+}
 
-    unsigned long flags;
-    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0)
+// Function to protect a file by name relative to its directory. path is only
+// used for logging. A file that is already immutable and read-only costs an
+// openat, an fstat and one ioctl.
+void protect_file_at(int dir_fd, const char *name, const char *path)
+{
+    uint64_t start_ns = metrics_now_ns();
+    int ret = set_protection_state_at(dir_fd, name, 1);
+    if (ret < 0)
     {
         char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to get flags for file: %s", path);
+        snprintf(log_buf, sizeof(log_buf), "Failed to protect file: %s", path);
         log_message(log_buf);
+    }
+    metrics_record(METRIC_LATENCY_PROTECT, metrics_now_ns() - start_ns);
+    metrics_count(ret < 0 ? METRIC_PROTECT_FAILED : METRIC_PROTECT_OK);
+}
+
+// Function to bring one file into its protected (immutable, read-only) or
+// unprotected (writable) state, relative to an open directory. Returns 1 if
+// anything changed, 0 if the file already matched and -1 on failure.
+int set_protection_state_at(int dir_fd, const char *name, int protect)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
         close(fd);
-        return;
+        return -1;
     }
 
-    flags |= FS_IMMUTABLE_FL;
+    // Filesystems without inode flags get the mode change only
+    int flags = 0;
+    int have_flags = ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0;
+    int immutable = have_flags && (flags & FS_IMMUTABLE_FL);
+    int target_immutable = protect && have_flags;
+    mode_t mode = st.st_mode & 07777;
+    mode_t target_mode = protect ? (S_IRUSR | S_IRGRP | S_IROTH) : (mode | S_IWUSR | S_IWGRP | S_IWOTH);
 
-    if (ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0)
+    if (mode == target_mode && immutable == target_immutable)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to set immutable flag for file: %s", path);
-        log_message(log_buf);
+        state_index_record_file(dir_fd, name, &st, immutable, protect);
+        close(fd);
+        return 0;
     }
 
-    close(fd);
+    // The mode of an immutable file cannot change, so clear the flag first
+    int ret = 1;
+    if (immutable)
+    {
+        flags &= ~FS_IMMUTABLE_FL;
+        if (ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0)
+            ret = -1;
+    }
+    if (ret > 0 && mode != target_mode && fchmod(fd, target_mode) < 0)
+    {
+        ret = -1;
+    }
+    if (ret > 0 && target_immutable)
+    {
+        flags |= FS_IMMUTABLE_FL;
+        if (ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0)
+            ret = -1;
+    }
 
-    // Set read-only permissions
-    if (chmod(path, S_IRUSR | S_IRGRP | S_IROTH) < 0)
+    if (ret > 0 && fstat(fd, &st) == 0)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to set read-only permissions for file: %s", path);
-        log_message(log_buf);
+        state_index_record_file(dir_fd, name, &st, target_immutable, protect);
     }
+    close(fd);
+    return ret;
+}
+
+// Function to set or clear the immutable flag on an open file. Returns 1 if
+// it changed, 0 if it already matched and -1 on failure.
+static int update_immutable(int fd, int immutable)
+{
+    int flags = 0;
+    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0)
+        return -1;
+    if (!(flags & FS_IMMUTABLE_FL) == !immutable)
+        return 0;
+    flags = immutable ? (flags | FS_IMMUTABLE_FL) : (flags & ~FS_IMMUTABLE_FL);
+    return ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0 ? -1 : 1;
 }
 
 // Function to set the immutable flag on a file
 void set_immutable(const char *path)
 {
-    int fd = open(path, O_RDONLY);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
     if (fd < 0)
     {
         char log_buf[MAX_PATH_LEN + 100];
@@ -356,38 +783,21 @@ void set_immutable(const char *path)
         return;
     }
 
-    unsigned long flags;
-    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0)
-    {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to get flags for file: %s", path);
-        log_message(log_buf);
-        close(fd);
-        return;
-    }
-
-    flags |= FS_IMMUTABLE_FL;
-
-    if (ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0)
-    {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to set immutable flag for file: %s", path);
-        log_message(log_buf);
-    }
-    else
+    int ret = update_immutable(fd, 1);
+    close(fd);
+    if (ret != 0)
     {
         char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Set immutable flag for file: %s", path);
+        snprintf(log_buf, sizeof(log_buf), ret < 0 ? "Failed to set immutable flag for file: %s"
+                                                   : "Set immutable flag for file: %s", path);
         log_message(log_buf);
     }
-
-    close(fd);
 }
 
 // Function to clear the immutable flag from a file
 void clear_immutable_flag(const char *path)
 {
-    int fd = open(path, O_RDONLY);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
     if (fd < 0)
     {
         char log_buf[MAX_PATH_LEN + 100];
@@ -396,48 +806,37 @@ void clear_immutable_flag(const char *path)
         return;
     }
 
-    unsigned long flags;
-    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0)
-    {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to get flags for file: %s", path);
-        log_message(log_buf);
-        close(fd);
-        return;
-    }
-
-    // Clear the immutable flag
-    flags &= ~FS_IMMUTABLE_FL;
-
-    if (ioctl(fd, FS_IOC_SETFLAGS, &flags) < 0)
-    {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to clear immutable flag for file: %s", path);
-        log_message(log_buf);
-    }
-    else
+    int ret = update_immutable(fd, 0);
+    close(fd);
+    if (ret != 0)
     {
         char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Cleared immutable flag for file: %s", path);
+        snprintf(log_buf, sizeof(log_buf), ret < 0 ? "Failed to clear immutable flag for file: %s"
+                                                   : "Cleared immutable flag for file: %s", path);
         log_message(log_buf);
     }
-
-    close(fd);
 }
 
 // Function to restore write permissions to a file
 void restore_permissions(const char *path)
 {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
     struct stat st;
-    if (stat(path, &st) == 0)
+    if (fd < 0 || fstat(fd, &st) < 0)
     {
-        if (chmod(path, st.st_mode | S_IWUSR | S_IWGRP | S_IWOTH) != 0)
-        {
-            char log_buf[MAX_PATH_LEN + 100];
-            snprintf(log_buf, sizeof(log_buf), "Failed to restore permissions for: %s", path);
-            log_message(log_buf);
-        }
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    mode_t writable = st.st_mode | S_IWUSR | S_IWGRP | S_IWOTH;
+    if (writable != st.st_mode && fchmod(fd, writable & 07777) != 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to restore permissions for: %s", path);
+        log_message(log_buf);
     }
+    close(fd);
 }
 
 void create_log_buffer(char *buffer, size_t buffer_size, const char *format, ...)
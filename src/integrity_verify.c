@@ -0,0 +1,748 @@
+#include "file_protection.h"
+
+#include <sys/syscall.h>
+
+// Integrity verification for the verify command. Events only show tampering
+// that happens while the daemon is watching; a file changed while it was
+// stopped, or through an event lost in an overflow, keeps its new contents
+// unnoticed. A verify run walks the protected trees with the parallel walker
+// and compares each protected file's SHA-256 with a manifest of the contents
+// recorded by earlier runs.
+//
+// The manifest also records each file's size, mtime, ctime and inode. A file
+// whose metadata all still match was not written since it was hashed, and
+// is not read again, so later runs only hash what changed. The first run
+// records the baseline. Reads go through a rate limit shared by all walker
+// threads, at the lowest best-effort I/O priority, and the pages read are
+// dropped from the page cache afterwards, so verifying a large tree does not
+// crowd out the production load.
+
+#define MANIFEST_MAGIC "FPMANIF1"
+#define MANIFEST_VERSION 1
+#define VERIFY_BURST_NS 100000000ULL // Unused read budget kept for at most this long
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+} ManifestHeader;
+
+// One file's baseline; followed on disk by path_len bytes of path
+typedef struct
+{
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    unsigned char digest[SHA256_DIGEST_LEN];
+    uint32_t path_len;
+    uint32_t reserved;
+} ManifestRecord;
+
+typedef struct
+{
+    char *path;
+    ManifestRecord record;
+    int seen; // Set by the walker thread that found the file
+} ManifestEntry;
+
+typedef struct
+{
+    ManifestEntry *entries;
+    size_t count;
+    size_t capacity;
+    uint32_t *slots; // Entry index + 1 by path hash; 0 is empty
+    size_t slot_capacity;
+} Manifest;
+
+typedef struct
+{
+    VerifyMode mode;
+    int root; // Slot of the root being walked
+    atomic_int cancel;
+    atomic_int running;
+    atomic_long files;
+    atomic_long hashed;
+    atomic_long unchanged;
+    atomic_long added;
+    atomic_long drifted;
+    atomic_long missing;
+    atomic_long restored;
+    atomic_long failed;
+    atomic_ullong bytes;
+    struct timespec started;
+    double elapsed;
+} Verify;
+
+static Verify verify;
+static pthread_t verify_thread;
+static int verify_thread_valid = 0;
+static int verify_ever_started = 0;
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Manifest baseline;  // Read-only while the walk runs
+static Manifest next_manifest; // Appended to by the walker threads
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t throttle_next_ns = 0;
+
+static const char *verify_mode_name(VerifyMode mode)
+{
+    return mode == VERIFY_RESTORE ? "restore" : mode == VERIFY_ACCEPT ? "accept" : "report";
+}
+
+static uint32_t manifest_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+    {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static void manifest_free(Manifest *m)
+{
+    for (size_t i = 0; i < m->count; i++)
+    {
+        free(m->entries[i].path);
+    }
+    free(m->entries);
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+// Function to append an entry; the path is copied. Returns -1 on allocation failure.
+static int manifest_append(Manifest *m, const char *path, const ManifestRecord *record)
+{
+    if (m->count == m->capacity)
+    {
+        size_t capacity = m->capacity ? m->capacity * 2 : 1024;
+        ManifestEntry *grown = realloc(m->entries, capacity * sizeof(ManifestEntry));
+        if (grown == NULL)
+            return -1;
+        m->entries = grown;
+        m->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    m->entries[m->count++] = (ManifestEntry){copy, *record, 0};
+    return 0;
+}
+
+// Function to index the entries of a loaded manifest by path
+static int manifest_index(Manifest *m)
+{
+    size_t capacity = 1024;
+    while (capacity < m->count * 2)
+    {
+        capacity *= 2;
+    }
+    m->slots = calloc(capacity, sizeof(uint32_t));
+    if (m->slots == NULL)
+        return -1;
+    m->slot_capacity = capacity;
+    for (size_t i = 0; i < m->count; i++)
+    {
+        size_t slot = manifest_hash(m->entries[i].path) & (capacity - 1);
+        while (m->slots[slot] != 0)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        m->slots[slot] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+static ManifestEntry *manifest_find(const Manifest *m, const char *path)
+{
+    if (m->slot_capacity == 0)
+        return NULL;
+    size_t slot = manifest_hash(path) & (m->slot_capacity - 1);
+    while (m->slots[slot] != 0)
+    {
+        ManifestEntry *entry = &m->entries[m->slots[slot] - 1];
+        if (strcmp(entry->path, path) == 0)
+            return entry;
+        slot = (slot + 1) & (m->slot_capacity - 1);
+    }
+    return NULL;
+}
+
+// Function to read the manifest at path into m. A missing file is an empty
+// baseline; a damaged one is reported and also treated as empty.
+static int manifest_load(const char *path, Manifest *m)
+{
+    memset(m, 0, sizeof(*m));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return errno == ENOENT ? manifest_index(m) : -1;
+
+    ManifestHeader header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, MANIFEST_MAGIC, 8) == 0 &&
+             header.version == MANIFEST_VERSION;
+    for (uint64_t i = 0; ok && i < header.count; i++)
+    {
+        ManifestRecord record;
+        char entry_path[MAX_PATH_LEN];
+        ok = fread(&record, sizeof(record), 1, file) == 1 && record.path_len > 0 &&
+             record.path_len < sizeof(entry_path) && fread(entry_path, record.path_len, 1, file) == 1;
+        if (ok)
+        {
+            entry_path[record.path_len] = '\0';
+            ok = manifest_append(m, entry_path, &record) == 0;
+        }
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Integrity manifest %s is damaged; starting a new baseline", path);
+        log_message(log_buf);
+        manifest_free(m);
+    }
+    return manifest_index(m);
+}
+
+// Function to replace the manifest at path with m, atomically
+static int manifest_save(const char *path, const Manifest *m)
+{
+    char temp[MAX_PATH_LEN + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL)
+        return -1;
+
+    ManifestHeader header = {0};
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.count = m->count;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok && i < m->count; i++)
+    {
+        ManifestRecord record = m->entries[i].record;
+        record.path_len = (uint32_t)strlen(m->entries[i].path);
+        ok = fwrite(&record, sizeof(record), 1, file) == 1 &&
+             fwrite(m->entries[i].path, record.path_len, 1, file) == 1;
+    }
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp, path) < 0)
+    {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+static void record_from_stat(ManifestRecord *record, const struct stat *st)
+{
+    record->size = (uint64_t)st->st_size;
+    record->dev = (uint64_t)st->st_dev;
+    record->ino = (uint64_t)st->st_ino;
+    record->mtime_sec = st->st_mtim.tv_sec;
+    record->mtime_nsec = st->st_mtim.tv_nsec;
+    record->ctime_sec = st->st_ctim.tv_sec;
+    record->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+// Any write to the file, or a replacement, changes one of these
+static int record_matches_stat(const ManifestRecord *record, const struct stat *st)
+{
+    return record->size == (uint64_t)st->st_size && record->dev == (uint64_t)st->st_dev &&
+           record->ino == (uint64_t)st->st_ino && record->mtime_sec == st->st_mtim.tv_sec &&
+           record->mtime_nsec == st->st_mtim.tv_nsec && record->ctime_sec == st->st_ctim.tv_sec &&
+           record->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+static void next_append(const char *path, const ManifestRecord *record)
+{
+    pthread_mutex_lock(&next_lock);
+    int ret = manifest_append(&next_manifest, path, record);
+    pthread_mutex_unlock(&next_lock);
+    if (ret < 0)
+        atomic_fetch_add_explicit(&verify.failed, 1, memory_order_relaxed);
+}
+
+// Function to wait until the shared read budget allows bytes more
+static void verify_throttle(size_t bytes)
+{
+    if (config.verify_mbps == 0)
+        return;
+
+    uint64_t cost = (uint64_t)bytes * 1000000000ULL / ((uint64_t)config.verify_mbps * 1024 * 1024);
+    uint64_t now = metrics_now_ns();
+    pthread_mutex_lock(&throttle_lock);
+    if (throttle_next_ns + VERIFY_BURST_NS < now)
+        throttle_next_ns = now - VERIFY_BURST_NS;
+    uint64_t start = throttle_next_ns;
+    throttle_next_ns += cost;
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (start > now)
+    {
+        struct timespec delay = {(time_t)((start - now) / 1000000000ULL), (long)((start - now) % 1000000000ULL)};
+        nanosleep(&delay, NULL);
+    }
+}
+
+// Function to hash an open file in large blocks under the rate limit, then
+// drop its pages from the cache. Returns -1 if it could not be read whole.
+static int verify_hash_fd(int fd, off_t size, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    size_t chunk = size < VERIFY_READ_CHUNK ? (size_t)size : VERIFY_READ_CHUNK;
+    unsigned char *buffer = malloc(chunk > 0 ? chunk : 1);
+    if (buffer == NULL)
+        return -1;
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+    Sha256 ctx;
+    sha256_init(&ctx);
+    off_t offset = 0;
+    int ret = 0;
+    while (offset < size && !atomic_load_explicit(&verify.cancel, memory_order_relaxed))
+    {
+        size_t want = size - offset < (off_t)chunk ? (size_t)(size - offset) : chunk;
+        verify_throttle(want);
+        ssize_t n = pread(fd, buffer, want, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            ret = -1;
+            break;
+        }
+        sha256_update(&ctx, buffer, (size_t)n);
+        offset += n;
+    }
+    free(buffer);
+    posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+    if (ret < 0 || offset < size)
+        return -1;
+    sha256_final(&ctx, digest);
+    atomic_fetch_add_explicit(&verify.bytes, (unsigned long long)size, memory_order_relaxed);
+    return 0;
+}
+
+// Function to open and hash a file in dir_fd, filling st
+static int verify_hash_at(int dir_fd, const char *name, struct stat *st, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+    if (fd < 0 && errno == EPERM)
+        fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int ret = fstat(fd, st) == 0 && S_ISREG(st->st_mode) ? verify_hash_fd(fd, st->st_size, digest) : -1;
+    close(fd);
+    return ret;
+}
+
+// Function to put a file back from its snapshot. The daemon's own workers
+// would take the unlink and the new file for tampering, so the events they
+// cause in a watched directory are announced first.
+static int verify_restore_file(int dir_fd, const char *name, const char *path, int exists)
+{
+    if (!snapshot_available(path))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    InotifyShard *shard = NULL;
+    int wd = -1;
+    struct stat dir_st;
+    if (fstat(dir_fd, &dir_st) == 0)
+    {
+        policy_read_lock();
+        const PolicyRoot *root = policy_root_for_path(policy_current(), path);
+        shard = root != NULL ? inotify_shard_for_directory(root->slot, &dir_st) : NULL;
+        policy_read_unlock();
+        wd = shard != NULL ? inotify_shard_find_directory(shard, &dir_st) : -1;
+    }
+
+    if (exists)
+    {
+        set_protection_state_at(dir_fd, name, 0);
+        if (wd > 0)
+            self_event_expect(shard->fd, wd, name, IN_DELETE);
+        if (unlinkat(dir_fd, name, 0) < 0)
+        {
+            if (wd > 0)
+                self_event_cancel(shard->fd, wd, name, IN_DELETE);
+            return -1;
+        }
+    }
+    if (wd > 0)
+        self_event_expect(shard->fd, wd, name, IN_CREATE);
+    if (snapshot_restore(path) < 0)
+    {
+        if (wd > 0)
+            self_event_cancel(shard->fd, wd, name, IN_CREATE);
+        return -1;
+    }
+    if (protection_enabled)
+        set_protection_state_at(dir_fd, name, 1);
+    return 0;
+}
+
+// Function to deal with a file whose contents differ from its baseline, or
+// that is gone. Returns the record to keep in the manifest.
+static ManifestRecord verify_drift(int dir_fd, const char *name, const char *path, const ManifestEntry *entry,
+                                   const struct stat *st, const unsigned char digest[SHA256_DIGEST_LEN])
+{
+    char expected[SHA256_HEX_LEN + 1];
+    char found[SHA256_HEX_LEN + 1];
+    content_hash_hex(entry->record.digest, expected);
+    char log_buf[MAX_PATH_LEN + 200];
+    if (st != NULL)
+    {
+        content_hash_hex(digest, found);
+        atomic_fetch_add_explicit(&verify.drifted, 1, memory_order_relaxed);
+        snprintf(log_buf, sizeof(log_buf), "Protected file changed since its baseline: %s (expected %.12s, found %.12s)",
+                 path, expected, found);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&verify.missing, 1, memory_order_relaxed);
+        snprintf(log_buf, sizeof(log_buf), "Protected file missing since its baseline: %s", path);
+    }
+    console_message(log_buf);
+
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_path(policy_current(), path);
+    int slot = root != NULL ? root->slot : 0;
+    policy_read_unlock();
+    audit_record(AUDIT_VERIFY_DRIFT, 0, slot, path, 1);
+
+    ManifestRecord keep = entry->record;
+    if (verify.mode == VERIFY_ACCEPT && st != NULL)
+    {
+        record_from_stat(&keep, st);
+        memcpy(keep.digest, digest, SHA256_DIGEST_LEN);
+        snprintf(log_buf, sizeof(log_buf), "Accepted current contents of %s as its baseline", path);
+        log_message(log_buf);
+    }
+    else if (verify.mode == VERIFY_RESTORE)
+    {
+        struct stat restored_st;
+        unsigned char restored[SHA256_DIGEST_LEN];
+        int ok = verify_restore_file(dir_fd, name, path, st != NULL) == 0 &&
+                 verify_hash_at(dir_fd, name, &restored_st, restored) == 0 &&
+                 memcmp(restored, entry->record.digest, SHA256_DIGEST_LEN) == 0;
+        audit_record(AUDIT_VERIFY_RESTORE, !ok, slot, path, 1);
+        if (ok)
+        {
+            atomic_fetch_add_explicit(&verify.restored, 1, memory_order_relaxed);
+            record_from_stat(&keep, &restored_st);
+            snprintf(log_buf, sizeof(log_buf), "Restored %s to its baseline contents", path);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&verify.failed, 1, memory_order_relaxed);
+            snprintf(log_buf, sizeof(log_buf), "Could not restore %s to its baseline contents%s", path,
+                     snapshot_available(path) ? "; its snapshot differs from the baseline" : ": no snapshot");
+        }
+        console_message(log_buf);
+    }
+    return keep;
+}
+
+// Function to lower the walker thread's I/O priority to the bottom of the
+// best-effort class, once per thread
+static void verify_lower_io_priority(void)
+{
+    static _Thread_local int lowered = 0;
+    if (!lowered)
+    {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 7);
+        lowered = 1;
+    }
+}
+
+static void verify_files(void *ctx, int dir_fd, const char *path, const char **names, size_t count)
+{
+    Verify *v = ctx;
+    verify_lower_io_priority();
+
+    for (size_t i = 0; i < count && !atomic_load_explicit(&v->cancel, memory_order_relaxed); i++)
+    {
+        if (!is_protected_name(v->root, path, names[i]))
+            continue;
+        atomic_fetch_add_explicit(&v->files, 1, memory_order_relaxed);
+
+        char full_path[MAX_PATH_LEN];
+        if (snprintf(full_path, sizeof(full_path), "%s/%s", path, names[i]) >= (int)sizeof(full_path))
+            continue;
+        ManifestEntry *entry = manifest_find(&baseline, full_path);
+        if (entry != NULL)
+            entry->seen = 1;
+
+        struct stat st;
+        if (entry != NULL && fstatat(dir_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            record_matches_stat(&entry->record, &st))
+        {
+            // Not written since it was hashed
+            atomic_fetch_add_explicit(&v->unchanged, 1, memory_order_relaxed);
+            next_append(full_path, &entry->record);
+            continue;
+        }
+
+        unsigned char digest[SHA256_DIGEST_LEN];
+        if (verify_hash_at(dir_fd, names[i], &st, digest) < 0)
+        {
+            if (atomic_load_explicit(&v->cancel, memory_order_relaxed))
+                break;
+            atomic_fetch_add_explicit(&v->failed, 1, memory_order_relaxed);
+            char log_buf[MAX_PATH_LEN + 100];
+            snprintf(log_buf, sizeof(log_buf), "Failed to hash protected file: %s (%s)", full_path, strerror(errno));
+            log_message(log_buf);
+            // Keep its baseline for the next run
+            if (entry != NULL)
+                next_append(full_path, &entry->record);
+            continue;
+        }
+        atomic_fetch_add_explicit(&v->hashed, 1, memory_order_relaxed);
+
+        ManifestRecord record = {0};
+        if (entry == NULL)
+        {
+            atomic_fetch_add_explicit(&v->added, 1, memory_order_relaxed);
+            record_from_stat(&record, &st);
+            memcpy(record.digest, digest, SHA256_DIGEST_LEN);
+        }
+        else if (memcmp(digest, entry->record.digest, SHA256_DIGEST_LEN) == 0)
+        {
+            // Only the metadata changed, e.g. the protection flags were set again
+            atomic_fetch_add_explicit(&v->unchanged, 1, memory_order_relaxed);
+            record = entry->record;
+            record_from_stat(&record, &st);
+        }
+        else
+        {
+            record = verify_drift(dir_fd, names[i], full_path, entry, &st, digest);
+        }
+        next_append(full_path, &record);
+    }
+}
+
+// Directories no template can reach hold no protected files
+static int verify_directory(void *ctx, int dir_fd, const char *path, const struct stat *st)
+{
+    (void)dir_fd;
+    (void)st;
+    Verify *v = ctx;
+    return is_pruned_directory(v->root, path) ? -1 : 0;
+}
+
+// Function to report baseline files the walk did not find. A file that still
+// exists is no longer protected and leaves the manifest; one that is gone
+// from a protected directory is reported, and restored if asked.
+static void verify_missing(void)
+{
+    for (size_t i = 0; i < baseline.count && !atomic_load(&verify.cancel); i++)
+    {
+        ManifestEntry *entry = &baseline.entries[i];
+        struct stat st;
+        if (entry->seen || lstat(entry->path, &st) == 0 || errno != ENOENT)
+            continue;
+
+        policy_read_lock();
+        int protected_root = policy_root_for_path(policy_current(), entry->path) != NULL;
+        policy_read_unlock();
+        if (!protected_root)
+            continue;
+
+        char dir_path[MAX_PATH_LEN];
+        snprintf(dir_path, sizeof(dir_path), "%s", entry->path);
+        char *slash = strrchr(dir_path, '/');
+        if (slash == NULL)
+            continue;
+        *slash = '\0';
+        int dir_fd = open(dir_path[0] ? dir_path : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0)
+            continue;
+        ManifestRecord keep = verify_drift(dir_fd, slash + 1, entry->path, entry, NULL, NULL);
+        close(dir_fd);
+        if (verify.mode != VERIFY_ACCEPT)
+            next_append(entry->path, &keep);
+    }
+}
+
+static void *verify_main(void *arg)
+{
+    (void)arg;
+
+    manifest_free(&baseline);
+    manifest_free(&next_manifest);
+    if (manifest_load(config.manifest_path, &baseline) < 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot read integrity manifest %s: %s", config.manifest_path,
+                 strerror(errno));
+        log_message(log_buf);
+        atomic_store(&verify.running, 0);
+        return NULL;
+    }
+
+    // Only the list of roots is taken from a settled policy. A throttled run
+    // can take hours, so sweeps and reloads go ahead meanwhile; each file is
+    // checked against the policy current when it is reached.
+    char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+    int slots[POLICY_MAX_ROOTS];
+    policy_lock_changes();
+    int root_count = policy_copy_roots(roots, slots);
+    policy_unlock_changes();
+    TreeWalkStats stats = {0};
+    for (int i = 0; i < root_count && !stats.cancelled; i++)
+    {
+        verify.root = slots[i];
+        TreeVisitor visitor = {
+            .label = "Integrity verification",
+            .visit_directory = verify_directory,
+            .visit_files = verify_files,
+            .ctx = &verify,
+            .cancel = &verify.cancel,
+            .root = roots[i],
+        };
+
+        TreeWalkStats root_stats;
+        walk_tree(roots[i], &visitor, tree_walk_threads(), 0, &root_stats);
+        stats.directories += root_stats.directories;
+        stats.cancelled |= root_stats.cancelled;
+    }
+    if (!stats.cancelled)
+        verify_missing();
+
+    // A cancelled run has not seen every file, so the old baseline stays
+    int cancelled = atomic_load(&verify.cancel);
+    if (!cancelled && manifest_save(config.manifest_path, &next_manifest) < 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to write integrity manifest %s: %s", config.manifest_path,
+                 strerror(errno));
+        log_message(log_buf);
+    }
+    manifest_free(&baseline);
+    manifest_free(&next_manifest);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    verify.elapsed =
+        (double)(now.tv_sec - verify.started.tv_sec) + (double)(now.tv_nsec - verify.started.tv_nsec) / 1e9;
+
+    char log_buf[512];
+    snprintf(log_buf, sizeof(log_buf),
+             "Integrity verification (%s) %s: %ld files, %ld hashed (%.1f MB), %ld unchanged, %ld new, %ld drifted, "
+             "%ld missing, %ld restored, %ld failed, %ld directories in %.3fs",
+             verify_mode_name(verify.mode), cancelled ? "cancelled" : "finished", atomic_load(&verify.files),
+             atomic_load(&verify.hashed), (double)atomic_load(&verify.bytes) / (1024.0 * 1024.0),
+             atomic_load(&verify.unchanged), atomic_load(&verify.added), atomic_load(&verify.drifted),
+             atomic_load(&verify.missing), atomic_load(&verify.restored), atomic_load(&verify.failed),
+             stats.directories, verify.elapsed);
+    log_message(log_buf);
+    printf("%s\n", log_buf);
+
+    atomic_store(&verify.running, 0);
+    return NULL;
+}
+
+// Function to wait for the current verify run, if any, to finish
+void verify_wait(void)
+{
+    pthread_mutex_lock(&verify_lock);
+    if (verify_thread_valid)
+    {
+        pthread_join(verify_thread, NULL);
+        verify_thread_valid = 0;
+    }
+    pthread_mutex_unlock(&verify_lock);
+}
+
+// Function to ask a running verify to stop; the manifest is left as it was
+void verify_cancel(void)
+{
+    atomic_store(&verify.cancel, 1);
+}
+
+// Function to start a verify run in the background. Returns -1 if one is
+// already running or there is no manifest to keep the baseline in.
+int verify_start(VerifyMode mode)
+{
+    if (config.manifest_path == NULL || atomic_load(&verify.running))
+        return -1;
+    verify_wait();
+
+    pthread_mutex_lock(&verify_lock);
+    verify.mode = mode;
+    atomic_store(&verify.cancel, 0);
+    atomic_store(&verify.files, 0);
+    atomic_store(&verify.hashed, 0);
+    atomic_store(&verify.unchanged, 0);
+    atomic_store(&verify.added, 0);
+    atomic_store(&verify.drifted, 0);
+    atomic_store(&verify.missing, 0);
+    atomic_store(&verify.restored, 0);
+    atomic_store(&verify.failed, 0);
+    atomic_store(&verify.bytes, 0);
+    verify.elapsed = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &verify.started);
+    atomic_store(&verify.running, 1);
+
+    if (pthread_create(&verify_thread, NULL, verify_main, NULL) != 0)
+    {
+        atomic_store(&verify.running, 0);
+        pthread_mutex_unlock(&verify_lock);
+        log_message("Failed to start integrity verification thread");
+        return -1;
+    }
+    verify_thread_valid = 1;
+    verify_ever_started = 1;
+    pthread_mutex_unlock(&verify_lock);
+
+    char log_buf[100];
+    snprintf(log_buf, sizeof(log_buf), "Integrity verification (%s) started", verify_mode_name(mode));
+    log_message(log_buf);
+    return 0;
+}
+
+int verify_get_status(VerifyStatus *status)
+{
+    if (!verify_ever_started)
+        return -1;
+
+    status->mode = verify.mode;
+    status->running = atomic_load(&verify.running);
+    status->cancelled = atomic_load(&verify.cancel);
+    status->files = atomic_load(&verify.files);
+    status->hashed = atomic_load(&verify.hashed);
+    status->unchanged = atomic_load(&verify.unchanged);
+    status->added = atomic_load(&verify.added);
+    status->drifted = atomic_load(&verify.drifted);
+    status->missing = atomic_load(&verify.missing);
+    status->restored = atomic_load(&verify.restored);
+    status->failed = atomic_load(&verify.failed);
+    status->bytes = atomic_load(&verify.bytes);
+    if (status->running)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        status->elapsed = (double)(now.tv_sec - verify.started.tv_sec) +
+                          (double)(now.tv_nsec - verify.started.tv_nsec) / 1e9;
+    }
+    else
+    {
+        status->elapsed = verify.elapsed;
+    }
+    return 0;
+}
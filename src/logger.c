@@ -0,0 +1,343 @@
+#include "file_protection.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Asynchronous logging backend. log_message() only formats into a slot of a
+// bounded lock-free ring (Vyukov MPMC sequence scheme), and a dedicated writer
+// thread keeps the log file open and drains the ring in batches with writev.
+// The enforcement path therefore never touches the log file itself.
+// console_message() queues a line that the writer also prints to stdout, so
+// enforcement workers do not block on the terminal either. The writer runs at
+// a lower scheduling priority than the event threads.
+
+typedef struct
+{
+    atomic_size_t seq;
+    time_t timestamp;
+    size_t len;
+    int console; // Also print to stdout after the file write
+    char text[LOG_MESSAGE_MAX];
+} LogSlot;
+
+static LogSlot *log_slots = NULL;
+static size_t log_capacity = 0;
+static atomic_size_t log_enqueue_pos;
+static atomic_size_t log_dequeue_pos;
+static atomic_int log_running = 0;
+static atomic_ulong log_dropped = 0;
+static atomic_ulong log_dropped_total = 0;
+static atomic_ulong log_written = 0;
+static pthread_t log_thread;
+static int log_fd = -1;
+
+// Synchronous fallback used before the writer starts and after it stops
+static void log_message_sync(const char *message)
+{
+    FILE *log_file = fopen(LOG_FILE, "a");
+    if (log_file == NULL)
+    {
+        perror("Error opening log file");
+        return;
+    }
+    time_t now = time(NULL);
+    char *time_str = ctime(&now);
+    time_str[strlen(time_str) - 1] = '\0'; // Remove newline
+    fprintf(log_file, "[%s] %s\n", time_str, message);
+    fclose(log_file);
+}
+
+static int log_enqueue(const char *message, int console)
+{
+    size_t pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+    LogSlot *slot;
+
+    for (;;)
+    {
+        slot = &log_slots[pos & (log_capacity - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&log_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return -1; // Ring is full
+        }
+        else
+        {
+            pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->timestamp = time(NULL);
+    int len = snprintf(slot->text, LOG_MESSAGE_MAX - 1, "%s", message);
+    if (len < 0)
+        len = 0;
+    if (len > LOG_MESSAGE_MAX - 2)
+        len = LOG_MESSAGE_MAX - 2;
+    slot->text[len] = '\n';
+    slot->len = (size_t)len + 1;
+    slot->console = console;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static void log_submit(const char *message, int console)
+{
+    while (log_enqueue(message, console) < 0)
+    {
+        if (config.log_policy == LOG_POLICY_DROP)
+        {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        }
+        // LOG_POLICY_BLOCK: wait for the writer to free a slot
+        sched_yield();
+    }
+}
+
+void log_message(const char *message)
+{
+    if (!atomic_load_explicit(&log_running, memory_order_acquire))
+    {
+        log_message_sync(message);
+        return;
+    }
+    log_submit(message, 0);
+}
+
+// Function to log a message and show it on the console from the writer thread
+void console_message(const char *message)
+{
+    if (!atomic_load_explicit(&log_running, memory_order_acquire))
+    {
+        log_message_sync(message);
+        printf("%s\n", message);
+        return;
+    }
+    log_submit(message, 1);
+}
+
+static int write_all_iov(struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(log_fd, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Write one group-committed batch. Returns the number of messages drained.
+static size_t log_flush_batch(void)
+{
+    static struct iovec iov[LOG_BATCH_MAX * 2 + 2];
+    static char prefixes[LOG_BATCH_MAX + 1][40];
+    static char drop_line[128];
+    int iovcnt = 0;
+    int prefix_count = 0;
+    time_t prefix_time = (time_t)-1;
+    size_t drained = 0;
+
+    // Report drops inline so gaps in the log are visible
+    unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+    {
+        atomic_fetch_add_explicit(&log_dropped_total, dropped, memory_order_relaxed);
+        int len = snprintf(drop_line, sizeof(drop_line), "Log queue full: %lu messages dropped\n", dropped);
+        time_t now = time(NULL);
+        char time_str[32];
+        ctime_r(&now, time_str);
+        time_str[strlen(time_str) - 1] = '\0';
+        snprintf(prefixes[0], sizeof(prefixes[0]), "[%s] ", time_str);
+        prefix_time = now;
+        prefix_count = 1;
+        iov[iovcnt].iov_base = prefixes[0];
+        iov[iovcnt++].iov_len = strlen(prefixes[0]);
+        iov[iovcnt].iov_base = drop_line;
+        iov[iovcnt++].iov_len = (size_t)len;
+    }
+
+    size_t start = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+    size_t pos = start;
+    while (drained < LOG_BATCH_MAX)
+    {
+        LogSlot *slot = &log_slots[pos & (log_capacity - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+            break;
+
+        // Timestamps are formatted once per distinct second in the batch
+        if (slot->timestamp != prefix_time)
+        {
+            char time_str[32];
+            ctime_r(&slot->timestamp, time_str);
+            time_str[strlen(time_str) - 1] = '\0';
+            snprintf(prefixes[prefix_count], sizeof(prefixes[0]), "[%s] ", time_str);
+            prefix_time = slot->timestamp;
+            prefix_count++;
+        }
+        iov[iovcnt].iov_base = prefixes[prefix_count - 1];
+        iov[iovcnt++].iov_len = strlen(prefixes[prefix_count - 1]);
+        iov[iovcnt].iov_base = slot->text;
+        iov[iovcnt++].iov_len = slot->len;
+
+        pos++;
+        drained++;
+    }
+
+    if (iovcnt > 0 && write_all_iov(iov, iovcnt) < 0)
+    {
+        perror("Error writing log file");
+    }
+
+    int printed = 0;
+    for (size_t i = start; i < pos; i++)
+    {
+        LogSlot *slot = &log_slots[i & (log_capacity - 1)];
+        if (slot->console)
+        {
+            fwrite(slot->text, 1, slot->len, stdout);
+            printed = 1;
+        }
+    }
+    if (printed)
+    {
+        fflush(stdout);
+    }
+
+    // Release the slots only after writev has consumed them
+    for (size_t i = start; i < pos; i++)
+    {
+        LogSlot *slot = &log_slots[i & (log_capacity - 1)];
+        atomic_store_explicit(&slot->seq, i + log_capacity, memory_order_release);
+    }
+    atomic_store_explicit(&log_dequeue_pos, pos, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log_written, drained, memory_order_relaxed);
+    return drained;
+}
+
+static void *log_writer_thread(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {
+        .tv_sec = config.log_flush_interval_ms / 1000,
+        .tv_nsec = (long)(config.log_flush_interval_ms % 1000) * 1000000L,
+    };
+
+    // Logging yields to the reader and enforcement threads under load
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), LOG_WRITER_NICE) < 0)
+    {
+        perror("setpriority");
+    }
+
+    while (atomic_load_explicit(&log_running, memory_order_acquire))
+    {
+        // A full batch means more is queued; keep draining without sleeping
+        if (log_flush_batch() < LOG_BATCH_MAX)
+        {
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    while (log_flush_batch() > 0)
+    {
+    }
+    return NULL;
+}
+
+int logger_start(void)
+{
+    if (atomic_load(&log_running))
+        return 0;
+
+    size_t capacity = 2;
+    while (capacity < config.log_queue_capacity)
+    {
+        capacity <<= 1;
+    }
+
+    log_slots = calloc(capacity, sizeof(LogSlot));
+    if (log_slots == NULL)
+    {
+        log_message_sync("Memory allocation failed for log queue");
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        atomic_init(&log_slots[i].seq, i);
+    }
+    log_capacity = capacity;
+    atomic_store(&log_enqueue_pos, 0);
+    atomic_store(&log_dequeue_pos, 0);
+
+    log_fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd < 0)
+    {
+        perror("Error opening log file");
+        free(log_slots);
+        log_slots = NULL;
+        return -1;
+    }
+
+    atomic_store(&log_running, 1);
+    if (pthread_create(&log_thread, NULL, log_writer_thread, NULL) != 0)
+    {
+        atomic_store(&log_running, 0);
+        close(log_fd);
+        log_fd = -1;
+        free(log_slots);
+        log_slots = NULL;
+        log_message_sync("Failed to start log writer thread");
+        return -1;
+    }
+
+    atexit(logger_stop);
+    return 0;
+}
+
+// Stop the writer after it has drained everything already queued
+void logger_stop(void)
+{
+    if (!atomic_exchange(&log_running, 0))
+        return;
+
+    pthread_join(log_thread, NULL);
+    close(log_fd);
+    log_fd = -1;
+    free(log_slots);
+    log_slots = NULL;
+    log_capacity = 0;
+}
+
+void logger_get_stats(size_t *depth, size_t *capacity, unsigned long *dropped, unsigned long *written)
+{
+    size_t enqueued = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+    size_t dequeued = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+    *depth = log_capacity && enqueued > dequeued ? enqueued - dequeued : 0;
+    *capacity = log_capacity;
+    *dropped = atomic_load_explicit(&log_dropped_total, memory_order_relaxed) +
+               atomic_load_explicit(&log_dropped, memory_order_relaxed);
+    *written = atomic_load_explicit(&log_written, memory_order_relaxed);
+}
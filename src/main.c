@@ -1,6 +1,14 @@
 #include "file_protection.h"
 
-int main()
+int main(int argc, char *argv[])
 {
+    int ret = parse_command_line(argc, argv);
+    if (ret != 0)
+    {
+        return ret < 0 ? 1 : 0;
+    }
+
+    // Keep console output in order with the log when stdout is a file or pipe
+    setvbuf(stdout, NULL, _IOLBF, 0);
     return run_protection_system();
 }
\ No newline at end of file
@@ -0,0 +1,508 @@
+#include "file_protection.h"
+
+// Runtime counters and latency histograms for the hot paths. Every thread
+// that records anything claims a slot of its own, so recording is a relaxed
+// atomic add on a cache line no other thread writes; readers add the slots
+// up. A slot outlives its thread and is handed to the next thread that needs
+// one, so totals never go backwards when sweep threads come and go. Should
+// more threads than METRICS_MAX_THREADS record at once, the extra ones share
+// the last slot, which stays correct because every update is atomic.
+//
+// Histograms are log-linear, as in HdrHistogram: each power of two of
+// nanoseconds is split into 2^METRICS_SUB_BUCKET_BITS equal buckets, giving
+// constant relative precision from nanoseconds to minutes in a few hundred
+// buckets per histogram.
+
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+typedef struct
+{
+    _Alignas(64) atomic_int owned;
+    atomic_ulong counters[METRIC_COUNTER_COUNT];
+    atomic_ulong max_ns[METRIC_HISTOGRAM_COUNT];
+    atomic_ulong sum_ns[METRIC_HISTOGRAM_COUNT];
+    atomic_ulong buckets[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+} MetricsSlot;
+
+// Per-root totals, so a storm in one protected tree can be told apart from
+// slow enforcement in another. A root's events and actions come from its own
+// instances and workers, so these are shared atomics rather than per thread.
+typedef struct
+{
+    _Alignas(64) atomic_ulong events;
+    atomic_ulong actions;
+    atomic_ulong sum_ns;
+    atomic_ulong max_ns;
+    atomic_ulong buckets[METRICS_HISTOGRAM_BUCKETS];
+} RootMetrics;
+
+static MetricsSlot metrics_slots[METRICS_MAX_THREADS];
+static RootMetrics root_metrics[POLICY_MAX_ROOTS];
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local MetricsSlot *metrics_self = NULL;
+static _Thread_local uint64_t metrics_current_event_ns = 0;
+
+static const char *const counter_families[METRIC_COUNTER_COUNT] = {
+    [METRIC_EVENTS_READ] = "events_read_total",
+    [METRIC_EVENT_CREATE] = "events_total",
+    [METRIC_EVENT_DELETE] = "events_total",
+    [METRIC_EVENT_MODIFY] = "events_total",
+    [METRIC_EVENT_MOVED_FROM] = "events_total",
+    [METRIC_EVENT_MOVED_TO] = "events_total",
+    [METRIC_EVENT_MOVE_SELF] = "events_total",
+    [METRIC_EVENT_DELETE_SELF] = "events_total",
+    [METRIC_EVENT_IGNORED] = "events_total",
+    [METRIC_EVENT_OVERFLOW] = "events_total",
+    [METRIC_MATCHER_HIT] = "matcher_lookups_total",
+    [METRIC_MATCHER_MISS] = "matcher_lookups_total",
+    [METRIC_PROTECT_OK] = "protect_total",
+    [METRIC_PROTECT_FAILED] = "protect_total",
+    [METRIC_UNLINK_OK] = "unlink_total",
+    [METRIC_UNLINK_FAILED] = "unlink_total",
+    [METRIC_RESTORE_SNAPSHOT] = "restore_total",
+    [METRIC_RESTORE_EMPTY] = "restore_total",
+    [METRIC_RESTORE_FAILED] = "restore_total",
+};
+
+// Label of each counter within its family, NULL for unlabelled families
+static const char *const counter_labels[METRIC_COUNTER_COUNT] = {
+    [METRIC_EVENT_CREATE] = "type=\"create\"",
+    [METRIC_EVENT_DELETE] = "type=\"delete\"",
+    [METRIC_EVENT_MODIFY] = "type=\"modify\"",
+    [METRIC_EVENT_MOVED_FROM] = "type=\"moved_from\"",
+    [METRIC_EVENT_MOVED_TO] = "type=\"moved_to\"",
+    [METRIC_EVENT_MOVE_SELF] = "type=\"move_self\"",
+    [METRIC_EVENT_DELETE_SELF] = "type=\"delete_self\"",
+    [METRIC_EVENT_IGNORED] = "type=\"ignored\"",
+    [METRIC_EVENT_OVERFLOW] = "type=\"overflow\"",
+    [METRIC_MATCHER_HIT] = "result=\"hit\"",
+    [METRIC_MATCHER_MISS] = "result=\"miss\"",
+    [METRIC_PROTECT_OK] = "result=\"ok\"",
+    [METRIC_PROTECT_FAILED] = "result=\"failed\"",
+    [METRIC_UNLINK_OK] = "result=\"ok\"",
+    [METRIC_UNLINK_FAILED] = "result=\"failed\"",
+    [METRIC_RESTORE_SNAPSHOT] = "result=\"snapshot\"",
+    [METRIC_RESTORE_EMPTY] = "result=\"empty\"",
+    [METRIC_RESTORE_FAILED] = "result=\"failed\"",
+};
+
+static const char *const counter_help[METRIC_COUNTER_COUNT] = {
+    [METRIC_EVENTS_READ] = "inotify events read by the event reader",
+    [METRIC_EVENT_CREATE] = "inotify events read, by event type",
+    [METRIC_MATCHER_HIT] = "Template matcher lookups for names in watched directories",
+    [METRIC_PROTECT_OK] = "protect_file calls, by outcome",
+    [METRIC_UNLINK_OK] = "Unlinks of created protected files, by outcome",
+    [METRIC_RESTORE_SNAPSHOT] = "Deleted or moved protected files rebuilt, by outcome",
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_LATENCY_QUEUE] = {"queue_latency_seconds", "Delay from reading an event to an enforcement worker taking it"},
+    [METRIC_LATENCY_ENFORCE] = {"enforcement_latency_seconds", "Delay from reading an event to its enforcement action"},
+    [METRIC_LATENCY_PROTECT] = {"protect_seconds", "Time spent in one protect_file call"},
+    [METRIC_LATENCY_RESTORE] = {"restore_seconds", "Time spent rebuilding one deleted or moved protected file"},
+};
+
+static void metrics_release_slot(void *slot)
+{
+    atomic_store_explicit(&((MetricsSlot *)slot)->owned, 0, memory_order_release);
+}
+
+static void metrics_create_key(void)
+{
+    pthread_key_create(&metrics_key, metrics_release_slot);
+}
+
+// Function to find this thread's slot, claiming a free one on first use
+static MetricsSlot *metrics_slot(void)
+{
+    if (metrics_self != NULL)
+        return metrics_self;
+
+    pthread_once(&metrics_key_once, metrics_create_key);
+    MetricsSlot *slot = &metrics_slots[METRICS_MAX_THREADS - 1];
+    for (int i = 0; i < METRICS_MAX_THREADS - 1; i++)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&metrics_slots[i].owned, &expected, 1))
+        {
+            slot = &metrics_slots[i];
+            pthread_setspecific(metrics_key, slot);
+            break;
+        }
+    }
+    metrics_self = slot;
+    return slot;
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_count(MetricCounter counter)
+{
+    atomic_fetch_add_explicit(&metrics_slot()->counters[counter], 1, memory_order_relaxed);
+}
+
+// Function to count one inotify event under each type bit of its mask
+void metrics_count_event(uint32_t mask)
+{
+    static const struct
+    {
+        uint32_t bit;
+        MetricCounter counter;
+    } types[] = {
+        {IN_CREATE, METRIC_EVENT_CREATE},         {IN_DELETE, METRIC_EVENT_DELETE},
+        {IN_MODIFY, METRIC_EVENT_MODIFY},         {IN_MOVED_FROM, METRIC_EVENT_MOVED_FROM},
+        {IN_MOVED_TO, METRIC_EVENT_MOVED_TO},     {IN_MOVE_SELF, METRIC_EVENT_MOVE_SELF},
+        {IN_DELETE_SELF, METRIC_EVENT_DELETE_SELF}, {IN_IGNORED, METRIC_EVENT_IGNORED},
+        {IN_Q_OVERFLOW, METRIC_EVENT_OVERFLOW},
+    };
+    MetricsSlot *slot = metrics_slot();
+    atomic_fetch_add_explicit(&slot->counters[METRIC_EVENTS_READ], 1, memory_order_relaxed);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (mask & types[i].bit)
+            atomic_fetch_add_explicit(&slot->counters[types[i].counter], 1, memory_order_relaxed);
+    }
+}
+
+static size_t bucket_index(uint64_t ns)
+{
+    if (ns < METRICS_SUB_BUCKETS)
+        return (size_t)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= METRICS_MAX_EXPONENT)
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    size_t sub = (size_t)(ns >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (size_t)(exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+// Function to give the largest value that falls in a bucket
+static uint64_t bucket_upper_bound(size_t index)
+{
+    if (index < METRICS_SUB_BUCKETS)
+        return index;
+    int shift = (int)(index / METRICS_SUB_BUCKETS) - 1;
+    uint64_t sub = index % METRICS_SUB_BUCKETS;
+    return ((METRICS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+// Function to add one sample to a histogram and its sum and maximum
+static void histogram_add(atomic_ulong *buckets, atomic_ulong *sum_ns, atomic_ulong *max_ns, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&buckets[bucket_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(sum_ns, ns, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(max_ns, &max, ns, memory_order_relaxed,
+                                                              memory_order_relaxed))
+    {
+    }
+}
+
+void metrics_record(MetricHistogram histogram, uint64_t ns)
+{
+    MetricsSlot *slot = metrics_slot();
+    histogram_add(slot->buckets[histogram], &slot->sum_ns[histogram], &slot->max_ns[histogram], ns);
+}
+
+// Function to count an event read from one of a root's inotify instances
+void metrics_count_root_event(int root)
+{
+    if (root >= 0 && root < POLICY_MAX_ROOTS)
+        atomic_fetch_add_explicit(&root_metrics[root].events, 1, memory_order_relaxed);
+}
+
+// Function to count an enforcement action in a root, with its lag from the
+// event read if known (0 otherwise)
+void metrics_record_root(int root, uint64_t ns)
+{
+    if (root < 0 || root >= POLICY_MAX_ROOTS)
+        return;
+    RootMetrics *metrics = &root_metrics[root];
+    atomic_fetch_add_explicit(&metrics->actions, 1, memory_order_relaxed);
+    if (ns != 0)
+        histogram_add(metrics->buckets, &metrics->sum_ns, &metrics->max_ns, ns);
+}
+
+// Function to clear a root slot's totals when a reload gives it to a new root
+void metrics_reset_root(int root)
+{
+    RootMetrics *metrics = &root_metrics[root];
+    atomic_store(&metrics->events, 0);
+    atomic_store(&metrics->actions, 0);
+    atomic_store(&metrics->sum_ns, 0);
+    atomic_store(&metrics->max_ns, 0);
+    for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++)
+    {
+        atomic_store_explicit(&metrics->buckets[b], 0, memory_order_relaxed);
+    }
+}
+
+// Function to note when the event this thread is handling was read, so
+// enforcement can measure its lag; 0 means no event is being handled
+void metrics_set_event_time(uint64_t read_ns)
+{
+    metrics_current_event_ns = read_ns;
+}
+
+uint64_t metrics_event_time(void)
+{
+    return metrics_current_event_ns;
+}
+
+unsigned long metrics_counter_total(MetricCounter counter)
+{
+    unsigned long total = 0;
+    for (int i = 0; i < METRICS_MAX_THREADS; i++)
+    {
+        total += atomic_load_explicit(&metrics_slots[i].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+// Function to turn merged bucket counts into percentiles. The figures are
+// bucket upper bounds, so they err on the slow side. summary->count must
+// already hold the total.
+static void summarize(const unsigned long *merged, unsigned long sum_ns, unsigned long max_ns, LatencySummary *summary)
+{
+    const double quantiles[] = {0.50, 0.90, 0.99, 0.999};
+    double *results[] = {&summary->p50_us, &summary->p90_us, &summary->p99_us, &summary->p999_us};
+    unsigned long seen = 0;
+    size_t q = 0;
+    for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS && q < 4 && summary->count > 0; b++)
+    {
+        seen += merged[b];
+        while (q < 4 && (double)seen >= quantiles[q] * (double)summary->count && seen > 0)
+        {
+            uint64_t bound = bucket_upper_bound(b);
+            *results[q++] = (double)(bound < max_ns ? bound : max_ns) / 1000.0;
+        }
+    }
+    summary->sum_us = (double)sum_ns / 1000.0;
+    summary->max_us = (double)max_ns / 1000.0;
+}
+
+// Function to merge one histogram over all threads into percentiles
+void metrics_get_latency(MetricHistogram histogram, LatencySummary *summary)
+{
+    static unsigned long merged[METRICS_HISTOGRAM_BUCKETS];
+    static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    memset(summary, 0, sizeof(*summary));
+    pthread_mutex_lock(&merge_lock);
+    memset(merged, 0, sizeof(merged));
+    unsigned long sum_ns = 0, max_ns = 0;
+    for (int i = 0; i < METRICS_MAX_THREADS; i++)
+    {
+        MetricsSlot *slot = &metrics_slots[i];
+        sum_ns += atomic_load_explicit(&slot->sum_ns[histogram], memory_order_relaxed);
+        unsigned long max = atomic_load_explicit(&slot->max_ns[histogram], memory_order_relaxed);
+        if (max > max_ns)
+            max_ns = max;
+        for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++)
+        {
+            unsigned long n = atomic_load_explicit(&slot->buckets[histogram][b], memory_order_relaxed);
+            merged[b] += n;
+            summary->count += n;
+        }
+    }
+
+    summarize(merged, sum_ns, max_ns, summary);
+    pthread_mutex_unlock(&merge_lock);
+}
+
+// Function to summarise one root's enforcement latency and totals
+void metrics_get_root(int root, RootStats *stats)
+{
+    static unsigned long copy[METRICS_HISTOGRAM_BUCKETS];
+    static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    RootMetrics *metrics = &root_metrics[root];
+    memset(stats, 0, sizeof(*stats));
+    stats->events = atomic_load_explicit(&metrics->events, memory_order_relaxed);
+    stats->actions = atomic_load_explicit(&metrics->actions, memory_order_relaxed);
+
+    pthread_mutex_lock(&copy_lock);
+    for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++)
+    {
+        copy[b] = atomic_load_explicit(&metrics->buckets[b], memory_order_relaxed);
+        stats->enforce.count += copy[b];
+    }
+    summarize(copy, atomic_load_explicit(&metrics->sum_ns, memory_order_relaxed),
+              atomic_load_explicit(&metrics->max_ns, memory_order_relaxed), &stats->enforce);
+    pthread_mutex_unlock(&copy_lock);
+}
+
+static void write_counters(FILE *file)
+{
+    const char *family = NULL;
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        if (family == NULL || strcmp(family, counter_families[i]) != 0)
+        {
+            family = counter_families[i];
+            fprintf(file, "# HELP file_protection_%s %s\n", family, counter_help[i]);
+            fprintf(file, "# TYPE file_protection_%s counter\n", family);
+        }
+        if (counter_labels[i] != NULL)
+        {
+            fprintf(file, "file_protection_%s{%s} %lu\n", family, counter_labels[i],
+                    metrics_counter_total((MetricCounter)i));
+        }
+        else
+        {
+            fprintf(file, "file_protection_%s %lu\n", family, metrics_counter_total((MetricCounter)i));
+        }
+    }
+}
+
+static void write_gauge(FILE *file, const char *name, const char *type, const char *help, double value)
+{
+    fprintf(file, "# HELP file_protection_%s %s\n", name, help);
+    fprintf(file, "# TYPE file_protection_%s %s\n", name, type);
+    fprintf(file, "file_protection_%s %.0f\n", name, value);
+}
+
+// Function to write a path as a Prometheus label value
+static void write_label_value(FILE *file, const char *value)
+{
+    fputc('"', file);
+    for (const char *c = value; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', file);
+        if (*c == '\n')
+            fputs("\\n", file);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+// Function to write the per-root families, one labelled series per root
+static void write_roots(FILE *file)
+{
+    char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+    int slots[POLICY_MAX_ROOTS];
+    RootStats stats[POLICY_MAX_ROOTS];
+    int count = policy_copy_roots(roots, slots);
+    for (int i = 0; i < count; i++)
+    {
+        metrics_get_root(slots[i], &stats[i]);
+    }
+
+    static const char *const quantile_names[] = {"0.5", "0.9", "0.99", "0.999"};
+    fprintf(file, "# HELP file_protection_root_events_total inotify events read, by protected directory\n");
+    fprintf(file, "# TYPE file_protection_root_events_total counter\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, "file_protection_root_events_total{root=");
+        write_label_value(file, roots[i]);
+        fprintf(file, "} %lu\n", stats[i].events);
+    }
+    fprintf(file, "# HELP file_protection_root_actions_total Enforcement actions, by protected directory\n");
+    fprintf(file, "# TYPE file_protection_root_actions_total counter\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(file, "file_protection_root_actions_total{root=");
+        write_label_value(file, roots[i]);
+        fprintf(file, "} %lu\n", stats[i].actions);
+    }
+    fprintf(file, "# HELP file_protection_root_enforcement_latency_seconds Delay from reading an event to its "
+                  "enforcement action, by protected directory\n");
+    fprintf(file, "# TYPE file_protection_root_enforcement_latency_seconds summary\n");
+    for (int i = 0; i < count; i++)
+    {
+        const LatencySummary *summary = &stats[i].enforce;
+        const double values[] = {summary->p50_us, summary->p90_us, summary->p99_us, summary->p999_us};
+        for (int q = 0; q < 4; q++)
+        {
+            fprintf(file, "file_protection_root_enforcement_latency_seconds{root=");
+            write_label_value(file, roots[i]);
+            fprintf(file, ",quantile=\"%s\"} %.9f\n", quantile_names[q], values[q] / 1e6);
+        }
+        fprintf(file, "file_protection_root_enforcement_latency_seconds_sum{root=");
+        write_label_value(file, roots[i]);
+        fprintf(file, "} %.9f\n", summary->sum_us / 1e6);
+        fprintf(file, "file_protection_root_enforcement_latency_seconds_count{root=");
+        write_label_value(file, roots[i]);
+        fprintf(file, "} %lu\n", summary->count);
+    }
+}
+
+static void write_summaries(FILE *file)
+{
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        LatencySummary summary;
+        metrics_get_latency((MetricHistogram)i, &summary);
+        const char *name = histogram_names[i].name;
+        fprintf(file, "# HELP file_protection_%s %s\n", name, histogram_names[i].help);
+        fprintf(file, "# TYPE file_protection_%s summary\n", name);
+        fprintf(file, "file_protection_%s{quantile=\"0.5\"} %.9f\n", name, summary.p50_us / 1e6);
+        fprintf(file, "file_protection_%s{quantile=\"0.9\"} %.9f\n", name, summary.p90_us / 1e6);
+        fprintf(file, "file_protection_%s{quantile=\"0.99\"} %.9f\n", name, summary.p99_us / 1e6);
+        fprintf(file, "file_protection_%s{quantile=\"0.999\"} %.9f\n", name, summary.p999_us / 1e6);
+        fprintf(file, "file_protection_%s_sum %.9f\n", name, summary.sum_us / 1e6);
+        fprintf(file, "file_protection_%s_count %lu\n", name, summary.count);
+    }
+}
+
+// Function to rewrite the Prometheus text-format file. It is written under
+// a temporary name and renamed into place, so a collector never reads a
+// half-written file.
+int metrics_write_file(const char *path)
+{
+    char tmp_path[MAX_PATH_LEN];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+        return -1;
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL)
+        return -1;
+
+    write_counters(file);
+
+    size_t watches = 0;
+    for (int i = 0; i < inotify_shard_count; i++)
+    {
+        watches += inotify_shards[i].watches.count;
+    }
+    PipelineStats pipeline;
+    pipeline_get_stats(&pipeline);
+    size_t queued = 0;
+    for (int i = 0; i < pipeline.workers; i++)
+    {
+        queued += pipeline.depth[i];
+    }
+    ResyncStats resync;
+    resync_get_stats(&resync);
+    size_t log_depth, log_capacity;
+    unsigned long log_dropped, log_written;
+    logger_get_stats(&log_depth, &log_capacity, &log_dropped, &log_written);
+
+    write_gauge(file, "protection_enabled", "gauge", "1 while protection is enabled", protection_enabled ? 1 : 0);
+    write_gauge(file, "watches", "gauge", "Directories watched with inotify", (double)watches);
+    write_gauge(file, "pipeline_queued_events", "gauge", "Events waiting in the enforcement worker queues",
+                (double)queued);
+    write_gauge(file, "queue_overflows_total", "counter", "inotify queue overflows", (double)resync.overflows);
+    write_gauge(file, "log_queue_depth", "gauge", "Messages waiting for the log writer", (double)log_depth);
+    write_gauge(file, "log_queue_capacity", "gauge", "Capacity of the log queue", (double)log_capacity);
+    write_gauge(file, "log_dropped_total", "counter", "Log messages dropped on a full queue", (double)log_dropped);
+    write_summaries(file);
+    write_roots(file);
+
+    if (fclose(file) != 0 || rename(tmp_path, path) < 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
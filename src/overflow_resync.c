@@ -0,0 +1,436 @@
+#include "file_protection.h"
+
+// Recovery from inotify queue overflow. When the kernel queue of an instance
+// overflows, events for its directories were lost, so a protected file may
+// have been changed, or a subdirectory created, without us seeing it. The
+// event reader then asks for a resync of that instance: a background thread
+// rescans every directory the instance watches, puts protected files back
+// into protected state, watches subdirectories that were missed and drops
+// watches the kernel already removed. Directories that were busiest just
+// before the overflow are rescanned first, since that is where the lost
+// events most likely were.
+//
+// Once a protect sweep has finished, every protected file is in the state
+// index. A protected name the index does not hold, unchanged, was then
+// created or replaced while events were lost, and is removed as its
+// IN_CREATE would have had it; a recorded name that is gone is recreated. The rescan holds the
+// policy change lock so no reload or sweep changes file states meanwhile.
+
+typedef struct
+{
+    int wd;
+    dev_t dev;
+    ino_t ino;
+    char *path;
+} ResyncDirectory;
+
+static pthread_mutex_t resync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resync_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t resync_thread;
+static int resync_thread_valid = 0;
+static int resync_pending[INOTIFY_MAX_INSTANCES];
+static int resync_hot[INOTIFY_MAX_INSTANCES][RESYNC_HOT_DIRECTORIES];
+static size_t resync_hot_count[INOTIFY_MAX_INSTANCES];
+static atomic_int resync_stopping = 0;
+static ResyncStats resync_stats; // Guarded by resync_lock
+
+// Function to check whether a subdirectory found by the rescan is already
+// watched under its current path by the instances of the overflowed root
+static int resync_directory_known(int root, const char *path, const struct stat *st)
+{
+    InotifyShard *shard = inotify_shard_for_directory(root, st);
+    if (shard == NULL)
+        return 1;
+    // Adding an existing watch hands back its wd without side effects
+    int wd = inotify_add_watch(shard->fd, path, WATCH_EVENT_MASK | IN_DONT_FOLLOW | IN_ONLYDIR);
+    if (wd < 0)
+        return 1; // Cannot be watched; the walk would fail the same way
+
+    WatchInfo watch;
+    char watched_path[MAX_PATH_LEN];
+    return inotify_shard_lookup(shard, wd, &watch, watched_path) == 0 && watch.dev == st->st_dev &&
+           watch.ino == st->st_ino && strcmp(watched_path, path) == 0;
+}
+
+// Function to drop a watch whose IN_IGNORED was lost in the overflow
+static int resync_drop_stale(InotifyShard *shard, const ResyncDirectory *dir)
+{
+    // EINVAL means the kernel no longer has this wd; a directory that was
+    // merely moved keeps its watch and is found again under its new parent
+    if (inotify_rm_watch(shard->fd, dir->wd) == 0 || errno != EINVAL)
+        return 0;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    watch_table_remove(&shard->watches, dir->wd);
+    pthread_rwlock_unlock(&shard->lock);
+    state_index_forget(dir->dev, dir->ino);
+    return 1;
+}
+
+// Function to find the recorded files of one directory in the sorted list
+static const StateIndexFile *resync_recorded_files(const StateIndexFile *files, size_t count, const ResyncDirectory *dir,
+                                                   size_t *found)
+{
+    size_t low = 0, high = count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (files[mid].parent_dev < (uint64_t)dir->dev ||
+            (files[mid].parent_dev == (uint64_t)dir->dev && files[mid].parent_ino < (uint64_t)dir->ino))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    size_t end = low;
+    while (end < count && files[end].parent_dev == (uint64_t)dir->dev && files[end].parent_ino == (uint64_t)dir->ino)
+    {
+        end++;
+    }
+    *found = end - low;
+    return files + low;
+}
+
+// Function to remove a protected name created while events were lost. Our
+// own IN_DELETE is expected so the reader does not restore it.
+static void resync_remove_created(InotifyShard *shard, int dir_fd, const ResyncDirectory *dir, const char *name,
+                                  const char *path, ResyncStats *run)
+{
+    char log_buf[MAX_PATH_LEN + 100];
+    self_event_expect(shard->fd, dir->wd, name, IN_DELETE);
+    if (unlinkat(dir_fd, name, 0) == 0)
+    {
+        run->removed++;
+        snprintf(log_buf, sizeof(log_buf), "Resync removed protected file created during overflow: %s", path);
+    }
+    else
+    {
+        self_event_cancel(shard->fd, dir->wd, name, IN_DELETE);
+        run->failed++;
+        snprintf(log_buf, sizeof(log_buf), "Resync failed to remove: %s (%s)", path, strerror(errno));
+    }
+    log_message(log_buf);
+}
+
+// Function to recreate the recorded protected files of a directory that are
+// gone, from their snapshots where there are any
+static void resync_recreate_missing(InotifyShard *shard, int dir_fd, const ResyncDirectory *dir,
+                                    const StateIndexFile *files, size_t count, ResyncStats *run)
+{
+    for (size_t i = 0; i < count && !atomic_load(&resync_stopping); i++)
+    {
+        const char *name = files[i].name;
+        char full_path[MAX_PATH_LEN];
+        if (faccessat(dir_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT ||
+            !is_protected_name(shard->root, dir->path, name) ||
+            snprintf(full_path, sizeof(full_path), "%s/%s", dir->path, name) >= (int)sizeof(full_path))
+            continue;
+
+        char log_buf[MAX_PATH_LEN + 100];
+        int restored = recreate_watched_file(shard->fd, dir->wd, name, full_path);
+        if (restored >= 0)
+        {
+            set_protection_state_at(dir_fd, name, 1);
+            state_index_forget((dev_t)files[i].dev, (ino_t)files[i].ino);
+            run->recreated++;
+            snprintf(log_buf, sizeof(log_buf), "Resync recreated protected file deleted during overflow: %s%s",
+                     full_path, restored ? "" : " (empty, no snapshot)");
+            log_message(log_buf);
+        }
+        else if (faccessat(dir_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            // A name that exists again was put back by the event reader meanwhile
+            run->failed++;
+            snprintf(log_buf, sizeof(log_buf), "Resync failed to recreate: %s (%s)", full_path, strerror(errno));
+            log_message(log_buf);
+        }
+    }
+}
+
+// Function to rescan one watched directory. recorded lists the directory's
+// files in the state index, or is NULL when file states are not settled.
+static void resync_directory(InotifyShard *shard, const ResyncDirectory *dir, const StateIndexFile *recorded,
+                             size_t recorded_count, ResyncStats *run)
+{
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        run->stale_watches += resync_drop_stale(shard, dir);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_dev != dir->dev || st.st_ino != dir->ino)
+    {
+        // Something else now lives at this path; its own parent's rescan covers it
+        close(fd);
+        return;
+    }
+
+    DIR *d = fdopendir(fd);
+    if (d == NULL)
+    {
+        close(fd);
+        return;
+    }
+    run->directories++;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        int is_dir = entry->d_type == DT_DIR;
+        int is_file = entry->d_type == DT_REG;
+        struct stat entry_st;
+        if (entry->d_type == DT_UNKNOWN || is_dir)
+        {
+            if (fstatat(fd, entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            is_dir = S_ISDIR(entry_st.st_mode);
+            is_file = S_ISREG(entry_st.st_mode);
+        }
+
+        char full_path[MAX_PATH_LEN];
+        if (snprintf(full_path, sizeof(full_path), "%s/%s", dir->path, entry->d_name) >= (int)sizeof(full_path))
+            continue;
+
+        if (is_dir)
+        {
+            // Skipped subtrees stay unwatched; probing them would add a watch
+            if (is_pruned_directory(shard->root, full_path))
+                continue;
+            if (!resync_directory_known(shard->root, full_path, &entry_st))
+            {
+                add_watch_recursive(full_path);
+                run->new_subtrees++;
+            }
+        }
+        else if (is_file && protection_enabled && is_protected_name(shard->root, dir->path, entry->d_name))
+        {
+            // A file the index does not hold as it is was created or replaced
+            // while events were lost; a replaced one is recreated below
+            if (recorded != NULL && entry->d_type == DT_REG &&
+                fstatat(fd, entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            if (recorded != NULL && state_index_has_file(dir->dev, dir->ino, entry->d_name, &entry_st) == 0)
+            {
+                resync_remove_created(shard, fd, dir, entry->d_name, full_path, run);
+                continue;
+            }
+
+            int ret = set_protection_state_at(fd, entry->d_name, 1);
+            char log_buf[MAX_PATH_LEN + 100];
+            if (ret > 0)
+            {
+                run->restored++;
+                snprintf(log_buf, sizeof(log_buf), "Resync restored protection of: %s", full_path);
+                log_message(log_buf);
+            }
+            else if (ret < 0)
+            {
+                run->failed++;
+                snprintf(log_buf, sizeof(log_buf), "Resync failed to protect: %s (%s)", full_path, strerror(errno));
+                log_message(log_buf);
+            }
+        }
+    }
+    if (recorded != NULL)
+    {
+        resync_recreate_missing(shard, fd, dir, recorded, recorded_count, run);
+    }
+    closedir(d);
+}
+
+static int resync_is_hot(int wd, const int *hot, size_t hot_count)
+{
+    for (size_t i = 0; i < hot_count; i++)
+    {
+        if (hot[i] == wd)
+            return 1;
+    }
+    return 0;
+}
+
+static int resync_add_directory(ResyncDirectory *dirs, size_t *count, const WatchInfo *watch)
+{
+    char buffer[MAX_PATH_LEN];
+    if (dir_tree_path(watch->dir, buffer, sizeof(buffer)) < 0)
+        return 0;
+    char *path = strdup(buffer);
+    if (path == NULL)
+        return -1;
+    dirs[*count] = (ResyncDirectory){.wd = watch->wd, .dev = watch->dev, .ino = watch->ino, .path = path};
+    (*count)++;
+    return 0;
+}
+
+// Function to rescan every directory of one inotify instance, hottest first
+static void resync_shard(int index, const int *hot, size_t hot_count, ResyncStats *run)
+{
+    InotifyShard *shard = &inotify_shards[index];
+
+    // Snapshot the table so the rescan does not hold the lock while it works
+    pthread_rwlock_rdlock(&shard->lock);
+    size_t capacity = shard->watches.count;
+    ResyncDirectory *dirs = malloc((capacity + 1) * sizeof(ResyncDirectory));
+    size_t count = 0;
+    if (dirs != NULL)
+    {
+        for (size_t i = 0; i < hot_count; i++)
+        {
+            WatchInfo *watch = watch_table_find(&shard->watches, hot[i]);
+            if (watch != NULL && watch->inside_root && resync_add_directory(dirs, &count, watch) < 0)
+                break;
+        }
+        for (size_t i = 0; i < shard->watches.capacity && count < capacity; i++)
+        {
+            WatchInfo *watch = &shard->watches.slots[i];
+            if (watch->wd != 0 && watch->inside_root && !resync_is_hot(watch->wd, hot, hot_count) &&
+                resync_add_directory(dirs, &count, watch) < 0)
+                break;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (dirs == NULL)
+    {
+        log_message("Memory allocation failed for overflow resync");
+        return;
+    }
+
+    policy_lock_changes();
+    StateIndexFile *files = NULL;
+    size_t file_count = 0;
+    int settled = protection_enabled && sweep_protected_all() && state_index_list_files(&files, &file_count) == 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!atomic_load(&resync_stopping))
+        {
+            size_t recorded_count = 0;
+            const StateIndexFile *recorded =
+                settled ? resync_recorded_files(files, file_count, &dirs[i], &recorded_count) : NULL;
+            resync_directory(shard, &dirs[i], recorded, recorded_count, run);
+        }
+        free(dirs[i].path);
+    }
+    policy_unlock_changes();
+    state_index_free_files(files, file_count);
+    free(dirs);
+}
+
+static void *resync_main(void *arg)
+{
+    (void)arg;
+    int hot[RESYNC_HOT_DIRECTORIES];
+
+    pthread_mutex_lock(&resync_lock);
+    while (!atomic_load(&resync_stopping))
+    {
+        int index = -1;
+        int shard_count = atomic_load(&inotify_shard_count);
+        for (int i = 0; i < shard_count; i++)
+        {
+            if (resync_pending[i])
+            {
+                index = i;
+                break;
+            }
+        }
+        if (index < 0)
+        {
+            pthread_cond_wait(&resync_cond, &resync_lock);
+            continue;
+        }
+
+        // A further overflow while this runs queues another pass
+        size_t hot_count = resync_hot_count[index];
+        memcpy(hot, resync_hot[index], hot_count * sizeof(int));
+        resync_pending[index] = 0;
+        resync_stats.running = 1;
+        pthread_mutex_unlock(&resync_lock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ResyncStats run = {0};
+        resync_shard(index, hot, hot_count, &run);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf),
+                 "Overflow resync of inotify instance %d: %ld directories rescanned (%zu hot first), "
+                 "%ld files restored, %ld removed, %ld recreated, %ld failed, %ld new subtrees, "
+                 "%ld stale watches dropped in %.3fs",
+                 index, run.directories, hot_count, run.restored, run.removed, run.recreated, run.failed,
+                 run.new_subtrees, run.stale_watches, elapsed);
+        console_message(log_buf);
+
+        pthread_mutex_lock(&resync_lock);
+        resync_stats.running = 0;
+        resync_stats.resyncs++;
+        resync_stats.directories += run.directories;
+        resync_stats.restored += run.restored;
+        resync_stats.removed += run.removed;
+        resync_stats.recreated += run.recreated;
+        resync_stats.failed += run.failed;
+        resync_stats.new_subtrees += run.new_subtrees;
+        resync_stats.stale_watches += run.stale_watches;
+        resync_stats.last_duration = elapsed;
+        resync_stats.total_duration += elapsed;
+        if (elapsed > resync_stats.longest_duration)
+            resync_stats.longest_duration = elapsed;
+    }
+    pthread_mutex_unlock(&resync_lock);
+    return NULL;
+}
+
+// Function to start the resync thread; it sleeps until an overflow is reported
+int resync_start(void)
+{
+    atomic_store(&resync_stopping, 0);
+    if (pthread_create(&resync_thread, NULL, resync_main, NULL) != 0)
+    {
+        log_message("Failed to start overflow resync thread");
+        return -1;
+    }
+    resync_thread_valid = 1;
+    return 0;
+}
+
+// Function to stop the resync thread, abandoning a rescan in progress
+void resync_stop(void)
+{
+    if (!resync_thread_valid)
+        return;
+
+    pthread_mutex_lock(&resync_lock);
+    atomic_store(&resync_stopping, 1);
+    pthread_cond_signal(&resync_cond);
+    pthread_mutex_unlock(&resync_lock);
+    pthread_join(resync_thread, NULL);
+    resync_thread_valid = 0;
+}
+
+// Function to report an overflow on an instance and queue its resync. hot
+// lists the instance's busiest watch descriptors, busiest first.
+void resync_request(int index, const int *hot, size_t hot_count)
+{
+    if (hot_count > RESYNC_HOT_DIRECTORIES)
+        hot_count = RESYNC_HOT_DIRECTORIES;
+
+    pthread_mutex_lock(&resync_lock);
+    resync_stats.overflows++;
+    memcpy(resync_hot[index], hot, hot_count * sizeof(int));
+    resync_hot_count[index] = hot_count;
+    resync_pending[index] = 1;
+    pthread_cond_signal(&resync_cond);
+    pthread_mutex_unlock(&resync_lock);
+}
+
+void resync_get_stats(ResyncStats *stats)
+{
+    pthread_mutex_lock(&resync_lock);
+    *stats = resync_stats;
+    pthread_mutex_unlock(&resync_lock);
+}
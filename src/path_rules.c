@@ -0,0 +1,374 @@
+#include "file_protection.h"
+
+// Path-level templates. A pattern with a '/' is matched against the file's
+// path relative to its protected directory, one component per segment, and
+// "**" stands for any number of directories. A pattern starting with '!'
+// excludes what it matches; an exclusion without a '/' applies at any depth.
+// Plain patterns without a '/' are left to the name matcher.
+//
+// Patterns are stored in a trie of segments, so patterns with a common prefix
+// share nodes and a path is matched in one pass over its components with a
+// small set of live nodes. The same pass tells whether a directory can be
+// skipped: it is excluded, or no include pattern can match anything below it
+// and no name pattern could either. Skipped directories are never watched,
+// so the kernel never queues their events.
+
+#define PATH_NODE_INCLUDE 0x1 // An include pattern ends here
+#define PATH_NODE_EXCLUDE 0x2 // An exclusion ends here
+#define PATH_ACTIVE_STACK 64
+
+typedef struct PathNode
+{
+    char *segment; // Glob for one path component, or "**"
+    int globstar;
+    int literal; // No glob characters; compared with strcmp
+    int flags;
+    int include_below; // Some include pattern can still match after this node
+    struct PathNode **children;
+    size_t child_count;
+} PathNode;
+
+struct PathRules
+{
+    PathNode root;
+    size_t includes;
+    size_t exclusions;
+    size_t nodes;
+};
+
+// Live trie nodes while a path is matched
+typedef struct
+{
+    const PathNode **nodes;
+    size_t count;
+    size_t capacity;
+    const PathNode *stack[PATH_ACTIVE_STACK];
+} PathActive;
+
+static void path_node_free(PathNode *node)
+{
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        path_node_free(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    free(node->segment);
+}
+
+static PathNode *path_node_child(PathRules *rules, PathNode *parent, const char *segment, size_t len)
+{
+    for (size_t i = 0; i < parent->child_count; i++)
+    {
+        PathNode *child = parent->children[i];
+        if (strncmp(child->segment, segment, len) == 0 && child->segment[len] == '\0')
+            return child;
+    }
+
+    PathNode **children = realloc(parent->children, (parent->child_count + 1) * sizeof(PathNode *));
+    if (children == NULL)
+        return NULL;
+    parent->children = children;
+    PathNode *child = calloc(1, sizeof(PathNode));
+    if (child == NULL)
+        return NULL;
+    child->segment = strndup(segment, len);
+    if (child->segment == NULL)
+    {
+        free(child);
+        return NULL;
+    }
+    child->globstar = strcmp(child->segment, "**") == 0;
+    child->literal = strpbrk(child->segment, "*?[\\") == NULL;
+    parent->children[parent->child_count++] = child;
+    rules->nodes++;
+    return child;
+}
+
+// Function to add one pattern's segments to the trie
+static int path_rules_add(PathRules *rules, const char *pattern, int flag)
+{
+    PathNode *node = &rules->root;
+    const char *p = pattern;
+    while (*p != '\0')
+    {
+        size_t len = strcspn(p, "/");
+        // "a//b" and a trailing "/" add no empty segments
+        if (len > 0)
+        {
+            node = path_node_child(rules, node, p, len);
+            if (node == NULL)
+                return -1;
+        }
+        p += len;
+        if (*p == '/')
+            p++;
+    }
+    if (node == &rules->root)
+        return 0;
+    node->flags |= flag;
+    return 0;
+}
+
+static int path_node_mark(PathNode *node)
+{
+    int below = 0;
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        PathNode *child = node->children[i];
+        below |= path_node_mark(child) || (child->flags & PATH_NODE_INCLUDE);
+    }
+    // A trailing "**" matches every path under where it started
+    node->include_below = below || (node->globstar && (node->flags & PATH_NODE_INCLUDE));
+    return node->include_below;
+}
+
+// Function to check whether a template is a path pattern or an exclusion,
+// which this module handles instead of the name matcher
+int path_rules_handles(const char *pattern)
+{
+    return pattern[0] == '!' || strchr(pattern, '/') != NULL;
+}
+
+// Function to compile the path patterns and exclusions among a root's
+// templates. Returns NULL if there are none or on allocation failure (with
+// *failed set).
+PathRules *path_rules_compile(char **patterns, int count, int *failed)
+{
+    *failed = 0;
+    PathRules *rules = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        const char *pattern = patterns[i];
+        if (!path_rules_handles(pattern))
+            continue;
+        if (rules == NULL && (rules = calloc(1, sizeof(PathRules))) == NULL)
+        {
+            *failed = 1;
+            return NULL;
+        }
+
+        int ret;
+        if (pattern[0] == '!')
+        {
+            const char *excluded = pattern + 1;
+            if (strchr(excluded, '/') != NULL)
+            {
+                ret = path_rules_add(rules, excluded, PATH_NODE_EXCLUDE);
+            }
+            else
+            {
+                char anywhere[MAX_PATH_LEN];
+                snprintf(anywhere, sizeof(anywhere), "**/%s", excluded);
+                ret = path_rules_add(rules, anywhere, PATH_NODE_EXCLUDE);
+            }
+            rules->exclusions++;
+        }
+        else
+        {
+            ret = path_rules_add(rules, pattern, PATH_NODE_INCLUDE);
+            rules->includes++;
+        }
+        if (ret < 0)
+        {
+            path_rules_free(rules);
+            *failed = 1;
+            return NULL;
+        }
+    }
+    if (rules != NULL)
+    {
+        path_node_mark(&rules->root);
+    }
+    return rules;
+}
+
+void path_rules_free(PathRules *rules)
+{
+    if (rules == NULL)
+        return;
+    path_node_free(&rules->root);
+    free(rules);
+}
+
+static int active_add(PathActive *active, const PathNode *node)
+{
+    for (size_t i = 0; i < active->count; i++)
+    {
+        if (active->nodes[i] == node)
+            return 0;
+    }
+    if (active->count == active->capacity)
+    {
+        size_t capacity = active->capacity * 2;
+        const PathNode **nodes = malloc(capacity * sizeof(PathNode *));
+        if (nodes == NULL)
+            return -1;
+        memcpy(nodes, active->nodes, active->count * sizeof(PathNode *));
+        if (active->nodes != active->stack)
+            free(active->nodes);
+        active->nodes = nodes;
+        active->capacity = capacity;
+    }
+    active->nodes[active->count++] = node;
+    return 0;
+}
+
+// Function to enter "**" children without consuming a component
+static void active_closure(PathActive *active)
+{
+    for (size_t i = 0; i < active->count; i++)
+    {
+        const PathNode *node = active->nodes[i];
+        for (size_t c = 0; c < node->child_count; c++)
+        {
+            if (node->children[c]->globstar)
+                active_add(active, node->children[c]);
+        }
+    }
+}
+
+static int segment_matches(const PathNode *node, const char *component, size_t len)
+{
+    if (node->literal)
+        return strncmp(node->segment, component, len) == 0 && node->segment[len] == '\0';
+
+    char name[MAX_FILENAME_LEN];
+    if (len >= sizeof(name))
+        return 0;
+    memcpy(name, component, len);
+    name[len] = '\0';
+    return fnmatch(node->segment, name, 0) == 0;
+}
+
+// Function to move the live nodes past one path component
+static void active_step(PathActive *active, const char *component, size_t len)
+{
+    size_t previous = active->count;
+    const PathNode *stack[PATH_ACTIVE_STACK];
+    const PathNode **from = previous <= PATH_ACTIVE_STACK ? stack : malloc(previous * sizeof(PathNode *));
+    if (from == NULL)
+    {
+        active->count = 0;
+        return;
+    }
+    memcpy(from, active->nodes, previous * sizeof(PathNode *));
+
+    active->count = 0;
+    for (size_t i = 0; i < previous; i++)
+    {
+        const PathNode *node = from[i];
+        if (node->globstar)
+            active_add(active, node);
+        for (size_t c = 0; c < node->child_count; c++)
+        {
+            const PathNode *child = node->children[c];
+            if (!child->globstar && segment_matches(child, component, len))
+                active_add(active, child);
+        }
+    }
+    if (from != stack)
+        free(from);
+    active_closure(active);
+}
+
+static int active_flags(const PathActive *active)
+{
+    int flags = 0;
+    for (size_t i = 0; i < active->count; i++)
+    {
+        flags |= active->nodes[i]->flags;
+    }
+    return flags;
+}
+
+static void active_init(PathActive *active, const PathRules *rules)
+{
+    active->nodes = active->stack;
+    active->count = 0;
+    active->capacity = PATH_ACTIVE_STACK;
+    active_add(active, &rules->root);
+    active_closure(active);
+}
+
+static void active_free(PathActive *active)
+{
+    if (active->nodes != active->stack)
+        free(active->nodes);
+}
+
+// Function to walk the components of a directory path relative to its root.
+// Returns 1 if the directory or one of its ancestors is excluded.
+static int active_walk(PathActive *active, const char *relative)
+{
+    const char *p = relative;
+    while (*p != '\0' && active->count > 0)
+    {
+        size_t len = strcspn(p, "/");
+        if (len > 0)
+        {
+            active_step(active, p, len);
+            if (active_flags(active) & PATH_NODE_EXCLUDE)
+                return 1;
+        }
+        p += len;
+        if (*p == '/')
+            p++;
+    }
+    return 0;
+}
+
+// Function to decide whether a file is protected. relative is its directory
+// relative to the protected directory ("" for the directory itself), and
+// name_match whether a name template matched it. Exclusions win over
+// includes.
+int path_rules_match(const PathRules *rules, const char *relative, const char *name, int name_match)
+{
+    if (rules == NULL)
+        return name_match;
+
+    PathActive active;
+    active_init(&active, rules);
+    int protect = 0;
+    if (!active_walk(&active, relative))
+    {
+        if (active.count > 0)
+        {
+            active_step(&active, name, strlen(name));
+        }
+        int flags = active_flags(&active);
+        protect = !(flags & PATH_NODE_EXCLUDE) && (name_match || (flags & PATH_NODE_INCLUDE));
+    }
+    active_free(&active);
+    return protect;
+}
+
+// Function to decide whether a directory's subtree can be left unwatched.
+// name_patterns says whether the root has name templates, which can match
+// at any depth and so keep every directory that is not excluded.
+int path_rules_prune(const PathRules *rules, const char *relative, int name_patterns)
+{
+    if (rules == NULL || relative[0] == '\0')
+        return 0;
+
+    PathActive active;
+    active_init(&active, rules);
+    int prune = active_walk(&active, relative);
+    if (!prune && !name_patterns)
+    {
+        prune = 1;
+        for (size_t i = 0; i < active.count && prune; i++)
+        {
+            prune = !active.nodes[i]->include_below;
+        }
+    }
+    active_free(&active);
+    return prune;
+}
+
+void path_rules_get_stats(const PathRules *rules, size_t *includes, size_t *exclusions, size_t *nodes)
+{
+    *includes = rules != NULL ? rules->includes : 0;
+    *exclusions = rules != NULL ? rules->exclusions : 0;
+    *nodes = rules != NULL ? rules->nodes : 0;
+}
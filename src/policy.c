@@ -0,0 +1,815 @@
+#include "file_protection.h"
+
+// The protection policy: the protected directories and their compiled templates,
+// read from the template file at startup and again when the file changes, on
+// SIGHUP or on the reload command. A reload parses and compiles the file on
+// its own thread and then publishes the result with a single pointer swap.
+//
+// Readers never take a lock. A read section stores the current epoch in the
+// thread's reader slot and keeps using the policy pointer it loaded until the
+// section ends; sections nest, and only the outermost one touches the slot.
+// After publishing, the writer advances the epoch and waits until no slot
+// still holds an older one (an RCU grace period) before freeing the previous
+// policy, so any one event is judged entirely by the old policy or entirely
+// by the new one.
+//
+// A reload applies only what changed between the two policies: files whose
+// protection differs are protected or unprotected, and watches are added or
+// removed only where the protected directories moved or a subtree stopped or
+// started being skipped. Each root keeps a slot that names its inotify
+// instances, workers and counters; a reload hands a root the slot of the old
+// root it replaces, so a root that is only edited keeps its watches. Sweeps wait for a reload to finish applying its changes,
+// and the other way round.
+
+typedef struct
+{
+    _Alignas(64) atomic_int owned;
+    atomic_ulong epoch; // Epoch the current read section started in; 0 when idle
+} PolicyReader;
+
+// What a reload has to change on disk and in the watch tables
+typedef struct
+{
+    const Policy *previous;
+    const Policy *next;
+    int roots_changed;
+    int enforce;      // Protection was enabled when the reload started
+    int record_index; // The state index was reset and is being rebuilt
+    atomic_long protected_files;
+    atomic_long unprotected_files;
+    atomic_long failed_files;
+    atomic_long watches_added;
+} PolicyDiff;
+
+// One tree walk of a reload: the root being walked and the diff it adds to
+typedef struct
+{
+    PolicyDiff *diff;
+    const PolicyRoot *root;
+} PolicyWalk;
+
+static _Atomic(Policy *) policy_published = NULL;
+static atomic_ulong policy_epoch = 1;
+static unsigned long policy_generation = 0; // Written by the reload thread only
+static PolicyReader policy_readers[POLICY_MAX_READERS];
+static atomic_long policy_overflow_readers = 0; // Sections of threads that found no free slot
+static pthread_key_t policy_reader_key;
+static pthread_once_t policy_reader_once = PTHREAD_ONCE_INIT;
+static _Thread_local PolicyReader *policy_reader_self = NULL;
+static _Thread_local int policy_reader_claimed = 0;
+static _Thread_local int policy_read_depth = 0;
+static _Thread_local Policy *policy_held = NULL;
+
+static pthread_mutex_t policy_change_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t reload_thread;
+static int reload_thread_valid = 0;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static int reload_pending = 0;
+static int reload_stopping = 0;
+static char reload_reason[64];
+static atomic_int reload_cancel = 0;
+static PolicyStats policy_stats; // Guarded by reload_lock
+static int template_watch_fd = -1;
+
+static void policy_release_reader(void *slot)
+{
+    atomic_store_explicit(&((PolicyReader *)slot)->owned, 0, memory_order_release);
+}
+
+static void policy_create_key(void)
+{
+    pthread_key_create(&policy_reader_key, policy_release_reader);
+}
+
+// Function to find this thread's reader slot, claiming a free one on first
+// use. Returns NULL if every slot is taken.
+static PolicyReader *policy_reader(void)
+{
+    if (policy_reader_claimed)
+        return policy_reader_self;
+
+    pthread_once(&policy_reader_once, policy_create_key);
+    for (int i = 0; i < POLICY_MAX_READERS; i++)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&policy_readers[i].owned, &expected, 1))
+        {
+            policy_reader_self = &policy_readers[i];
+            pthread_setspecific(policy_reader_key, policy_reader_self);
+            break;
+        }
+    }
+    policy_reader_claimed = 1;
+    return policy_reader_self;
+}
+
+// Function to start a read section. The policy returned by policy_current
+// stays valid until the matching policy_read_unlock.
+void policy_read_lock(void)
+{
+    if (policy_read_depth++ > 0)
+        return;
+
+    PolicyReader *reader = policy_reader();
+    if (reader != NULL)
+    {
+        atomic_store(&reader->epoch, atomic_load(&policy_epoch));
+    }
+    else
+    {
+        atomic_fetch_add(&policy_overflow_readers, 1);
+    }
+    policy_held = atomic_load(&policy_published);
+}
+
+void policy_read_unlock(void)
+{
+    if (--policy_read_depth > 0)
+        return;
+
+    policy_held = NULL;
+    if (policy_reader_self != NULL)
+    {
+        atomic_store_explicit(&policy_reader_self->epoch, 0, memory_order_release);
+    }
+    else
+    {
+        atomic_fetch_sub_explicit(&policy_overflow_readers, 1, memory_order_release);
+    }
+}
+
+// Function to get the policy of the current read section. Outside a section
+// only the reload thread and startup code may call it.
+const Policy *policy_current(void)
+{
+    return policy_held != NULL ? policy_held : atomic_load(&policy_published);
+}
+
+// Function to find the root whose tree contains path. Roots never overlap,
+// so there is at most one.
+const PolicyRoot *policy_root_for_path(const Policy *policy, const char *path)
+{
+    for (int i = 0; i < policy->root_count; i++)
+    {
+        if (is_path_within(policy->roots[i].path, path))
+            return &policy->roots[i];
+    }
+    return NULL;
+}
+
+// Function to find the root that owns a slot, or NULL if none does
+const PolicyRoot *policy_root_for_slot(const Policy *policy, int slot)
+{
+    for (int i = 0; i < policy->root_count; i++)
+    {
+        if (policy->roots[i].slot == slot)
+            return &policy->roots[i];
+    }
+    return NULL;
+}
+
+// Function to copy the protected directories, and optionally their slots, for
+// use outside a read section. Returns the number of roots.
+int policy_copy_roots(char roots[][MAX_PATH_LEN], int *slots)
+{
+    policy_read_lock();
+    const Policy *policy = policy_current();
+    int count = policy->root_count;
+    for (int i = 0; i < count; i++)
+    {
+        strcpy(roots[i], policy->roots[i].path);
+        if (slots != NULL)
+            slots[i] = policy->roots[i].slot;
+    }
+    policy_read_unlock();
+    return count;
+}
+
+// Function to wait until every read section that might have loaded the
+// previously published policy has ended
+static void policy_synchronize(void)
+{
+    unsigned long target = atomic_fetch_add(&policy_epoch, 1) + 1;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = POLICY_GRACE_POLL_US * 1000L};
+    for (int i = 0; i < POLICY_MAX_READERS; i++)
+    {
+        for (;;)
+        {
+            unsigned long epoch = atomic_load(&policy_readers[i].epoch);
+            if (epoch == 0 || epoch >= target)
+                break;
+            nanosleep(&pause, NULL);
+        }
+    }
+    while (atomic_load(&policy_overflow_readers) > 0)
+    {
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void policy_publish(Policy *policy)
+{
+    policy->generation = ++policy_generation;
+    atomic_store(&policy_published, policy);
+}
+
+void policy_free(Policy *policy)
+{
+    if (policy == NULL)
+        return;
+
+    for (int i = 0; i < policy->root_count; i++)
+    {
+        PolicyRoot *root = &policy->roots[i];
+        for (int j = 0; j < root->pattern_count; j++)
+        {
+            free(root->patterns[j]);
+        }
+        free(root->patterns);
+        matcher_free(root->matcher);
+        path_rules_free(root->rules);
+    }
+    free(policy);
+}
+
+// Function to load the template file and publish the first policy
+int policy_init(void)
+{
+    Policy *policy = load_templates();
+    if (policy == NULL)
+        return -1;
+
+    policy_publish(policy);
+    return 0;
+}
+
+// Function to free the published policy once nothing can read it any more
+void policy_shutdown(void)
+{
+    Policy *policy = atomic_exchange(&policy_published, NULL);
+    policy_synchronize();
+    policy_free(policy);
+}
+
+// Reloads and protection sweeps both change file states across the tree; they
+// take turns so each one works from a settled policy
+void policy_lock_changes(void)
+{
+    pthread_mutex_lock(&policy_change_lock);
+}
+
+// Function to take the change lock only if it is free; returns -1 while held
+int policy_trylock_changes(void)
+{
+    return pthread_mutex_trylock(&policy_change_lock) == 0 ? 0 : -1;
+}
+
+void policy_unlock_changes(void)
+{
+    pthread_mutex_unlock(&policy_change_lock);
+}
+
+static int policy_patterns_equal(const PolicyRoot *a, const PolicyRoot *b)
+{
+    if (a == NULL || b == NULL || a->pattern_count != b->pattern_count)
+        return 0;
+    for (int i = 0; i < a->pattern_count; i++)
+    {
+        if (strcmp(a->patterns[i], b->patterns[i]) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int policy_roots_equal(const Policy *a, const Policy *b)
+{
+    if (a->root_count != b->root_count)
+        return 0;
+    for (int i = 0; i < a->root_count; i++)
+    {
+        if (strcmp(a->roots[i].path, b->roots[i].path) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int policy_equal(const Policy *a, const Policy *b)
+{
+    if (!policy_roots_equal(a, b))
+        return 0;
+    for (int i = 0; i < a->root_count; i++)
+    {
+        if (!policy_patterns_equal(&a->roots[i], &b->roots[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// Function to give each root of the next policy a slot. A root keeps the slot
+// of an old root at the same path, or failing that of an old root it contains
+// or lies inside, so the watches they share stay where they are. Other roots
+// take the lowest free slot.
+static void policy_assign_slots(Policy *next, const Policy *previous)
+{
+    int taken[POLICY_MAX_ROOTS] = {0};
+    for (int i = 0; i < next->root_count; i++)
+    {
+        next->roots[i].slot = -1;
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < next->root_count; i++)
+        {
+            PolicyRoot *root = &next->roots[i];
+            for (int j = 0; j < previous->root_count && root->slot < 0; j++)
+            {
+                const PolicyRoot *old = &previous->roots[j];
+                int match = pass == 0 ? strcmp(old->path, root->path) == 0
+                                      : is_path_within(old->path, root->path) || is_path_within(root->path, old->path);
+                if (match && !taken[old->slot])
+                {
+                    root->slot = old->slot;
+                    taken[old->slot] = 1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < next->root_count; i++)
+    {
+        if (next->roots[i].slot >= 0)
+            continue;
+        int slot = 0;
+        while (taken[slot])
+        {
+            slot++;
+        }
+        next->roots[i].slot = slot;
+        taken[slot] = 1;
+    }
+}
+
+// Function to apply one file's protection change and log it like a sweep does
+static void policy_set_file(PolicyDiff *diff, int dir_fd, const char *name, const char *path, int protect)
+{
+    char log_buf[MAX_PATH_LEN + 100];
+    int ret = set_protection_state_at(dir_fd, name, protect);
+    if (ret > 0)
+    {
+        atomic_fetch_add_explicit(protect ? &diff->protected_files : &diff->unprotected_files, 1,
+                                  memory_order_relaxed);
+        snprintf(log_buf, sizeof(log_buf), "%s file: %s", protect ? "Protected" : "Removed protection from", path);
+        log_message(log_buf);
+    }
+    else if (ret < 0)
+    {
+        atomic_fetch_add_explicit(&diff->failed_files, 1, memory_order_relaxed);
+        snprintf(log_buf, sizeof(log_buf), "Failed to %s file: %s (%s)", protect ? "protect" : "unprotect", path,
+                 strerror(errno));
+        log_message(log_buf);
+    }
+}
+
+// Directories under a new root: watch the ones no old root with the same
+// slot watched. A subtree the new templates skip is only walked if the old
+// ones did not, to unprotect what it holds.
+static int diff_new_directory(void *ctx, int dir_fd, const char *path, const struct stat *st)
+{
+    PolicyWalk *walk = ctx;
+    PolicyDiff *diff = walk->diff;
+    const PolicyRoot *old = policy_root_for_path(diff->previous, path);
+    int old_pruned = old != NULL && policy_prunes_directory(old, path);
+    if (policy_prunes_directory(walk->root, path))
+        return old != NULL && !old_pruned && diff->enforce ? 0 : -1;
+
+    if (old == NULL || old->slot != walk->root->slot || old_pruned)
+    {
+        if (watch_directory_at(dir_fd, path, st) == 0)
+        {
+            atomic_fetch_add_explicit(&diff->watches_added, 1, memory_order_relaxed);
+        }
+        return 0;
+    }
+    if (diff->record_index)
+    {
+        state_index_record_directory(dir_fd, path, st);
+        return 0;
+    }
+    // Already watched, and with the same templates no file below changes
+    return policy_patterns_equal(old, walk->root) ? -1 : 0;
+}
+
+// Files under a new root: compare what each policy says about them
+static void diff_new_files(void *ctx, int dir_fd, const char *path, const char **names, size_t count)
+{
+    PolicyWalk *walk = ctx;
+    PolicyDiff *diff = walk->diff;
+    const PolicyRoot *old = policy_root_for_path(diff->previous, path);
+    for (size_t i = 0; i < count; i++)
+    {
+        int want = policy_protects_name(walk->root, path, names[i]);
+        int had = old != NULL && policy_protects_name(old, path, names[i]);
+        if (want == had && !(want && diff->record_index && diff->enforce))
+            continue;
+
+        char file_path[MAX_PATH_LEN];
+        if (snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]) >= (int)sizeof(file_path))
+            continue;
+
+        if (want && !had)
+        {
+            // An inode the kernel was told to ignore may now be protected
+            fanotify_backend_forget(file_path);
+            if (diff->enforce && snapshot_store_active())
+            {
+                snapshot_capture_at(dir_fd, names[i], file_path);
+            }
+        }
+        if (diff->enforce)
+        {
+            // An unchanged protected file is only recorded again in the index
+            policy_set_file(diff, dir_fd, names[i], file_path, want);
+        }
+    }
+}
+
+// Directories under an old root: the parts inside a new root were handled by
+// the walks of the new roots
+static int diff_old_directory(void *ctx, int dir_fd, const char *path, const struct stat *st)
+{
+    (void)dir_fd;
+    (void)st;
+    PolicyWalk *walk = ctx;
+    return policy_root_for_path(walk->diff->next, path) != NULL || policy_prunes_directory(walk->root, path) ? -1 : 0;
+}
+
+// Files left outside every protected directory lose their protection
+static void diff_old_files(void *ctx, int dir_fd, const char *path, const char **names, size_t count)
+{
+    PolicyWalk *walk = ctx;
+    for (size_t i = 0; i < count; i++)
+    {
+        char file_path[MAX_PATH_LEN];
+        if (!policy_protects_name(walk->root, path, names[i]) ||
+            snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]) >= (int)sizeof(file_path))
+            continue;
+        policy_set_file(walk->diff, dir_fd, names[i], file_path, 0);
+    }
+}
+
+// Function to remove the watches on directories outside the root that now
+// owns each instance's slot, or in a subtree its templates skip. The kernel's
+// IN_IGNORED for each then releases its table slot.
+static long policy_drop_watches(const Policy *next)
+{
+    long removed = 0;
+    int shard_count = atomic_load(&inotify_shard_count);
+    for (int i = 0; i < shard_count; i++)
+    {
+        InotifyShard *shard = &inotify_shards[i];
+        const PolicyRoot *root = policy_root_for_slot(next, shard->root);
+        int *wds = NULL;
+        size_t count = 0, capacity = 0;
+
+        pthread_rwlock_wrlock(&shard->lock);
+        for (size_t slot = 0; slot < shard->watches.capacity; slot++)
+        {
+            WatchInfo *watch = &shard->watches.slots[slot];
+            char path[MAX_PATH_LEN];
+            if (watch->wd == 0 || (root != NULL && dir_tree_path(watch->dir, path, sizeof(path)) >= 0 &&
+                                   is_path_within(root->path, path) && !policy_prunes_directory(root, path)))
+                continue;
+            // Events already queued for this directory are no longer enforced
+            watch->inside_root = 0;
+            if (count == capacity)
+            {
+                size_t new_capacity = capacity ? capacity * 2 : 64;
+                int *new_wds = realloc(wds, new_capacity * sizeof(int));
+                if (new_wds == NULL)
+                    continue;
+                wds = new_wds;
+                capacity = new_capacity;
+            }
+            wds[count++] = watch->wd;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+
+        for (size_t j = 0; j < count; j++)
+        {
+            if (inotify_rm_watch(shard->fd, wds[j]) == 0)
+                removed++;
+        }
+        free(wds);
+    }
+    return removed;
+}
+
+// Function to bring files and watches from the previous policy in line with
+// the next one. Returns the number of watches removed.
+static long policy_apply(PolicyDiff *diff)
+{
+    const Policy *previous = diff->previous;
+    const Policy *next = diff->next;
+    long removed = policy_drop_watches(next);
+    if (diff->roots_changed)
+    {
+        diff->record_index = state_index_set_roots() > 0;
+    }
+
+    // Without enforcement, files only matter for stale fanotify ignore marks
+    int visit_files = diff->enforce || fanotify_backend_active();
+    for (int i = 0; i < next->root_count; i++)
+    {
+        const PolicyRoot *root = &next->roots[i];
+        // With the same roots, only roots whose templates changed are walked
+        if (!diff->roots_changed && policy_patterns_equal(policy_root_for_slot(previous, root->slot), root))
+            continue;
+
+        PolicyWalk walk = {.diff = diff, .root = root};
+        TreeVisitor visitor = {
+            .label = "Applying policy",
+            .visit_directory = diff_new_directory,
+            .visit_files = visit_files ? diff_new_files : NULL,
+            .ctx = &walk,
+            .cancel = &reload_cancel,
+            .root = root->path,
+        };
+        walk_tree(root->path, &visitor, tree_walk_threads(), 0, NULL);
+    }
+
+    for (int i = 0; diff->roots_changed && diff->enforce && i < previous->root_count; i++)
+    {
+        const PolicyRoot *old = &previous->roots[i];
+        if (policy_root_for_path(next, old->path) != NULL)
+            continue;
+
+        PolicyWalk walk = {.diff = diff, .root = old};
+        TreeVisitor old_visitor = {
+            .label = "Applying policy",
+            .visit_directory = diff_old_directory,
+            .visit_files = diff_old_files,
+            .ctx = &walk,
+            .cancel = &reload_cancel,
+            .root = old->path,
+        };
+        walk_tree(old->path, &old_visitor, tree_walk_threads(), 0, NULL);
+    }
+
+    // The files now follow the new templates; a cancelled walk leaves the
+    // old hashes, so the next start does not trust the index
+    if (!atomic_load(&reload_cancel))
+    {
+        state_index_set_roots();
+    }
+    return removed;
+}
+
+// Function to reload the template file and apply the difference
+static void policy_reload(const char *reason)
+{
+    char log_buf[MAX_PATH_LEN + 200];
+    snprintf(log_buf, sizeof(log_buf), "Reloading %s (%s)", TEMPLATE_FILE, reason);
+    log_message(log_buf);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Only this thread publishes, so the current policy cannot change under us
+    Policy *previous = atomic_load(&policy_published);
+    Policy *next = load_templates();
+    if (next == NULL)
+    {
+        pthread_mutex_lock(&reload_lock);
+        policy_stats.reloads++;
+        policy_stats.failed++;
+        pthread_mutex_unlock(&reload_lock);
+        snprintf(log_buf, sizeof(log_buf), "Failed to reload %s; keeping the current policy", TEMPLATE_FILE);
+        console_message(log_buf);
+        return;
+    }
+
+    if (policy_equal(previous, next))
+    {
+        policy_free(next);
+        pthread_mutex_lock(&reload_lock);
+        policy_stats.reloads++;
+        policy_stats.unchanged++;
+        pthread_mutex_unlock(&reload_lock);
+        log_message("Policy unchanged; nothing to apply");
+        return;
+    }
+
+    // A root that does not carry on an old one gets its inotify instances
+    // before anything can route events to them, and fresh counters
+    policy_assign_slots(next, previous);
+    for (int i = 0; i < next->root_count; i++)
+    {
+        const PolicyRoot *root = &next->roots[i];
+        const PolicyRoot *old = policy_root_for_slot(previous, root->slot);
+        if (old != NULL && (is_path_within(old->path, root->path) || is_path_within(root->path, old->path)))
+            continue;
+        int slot = root->slot;
+        if (inotify_shards_add_root(slot) < 0)
+        {
+            policy_free(next);
+            pthread_mutex_lock(&reload_lock);
+            policy_stats.reloads++;
+            policy_stats.failed++;
+            pthread_mutex_unlock(&reload_lock);
+            snprintf(log_buf, sizeof(log_buf), "Failed to add inotify instances for %s; keeping the current policy",
+                     root->path);
+            console_message(log_buf);
+            return;
+        }
+        metrics_reset_root(slot);
+    }
+
+    PolicyDiff diff = {
+        .previous = previous,
+        .next = next,
+        .roots_changed = !policy_roots_equal(previous, next),
+    };
+
+    policy_lock_changes();
+    diff.enforce = protection_enabled;
+    policy_publish(next);
+    fanotify_backend_invalidate();
+    long removed = policy_apply(&diff);
+    policy_unlock_changes();
+
+    // The previous policy is freed once no reader can still be using it
+    policy_synchronize();
+    policy_free(previous);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    pthread_mutex_lock(&reload_lock);
+    policy_stats.reloads++;
+    policy_stats.protected_files = atomic_load(&diff.protected_files);
+    policy_stats.unprotected_files = atomic_load(&diff.unprotected_files);
+    policy_stats.failed_files = atomic_load(&diff.failed_files);
+    policy_stats.watches_added = atomic_load(&diff.watches_added);
+    policy_stats.watches_removed = removed;
+    policy_stats.last_duration = elapsed;
+    pthread_mutex_unlock(&reload_lock);
+
+    snprintf(log_buf, sizeof(log_buf),
+             "Policy generation %lu applied: %d protected director%s; %ld files protected, %ld unprotected, "
+             "%ld failed, %ld watches added, %ld removed in %.3fs",
+             next->generation, next->root_count, next->root_count == 1 ? "y" : "ies",
+             atomic_load(&diff.protected_files),
+             atomic_load(&diff.unprotected_files), atomic_load(&diff.failed_files),
+             atomic_load(&diff.watches_added), removed, elapsed);
+    console_message(log_buf);
+}
+
+static void *reload_main(void *arg)
+{
+    (void)arg;
+    char reason[sizeof(reload_reason)];
+    for (;;)
+    {
+        pthread_mutex_lock(&reload_lock);
+        while (!reload_pending && !reload_stopping)
+        {
+            pthread_cond_wait(&reload_cond, &reload_lock);
+        }
+        if (reload_stopping)
+        {
+            pthread_mutex_unlock(&reload_lock);
+            break;
+        }
+        // Requests that arrive while a reload runs are folded into one more
+        reload_pending = 0;
+        strcpy(reason, reload_reason);
+        policy_stats.running = 1;
+        pthread_mutex_unlock(&reload_lock);
+
+        policy_reload(reason);
+
+        pthread_mutex_lock(&reload_lock);
+        policy_stats.running = 0;
+        pthread_mutex_unlock(&reload_lock);
+    }
+    return NULL;
+}
+
+// Function to ask the reload thread to read the template file again
+void policy_request_reload(const char *reason)
+{
+    pthread_mutex_lock(&reload_lock);
+    reload_pending = 1;
+    snprintf(reload_reason, sizeof(reload_reason), "%s", reason);
+    pthread_cond_signal(&reload_cond);
+    pthread_mutex_unlock(&reload_lock);
+}
+
+// Function to start the reload thread and watch the template file's
+// directory, so edits are picked up whether they rewrite the file in place
+// or rename a new one over it
+int policy_reload_start(int epoll_fd)
+{
+    if (pthread_create(&reload_thread, NULL, reload_main, NULL) != 0)
+    {
+        log_message("Failed to start policy reload thread");
+        return -1;
+    }
+    reload_thread_valid = 1;
+
+    char directory[MAX_PATH_LEN];
+    snprintf(directory, sizeof(directory), "%s", TEMPLATE_FILE);
+    char *slash = strrchr(directory, '/');
+    if (slash == NULL)
+    {
+        strcpy(directory, ".");
+    }
+    else
+    {
+        *slash = '\0';
+    }
+
+    template_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (template_watch_fd < 0 || inotify_add_watch(template_watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        // Reloading still works through SIGHUP and the reload command
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to watch %s for changes: %s", TEMPLATE_FILE, strerror(errno));
+        log_message(log_buf);
+        if (template_watch_fd >= 0)
+            close(template_watch_fd);
+        template_watch_fd = -1;
+        return 0;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = template_watch_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, template_watch_fd, &ev);
+    return 0;
+}
+
+void policy_reload_stop(void)
+{
+    if (template_watch_fd >= 0)
+    {
+        close(template_watch_fd);
+        template_watch_fd = -1;
+    }
+    if (!reload_thread_valid)
+        return;
+
+    atomic_store(&reload_cancel, 1);
+    pthread_mutex_lock(&reload_lock);
+    reload_stopping = 1;
+    pthread_cond_signal(&reload_cond);
+    pthread_mutex_unlock(&reload_lock);
+    pthread_join(reload_thread, NULL);
+    reload_thread_valid = 0;
+}
+
+// Function to handle a readable template watch. Returns 1 if fd was the
+// template watch, 0 if it belongs to someone else.
+int policy_watch_handle(int fd)
+{
+    if (template_watch_fd < 0 || fd != template_watch_fd)
+        return 0;
+
+    const char *name = strrchr(TEMPLATE_FILE, '/');
+    name = name != NULL ? name + 1 : TEMPLATE_FILE;
+
+    char buffer[EVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t length;
+    while ((length = read(template_watch_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *ptr = buffer; ptr < buffer + length;)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->len && strcmp(event->name, name) == 0)
+            {
+                changed = 1;
+            }
+            ptr += EVENT_SIZE + event->len;
+        }
+    }
+
+    if (changed)
+    {
+        policy_request_reload("template file changed");
+    }
+    return 1;
+}
+
+void policy_get_stats(PolicyStats *stats)
+{
+    pthread_mutex_lock(&reload_lock);
+    *stats = policy_stats;
+    pthread_mutex_unlock(&reload_lock);
+
+    policy_read_lock();
+    stats->generation = policy_current()->generation;
+    policy_read_unlock();
+}
@@ -0,0 +1,281 @@
+#include "file_protection.h"
+
+// Bulk protect/unprotect sweeps for the enable and disable commands. A sweep
+// walks each protected tree once with the shared parallel walker and applies
+// the target state to each directory's matching files as a batch. Files that
+// already match are skipped without any change. Sweeps run on a background
+// thread, so the command loop keeps handling events; they report progress via
+// sweep_get_status and can be cancelled.
+//
+// Each sweep has its own state. A new sweep cancels the one before it and
+// its thread joins that predecessor before walking, so starting a sweep never
+// waits on the command loop.
+
+#define SWEEP_LOCK_POLL_NS 10000000L // Interval between attempts at the policy change lock
+
+typedef struct Sweep
+{
+    SweepMode mode;
+    int root; // Slot of the root being walked
+    atomic_int cancel;
+    atomic_int running;
+    atomic_long matched;
+    atomic_long changed;
+    atomic_long unchanged;
+    atomic_long failed;
+    struct timespec started;
+    double elapsed;
+    pthread_t thread;
+    int joinable;            // Not yet joined, and not handed to a successor
+    struct Sweep *previous;  // Cancelled predecessor this sweep's thread joins
+} Sweep;
+
+static Sweep *sweep_current = NULL; // Most recently started sweep
+static atomic_int sweep_settled = 0; // Last sweep protected every matching file
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *sweep_mode_name(SweepMode mode)
+{
+    return mode == SWEEP_PROTECT ? "protect" : "unprotect";
+}
+
+static void sweep_files(void *ctx, int dir_fd, const char *path, const char **names, size_t count)
+{
+    Sweep *s = ctx;
+    int protect = s->mode == SWEEP_PROTECT;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!is_protected_name(s->root, path, names[i]))
+            continue;
+        atomic_fetch_add_explicit(&s->matched, 1, memory_order_relaxed);
+
+        char log_buf[MAX_PATH_LEN + 100];
+        if (protect && snapshot_store_active())
+        {
+            // Capture before protecting, so the snapshot keeps the original mode
+            snprintf(log_buf, sizeof(log_buf), "%s/%s", path, names[i]);
+            snapshot_capture_at(dir_fd, names[i], log_buf);
+        }
+
+        int ret = set_protection_state_at(dir_fd, names[i], protect);
+        if (ret == 0)
+        {
+            atomic_fetch_add_explicit(&s->unchanged, 1, memory_order_relaxed);
+            continue;
+        }
+
+        // Only actual changes and failures are logged, not files already in state
+        if (ret > 0)
+        {
+            atomic_fetch_add_explicit(&s->changed, 1, memory_order_relaxed);
+            snprintf(log_buf, sizeof(log_buf), "%s file: %s/%s", protect ? "Protected" : "Removed protection from",
+                     path, names[i]);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&s->failed, 1, memory_order_relaxed);
+            snprintf(log_buf, sizeof(log_buf), "Failed to %s file: %s/%s (%s)", sweep_mode_name(s->mode), path,
+                     names[i], strerror(errno));
+        }
+        log_message(log_buf);
+    }
+}
+
+// Directories no template can reach hold no protected files
+static int sweep_directory(void *ctx, int dir_fd, const char *path, const struct stat *st)
+{
+    (void)dir_fd;
+    (void)st;
+    Sweep *s = ctx;
+    return is_pruned_directory(s->root, path) ? -1 : 0;
+}
+
+// Function to take the policy change lock, giving up if the sweep is
+// cancelled while a reload or verify holds it. Returns -1 when cancelled.
+static int sweep_lock_changes(Sweep *s)
+{
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = SWEEP_LOCK_POLL_NS};
+    while (policy_trylock_changes() < 0)
+    {
+        if (atomic_load(&s->cancel))
+            return -1;
+        nanosleep(&pause, NULL);
+    }
+    return 0;
+}
+
+static void *sweep_main(void *arg)
+{
+    Sweep *s = arg;
+
+    // The cancelled sweep before this one stops before this one starts
+    // changing files, so the two never apply opposite states together
+    if (s->previous != NULL)
+    {
+        pthread_join(s->previous->thread, NULL);
+        free(s->previous);
+        s->previous = NULL;
+    }
+
+    // A policy reload applying its changes finishes first, so the sweep
+    // walks the roots and templates the reload left in place
+    TreeWalkStats stats = {0};
+    if (sweep_lock_changes(s) < 0)
+    {
+        stats.cancelled = 1;
+    }
+    else
+    {
+        char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+        int slots[POLICY_MAX_ROOTS];
+        int root_count = policy_copy_roots(roots, slots);
+        for (int i = 0; i < root_count && !stats.cancelled; i++)
+        {
+            s->root = slots[i];
+            TreeVisitor visitor = {
+                .label = "Protection sweep",
+                .visit_directory = sweep_directory,
+                .visit_files = sweep_files,
+                .ctx = s,
+                .cancel = &s->cancel,
+                .root = roots[i],
+            };
+
+            TreeWalkStats root_stats;
+            walk_tree(roots[i], &visitor, tree_walk_threads(), 0, &root_stats);
+            stats.directories += root_stats.directories;
+            stats.elapsed += root_stats.elapsed;
+            stats.cancelled |= root_stats.cancelled;
+        }
+        policy_unlock_changes();
+    }
+    s->elapsed = stats.elapsed;
+    if (s->mode == SWEEP_PROTECT && !stats.cancelled && atomic_load(&s->failed) == 0)
+        atomic_store(&sweep_settled, 1);
+
+    char log_buf[512];
+    snprintf(log_buf, sizeof(log_buf),
+             "Protection sweep (%s) %s: %ld files matched, %ld changed, %ld already in state, %ld failed, "
+             "%ld directories in %.3fs",
+             sweep_mode_name(s->mode), stats.cancelled ? "cancelled" : "finished", atomic_load(&s->matched),
+             atomic_load(&s->changed), atomic_load(&s->unchanged), atomic_load(&s->failed),
+             stats.directories, stats.elapsed);
+    log_message(log_buf);
+    printf("%s\n", log_buf);
+
+    atomic_store(&s->running, 0);
+    return NULL;
+}
+
+// Function to wait for the current sweep, if any, to finish. Its thread
+// joins any predecessors first, so every sweep has stopped on return.
+void sweep_wait(void)
+{
+    pthread_mutex_lock(&sweep_lock);
+    if (sweep_current != NULL && sweep_current->joinable)
+    {
+        pthread_join(sweep_current->thread, NULL);
+        sweep_current->joinable = 0;
+    }
+    pthread_mutex_unlock(&sweep_lock);
+}
+
+// Function to ask a running sweep to stop; already-processed files keep their state
+void sweep_cancel(void)
+{
+    pthread_mutex_lock(&sweep_lock);
+    if (sweep_current != NULL)
+    {
+        atomic_store(&sweep_current->cancel, 1);
+    }
+    pthread_mutex_unlock(&sweep_lock);
+}
+
+// Function to start a protect or unprotect sweep in the background. A sweep
+// still running in the other direction is cancelled, and the new sweep's
+// thread waits for it, so this returns without blocking.
+int sweep_start(SweepMode mode)
+{
+    Sweep *next = calloc(1, sizeof(Sweep));
+    if (next == NULL)
+    {
+        log_message("Failed to allocate protection sweep");
+        return -1;
+    }
+    next->mode = mode;
+    clock_gettime(CLOCK_MONOTONIC, &next->started);
+    atomic_store(&next->running, 1);
+
+    atomic_store(&sweep_settled, 0);
+    pthread_mutex_lock(&sweep_lock);
+    Sweep *previous = sweep_current;
+    if (previous != NULL)
+    {
+        atomic_store(&previous->cancel, 1);
+        next->previous = previous->joinable ? previous : NULL;
+    }
+
+    if (pthread_create(&next->thread, NULL, sweep_main, next) != 0)
+    {
+        pthread_mutex_unlock(&sweep_lock);
+        free(next);
+        log_message("Failed to start protection sweep thread");
+        return -1;
+    }
+    next->joinable = 1;
+    sweep_current = next;
+    if (previous != NULL)
+    {
+        // Either the new thread now joins and frees it, or it was already joined
+        if (previous->joinable)
+            previous->joinable = 0;
+        else
+            free(previous);
+    }
+    pthread_mutex_unlock(&sweep_lock);
+
+    char log_buf[100];
+    snprintf(log_buf, sizeof(log_buf), "Protection sweep (%s) started", sweep_mode_name(mode));
+    log_message(log_buf);
+    return 0;
+}
+
+// Function to check whether the last sweep was a protect sweep that
+// finished without failures, so every protected file was recorded
+int sweep_protected_all(void)
+{
+    return atomic_load(&sweep_settled);
+}
+
+int sweep_get_status(SweepStatus *status)
+{
+    pthread_mutex_lock(&sweep_lock);
+    const Sweep *s = sweep_current;
+    if (s == NULL)
+    {
+        pthread_mutex_unlock(&sweep_lock);
+        return -1;
+    }
+
+    status->mode = s->mode;
+    status->running = atomic_load(&s->running);
+    status->cancelled = atomic_load(&s->cancel);
+    status->matched = atomic_load(&s->matched);
+    status->changed = atomic_load(&s->changed);
+    status->unchanged = atomic_load(&s->unchanged);
+    status->failed = atomic_load(&s->failed);
+    if (status->running)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        status->elapsed = (double)(now.tv_sec - s->started.tv_sec) +
+                          (double)(now.tv_nsec - s->started.tv_nsec) / 1e9;
+    }
+    else
+    {
+        status->elapsed = s->elapsed;
+    }
+    pthread_mutex_unlock(&sweep_lock);
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include "file_protection.h"
+
+// Events caused by the daemon's own enforcement. Unlinking a blocked creation
+// queues an IN_DELETE for the same name, and restoring a deleted or moved-away
+// file queues an IN_CREATE; handled again, each would undo the action that
+// caused it (a restored file would be unlinked as a new creation). Before such
+// a call the worker records the (instance, wd, name, mask) it expects, and the
+// reader thread drops the matching event before it is queued for a worker.
+//
+// The table is a fixed open-addressed map with backward-shift deletion. An
+// expectation that is not met within SELF_EVENT_TTL_MS (the event was lost
+// in an overflow, or the name changed) expires so it cannot hide a later
+// event from someone else. When nothing is expected, the reader pays one
+// atomic load per event.
+
+typedef struct
+{
+    int used;
+    int fd; // inotify instance the wd belongs to
+    int wd;
+    uint32_t mask;
+    unsigned int count; // Outstanding events; the same action can repeat
+    uint32_t hash;
+    uint64_t expires_ns;
+    char name[NAME_MAX + 1];
+} SelfEvent;
+
+static SelfEvent self_events[SELF_EVENT_TABLE_SIZE];
+static size_t self_event_count = 0;
+static uint64_t last_expire_ns = 0;
+static pthread_mutex_t self_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t self_event_pending = 0; // Outstanding events across the table
+
+static atomic_ulong self_event_expected = 0;
+static atomic_ulong self_event_suppressed = 0;
+static atomic_ulong self_event_expired = 0;
+static atomic_ulong self_event_dropped = 0; // Table full; the event is handled normally
+
+static uint32_t self_event_hash(int fd, int wd, const char *name, uint32_t mask)
+{
+    // FNV-1a over the name, seeded with the instance, wd and event type
+    uint32_t h = ((2166136261u ^ (uint32_t)wd) * 16777619u ^ (uint32_t)fd) * 16777619u ^ mask;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static size_t self_event_home(uint32_t hash)
+{
+    return (size_t)((uint64_t)hash * 0x9E3779B97F4A7C15ULL >> 32) & (SELF_EVENT_TABLE_SIZE - 1);
+}
+
+// Function to find the slot of an expectation, or -1
+static long self_event_find(int fd, int wd, const char *name, uint32_t mask, uint32_t hash)
+{
+    size_t slot = self_event_home(hash);
+    while (self_events[slot].used)
+    {
+        SelfEvent *e = &self_events[slot];
+        if (e->hash == hash && e->fd == fd && e->wd == wd && e->mask == mask && strcmp(e->name, name) == 0)
+            return (long)slot;
+        slot = (slot + 1) & (SELF_EVENT_TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+static void self_event_remove(size_t slot)
+{
+    const size_t mask = SELF_EVENT_TABLE_SIZE - 1;
+    atomic_fetch_sub_explicit(&self_event_pending, self_events[slot].count, memory_order_relaxed);
+    self_events[slot].used = 0;
+    self_event_count--;
+
+    // Backward-shift the rest of the probe run so no lookup chain is broken
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+    while (self_events[next].used)
+    {
+        size_t home = self_event_home(self_events[next].hash);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            self_events[hole] = self_events[next];
+            self_events[next].used = 0;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Function to count one outstanding event of an expectation as met
+static void self_event_take(size_t slot)
+{
+    self_events[slot].count--;
+    atomic_fetch_sub_explicit(&self_event_pending, 1, memory_order_relaxed);
+    if (self_events[slot].count == 0)
+    {
+        self_event_remove(slot);
+    }
+}
+
+// Function to drop every expectation past its deadline
+static void self_event_expire(uint64_t now)
+{
+    last_expire_ns = now;
+    size_t slot = 0;
+    while (slot < SELF_EVENT_TABLE_SIZE)
+    {
+        // A removal can shift a later entry into this slot, so look again
+        if (self_events[slot].used && self_events[slot].expires_ns <= now)
+        {
+            atomic_fetch_add_explicit(&self_event_expired, self_events[slot].count, memory_order_relaxed);
+            self_event_remove(slot);
+            continue;
+        }
+        slot++;
+    }
+}
+
+// Function to record that the daemon is about to cause one event. mask is a
+// single event type such as IN_DELETE or IN_CREATE.
+void self_event_expect(int fd, int wd, const char *name, uint32_t mask)
+{
+    uint32_t hash = self_event_hash(fd, wd, name, mask);
+    uint64_t now = metrics_now_ns();
+
+    pthread_mutex_lock(&self_event_lock);
+    long slot = self_event_find(fd, wd, name, mask, hash);
+    if (slot < 0 && (self_event_count + 1) * 100 > SELF_EVENT_TABLE_SIZE * SELF_EVENT_MAX_LOAD_PERCENT)
+    {
+        self_event_expire(now);
+    }
+    if (slot < 0 && (self_event_count + 1) * 100 <= SELF_EVENT_TABLE_SIZE * SELF_EVENT_MAX_LOAD_PERCENT)
+    {
+        size_t free_slot = self_event_home(hash);
+        while (self_events[free_slot].used)
+        {
+            free_slot = (free_slot + 1) & (SELF_EVENT_TABLE_SIZE - 1);
+        }
+        SelfEvent *e = &self_events[free_slot];
+        e->used = 1;
+        e->fd = fd;
+        e->wd = wd;
+        e->mask = mask;
+        e->count = 0;
+        e->hash = hash;
+        snprintf(e->name, sizeof(e->name), "%s", name);
+        self_event_count++;
+        slot = (long)free_slot;
+    }
+
+    if (slot >= 0)
+    {
+        self_events[slot].count++;
+        self_events[slot].expires_ns = now + (uint64_t)SELF_EVENT_TTL_MS * 1000000ULL;
+        atomic_fetch_add_explicit(&self_event_pending, 1, memory_order_release);
+        atomic_fetch_add_explicit(&self_event_expected, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&self_event_dropped, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&self_event_lock);
+}
+
+// Function to withdraw an expectation when the call that would have caused
+// the event failed
+void self_event_cancel(int fd, int wd, const char *name, uint32_t mask)
+{
+    uint32_t hash = self_event_hash(fd, wd, name, mask);
+
+    pthread_mutex_lock(&self_event_lock);
+    long slot = self_event_find(fd, wd, name, mask, hash);
+    if (slot >= 0)
+    {
+        atomic_fetch_sub_explicit(&self_event_expected, 1, memory_order_relaxed);
+        self_event_take((size_t)slot);
+    }
+    pthread_mutex_unlock(&self_event_lock);
+}
+
+// Function to check an event read from inotify against the expected ones.
+// Returns 1 if the daemon caused it and it should be dropped.
+int self_event_consume(int fd, const struct inotify_event *event)
+{
+    if (atomic_load_explicit(&self_event_pending, memory_order_acquire) == 0 || event->len == 0)
+        return 0;
+
+    uint32_t type = event->mask & (IN_CREATE | IN_DELETE);
+    if (type == 0 || (event->mask & IN_ISDIR))
+        return 0;
+
+    uint32_t hash = self_event_hash(fd, event->wd, event->name, type);
+    uint64_t now = metrics_now_ns();
+    int suppressed = 0;
+    pthread_mutex_lock(&self_event_lock);
+    // Expectations that are never met would otherwise keep every event on
+    // this slower path
+    if (now - last_expire_ns > (uint64_t)SELF_EVENT_TTL_MS * 1000000ULL)
+    {
+        self_event_expire(now);
+    }
+    long slot = self_event_find(fd, event->wd, event->name, type, hash);
+    if (slot >= 0)
+    {
+        SelfEvent *e = &self_events[slot];
+        if (e->expires_ns <= now)
+        {
+            atomic_fetch_add_explicit(&self_event_expired, e->count, memory_order_relaxed);
+            self_event_remove((size_t)slot);
+        }
+        else
+        {
+            suppressed = 1;
+            self_event_take((size_t)slot);
+        }
+    }
+    pthread_mutex_unlock(&self_event_lock);
+
+    if (suppressed)
+    {
+        atomic_fetch_add_explicit(&self_event_suppressed, 1, memory_order_relaxed);
+    }
+    return suppressed;
+}
+
+void self_event_get_stats(SelfEventStats *stats)
+{
+    stats->expected = atomic_load_explicit(&self_event_expected, memory_order_relaxed);
+    stats->suppressed = atomic_load_explicit(&self_event_suppressed, memory_order_relaxed);
+    stats->expired = atomic_load_explicit(&self_event_expired, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&self_event_dropped, memory_order_relaxed);
+    stats->pending = atomic_load_explicit(&self_event_pending, memory_order_relaxed);
+}
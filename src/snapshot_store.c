@@ -0,0 +1,449 @@
+#include "file_protection.h"
+
+#include <sys/sendfile.h>
+
+// Content-addressed snapshot store. When a file comes under protection its
+// contents are stored once per distinct SHA-256 as objects/xx/<rest of hash>,
+// and a small ref file records which object and mode belong to that file.
+// Deleting or moving a protected file away can then be undone with its real
+// contents instead of an empty file.
+//
+// Refs are keyed by the parent directory's inode and the file's name rather
+// than by the full path, so they stay valid when a directory above the file
+// is renamed; a renamed directory keeps its watches without a rescan, and
+// its files keep their snapshots the same way.
+//
+// Data never passes through our buffers on capture or restore: contents are
+// shared with a FICLONE reflink where the filesystem supports it, and copied
+// in the kernel with copy_file_range, or sendfile, where it does not. New
+// objects and refs are written under a temporary name or O_TMPFILE and then
+// linked into place, so a crash never leaves a partial object behind.
+
+static int store_fd = -1;
+static atomic_ulong store_captured = 0;
+static atomic_ulong store_deduplicated = 0;
+static atomic_ulong store_reflinked = 0;
+static atomic_ulong store_copied = 0;
+static atomic_ulong store_restored = 0;
+static atomic_ulong store_failed = 0;
+static atomic_ullong store_bytes = 0;
+static atomic_uint store_temp_seq = 0;
+
+// What a ref file records about the captured file
+typedef struct
+{
+    char hash[SHA256_HEX_LEN + 1];
+    mode_t mode;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} SnapshotRef;
+
+// Function to open (creating if needed) the snapshot store at path
+int snapshot_store_open(const char *path)
+{
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot create snapshot store %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        return -1;
+    }
+    store_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store_fd < 0 || (mkdirat(store_fd, "objects", 0700) < 0 && errno != EEXIST) ||
+        (mkdirat(store_fd, "refs", 0700) < 0 && errno != EEXIST))
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot open snapshot store %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        if (store_fd >= 0)
+            close(store_fd);
+        store_fd = -1;
+        return -1;
+    }
+
+    char log_buf[MAX_PATH_LEN + 100];
+    snprintf(log_buf, sizeof(log_buf), "Snapshot store opened: %s", path);
+    log_message(log_buf);
+    return 0;
+}
+
+void snapshot_store_close(void)
+{
+    if (store_fd >= 0)
+    {
+        close(store_fd);
+        store_fd = -1;
+    }
+}
+
+int snapshot_store_active(void)
+{
+    return store_fd >= 0;
+}
+
+// Function to copy size bytes between files inside the kernel: a reflink if
+// possible, else copy_file_range, else sendfile
+static int clone_contents(int src, int dst, off_t size)
+{
+    if (ioctl(dst, FICLONE, src) == 0)
+    {
+        atomic_fetch_add_explicit(&store_reflinked, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    off_t in = 0, out = 0;
+    int use_sendfile = 0;
+    while (in < size)
+    {
+        ssize_t n;
+        if (!use_sendfile)
+        {
+            n = copy_file_range(src, &in, dst, &out, (size_t)(size - in), 0);
+            if (n < 0 && in == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+            {
+                use_sendfile = 1;
+                continue;
+            }
+        }
+        else
+        {
+            // sendfile writes at dst's file offset, which starts at 0 here
+            n = sendfile(dst, src, &in, (size_t)(size - in));
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+    }
+    atomic_fetch_add_explicit(&store_copied, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Function to build the key of the file name in dir_fd, "dev ino name", and
+// the ref file it is stored under: refs/xx/<rest of key hash>
+static int ref_name(int dir_fd, const char *file, char *key, size_t key_size, char *name, size_t size)
+{
+    struct stat dir_st;
+    if (fstat(dir_fd, &dir_st) < 0 ||
+        snprintf(key, key_size, "%llu %llu %s", (unsigned long long)dir_st.st_dev,
+                 (unsigned long long)dir_st.st_ino, file) >= (int)key_size)
+        return -1;
+
+    unsigned char digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_HEX_LEN + 1];
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, key, strlen(key));
+    sha256_final(&ctx, digest);
+    content_hash_hex(digest, hex);
+    snprintf(name, size, "refs/%.2s/%s", hex, hex + 2);
+    return 0;
+}
+
+static int ref_read(int dir_fd, const char *file, SnapshotRef *ref)
+{
+    char key[MAX_FILENAME_LEN + 64];
+    char name[128];
+    if (ref_name(dir_fd, file, key, sizeof(key), name, sizeof(name)) < 0)
+        return -1;
+    int fd = openat(store_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    char buf[MAX_PATH_LEN + 256];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    // Line 1: hash mode dev ino size mtime; line 2: the key, to catch collisions
+    unsigned int mode;
+    unsigned long long dev, ino;
+    long long size, sec, nsec;
+    int consumed = 0;
+    if (sscanf(buf, "%64s %o %llu %llu %lld %lld.%lld\n%n", ref->hash, &mode, &dev, &ino, &size, &sec, &nsec,
+               &consumed) != 7 ||
+        strlen(ref->hash) != SHA256_HEX_LEN)
+        return -1;
+    char *stored_key = buf + consumed;
+    stored_key[strcspn(stored_key, "\n")] = '\0';
+    if (strcmp(stored_key, key) != 0)
+        return -1;
+
+    ref->mode = (mode_t)mode;
+    ref->dev = (dev_t)dev;
+    ref->ino = (ino_t)ino;
+    ref->size = (off_t)size;
+    ref->mtime.tv_sec = (time_t)sec;
+    ref->mtime.tv_nsec = (long)nsec;
+    return 0;
+}
+
+// Function to write a name under the store through a temporary file and rename
+static int store_write_atomic(const char *name, const char *data, size_t len)
+{
+    char dir[128];
+    snprintf(dir, sizeof(dir), "%s", name);
+    *strrchr(dir, '/') = '\0';
+    if (mkdirat(store_fd, dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+
+    char temp[160];
+    snprintf(temp, sizeof(temp), "%s/.tmp.%d.%u", dir, getpid(),
+             atomic_fetch_add_explicit(&store_temp_seq, 1, memory_order_relaxed));
+    int fd = openat(store_fd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    int ok = write(fd, data, len) == (ssize_t)len;
+    close(fd);
+    if (!ok || renameat(store_fd, temp, store_fd, name) < 0)
+    {
+        unlinkat(store_fd, temp, 0);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to store the contents of src as an object; fills in its hash
+static int object_store(int src, off_t size, char hash[SHA256_HEX_LEN + 1])
+{
+    unsigned char digest[SHA256_DIGEST_LEN];
+    if (content_hash_fd(src, size, digest) < 0)
+        return -1;
+    content_hash_hex(digest, hash);
+
+    char name[128];
+    snprintf(name, sizeof(name), "objects/%.2s/%s", hash, hash + 2);
+    if (faccessat(store_fd, name, F_OK, 0) == 0)
+    {
+        atomic_fetch_add_explicit(&store_deduplicated, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    char dir[32];
+    snprintf(dir, sizeof(dir), "objects/%.2s", hash);
+    if (mkdirat(store_fd, dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+
+    // Copy into an anonymous file if the filesystem allows, else a temp name
+    char temp[160] = "";
+    int dst = openat(store_fd, dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0400);
+    if (dst < 0)
+    {
+        snprintf(temp, sizeof(temp), "%s/.tmp.%d.%u", dir, getpid(),
+                 atomic_fetch_add_explicit(&store_temp_seq, 1, memory_order_relaxed));
+        dst = openat(store_fd, temp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0400);
+        if (dst < 0)
+            return -1;
+    }
+
+    // The source may have changed since it was hashed; name the object after
+    // what was actually copied
+    int ret = -1;
+    struct stat st;
+    if (clone_contents(src, dst, size) == 0 && fstat(dst, &st) == 0 &&
+        content_hash_fd(dst, st.st_size, digest) == 0)
+    {
+        content_hash_hex(digest, hash);
+        snprintf(name, sizeof(name), "objects/%.2s/%s", hash, hash + 2);
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dst);
+        int linked = temp[0] ? linkat(store_fd, temp, store_fd, name, 0)
+                             : linkat(AT_FDCWD, proc_path, store_fd, name, AT_SYMLINK_FOLLOW);
+        if (linked == 0)
+        {
+            atomic_fetch_add_explicit(&store_bytes, (unsigned long long)st.st_size, memory_order_relaxed);
+            ret = 0;
+        }
+        else if (errno == EEXIST)
+        {
+            atomic_fetch_add_explicit(&store_deduplicated, 1, memory_order_relaxed);
+            ret = 0;
+        }
+    }
+    if (temp[0])
+        unlinkat(store_fd, temp, 0);
+    close(dst);
+    return ret;
+}
+
+// Function to snapshot a file about to come under protection. An existing
+// snapshot of the same inode, size and mtime is kept as is, so re-enabling
+// protection only captures files that changed. Returns 1 if a snapshot was
+// written, 0 if the existing one is current, -1 on failure.
+int snapshot_capture_at(int dir_fd, const char *name, const char *path)
+{
+    if (store_fd < 0)
+        return 0;
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+
+    SnapshotRef ref;
+    if (ref_read(dir_fd, name, &ref) == 0 && ref.dev == st.st_dev && ref.ino == st.st_ino && ref.size == st.st_size &&
+        ref.mtime.tv_sec == st.st_mtim.tv_sec && ref.mtime.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        close(fd);
+        return 0;
+    }
+
+    char hash[SHA256_HEX_LEN + 1];
+    if (object_store(fd, st.st_size, hash) < 0)
+    {
+        close(fd);
+        atomic_fetch_add_explicit(&store_failed, 1, memory_order_relaxed);
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to snapshot %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        return -1;
+    }
+    close(fd);
+
+    char key[MAX_FILENAME_LEN + 64];
+    char ref_path[128];
+    char data[MAX_FILENAME_LEN + 256];
+    int len = -1;
+    if (ref_name(dir_fd, name, key, sizeof(key), ref_path, sizeof(ref_path)) == 0)
+    {
+        len = snprintf(data, sizeof(data), "%s %o %llu %llu %lld %lld.%09ld\n%s\n", hash, st.st_mode & 07777,
+                       (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (long long)st.st_size,
+                       (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, key);
+    }
+    if (len < 0 || len >= (int)sizeof(data) || store_write_atomic(ref_path, data, (size_t)len) < 0)
+    {
+        atomic_fetch_add_explicit(&store_failed, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&store_captured, 1, memory_order_relaxed);
+    return 1;
+}
+
+// Function to open the directory of an absolute path; name is set to the
+// path's last component
+static int open_parent(const char *path, const char **name)
+{
+    char dir_path[MAX_PATH_LEN];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    char *slash = strrchr(dir_path, '/');
+    if (slash == NULL || slash[1] == '\0')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *name = path + (slash - dir_path) + 1;
+    *slash = '\0';
+    return open(dir_path[0] ? dir_path : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Function to rebuild a protected file from its snapshot with its contents
+// and mode. The file appears under its name only once it is complete, and
+// only if the name is free; 0 means this call created it.
+int snapshot_restore(const char *path)
+{
+    if (store_fd < 0)
+        return -1;
+    const char *name;
+    int dir_fd = open_parent(path, &name);
+    if (dir_fd < 0)
+        return -1;
+
+    SnapshotRef ref;
+    char object[128];
+    int src = -1;
+    if (ref_read(dir_fd, name, &ref) == 0)
+    {
+        snprintf(object, sizeof(object), "objects/%.2s/%s", ref.hash, ref.hash + 2);
+        src = openat(store_fd, object, O_RDONLY | O_CLOEXEC);
+    }
+    struct stat st;
+    if (src < 0 || fstat(src, &st) < 0)
+    {
+        if (src >= 0)
+            close(src);
+        close(dir_fd);
+        return -1;
+    }
+
+    int ret = -1;
+    int dst = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, ref.mode);
+    if (dst >= 0)
+    {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dst);
+        if (clone_contents(src, dst, st.st_size) == 0 && fchmod(dst, ref.mode) == 0 &&
+            linkat(AT_FDCWD, proc_path, dir_fd, name, AT_SYMLINK_FOLLOW) == 0)
+        {
+            ret = 0;
+        }
+        close(dst);
+    }
+    if (ret < 0)
+    {
+        // No O_TMPFILE here: write in place. A name taken again by another
+        // process is left to that process's own events.
+        dst = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, ref.mode);
+        if (dst >= 0 && clone_contents(src, dst, st.st_size) == 0 && fchmod(dst, ref.mode) == 0)
+        {
+            ret = 0;
+        }
+        if (dst >= 0)
+            close(dst);
+    }
+    close(dir_fd);
+    close(src);
+
+    char log_buf[MAX_PATH_LEN + 100];
+    if (ret == 0)
+    {
+        atomic_fetch_add_explicit(&store_restored, 1, memory_order_relaxed);
+        snprintf(log_buf, sizeof(log_buf), "Restored %s from snapshot %.12s (%lld bytes)", path, ref.hash,
+                 (long long)st.st_size);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&store_failed, 1, memory_order_relaxed);
+        snprintf(log_buf, sizeof(log_buf), "Failed to restore %s from snapshot: %s", path, strerror(errno));
+    }
+    log_message(log_buf);
+    return ret;
+}
+
+// Function to check that path has a snapshot that can be restored
+int snapshot_available(const char *path)
+{
+    if (store_fd < 0)
+        return 0;
+    const char *name;
+    int dir_fd = open_parent(path, &name);
+    if (dir_fd < 0)
+        return 0;
+    SnapshotRef ref;
+    int found = ref_read(dir_fd, name, &ref) == 0;
+    close(dir_fd);
+    if (!found)
+        return 0;
+    char object[128];
+    snprintf(object, sizeof(object), "objects/%.2s/%s", ref.hash, ref.hash + 2);
+    return faccessat(store_fd, object, R_OK, 0) == 0;
+}
+
+void snapshot_get_stats(SnapshotStats *stats)
+{
+    stats->captured = atomic_load_explicit(&store_captured, memory_order_relaxed);
+    stats->deduplicated = atomic_load_explicit(&store_deduplicated, memory_order_relaxed);
+    stats->reflinked = atomic_load_explicit(&store_reflinked, memory_order_relaxed);
+    stats->copied = atomic_load_explicit(&store_copied, memory_order_relaxed);
+    stats->restored = atomic_load_explicit(&store_restored, memory_order_relaxed);
+    stats->failed = atomic_load_explicit(&store_failed, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&store_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,987 @@
+#include "file_protection.h"
+
+#include <sys/mman.h>
+
+// Persistent protection state, memory-mapped from STATE_INDEX_FILE so it
+// survives restarts without an explicit save. It is an open-addressed hash
+// table keyed by (dev, inode) holding one entry per watched directory and per
+// protected file. Entries store their parent's key and their own name rather
+// than a full path, so a path is rebuilt by following parent links and a
+// renamed directory only updates its own entry.
+//
+// On a warm start the watched directories are taken from the index instead of
+// listing the whole tree. Only directories whose ctime changed while the
+// daemon was down are listed again, and only protected files whose ctime
+// changed are re-verified.
+//
+// With several protected directories the index covers all of them. The header
+// holds their paths joined by newlines, and each root's own entry is found by
+// its inode, so a rebuilt path starts at whichever root it lies under.
+//
+// The header also holds a hash of each root's templates. Which files are
+// protected depends on them, so an index written under other templates is
+// not trusted and the daemon starts cold.
+
+#define STATE_INDEX_MAGIC "FPSTIDX1"
+#define STATE_INDEX_VERSION 2
+#define STATE_INDEX_HEADER_SIZE 8192
+#define STATE_INDEX_MAX_DEPTH (MAX_PATH_LEN / 2)
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t root_dev; // Of the first protected directory
+    uint64_t root_ino;
+    uint64_t templates[POLICY_MAX_ROOTS]; // Hash of each root's templates, in the order of root
+    char root[MAX_PATH_LEN];              // Protected directories, one per line
+} StateIndexHeader;
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t parent_dev;
+    uint64_t parent_ino;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint32_t mode;
+    uint32_t flags; // STATE_ENTRY_* bits; 0 marks an empty slot
+    char name[MAX_FILENAME_LEN];
+} StateEntry;
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    char *path;
+} WarmDirectory;
+
+// A protected directory the index currently covers
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t templates; // Hash of the root's templates
+    char path[MAX_PATH_LEN];
+} IndexRoot;
+
+_Static_assert(sizeof(StateIndexHeader) <= STATE_INDEX_HEADER_SIZE, "state index header too large");
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static int index_fd = -1;
+static StateIndexHeader *index_header = NULL;
+static StateEntry *index_entries = NULL;
+static size_t index_map_size = 0;
+static IndexRoot index_roots[POLICY_MAX_ROOTS]; // Guarded by index_lock
+static int index_root_count = 0;
+
+static size_t index_slot(uint64_t dev, uint64_t ino, uint64_t capacity)
+{
+    uint64_t h = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL);
+    return (size_t)(h >> 32) & (capacity - 1);
+}
+
+static size_t index_file_size(uint64_t capacity)
+{
+    return STATE_INDEX_HEADER_SIZE + capacity * sizeof(StateEntry);
+}
+
+static int index_map(size_t size)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    index_header = map;
+    index_entries = (StateEntry *)((char *)map + STATE_INDEX_HEADER_SIZE);
+    index_map_size = size;
+    return 0;
+}
+
+static void index_unmap(void)
+{
+    if (index_header != NULL)
+    {
+        munmap(index_header, index_map_size);
+    }
+    index_header = NULL;
+    index_entries = NULL;
+    index_map_size = 0;
+}
+
+static StateEntry *index_find(uint64_t dev, uint64_t ino)
+{
+    uint64_t mask = index_header->capacity - 1;
+    size_t slot = index_slot(dev, ino, index_header->capacity);
+    while (index_entries[slot].flags != 0)
+    {
+        if (index_entries[slot].dev == dev && index_entries[slot].ino == ino)
+            return &index_entries[slot];
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+static StateEntry *index_place(uint64_t dev, uint64_t ino)
+{
+    uint64_t mask = index_header->capacity - 1;
+    size_t slot = index_slot(dev, ino, index_header->capacity);
+    while (index_entries[slot].flags != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return &index_entries[slot];
+}
+
+// Double the table. The file is grown and remapped, then every entry is
+// rehashed from a private copy.
+static int index_grow(void)
+{
+    uint64_t old_capacity = index_header->capacity;
+    uint64_t new_capacity = old_capacity << 1;
+    StateEntry *old_entries = malloc(old_capacity * sizeof(StateEntry));
+    if (old_entries == NULL)
+        return -1;
+    memcpy(old_entries, index_entries, old_capacity * sizeof(StateEntry));
+
+    StateIndexHeader header = *index_header;
+    index_unmap();
+    if (ftruncate(index_fd, (off_t)index_file_size(new_capacity)) < 0 ||
+        index_map(index_file_size(new_capacity)) < 0)
+    {
+        // Keep running on the old table if the file could not grow
+        free(old_entries);
+        if (index_map(index_file_size(old_capacity)) < 0)
+        {
+            close(index_fd);
+            index_fd = -1;
+        }
+        return -1;
+    }
+
+    *index_header = header;
+    index_header->capacity = new_capacity;
+    memset(index_entries, 0, new_capacity * sizeof(StateEntry));
+    for (uint64_t i = 0; i < old_capacity; i++)
+    {
+        if (old_entries[i].flags != 0)
+        {
+            *index_place(old_entries[i].dev, old_entries[i].ino) = old_entries[i];
+        }
+    }
+    free(old_entries);
+    return 0;
+}
+
+static void index_put(const StateEntry *entry)
+{
+    if (index_header == NULL)
+        return;
+
+    StateEntry *slot = index_find(entry->dev, entry->ino);
+    if (slot == NULL)
+    {
+        if ((index_header->count + 1) * 100 > index_header->capacity * WATCH_TABLE_MAX_LOAD_PERCENT &&
+            index_grow() < 0)
+        {
+            log_message("Failed to grow protection state index");
+            return;
+        }
+        if (index_header == NULL)
+            return;
+        slot = index_place(entry->dev, entry->ino);
+        index_header->count++;
+    }
+    *slot = *entry;
+}
+
+static void index_remove(uint64_t dev, uint64_t ino)
+{
+    uint64_t mask = index_header->capacity - 1;
+    size_t slot = index_slot(dev, ino, index_header->capacity);
+    while (index_entries[slot].flags != 0 && (index_entries[slot].dev != dev || index_entries[slot].ino != ino))
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (index_entries[slot].flags == 0)
+        return;
+
+    memset(&index_entries[slot], 0, sizeof(StateEntry));
+    index_header->count--;
+
+    // Backward-shift deletion, as in the watch table
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+    while (index_entries[next].flags != 0)
+    {
+        size_t home = index_slot(index_entries[next].dev, index_entries[next].ino, index_header->capacity);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            index_entries[hole] = index_entries[next];
+            memset(&index_entries[next], 0, sizeof(StateEntry));
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// FNV-1a over a root's patterns in order, each with its terminating NUL
+static uint64_t index_templates_hash(const PolicyRoot *root)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < root->pattern_count; i++)
+    {
+        const unsigned char *p = (const unsigned char *)root->patterns[i];
+        do
+        {
+            hash = (hash ^ *p) * 1099511628211ULL;
+        } while (*p++ != '\0');
+    }
+    return hash;
+}
+
+// Function to read the protected directories of the current policy and their
+// template hashes into roots, and join their paths into joined. Returns the
+// number of roots, or -1 if one cannot be examined or the paths do not fit
+// in the header.
+static int index_read_roots(IndexRoot *roots, char *joined)
+{
+    policy_read_lock();
+    const Policy *policy = policy_current();
+    int count = policy->root_count;
+    for (int i = 0; i < count; i++)
+    {
+        strcpy(roots[i].path, policy->roots[i].path);
+        roots[i].templates = index_templates_hash(&policy->roots[i]);
+    }
+    policy_read_unlock();
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct stat st;
+        size_t path_len = strlen(roots[i].path);
+        if (stat(roots[i].path, &st) < 0 || len + path_len + 1 > MAX_PATH_LEN)
+            return -1;
+        roots[i].dev = (uint64_t)st.st_dev;
+        roots[i].ino = (uint64_t)st.st_ino;
+        if (i > 0)
+            joined[len++] = '\n';
+        memcpy(joined + len, roots[i].path, path_len + 1);
+        len += path_len;
+    }
+    return count > 0 ? count : -1;
+}
+
+// Function to check whether the header was written for these roots
+static int index_matches_roots(const IndexRoot *roots, const char *joined)
+{
+    return strcmp(index_header->root, joined) == 0 && index_header->root_dev == roots[0].dev &&
+           index_header->root_ino == roots[0].ino;
+}
+
+// Function to check whether the header was written under these roots' templates
+static int index_matches_templates(const IndexRoot *roots, int root_count)
+{
+    for (int i = 0; i < root_count; i++)
+    {
+        if (index_header->templates[i] != roots[i].templates)
+            return 0;
+    }
+    return 1;
+}
+
+static void index_set_templates(const IndexRoot *roots, int root_count)
+{
+    memset(index_header->templates, 0, sizeof(index_header->templates));
+    for (int i = 0; i < root_count; i++)
+    {
+        index_header->templates[i] = roots[i].templates;
+    }
+}
+
+static void index_reset(const IndexRoot *roots, int root_count, const char *joined)
+{
+    memset(index_entries, 0, index_header->capacity * sizeof(StateEntry));
+    memcpy(index_header->magic, STATE_INDEX_MAGIC, sizeof(index_header->magic));
+    index_header->version = STATE_INDEX_VERSION;
+    index_header->entry_size = sizeof(StateEntry);
+    index_header->count = 0;
+    index_header->root_dev = roots[0].dev;
+    index_header->root_ino = roots[0].ino;
+    strcpy(index_header->root, joined);
+    index_set_templates(roots, root_count);
+}
+
+// Function to find the protected directory with a given inode, if any
+static const IndexRoot *index_root_for(uint64_t dev, uint64_t ino)
+{
+    for (int i = 0; i < index_root_count; i++)
+    {
+        if (index_roots[i].dev == dev && index_roots[i].ino == ino)
+            return &index_roots[i];
+    }
+    return NULL;
+}
+
+// Function to open (or create) the state index. Returns 1 if it holds state
+// for the current protected directories, 0 if it starts empty and -1 if the
+// daemon has to run without an index.
+int state_index_open(const char *path)
+{
+    IndexRoot roots[POLICY_MAX_ROOTS];
+    char joined[MAX_PATH_LEN];
+    int root_count = index_read_roots(roots, joined);
+    if (root_count < 0)
+        return -1;
+    memcpy(index_roots, roots, (size_t)root_count * sizeof(IndexRoot));
+    index_root_count = root_count;
+
+    index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    struct stat st;
+    if (index_fd < 0 || fstat(index_fd, &st) < 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to open state index %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        if (index_fd >= 0)
+            close(index_fd);
+        index_fd = -1;
+        return -1;
+    }
+
+    // Trust the existing file only if its layout and size agree with its header
+    int usable = 0;
+    if ((size_t)st.st_size >= index_file_size(STATE_INDEX_MIN_CAPACITY))
+    {
+        StateIndexHeader header;
+        if (pread(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+            memcmp(header.magic, STATE_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+            header.version == STATE_INDEX_VERSION && header.entry_size == sizeof(StateEntry) &&
+            header.capacity >= STATE_INDEX_MIN_CAPACITY && (header.capacity & (header.capacity - 1)) == 0 &&
+            (uint64_t)st.st_size == index_file_size(header.capacity) && header.count < header.capacity)
+        {
+            usable = index_map(index_file_size(header.capacity)) == 0;
+        }
+    }
+
+    if (!usable)
+    {
+        if (ftruncate(index_fd, 0) < 0 ||
+            ftruncate(index_fd, (off_t)index_file_size(STATE_INDEX_MIN_CAPACITY)) < 0 ||
+            index_map(index_file_size(STATE_INDEX_MIN_CAPACITY)) < 0)
+        {
+            log_message("Failed to create state index; continuing without it");
+            close(index_fd);
+            index_fd = -1;
+            return -1;
+        }
+        index_header->capacity = STATE_INDEX_MIN_CAPACITY;
+        index_reset(roots, root_count, joined);
+        return 0;
+    }
+
+    if (!index_matches_roots(roots, joined))
+    {
+        log_message("State index belongs to different protected directories; starting cold");
+        index_reset(roots, root_count, joined);
+        return 0;
+    }
+    if (!index_matches_templates(roots, root_count))
+    {
+        log_message("State index was written under different templates; starting cold");
+        index_reset(roots, root_count, joined);
+        return 0;
+    }
+    return index_header->count > 0;
+}
+
+void state_index_close(void)
+{
+    pthread_mutex_lock(&index_lock);
+    if (index_header != NULL)
+    {
+        msync(index_header, index_map_size, MS_SYNC);
+    }
+    index_unmap();
+    if (index_fd >= 0)
+    {
+        close(index_fd);
+        index_fd = -1;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Function to record a watched directory. Its parent is found through ".."
+// of the open directory, so no path lookup is involved.
+void state_index_record_directory(int dir_fd, const char *path, const struct stat *st)
+{
+    if (index_fd < 0)
+        return;
+
+    StateEntry entry = {0};
+    entry.dev = (uint64_t)st->st_dev;
+    entry.ino = (uint64_t)st->st_ino;
+    entry.ctime_sec = st->st_ctim.tv_sec;
+    entry.ctime_nsec = st->st_ctim.tv_nsec;
+    entry.mode = st->st_mode;
+    entry.flags = STATE_ENTRY_DIRECTORY;
+
+    // A directory already recorded with the same ctime is left as it is
+    pthread_mutex_lock(&index_lock);
+    int is_root = index_header != NULL && index_root_for(entry.dev, entry.ino) != NULL;
+    StateEntry *existing = index_header != NULL ? index_find(entry.dev, entry.ino) : NULL;
+    int unchanged = existing != NULL && (existing->flags & STATE_ENTRY_DIRECTORY) &&
+                    existing->ctime_sec == entry.ctime_sec && existing->ctime_nsec == entry.ctime_nsec;
+    pthread_mutex_unlock(&index_lock);
+    if (unchanged)
+        return;
+
+    if (is_root)
+    {
+        entry.flags |= STATE_ENTRY_ROOT;
+    }
+    else
+    {
+        const char *name = strrchr(path, '/');
+        name = name != NULL ? name + 1 : path;
+        struct stat parent;
+        if (strlen(name) >= MAX_FILENAME_LEN || fstatat(dir_fd, "..", &parent, 0) < 0)
+            return;
+        entry.parent_dev = (uint64_t)parent.st_dev;
+        entry.parent_ino = (uint64_t)parent.st_ino;
+        strcpy(entry.name, name);
+    }
+
+    pthread_mutex_lock(&index_lock);
+    if (index_header != NULL)
+    {
+        index_put(&entry);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Function to record the state of a file after enforcement. Files that are no
+// longer protected are dropped from the index.
+void state_index_record_file(int dir_fd, const char *name, const struct stat *st, int immutable, int protect)
+{
+    if (index_fd < 0)
+        return;
+
+    if (!protect)
+    {
+        state_index_forget(st->st_dev, st->st_ino);
+        return;
+    }
+
+    StateEntry entry = {0};
+    entry.dev = (uint64_t)st->st_dev;
+    entry.ino = (uint64_t)st->st_ino;
+    entry.ctime_sec = st->st_ctim.tv_sec;
+    entry.ctime_nsec = st->st_ctim.tv_nsec;
+    entry.mode = st->st_mode;
+    entry.flags = STATE_ENTRY_FILE | (immutable ? STATE_ENTRY_IMMUTABLE : 0);
+
+    // Skip the parent lookup when nothing about the file changed
+    pthread_mutex_lock(&index_lock);
+    StateEntry *existing = index_header != NULL ? index_find(entry.dev, entry.ino) : NULL;
+    int unchanged = existing != NULL && existing->flags == entry.flags && existing->mode == entry.mode &&
+                    existing->ctime_sec == entry.ctime_sec && existing->ctime_nsec == entry.ctime_nsec &&
+                    strcmp(existing->name, name) == 0;
+    pthread_mutex_unlock(&index_lock);
+    if (unchanged)
+        return;
+
+    struct stat parent;
+    if (strlen(name) >= MAX_FILENAME_LEN || fstat(dir_fd, &parent) < 0)
+        return;
+    entry.parent_dev = (uint64_t)parent.st_dev;
+    entry.parent_ino = (uint64_t)parent.st_ino;
+    strcpy(entry.name, name);
+
+    pthread_mutex_lock(&index_lock);
+    if (index_header != NULL)
+    {
+        index_put(&entry);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Function to record a file by path, for enforcement paths that work on paths
+void state_index_record_path(const char *path)
+{
+    if (index_fd < 0)
+        return;
+
+    char parent_path[MAX_PATH_LEN];
+    strncpy(parent_path, path, MAX_PATH_LEN - 1);
+    parent_path[MAX_PATH_LEN - 1] = '\0';
+    char *slash = strrchr(parent_path, '/');
+    if (slash == NULL)
+        return;
+    const char *name = path + (slash - parent_path) + 1;
+    if (slash == parent_path)
+        slash++;
+    *slash = '\0';
+
+    int dir_fd = open(parent_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return;
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        int flags = 0;
+        int immutable = ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_IMMUTABLE_FL);
+        state_index_record_file(dir_fd, name, &st, immutable, 1);
+    }
+    if (fd >= 0)
+        close(fd);
+    close(dir_fd);
+}
+
+void state_index_forget(dev_t dev, ino_t ino)
+{
+    if (index_fd < 0)
+        return;
+
+    pthread_mutex_lock(&index_lock);
+    if (index_header != NULL)
+    {
+        index_remove((uint64_t)dev, (uint64_t)ino);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Function to check whether a file is the protected file the index holds
+// under this directory and name, unchanged since. A freed inode number can
+// be reused by a new file, so the name and ctime must match as well.
+// Returns -1 when there is no index to ask.
+int state_index_has_file(dev_t parent_dev, ino_t parent_ino, const char *name, const struct stat *st)
+{
+    if (index_fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&index_lock);
+    int found = -1;
+    if (index_header != NULL)
+    {
+        StateEntry *entry = index_find((uint64_t)st->st_dev, (uint64_t)st->st_ino);
+        found = entry != NULL && (entry->flags & STATE_ENTRY_FILE) && entry->parent_dev == (uint64_t)parent_dev &&
+                entry->parent_ino == (uint64_t)parent_ino && strcmp(entry->name, name) == 0 &&
+                entry->ctime_sec == st->st_ctim.tv_sec && entry->ctime_nsec == st->st_ctim.tv_nsec;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return found;
+}
+
+static int index_file_compare(const void *a, const void *b)
+{
+    const StateIndexFile *x = a;
+    const StateIndexFile *y = b;
+    if (x->parent_dev != y->parent_dev)
+        return x->parent_dev < y->parent_dev ? -1 : 1;
+    if (x->parent_ino != y->parent_ino)
+        return x->parent_ino < y->parent_ino ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Function to list the recorded protected files sorted by parent directory,
+// so a rescan can find each directory's files without walking the table
+// again. Returns -1 when there is no index or memory runs out.
+int state_index_list_files(StateIndexFile **files, size_t *count)
+{
+    *files = NULL;
+    *count = 0;
+    if (index_fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&index_lock);
+    if (index_header == NULL)
+    {
+        pthread_mutex_unlock(&index_lock);
+        return -1;
+    }
+    size_t capacity = (size_t)index_header->count;
+    StateIndexFile *list = malloc((capacity + 1) * sizeof(StateIndexFile));
+    size_t n = 0;
+    for (uint64_t i = 0; list != NULL && i < index_header->capacity && n < capacity; i++)
+    {
+        const StateEntry *entry = &index_entries[i];
+        if (!(entry->flags & STATE_ENTRY_FILE))
+            continue;
+        char *name = strndup(entry->name, MAX_FILENAME_LEN - 1);
+        if (name == NULL)
+        {
+            state_index_free_files(list, n);
+            list = NULL;
+            break;
+        }
+        list[n++] = (StateIndexFile){entry->parent_dev, entry->parent_ino, entry->dev, entry->ino, name};
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    if (list == NULL)
+        return -1;
+    qsort(list, n, sizeof(StateIndexFile), index_file_compare);
+    *files = list;
+    *count = n;
+    return 0;
+}
+
+void state_index_free_files(StateIndexFile *files, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(files[i].name);
+    }
+    free(files);
+}
+
+// Rebuild the path of a directory entry from its parent chain. Results are
+// memoised per slot; failed lookups are remembered as the empty string.
+static const char *warm_directory_path(size_t slot, char **memo, int depth)
+{
+    if (memo[slot] != NULL)
+        return memo[slot][0] != '\0' ? memo[slot] : NULL;
+
+    const StateEntry *entry = &index_entries[slot];
+    char *path = NULL;
+    if (entry->flags & STATE_ENTRY_ROOT)
+    {
+        const IndexRoot *root = index_root_for(entry->dev, entry->ino);
+        path = root != NULL ? strdup(root->path) : NULL;
+    }
+    else if (depth < STATE_INDEX_MAX_DEPTH)
+    {
+        const StateEntry *parent = index_find(entry->parent_dev, entry->parent_ino);
+        if (parent != NULL && (parent->flags & STATE_ENTRY_DIRECTORY))
+        {
+            const char *parent_path = warm_directory_path((size_t)(parent - index_entries), memo, depth + 1);
+            size_t parent_len = parent_path != NULL ? strlen(parent_path) : 0;
+            size_t name_len = strlen(entry->name);
+            if (parent_path != NULL && parent_len + name_len + 2 <= MAX_PATH_LEN)
+            {
+                path = malloc(parent_len + name_len + 2);
+                if (path != NULL)
+                {
+                    memcpy(path, parent_path, parent_len);
+                    path[parent_len] = '/';
+                    memcpy(path + parent_len + 1, entry->name, name_len + 1);
+                }
+            }
+        }
+    }
+
+    memo[slot] = path != NULL ? path : strdup("");
+    return path;
+}
+
+// Function to look up whether a directory is recorded in the index
+static int warm_directory_known(const struct stat *st)
+{
+    pthread_mutex_lock(&index_lock);
+    const StateEntry *entry = index_header != NULL ? index_find((uint64_t)st->st_dev, (uint64_t)st->st_ino) : NULL;
+    int known = entry != NULL && (entry->flags & STATE_ENTRY_DIRECTORY);
+    pthread_mutex_unlock(&index_lock);
+    return known;
+}
+
+// List a directory that changed while the daemon was down and walk any
+// subdirectory the index does not know about
+static void warm_rescan_directory(const char *path, long *new_subtrees)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(st.st_mode) ||
+            warm_directory_known(&st))
+            continue;
+
+        char child[MAX_PATH_LEN];
+        if (snprintf(child, sizeof(child), "%s/%s", path, name) >= (int)sizeof(child))
+            continue;
+        add_watch_recursive(child);
+        (*new_subtrees)++;
+    }
+    closedir(dir);
+}
+
+// Re-verify a protected file whose ctime changed while the daemon was down.
+// Returns 1 if it is still in the recorded state, 0 if not.
+static int warm_verify_file(const char *path, const StateEntry *entry, struct stat *st)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int flags = 0;
+    int immutable = ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_IMMUTABLE_FL);
+    int ok = fstat(fd, st) == 0 && st->st_mode == entry->mode &&
+             immutable == ((entry->flags & STATE_ENTRY_IMMUTABLE) != 0);
+    close(fd);
+    return ok;
+}
+
+// Function to install watches from the state index instead of walking the
+// tree. Returns -1 if the index cannot be used and a full walk is needed.
+int state_index_warm_start(void)
+{
+    if (index_fd < 0)
+        return -1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Snapshot directory and file entries with their rebuilt paths; watching
+    // directories updates the index, which may move entries around
+    pthread_mutex_lock(&index_lock);
+    size_t capacity = index_header->capacity;
+    char **memo = calloc(capacity, sizeof(char *));
+    WarmDirectory *dirs = malloc((index_header->count + 1) * sizeof(WarmDirectory));
+    StateEntry *files = malloc((index_header->count + 1) * sizeof(StateEntry));
+    char **file_paths = calloc(index_header->count + 1, sizeof(char *));
+    if (memo == NULL || dirs == NULL || files == NULL || file_paths == NULL)
+    {
+        pthread_mutex_unlock(&index_lock);
+        free(memo);
+        free(dirs);
+        free(files);
+        free(file_paths);
+        log_message("Memory allocation failed while loading state index");
+        return -1;
+    }
+
+    size_t dir_count = 0, file_count = 0, root_found = 0;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        const StateEntry *entry = &index_entries[i];
+        if (entry->flags & STATE_ENTRY_DIRECTORY)
+        {
+            const char *path = warm_directory_path(i, memo, 0);
+            dirs[dir_count].dev = entry->dev;
+            dirs[dir_count].ino = entry->ino;
+            dirs[dir_count].path = path != NULL ? strdup(path) : NULL;
+            dir_count++;
+            root_found |= (entry->flags & STATE_ENTRY_ROOT) != 0;
+        }
+        else if (entry->flags & STATE_ENTRY_FILE)
+        {
+            const StateEntry *parent = index_find(entry->parent_dev, entry->parent_ino);
+            const char *parent_path = parent != NULL && (parent->flags & STATE_ENTRY_DIRECTORY)
+                                          ? warm_directory_path((size_t)(parent - index_entries), memo, 0)
+                                          : NULL;
+            char path[MAX_PATH_LEN];
+            files[file_count] = *entry;
+            file_paths[file_count] = NULL;
+            if (parent_path != NULL &&
+                snprintf(path, sizeof(path), "%s/%s", parent_path, entry->name) < (int)sizeof(path))
+            {
+                file_paths[file_count] = strdup(path);
+            }
+            file_count++;
+        }
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        free(memo[i]);
+    }
+    free(memo);
+    pthread_mutex_unlock(&index_lock);
+
+    // Directories are accepted only inside one of the protected directories
+    char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+    int root_count = policy_copy_roots(roots, NULL);
+
+    long watched = 0, stale_dirs = 0, rescanned = 0, new_subtrees = 0;
+    long files_trusted = 0, files_verified = 0, files_dropped = 0;
+    char **rescan = calloc(dir_count + 1, sizeof(char *));
+    if (!root_found || rescan == NULL)
+    {
+        dir_count = 0;
+    }
+
+    for (size_t i = 0; i < dir_count; i++)
+    {
+        WarmDirectory *dir = &dirs[i];
+        int dir_fd = dir->path != NULL ? open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        struct stat st;
+        char resolved[MAX_PATH_LEN];
+        int valid = dir_fd >= 0 && fstat(dir_fd, &st) == 0 && (uint64_t)st.st_dev == dir->dev &&
+                    (uint64_t)st.st_ino == dir->ino && resolve_directory_fd(dir_fd, dir->path, resolved) == 0;
+        int inside = 0;
+        for (int r = 0; valid && r < root_count && !inside; r++)
+        {
+            inside = is_path_within(roots[r], resolved);
+        }
+        valid = valid && inside;
+        if (!valid)
+        {
+            // Gone, moved or replaced: its new location is found by rescanning its parent
+            state_index_forget((dev_t)dir->dev, (ino_t)dir->ino);
+            stale_dirs++;
+            if (dir_fd >= 0)
+                close(dir_fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&index_lock);
+        const StateEntry *entry = index_find(dir->dev, dir->ino);
+        int changed = entry == NULL || entry->ctime_sec != st.st_ctim.tv_sec || entry->ctime_nsec != st.st_ctim.tv_nsec;
+        pthread_mutex_unlock(&index_lock);
+
+        int ret = watch_directory_at(dir_fd, dir->path, &st);
+        if (ret > 0)
+        {
+            // The templates now skip this subtree
+            state_index_forget((dev_t)dir->dev, (ino_t)dir->ino);
+            close(dir_fd);
+            continue;
+        }
+        if (ret == 0)
+            watched++;
+        if (changed)
+        {
+            rescan[rescanned++] = dir->path;
+            dir->path = NULL;
+        }
+        close(dir_fd);
+    }
+
+    for (long i = 0; i < rescanned; i++)
+    {
+        warm_rescan_directory(rescan[i], &new_subtrees);
+    }
+
+    for (size_t i = 0; i < file_count; i++)
+    {
+        const StateEntry *entry = &files[i];
+        struct stat st;
+        if (file_paths[i] == NULL || lstat(file_paths[i], &st) < 0 || (uint64_t)st.st_dev != entry->dev ||
+            (uint64_t)st.st_ino != entry->ino)
+        {
+            state_index_forget((dev_t)entry->dev, (ino_t)entry->ino);
+            files_dropped++;
+            continue;
+        }
+        if (st.st_ctim.tv_sec == entry->ctime_sec && st.st_ctim.tv_nsec == entry->ctime_nsec)
+        {
+            files_trusted++;
+            continue;
+        }
+
+        files_verified++;
+        if (warm_verify_file(file_paths[i], entry, &st))
+        {
+            StateEntry refreshed = *entry;
+            refreshed.ctime_sec = st.st_ctim.tv_sec;
+            refreshed.ctime_nsec = st.st_ctim.tv_nsec;
+            pthread_mutex_lock(&index_lock);
+            index_put(&refreshed);
+            pthread_mutex_unlock(&index_lock);
+        }
+        else
+        {
+            char log_buf[MAX_PATH_LEN + 100];
+            snprintf(log_buf, sizeof(log_buf), "Protection changed while the daemon was stopped: %s", file_paths[i]);
+            log_message(log_buf);
+            state_index_forget((dev_t)entry->dev, (ino_t)entry->ino);
+            files_dropped++;
+        }
+    }
+
+    for (size_t i = 0; i < dir_count; i++)
+    {
+        free(dirs[i].path);
+    }
+    for (long i = 0; i < rescanned; i++)
+    {
+        free(rescan[i]);
+    }
+    for (size_t i = 0; i < file_count; i++)
+    {
+        free(file_paths[i]);
+    }
+    free(dirs);
+    free(rescan);
+    free(files);
+    free(file_paths);
+
+    if (watched == 0)
+    {
+        log_message("State index had no usable directories; starting cold");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    char log_buf[512];
+    snprintf(log_buf, sizeof(log_buf),
+             "Warm start from state index: %ld directories watched, %ld changed and rescanned, %ld new subtrees, "
+             "%ld stale; %ld protected files unchanged, %ld re-verified, %ld dropped in %.3fs",
+             watched, rescanned, new_subtrees, stale_dirs, files_trusted, files_verified, files_dropped,
+             (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+    log_message(log_buf);
+    printf("%s\n", log_buf);
+    return 0;
+}
+
+// Function to start the index afresh when a policy reload changes the set of
+// protected directories. Directories and files are recorded again as the
+// reload walks the new trees. With the same directories only the template
+// hashes are updated, for a reload that has applied new templates to the
+// files. Returns 1 if the index was reset, 0 if not.
+int state_index_set_roots(void)
+{
+    if (index_fd < 0)
+        return 0;
+
+    IndexRoot roots[POLICY_MAX_ROOTS];
+    char joined[MAX_PATH_LEN];
+    int root_count = index_read_roots(roots, joined);
+    if (root_count < 0)
+        return -1;
+
+    pthread_mutex_lock(&index_lock);
+    int reset = index_header != NULL && !index_matches_roots(roots, joined);
+    if (reset)
+    {
+        index_reset(roots, root_count, joined);
+    }
+    else if (index_header != NULL)
+    {
+        index_set_templates(roots, root_count);
+    }
+    memcpy(index_roots, roots, (size_t)root_count * sizeof(IndexRoot));
+    index_root_count = root_count;
+    pthread_mutex_unlock(&index_lock);
+
+    if (reset)
+    {
+        char log_buf[100];
+        snprintf(log_buf, sizeof(log_buf), "State index reset for %d protected director%s", root_count,
+                 root_count == 1 ? "y" : "ies");
+        log_message(log_buf);
+    }
+    return reset;
+}
+
+void state_index_get_stats(size_t *count, size_t *capacity)
+{
+    pthread_mutex_lock(&index_lock);
+    *count = index_header != NULL ? (size_t)index_header->count : 0;
+    *capacity = index_header != NULL ? (size_t)index_header->capacity : 0;
+    pthread_mutex_unlock(&index_lock);
+}
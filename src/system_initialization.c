@@ -1,124 +1,401 @@
 #include "file_protection.h"
 
+InotifyShard inotify_shards[INOTIFY_MAX_INSTANCES];
+atomic_int inotify_shard_count = 0;
+atomic_int stop_requested = 0;
+static int root_shard_first[POLICY_MAX_ROOTS]; // First instance of each root slot
+static int root_shard_count[POLICY_MAX_ROOTS]; // 0 until the slot is first used
+
 int initialize_protection_system()
 {
+    if (logger_start() < 0)
+    {
+        fprintf(stderr, "Failed to start asynchronous logger; logging synchronously\n");
+    }
+
     log_message("Initializing file protection system");
+    watch_dir_fds_init();
 
-    if (load_templates() < 0)
+    if (policy_init() < 0)
     {
         log_message("Failed to load templates. Exiting.");
         return -1;
     }
 
-    struct stat st;
-    if (stat(protected_directory, &st) == -1)
+    log_message("File protection system initialized successfully");
+    return 0;
+}
+
+void cleanup_protection_system()
+{
+    log_message("Cleaning up file protection system");
+
+    // A verify run is abandoned first rather than waited for. The unprotect
+    // sweep still matches templates, so the policy goes last.
+    verify_cancel();
+    verify_wait();
+    if (protection_enabled)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Protected directory does not exist or is inaccessible: %s (Error: %s)", protected_directory, strerror(errno));
-        log_message(log_buf);
-        return -1;
+        disable_protection(stdout);
     }
+    sweep_wait();
 
-    if (!S_ISDIR(st.st_mode))
+    fanotify_backend_stop();
+    inotify_shards_destroy();
+    state_index_close();
+    snapshot_store_close();
+    audit_log_close();
+    policy_shutdown();
+
+    log_message("File protection system cleanup completed");
+    logger_stop();
+}
+
+// Function to create the inotify instances a root slot's watches are spread
+// over. Each slot gets its own instances the first time a root uses it, so
+// one tree's event storm cannot overflow another tree's queue. Instances are
+// set up before they are counted, so readers never see a half-built one.
+int inotify_shards_add_root(int slot)
+{
+    if (root_shard_count[slot] > 0)
+        return 0;
+
+    int first = atomic_load(&inotify_shard_count);
+    int count = config.inotify_instances;
+    if (first + count > INOTIFY_MAX_INSTANCES)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Protected path is not a directory: %s", protected_directory);
+        char log_buf[100];
+        snprintf(log_buf, sizeof(log_buf), "Cannot add %d inotify instances; %d of %d in use", count, first,
+                 INOTIFY_MAX_INSTANCES);
         log_message(log_buf);
         return -1;
     }
 
-    log_message("File protection system initialized successfully");
+    for (int i = 0; i < count; i++)
+    {
+        InotifyShard *shard = &inotify_shards[first + i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->root = slot;
+        shard->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (shard->fd < 0 || watch_table_init(&shard->watches, WATCH_TABLE_INITIAL_CAPACITY / (size_t)count) < 0)
+        {
+            log_message("Failed to initialize inotify");
+            perror("inotify_init1");
+            if (shard->fd >= 0)
+                close(shard->fd);
+            pthread_rwlock_destroy(&shard->lock);
+            while (i-- > 0)
+            {
+                close(inotify_shards[first + i].fd);
+                watch_table_destroy(&inotify_shards[first + i].watches);
+                pthread_rwlock_destroy(&inotify_shards[first + i].lock);
+            }
+            return -1;
+        }
+    }
+
+    root_shard_first[slot] = first;
+    root_shard_count[slot] = count;
+    atomic_store(&inotify_shard_count, first + count);
+    for (int i = 0; i < count; i++)
+    {
+        pipeline_add_shard(first + i);
+    }
     return 0;
 }
 
-void cleanup_protection_system()
+void inotify_shards_destroy(void)
 {
-    log_message("Cleaning up file protection system");
+    int count = atomic_load(&inotify_shard_count);
+    for (int i = 0; i < count; i++)
+    {
+        close(inotify_shards[i].fd);
+        watch_table_destroy(&inotify_shards[i].watches);
+        pthread_rwlock_destroy(&inotify_shards[i].lock);
+    }
+    atomic_store(&inotify_shard_count, 0);
+    memset(root_shard_count, 0, sizeof(root_shard_count));
+}
 
-    for (int i = 0; i < template_count; i++)
+// Function to copy a watch node out of its table under the read lock, and
+// its directory's path into path (MAX_PATH_LEN bytes) unless that is NULL.
+// Returns -1 if the watch descriptor is unknown.
+int inotify_shard_lookup(InotifyShard *shard, int wd, WatchInfo *out, char *path)
+{
+    int ret = -1;
+    pthread_rwlock_rdlock(&shard->lock);
+    const WatchInfo *watch = watch_table_find(&shard->watches, wd);
+    if (watch != NULL && (path == NULL || dir_tree_path(watch->dir, path, MAX_PATH_LEN) >= 0))
     {
-        free(templates[i]);
+        *out = *watch;
+        // Neither is usable once the lock is dropped; see protect_watched_file
+        out->dir_fd = -1;
+        out->dir = NULL;
+        ret = 0;
     }
+    pthread_rwlock_unlock(&shard->lock);
+    return ret;
+}
 
-    if (protection_enabled)
+// Function to build the full path of a file in a watched directory into path
+// (MAX_PATH_LEN bytes). Returns -1 if the wd is unknown.
+int inotify_shard_file_path(InotifyShard *shard, int wd, const char *name, char *path)
+{
+    pthread_rwlock_rdlock(&shard->lock);
+    const WatchInfo *watch = watch_table_find(&shard->watches, wd);
+    int ret = watch != NULL ? dir_tree_file_path(watch->dir, name, path, MAX_PATH_LEN) : -1;
+    pthread_rwlock_unlock(&shard->lock);
+    return ret < 0 ? -1 : 0;
+}
+
+// Function to check whether a file in a watched directory is protected
+// without building the directory's path unless path templates need it.
+// Returns -1 if the wd is unknown.
+int inotify_shard_protects(InotifyShard *shard, int wd, const char *name)
+{
+    pthread_rwlock_rdlock(&shard->lock);
+    const WatchInfo *watch = watch_table_find(&shard->watches, wd);
+    int protects = watch == NULL ? -1 : watch->inside_root && is_protected_in(shard->root, watch->dir, name);
+    pthread_rwlock_unlock(&shard->lock);
+    return protects;
+}
+
+InotifyShard *inotify_shard_for_fd(int fd)
+{
+    for (int i = 0; i < inotify_shard_count; i++)
     {
-        disable_protection();
+        if (inotify_shards[i].fd == fd)
+            return &inotify_shards[i];
     }
+    return NULL;
+}
 
-    log_message("File protection system cleanup completed");
+// Function to pick the instance for a directory among its root slot's
+// instances. Keying on the inode keeps a directory on the same instance when
+// it is renamed or watched again. Returns NULL if the slot has none.
+InotifyShard *inotify_shard_for_directory(int slot, const struct stat *st)
+{
+    if (slot < 0 || slot >= POLICY_MAX_ROOTS || root_shard_count[slot] == 0)
+        return NULL;
+    uint64_t h = ((uint64_t)st->st_dev * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)st->st_ino * 0xC2B2AE3D27D4EB4FULL);
+    return &inotify_shards[root_shard_first[slot] + (int)((h >> 32) % (uint64_t)root_shard_count[slot])];
+}
+
+// Function to find the watch descriptor of a directory by its inode, or -1
+int inotify_shard_find_directory(InotifyShard *shard, const struct stat *st)
+{
+    int wd = -1;
+    pthread_rwlock_rdlock(&shard->lock);
+    for (size_t i = 0; i < shard->watches.capacity && wd < 0; i++)
+    {
+        const WatchInfo *watch = &shard->watches.slots[i];
+        if (watch->wd != 0 && watch->dev == st->st_dev && watch->ino == st->st_ino)
+            wd = watch->wd;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return wd;
 }
 
 int run_protection_system()
 {
-    int fd;
-    char buffer[EVENT_BUF_LEN];
+    // Signals are taken from a signalfd by the loop: SIGHUP reloads the
+    // template file and the others shut down. They are blocked before any
+    // thread starts so every thread inherits the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
     if (initialize_protection_system() < 0)
     {
         return 1;
     }
 
-    fd = inotify_init();
-    if (fd < 0)
+    char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+    int slots[POLICY_MAX_ROOTS];
+    int root_count = policy_copy_roots(roots, slots);
+    for (int i = 0; i < root_count; i++)
     {
-        log_message("Failed to initialize inotify");
-        perror("inotify_init");
+        if (inotify_shards_add_root(slots[i]) < 0)
+        {
+            cleanup_protection_system();
+            return 1;
+        }
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epoll_fd < 0 || timer_fd < 0 || signal_fd < 0)
+    {
+        log_message("Failed to set up event loop");
+        perror("epoll/timerfd/signalfd");
+        if (signal_fd >= 0)
+            close(signal_fd);
+        if (timer_fd >= 0)
+            close(timer_fd);
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+        cleanup_protection_system();
         return 1;
     }
 
-    add_watch_recursive(fd, protected_directory);
+    // inotify is read by the event pipeline; this loop only handles commands,
+    // signals and a periodic backlog check. Commands are read without
+    // blocking (command_server.c), so a password prompt holds nothing up.
+    struct itimerspec tick = {
+        .it_interval = {.tv_sec = PIPELINE_BACKLOG_CHECK_MS / 1000,
+                        .tv_nsec = (PIPELINE_BACKLOG_CHECK_MS % 1000) * 1000000L},
+    };
+    tick.it_value = tick.it_interval;
+    timerfd_settime(timer_fd, 0, &tick, NULL);
 
-    printf("File protection system started.\n");
-    printf("Protected directory (recursive): %s\n", protected_directory);
-    print_help();
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    ev.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
 
-    while (1)
+    if (config.backend == BACKEND_FANOTIFY && fanotify_backend_start() < 0)
     {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(STDIN_FILENO, &fds);
-        FD_SET(fd, &fds);
+        printf("fanotify permission events unavailable; falling back to inotify enforcement.\n");
+        log_message("Falling back to inotify enforcement");
+    }
+
+    if (config.snapshot_dir != NULL && snapshot_store_open(config.snapshot_dir) < 0)
+    {
+        printf("Snapshot store unavailable; deleted protected files will be restored empty.\n");
+    }
 
-        int ret = select(fd + 1, &fds, NULL, NULL, NULL);
-        if (ret < 0)
+    if (config.audit_dir != NULL && audit_log_open(config.audit_dir) < 0)
+    {
+        printf("Audit log unavailable; enforcement actions are only in the text log.\n");
+    }
+
+    // A usable state index lets us skip listing directories that did not change
+    if (config.state_index_path == NULL || state_index_open(config.state_index_path) <= 0 ||
+        state_index_warm_start() < 0)
+    {
+        for (int i = 0; i < root_count; i++)
         {
-            perror("select");
-            break;
+            add_watch_tree(roots[i]);
         }
+    }
 
-        if (FD_ISSET(STDIN_FILENO, &fds))
+    if (resync_start() < 0 || pipeline_start() < 0 || command_server_start(epoll_fd) < 0 ||
+        policy_reload_start(epoll_fd) < 0)
+    {
+        policy_reload_stop();
+        pipeline_stop();
+        resync_stop();
+        printf("Failed to start the event pipeline.\n");
+        close(signal_fd);
+        close(timer_fd);
+        close(epoll_fd);
+        cleanup_protection_system();
+        return 1;
+    }
+
+    printf("File protection system started.\n");
+    for (int i = 0; i < root_count; i++)
+    {
+        printf("Protected directory (recursive): %s\n", roots[i]);
+    }
+    printf("Enforcement backend: %s\n", fanotify_backend_active() ? "fanotify (blocking) + inotify" : "inotify");
+    if (atomic_load(&inotify_shard_count) > 1)
+    {
+        printf("inotify instances: %d\n", atomic_load(&inotify_shard_count));
+    }
+    if (config.control_socket != NULL)
+    {
+        printf("Control socket: %s\n", config.control_socket);
+    }
+    print_help(stdout);
+
+    uint64_t metrics_written_ns = 0;
+    int running = 1;
+    while (running)
+    {
+        struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+        int ready = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (ready < 0)
         {
-            handle_user_input();
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
         }
 
-        if (FD_ISSET(fd, &fds))
+        for (int i = 0; i < ready && running; i++)
         {
-            handle_file_events(fd, buffer);
+            int fd = events[i].data.fd;
+            if (fd == signal_fd)
+            {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) != (ssize_t)sizeof(info))
+                    continue;
+                if (info.ssi_signo == SIGHUP)
+                {
+                    policy_request_reload("SIGHUP");
+                }
+                else
+                {
+                    char log_buf[100];
+                    snprintf(log_buf, sizeof(log_buf), "Received %s; shutting down", strsignal((int)info.ssi_signo));
+                    log_message(log_buf);
+                    printf("%s\n", log_buf);
+                    running = 0;
+                }
+            }
+            else if (fd == timer_fd)
+            {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                {
+                    perror("timerfd");
+                }
+                pipeline_check_backlog();
+                watch_moves_expire();
+                audit_log_flush();
+
+                uint64_t now_ns = metrics_now_ns();
+                if (config.metrics_path != NULL &&
+                    now_ns - metrics_written_ns >= (uint64_t)METRICS_FILE_INTERVAL_MS * 1000000ULL)
+                {
+                    if (metrics_write_file(config.metrics_path) < 0 && metrics_written_ns == 0)
+                    {
+                        char log_buf[MAX_PATH_LEN + 100];
+                        snprintf(log_buf, sizeof(log_buf), "Failed to write metrics file %s: %s",
+                                 config.metrics_path, strerror(errno));
+                        log_message(log_buf);
+                    }
+                    metrics_written_ns = now_ns;
+                }
+            }
+            else if (!policy_watch_handle(fd))
+            {
+                command_server_handle(fd, events[i].events);
+                if (atomic_load(&stop_requested))
+                {
+                    running = 0;
+                }
+            }
         }
     }
 
-    close(fd);
+    // Stop reading first; workers enforce everything already queued
+    command_server_stop();
+    policy_reload_stop();
+    pipeline_stop();
+    resync_stop();
+    close(signal_fd);
+    close(timer_fd);
+    close(epoll_fd);
     cleanup_protection_system();
 
     printf("File protection system stopped.\n");
     return 0;
 }
-
-void handle_file_events(int fd, char *buffer)
-{
-    int length = read(fd, buffer, EVENT_BUF_LEN);
-    if (length < 0)
-    {
-        log_message("Error reading inotify events");
-        perror("read");
-        return;
-    }
-
-    int i = 0;
-    while (i < length)
-    {
-        struct inotify_event *event = (struct inotify_event *)&buffer[i];
-        handle_event(fd, event);
-        i += EVENT_SIZE + event->len;
-    }
-}
@@ -0,0 +1,670 @@
+#include "file_protection.h"
+
+// Compiled form of the template patterns. Patterns are split by shape:
+//   - literal names ("secret.key") go into a hash set of exact names,
+//   - "*.ext" patterns go into a hash set of suffixes looked up at each '.',
+//   - every other glob becomes part of one combined NFA whose subsets are
+//     cached lazily as DFA states, so a name is matched in one pass,
+//   - anything the NFA cannot express ([[:alpha:]] and friends) is kept for
+//     a plain fnmatch fallback.
+// Path patterns and exclusions are skipped here; path_rules.c compiles them.
+// Matching is safe to call from several threads: DFA states are published
+// with atomic stores and only created under the matcher's mutex.
+
+#define MATCHER_WORD_BITS 64
+
+typedef enum
+{
+    GLOB_CHAR,
+    GLOB_ANY,
+    GLOB_CLASS,
+    GLOB_STAR,
+} GlobTokenType;
+
+typedef struct
+{
+    GlobTokenType type;
+    unsigned char ch;
+    uint64_t set[4];
+} GlobToken;
+
+typedef struct
+{
+    char **keys;
+    size_t capacity;
+    size_t count;
+} StringSet;
+
+typedef struct
+{
+    uint64_t *bits;
+    uint64_t hash;
+    int accepting;
+    atomic_int next[]; // indexed by byte class
+} DfaState;
+
+struct TemplateMatcher
+{
+    int match_all;
+    StringSet exact;
+    StringSet suffixes;
+
+    // Combined NFA: one bit per position, all patterns laid out back to back
+    size_t state_count;
+    size_t words;
+    uint64_t *char_masks; // 256 * words: states whose token accepts the byte
+    uint64_t *star_mask;
+    uint64_t *accept_mask;
+    uint64_t *start_set;
+
+    // Bytes no pattern tells apart share a class, which keeps DFA states small
+    unsigned char byte_class[256];
+    int class_count;
+
+    // Lazily built DFA over NFA subsets
+    DfaState **dfa;
+    atomic_int dfa_count;
+    int *dfa_index; // open-addressed: subset hash -> DFA state id
+    size_t dfa_index_capacity;
+    pthread_mutex_t dfa_lock;
+    int dfa_start;
+    int dfa_dead;
+
+    char **fallback;
+    size_t fallback_count;
+
+    MatcherStats stats;
+};
+
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int string_set_add(StringSet *set, const char *key)
+{
+    if ((set->count + 1) * 2 > set->capacity)
+    {
+        size_t new_capacity = set->capacity ? set->capacity * 2 : 16;
+        char **new_keys = calloc(new_capacity, sizeof(char *));
+        if (new_keys == NULL)
+            return -1;
+        for (size_t i = 0; i < set->capacity; i++)
+        {
+            if (set->keys[i] == NULL)
+                continue;
+            size_t slot = hash_bytes(set->keys[i], strlen(set->keys[i])) & (new_capacity - 1);
+            while (new_keys[slot] != NULL)
+                slot = (slot + 1) & (new_capacity - 1);
+            new_keys[slot] = set->keys[i];
+        }
+        free(set->keys);
+        set->keys = new_keys;
+        set->capacity = new_capacity;
+    }
+
+    size_t slot = hash_bytes(key, strlen(key)) & (set->capacity - 1);
+    while (set->keys[slot] != NULL)
+    {
+        if (strcmp(set->keys[slot], key) == 0)
+            return 0;
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    set->keys[slot] = strdup(key);
+    if (set->keys[slot] == NULL)
+        return -1;
+    set->count++;
+    return 0;
+}
+
+static int string_set_contains(const StringSet *set, const char *key, size_t len)
+{
+    if (set->count == 0)
+        return 0;
+    size_t slot = hash_bytes(key, len) & (set->capacity - 1);
+    while (set->keys[slot] != NULL)
+    {
+        if (strncmp(set->keys[slot], key, len) == 0 && set->keys[slot][len] == '\0')
+            return 1;
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    return 0;
+}
+
+static void string_set_free(StringSet *set)
+{
+    for (size_t i = 0; i < set->capacity; i++)
+    {
+        free(set->keys[i]);
+    }
+    free(set->keys);
+}
+
+static int has_glob_chars(const char *s)
+{
+    return strpbrk(s, "*?[\\") != NULL;
+}
+
+// Parse a bracket expression starting just after '['. Returns the number of
+// pattern bytes consumed including the closing ']', 0 if there is no closing
+// bracket, or -1 for syntax the NFA does not support.
+static int parse_bracket(const char *p, uint64_t set[4])
+{
+    const char *start = p;
+    int negate = 0;
+    memset(set, 0, 4 * sizeof(uint64_t));
+
+    if (*p == '!' || *p == '^')
+    {
+        negate = 1;
+        p++;
+    }
+
+    int first = 1;
+    while (*p != '\0' && (*p != ']' || first))
+    {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+            return -1;
+
+        unsigned char lo = (unsigned char)*p;
+        if (*p == '\\')
+        {
+            if (p[1] == '\0')
+                return -1;
+            lo = (unsigned char)*++p;
+        }
+        p++;
+        first = 0;
+
+        unsigned char hi = lo;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0')
+        {
+            p++;
+            if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+                return -1;
+            if (*p == '\\')
+            {
+                if (p[1] == '\0')
+                    return -1;
+                p++;
+            }
+            hi = (unsigned char)*p++;
+            if (hi < lo)
+                return -1;
+        }
+
+        for (unsigned int c = lo; c <= hi; c++)
+        {
+            set[c >> 6] |= 1ULL << (c & 63);
+        }
+    }
+
+    if (*p != ']')
+        return 0;
+
+    if (negate)
+    {
+        for (int i = 0; i < 4; i++)
+            set[i] = ~set[i];
+    }
+    // fnmatch never matches the terminating NUL, and names never contain it
+    set[0] &= ~1ULL;
+    return (int)(p - start) + 1;
+}
+
+// Tokenize a glob. Returns the token count, or -1 if it needs fnmatch.
+static int tokenize_glob(const char *pattern, GlobToken *tokens, int max_tokens)
+{
+    int n = 0;
+    const char *p = pattern;
+    while (*p != '\0')
+    {
+        if (n >= max_tokens)
+            return -1;
+
+        GlobToken *t = &tokens[n];
+        if (*p == '*')
+        {
+            // Consecutive stars are equivalent to one
+            if (n > 0 && tokens[n - 1].type == GLOB_STAR)
+            {
+                p++;
+                continue;
+            }
+            t->type = GLOB_STAR;
+            p++;
+        }
+        else if (*p == '?')
+        {
+            t->type = GLOB_ANY;
+            p++;
+        }
+        else if (*p == '[')
+        {
+            // An unterminated bracket is left to fnmatch, whose handling of
+            // it depends on what precedes it
+            int consumed = parse_bracket(p + 1, t->set);
+            if (consumed <= 0)
+                return -1;
+            t->type = GLOB_CLASS;
+            p += consumed + 1;
+        }
+        else if (*p == '\\')
+        {
+            if (p[1] == '\0')
+                return -1;
+            t->type = GLOB_CHAR;
+            t->ch = (unsigned char)p[1];
+            p += 2;
+        }
+        else
+        {
+            t->type = GLOB_CHAR;
+            t->ch = (unsigned char)*p++;
+        }
+        n++;
+    }
+    return n;
+}
+
+static inline void set_bit(uint64_t *bits, size_t i)
+{
+    bits[i / MATCHER_WORD_BITS] |= 1ULL << (i % MATCHER_WORD_BITS);
+}
+
+// Follow '*' epsilon edges: a star position also means "star matched nothing"
+static void nfa_closure(const TemplateMatcher *m, uint64_t *set)
+{
+    uint64_t carry = 0;
+    for (size_t w = 0; w < m->words; w++)
+    {
+        uint64_t stars = set[w] & m->star_mask[w];
+        uint64_t shifted = (stars << 1) | carry;
+        carry = stars >> (MATCHER_WORD_BITS - 1);
+        set[w] |= shifted;
+    }
+}
+
+static void nfa_step(const TemplateMatcher *m, const uint64_t *from, uint64_t *to, unsigned char c)
+{
+    const uint64_t *mask = &m->char_masks[(size_t)c * m->words];
+    uint64_t carry = 0;
+    for (size_t w = 0; w < m->words; w++)
+    {
+        uint64_t advance = from[w] & mask[w];
+        to[w] = (advance << 1) | carry | (from[w] & m->star_mask[w]);
+        carry = advance >> (MATCHER_WORD_BITS - 1);
+    }
+    nfa_closure(m, to);
+}
+
+static int nfa_accepting(const TemplateMatcher *m, const uint64_t *set)
+{
+    for (size_t w = 0; w < m->words; w++)
+    {
+        if (set[w] & m->accept_mask[w])
+            return 1;
+    }
+    return 0;
+}
+
+// Find or create the DFA state for an NFA subset. Called with dfa_lock held.
+// Returns -1 once the DFA cache is full; callers then simulate the NFA.
+static int dfa_intern(TemplateMatcher *m, const uint64_t *set)
+{
+    uint64_t hash = hash_bytes(set, m->words * sizeof(uint64_t));
+    size_t mask = m->dfa_index_capacity - 1;
+    size_t slot = hash & mask;
+    while (m->dfa_index[slot] >= 0)
+    {
+        DfaState *s = m->dfa[m->dfa_index[slot]];
+        if (s->hash == hash && memcmp(s->bits, set, m->words * sizeof(uint64_t)) == 0)
+            return m->dfa_index[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    int id = atomic_load_explicit(&m->dfa_count, memory_order_relaxed);
+    if (id >= MATCHER_DFA_MAX_STATES)
+        return -1;
+
+    DfaState *s = malloc(sizeof(DfaState) + (size_t)m->class_count * sizeof(atomic_int));
+    if (s == NULL)
+        return -1;
+    s->bits = malloc(m->words * sizeof(uint64_t));
+    if (s->bits == NULL)
+    {
+        free(s);
+        return -1;
+    }
+    memcpy(s->bits, set, m->words * sizeof(uint64_t));
+    s->hash = hash;
+    s->accepting = nfa_accepting(m, set);
+    for (int c = 0; c < m->class_count; c++)
+    {
+        atomic_init(&s->next[c], -1);
+    }
+
+    m->dfa[id] = s;
+    m->dfa_index[slot] = id;
+    atomic_store_explicit(&m->dfa_count, id + 1, memory_order_release);
+    m->stats.dfa_states = (size_t)id + 1;
+    return id;
+}
+
+static int dfa_transition(TemplateMatcher *m, int state, unsigned char c)
+{
+    DfaState *s = m->dfa[state];
+    int cls = m->byte_class[c];
+    int next = atomic_load_explicit(&s->next[cls], memory_order_acquire);
+    if (next >= 0)
+        return next;
+
+    uint64_t stack_set[64];
+    uint64_t *to = m->words <= 64 ? stack_set : malloc(m->words * sizeof(uint64_t));
+    if (to == NULL)
+        return -1;
+    nfa_step(m, s->bits, to, c);
+
+    pthread_mutex_lock(&m->dfa_lock);
+    next = dfa_intern(m, to);
+    if (next >= 0)
+        atomic_store_explicit(&s->next[cls], next, memory_order_release);
+    pthread_mutex_unlock(&m->dfa_lock);
+
+    if (to != stack_set)
+        free(to);
+    return next;
+}
+
+static int nfa_match(const TemplateMatcher *m, const uint64_t *start, const char *name)
+{
+    uint64_t *cur = malloc(2 * m->words * sizeof(uint64_t));
+    if (cur == NULL)
+        return 0;
+    uint64_t *next = cur + m->words;
+    memcpy(cur, start, m->words * sizeof(uint64_t));
+
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        nfa_step(m, cur, next, *p);
+        uint64_t *tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    int matched = nfa_accepting(m, cur);
+    free(cur < next ? cur : next);
+    return matched;
+}
+
+static int glob_match(TemplateMatcher *m, const char *name)
+{
+    if (m->state_count == 0)
+        return 0;
+
+    int state = m->dfa_start;
+    const unsigned char *p = (const unsigned char *)name;
+    while (*p)
+    {
+        int next = dfa_transition(m, state, *p);
+        if (next < 0)
+        {
+            // DFA cache exhausted: finish this name on the NFA directly
+            return nfa_match(m, m->dfa[state]->bits, (const char *)p);
+        }
+        if (next == m->dfa_dead)
+            return 0;
+        state = next;
+        p++;
+    }
+    return m->dfa[state]->accepting;
+}
+
+static int compile_globs(TemplateMatcher *m, char **globs, size_t glob_count)
+{
+    GlobToken tokens[MAX_FILENAME_LEN];
+    size_t total = 0;
+
+    // First pass sizes the NFA; patterns the NFA cannot express are set aside
+    int *lengths = malloc((glob_count ? glob_count : 1) * sizeof(int));
+    if (lengths == NULL)
+        return -1;
+    for (size_t i = 0; i < glob_count; i++)
+    {
+        lengths[i] = tokenize_glob(globs[i], tokens, MAX_FILENAME_LEN);
+        if (lengths[i] < 0)
+        {
+            m->fallback[m->fallback_count++] = strdup(globs[i]);
+            continue;
+        }
+        total += (size_t)lengths[i] + 1;
+    }
+
+    m->state_count = total;
+    m->words = (total + MATCHER_WORD_BITS - 1) / MATCHER_WORD_BITS;
+    if (m->words == 0)
+    {
+        free(lengths);
+        return 0;
+    }
+
+    m->char_masks = calloc(256 * m->words, sizeof(uint64_t));
+    m->star_mask = calloc(m->words, sizeof(uint64_t));
+    m->accept_mask = calloc(m->words, sizeof(uint64_t));
+    m->start_set = calloc(m->words, sizeof(uint64_t));
+    m->dfa = calloc(MATCHER_DFA_MAX_STATES, sizeof(DfaState *));
+    m->dfa_index_capacity = 1;
+    while (m->dfa_index_capacity < MATCHER_DFA_MAX_STATES * 2)
+        m->dfa_index_capacity <<= 1;
+    m->dfa_index = malloc(m->dfa_index_capacity * sizeof(int));
+    if (!m->char_masks || !m->star_mask || !m->accept_mask || !m->start_set || !m->dfa || !m->dfa_index)
+    {
+        free(lengths);
+        return -1;
+    }
+    memset(m->dfa_index, 0xff, m->dfa_index_capacity * sizeof(int));
+
+    size_t base = 0;
+    for (size_t i = 0; i < glob_count; i++)
+    {
+        if (lengths[i] < 0)
+            continue;
+        tokenize_glob(globs[i], tokens, MAX_FILENAME_LEN);
+        for (int t = 0; t < lengths[i]; t++)
+        {
+            size_t state = base + (size_t)t;
+            switch (tokens[t].type)
+            {
+            case GLOB_STAR:
+                set_bit(m->star_mask, state);
+                break;
+            case GLOB_ANY:
+                for (int c = 1; c < 256; c++)
+                    set_bit(&m->char_masks[(size_t)c * m->words], state);
+                break;
+            case GLOB_CHAR:
+                set_bit(&m->char_masks[(size_t)tokens[t].ch * m->words], state);
+                break;
+            case GLOB_CLASS:
+                for (int c = 1; c < 256; c++)
+                {
+                    if (tokens[t].set[c >> 6] & (1ULL << (c & 63)))
+                        set_bit(&m->char_masks[(size_t)c * m->words], state);
+                }
+                break;
+            }
+        }
+        set_bit(m->start_set, base);
+        set_bit(m->accept_mask, base + (size_t)lengths[i]);
+        base += (size_t)lengths[i] + 1;
+    }
+    free(lengths);
+
+    // Group bytes whose columns in char_masks are identical
+    uint64_t row_hash[256];
+    m->class_count = 0;
+    for (int c = 0; c < 256; c++)
+    {
+        const uint64_t *row = &m->char_masks[(size_t)c * m->words];
+        row_hash[c] = hash_bytes(row, m->words * sizeof(uint64_t));
+        int cls = -1;
+        for (int prev = 0; prev < c && cls < 0; prev++)
+        {
+            if (row_hash[prev] == row_hash[c] &&
+                memcmp(&m->char_masks[(size_t)prev * m->words], row, m->words * sizeof(uint64_t)) == 0)
+                cls = m->byte_class[prev];
+        }
+        m->byte_class[c] = (unsigned char)(cls >= 0 ? cls : m->class_count++);
+    }
+
+    nfa_closure(m, m->start_set);
+    m->dfa_start = dfa_intern(m, m->start_set);
+
+    // The empty subset can never accept; reaching it ends a match early
+    uint64_t *empty = calloc(m->words, sizeof(uint64_t));
+    if (empty == NULL)
+        return -1;
+    m->dfa_dead = dfa_intern(m, empty);
+    free(empty);
+    return m->dfa_start < 0 || m->dfa_dead < 0 ? -1 : 0;
+}
+
+TemplateMatcher *matcher_compile(char **patterns, int count)
+{
+    TemplateMatcher *m = calloc(1, sizeof(TemplateMatcher));
+    if (m == NULL)
+        return NULL;
+    pthread_mutex_init(&m->dfa_lock, NULL);
+    atomic_init(&m->dfa_count, 0);
+
+    char **globs = malloc((count > 0 ? (size_t)count : 1) * sizeof(char *));
+    m->fallback = malloc((count > 0 ? (size_t)count : 1) * sizeof(char *));
+    if (globs == NULL || m->fallback == NULL)
+    {
+        free(globs);
+        matcher_free(m);
+        return NULL;
+    }
+
+    size_t glob_count = 0;
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++)
+    {
+        const char *p = patterns[i];
+        if (*p == '\0' || path_rules_handles(p))
+            continue;
+
+        if (strspn(p, "*") == strlen(p))
+        {
+            m->match_all = 1;
+        }
+        else if (!has_glob_chars(p))
+        {
+            failed = string_set_add(&m->exact, p) < 0;
+        }
+        else if (p[0] == '*' && p[1] == '.' && !has_glob_chars(p + 1))
+        {
+            failed = string_set_add(&m->suffixes, p + 1) < 0;
+        }
+        else
+        {
+            globs[glob_count++] = patterns[i];
+        }
+    }
+
+    if (failed || compile_globs(m, globs, glob_count) < 0)
+    {
+        free(globs);
+        matcher_free(m);
+        return NULL;
+    }
+    free(globs);
+
+    m->stats.match_all = m->match_all;
+    m->stats.exact = m->exact.count;
+    m->stats.suffixes = m->suffixes.count;
+    m->stats.globs = glob_count - m->fallback_count;
+    m->stats.fallback = m->fallback_count;
+    m->stats.nfa_states = m->state_count;
+    m->stats.byte_classes = (size_t)m->class_count;
+    return m;
+}
+
+// Function to check whether a file name matches any compiled template
+int matcher_match(TemplateMatcher *m, const char *name)
+{
+    if (m == NULL)
+        return 0;
+    if (m->match_all)
+        return 1;
+
+    size_t len = strlen(name);
+    if (string_set_contains(&m->exact, name, len))
+        return 1;
+
+    if (m->suffixes.count > 0)
+    {
+        for (const char *dot = strchr(name, '.'); dot != NULL; dot = strchr(dot + 1, '.'))
+        {
+            if (string_set_contains(&m->suffixes, dot, len - (size_t)(dot - name)))
+                return 1;
+        }
+    }
+
+    if (glob_match(m, name))
+        return 1;
+
+    for (size_t i = 0; i < m->fallback_count; i++)
+    {
+        if (fnmatch(m->fallback[i], name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+void matcher_get_stats(TemplateMatcher *m, MatcherStats *stats)
+{
+    if (m == NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    pthread_mutex_lock(&m->dfa_lock);
+    *stats = m->stats;
+    pthread_mutex_unlock(&m->dfa_lock);
+}
+
+void matcher_free(TemplateMatcher *m)
+{
+    if (m == NULL)
+        return;
+
+    string_set_free(&m->exact);
+    string_set_free(&m->suffixes);
+    int dfa_count = atomic_load(&m->dfa_count);
+    for (int i = 0; i < dfa_count; i++)
+    {
+        free(m->dfa[i]->bits);
+        free(m->dfa[i]);
+    }
+    free(m->dfa);
+    free(m->dfa_index);
+    free(m->char_masks);
+    free(m->star_mask);
+    free(m->accept_mask);
+    free(m->start_set);
+    for (size_t i = 0; i < m->fallback_count; i++)
+    {
+        free(m->fallback[i]);
+    }
+    free(m->fallback);
+    pthread_mutex_destroy(&m->dfa_lock);
+    free(m);
+}
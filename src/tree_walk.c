@@ -0,0 +1,582 @@
+#include "file_protection.h"
+
+// Parallel directory traversal shared by watch installation and protection
+// sweeps. Callers supply a TreeVisitor that is handed every directory and,
+// in batches, the regular files listed in it. Each worker owns a deque of
+// pending directories: it pushes and pops at the tail (depth first, good
+// locality) while idle workers steal from the head of someone else's deque.
+// Directories are listed with getdents64 into a large buffer, subdirectories
+// are opened with openat relative to their already-open parent, and entries
+// whose d_type is DT_UNKNOWN are classified with statx.
+
+typedef struct
+{
+    char *path;
+    int fd;       // Already open directory fd, or -1 to open by path
+    int verified; // Reached without following a symlink from a verified parent
+} WalkItem;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    WalkItem *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} WalkDeque;
+
+typedef struct
+{
+    const TreeVisitor *visitor;
+    int worker_count;
+    WalkDeque *deques;
+    atomic_long pending;
+    atomic_int open_fds;
+    atomic_long directories;
+    atomic_long entries;
+    atomic_long failures;
+} TreeWalk;
+
+typedef struct
+{
+    atomic_long watches;
+} WatchWalk;
+
+typedef struct
+{
+    TreeWalk *walk;
+    int index;
+} WalkWorker;
+
+// Resolve the canonical location of an open directory. Going through the fd
+// rather than the path means a concurrent symlink swap cannot redirect us.
+int resolve_directory_fd(int dir_fd, const char *path, char *resolved)
+{
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dir_fd);
+    ssize_t len = readlink(proc_path, resolved, MAX_PATH_LEN - 1);
+    if (len > 0)
+    {
+        resolved[len] = '\0';
+        return 0;
+    }
+    // /proc may not be mounted; fall back to resolving the path itself
+    return realpath(path, resolved) != NULL ? 0 : -1;
+}
+
+static int deque_push(WalkDeque *deque, WalkItem item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == deque->capacity)
+    {
+        size_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+        WalkItem *new_items = malloc(new_capacity * sizeof(WalkItem));
+        if (new_items == NULL)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        size_t count = deque->tail - deque->head;
+        for (size_t i = 0; i < count; i++)
+        {
+            new_items[i] = deque->items[(deque->head + i) & (deque->capacity - 1)];
+        }
+        free(deque->items);
+        deque->items = new_items;
+        deque->capacity = new_capacity;
+        deque->head = 0;
+        deque->tail = count;
+    }
+    deque->items[deque->tail & (deque->capacity - 1)] = item;
+    deque->tail++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static int deque_pop(WalkDeque *deque, WalkItem *item)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        deque->tail--;
+        *item = deque->items[deque->tail & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int deque_steal(WalkDeque *deque, WalkItem *item)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        *item = deque->items[deque->head & (deque->capacity - 1)];
+        deque->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void walk_enqueue(TreeWalk *walk, int worker, char *path, int fd, int verified)
+{
+    WalkItem item = {.path = path, .fd = fd, .verified = verified};
+    atomic_fetch_add(&walk->pending, 1);
+    if (deque_push(&walk->deques[worker], item) < 0)
+    {
+        atomic_fetch_sub(&walk->pending, 1);
+        atomic_fetch_add(&walk->failures, 1);
+        log_message("Memory allocation failed while queueing directory for watching");
+        if (fd >= 0)
+        {
+            close(fd);
+            atomic_fetch_sub(&walk->open_fds, 1);
+        }
+        free(path);
+    }
+}
+
+// Function to check a resolved directory against the walk's containment root
+static int walk_contains(const TreeVisitor *visitor, const char *resolved)
+{
+    if (visitor->root != NULL)
+        return is_path_within(visitor->root, resolved);
+
+    policy_read_lock();
+    int inside = policy_root_for_path(policy_current(), resolved) != NULL;
+    policy_read_unlock();
+    return inside;
+}
+
+// Install the watch for one directory and queue its subdirectories
+static void walk_directory(TreeWalk *walk, int worker, WalkItem *item, char *buffer)
+{
+    int dir_fd = item->fd;
+    if (dir_fd >= 0)
+    {
+        atomic_fetch_sub(&walk->open_fds, 1);
+    }
+    else
+    {
+        dir_fd = openat(AT_FDCWD, item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir_fd < 0)
+        {
+            char log_buf[MAX_PATH_LEN + 100];
+            snprintf(log_buf, sizeof(log_buf), "Failed to open directory for watching: %s", item->path);
+            log_message(log_buf);
+            atomic_fetch_add(&walk->failures, 1);
+            return;
+        }
+    }
+
+    // Containment is decided once here, so per-event checks need no realpath
+    char resolved[MAX_PATH_LEN];
+    struct stat st;
+    if ((!item->verified && (resolve_directory_fd(dir_fd, item->path, resolved) < 0 ||
+                             !walk_contains(walk->visitor, resolved))) ||
+        fstat(dir_fd, &st) < 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Skipping directory outside protected tree: %s", item->path);
+        log_message(log_buf);
+        close(dir_fd);
+        return;
+    }
+
+    if (walk->visitor->visit_directory != NULL &&
+        walk->visitor->visit_directory(walk->visitor->ctx, dir_fd, item->path, &st) < 0)
+    {
+        close(dir_fd);
+        return;
+    }
+
+    size_t path_len = strlen(item->path);
+    long entries = 0;
+    const char *files[TREE_WALK_FILE_BATCH];
+    size_t file_count = 0;
+    for (;;)
+    {
+        ssize_t nread = getdents64(dir_fd, buffer, TREE_WALK_BUF_LEN);
+        if (nread <= 0)
+        {
+            if (nread < 0)
+            {
+                char log_buf[MAX_PATH_LEN + 100];
+                snprintf(log_buf, sizeof(log_buf), "Failed to list directory %s: %s", item->path, strerror(errno));
+                log_message(log_buf);
+            }
+            break;
+        }
+
+        for (ssize_t pos = 0; pos < nread;)
+        {
+            struct dirent64 *entry = (struct dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+            entries++;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                // Some filesystems never fill in d_type
+                struct statx stx;
+                if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE, &stx) == 0)
+                {
+                    type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+                }
+            }
+
+            if (type == DT_REG && walk->visitor->visit_files != NULL)
+            {
+                // Names point into the getdents buffer, so the batch is
+                // handed over before the buffer is refilled
+                files[file_count++] = name;
+                if (file_count == TREE_WALK_FILE_BATCH)
+                {
+                    walk->visitor->visit_files(walk->visitor->ctx, dir_fd, item->path, files, file_count);
+                    file_count = 0;
+                }
+                continue;
+            }
+            if (type != DT_DIR)
+                continue;
+
+            size_t name_len = strlen(name);
+            if (path_len + 1 + name_len >= MAX_PATH_LEN)
+            {
+                char log_buf[MAX_PATH_LEN + 100];
+                snprintf(log_buf, sizeof(log_buf), "Path too long to walk under: %s", item->path);
+                log_message(log_buf);
+                continue;
+            }
+            char *child = malloc(path_len + name_len + 2);
+            if (child == NULL)
+            {
+                log_message("Memory allocation failed while walking directory tree");
+                atomic_fetch_add(&walk->failures, 1);
+                continue;
+            }
+            memcpy(child, item->path, path_len);
+            child[path_len] = '/';
+            memcpy(child + path_len + 1, name, name_len + 1);
+
+            // Open the child relative to its parent while the parent is open;
+            // past the fd budget it is reopened by path and verified then
+            int child_fd = -1;
+            if (atomic_fetch_add(&walk->open_fds, 1) < TREE_WALK_MAX_OPEN_FDS)
+            {
+                child_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            }
+            if (child_fd < 0)
+            {
+                atomic_fetch_sub(&walk->open_fds, 1);
+            }
+            walk_enqueue(walk, worker, child, child_fd, child_fd >= 0);
+        }
+
+        if (file_count > 0)
+        {
+            walk->visitor->visit_files(walk->visitor->ctx, dir_fd, item->path, files, file_count);
+            file_count = 0;
+        }
+    }
+
+    close(dir_fd);
+    atomic_fetch_add(&walk->directories, 1);
+    atomic_fetch_add(&walk->entries, entries);
+}
+
+static void *walk_worker(void *arg)
+{
+    WalkWorker *self = arg;
+    TreeWalk *walk = self->walk;
+    char *buffer = malloc(TREE_WALK_BUF_LEN);
+    if (buffer == NULL)
+    {
+        log_message("Memory allocation failed for directory buffer");
+        return NULL;
+    }
+
+    unsigned int victim = (unsigned int)self->index;
+    for (;;)
+    {
+        WalkItem item;
+        int found = deque_pop(&walk->deques[self->index], &item);
+        for (int attempt = 1; !found && attempt < walk->worker_count; attempt++)
+        {
+            victim = (victim + 1) % (unsigned int)walk->worker_count;
+            if ((int)victim != self->index)
+                found = deque_steal(&walk->deques[victim], &item);
+        }
+
+        if (found)
+        {
+            if (walk->visitor->cancel != NULL && atomic_load(walk->visitor->cancel))
+            {
+                // Cancelled: drain the queue without visiting anything
+                if (item.fd >= 0)
+                {
+                    close(item.fd);
+                    atomic_fetch_sub(&walk->open_fds, 1);
+                }
+            }
+            else
+            {
+                walk_directory(walk, self->index, &item, buffer);
+            }
+            free(item.path);
+            // Children were queued before this decrement, so pending only
+            // reaches zero once the whole tree is done
+            atomic_fetch_sub(&walk->pending, 1);
+            continue;
+        }
+
+        if (atomic_load(&walk->pending) == 0)
+            break;
+        // Nothing to steal right now; back off briefly instead of spinning
+        struct timespec backoff = {.tv_sec = 0, .tv_nsec = TREE_WALK_IDLE_NS};
+        nanosleep(&backoff, NULL);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Walk the tree under path with the given number of threads, handing every
+// directory and regular file to the visitor. Progress is printed using the
+// visitor's label when report_progress is set.
+int walk_tree(const char *path, const TreeVisitor *visitor, int threads, int report_progress, TreeWalkStats *stats)
+{
+    TreeWalk walk = {.visitor = visitor, .worker_count = threads > 0 ? threads : 1};
+    atomic_init(&walk.pending, 0);
+    atomic_init(&walk.open_fds, 0);
+    atomic_init(&walk.directories, 0);
+    atomic_init(&walk.entries, 0);
+    atomic_init(&walk.failures, 0);
+
+    walk.deques = calloc((size_t)walk.worker_count, sizeof(WalkDeque));
+    WalkWorker *workers = calloc((size_t)walk.worker_count, sizeof(WalkWorker));
+    pthread_t *tids = calloc((size_t)walk.worker_count, sizeof(pthread_t));
+    char *root = strdup(path);
+    if (walk.deques == NULL || workers == NULL || tids == NULL || root == NULL)
+    {
+        log_message("Memory allocation failed while starting directory walk");
+        free(walk.deques);
+        free(workers);
+        free(tids);
+        free(root);
+        return -1;
+    }
+    for (int i = 0; i < walk.worker_count; i++)
+    {
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+        workers[i].walk = &walk;
+        workers[i].index = i;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    walk_enqueue(&walk, 0, root, -1, 0);
+
+    int started = 0;
+    if (walk.worker_count > 1)
+    {
+        for (int i = 0; i < walk.worker_count; i++)
+        {
+            if (pthread_create(&tids[i], NULL, walk_worker, &workers[i]) != 0)
+                break;
+            started++;
+        }
+    }
+    if (started == 0)
+    {
+        // Single-threaded walk, or no threads available: walk on this thread
+        walk_worker(&workers[0]);
+    }
+
+    // Poll for completion often, but only print progress periodically
+    long polls = 0;
+    while (started > 0 && report_progress && atomic_load(&walk.pending) > 0)
+    {
+        struct timespec interval = {.tv_sec = 0, .tv_nsec = TREE_WALK_POLL_MS * 1000000L};
+        nanosleep(&interval, NULL);
+        if (atomic_load(&walk.pending) == 0 || ++polls % (TREE_WALK_PROGRESS_MS / TREE_WALK_POLL_MS) != 0)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        printf("%s: %ld directories, %ld entries scanned (%.1fs)\n", visitor->label,
+               atomic_load(&walk.directories), atomic_load(&walk.entries),
+               (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (stats != NULL)
+    {
+        stats->directories = atomic_load(&walk.directories);
+        stats->entries = atomic_load(&walk.entries);
+        stats->failures = atomic_load(&walk.failures);
+        stats->threads = walk.worker_count;
+        stats->cancelled = visitor->cancel != NULL && atomic_load(visitor->cancel);
+        stats->elapsed = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+
+    for (int i = 0; i < walk.worker_count; i++)
+    {
+        pthread_mutex_destroy(&walk.deques[i].lock);
+        free(walk.deques[i].items);
+    }
+    free(walk.deques);
+    free(workers);
+    free(tids);
+    return 0;
+}
+
+// Function to choose the number of walker threads from the configuration
+int tree_walk_threads(void)
+{
+    int threads = config.walk_threads;
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+        if (threads > TREE_WALK_MAX_THREADS)
+            threads = TREE_WALK_MAX_THREADS;
+    }
+    return threads;
+}
+
+// Install an inotify (and fanotify, if active) watch on one open directory
+// already known to lie inside a protected tree. The tree's root slot decides
+// which instances may watch it, and the directory's inode which of those.
+// Returns 1 without watching if the templates let its subtree be skipped.
+int watch_directory_at(int dir_fd, const char *path, const struct stat *st)
+{
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_path(policy_current(), path);
+    int pruned = root != NULL && policy_prunes_directory(root, path);
+    InotifyShard *shard = root != NULL ? inotify_shard_for_directory(root->slot, st) : NULL;
+    policy_read_unlock();
+    if (pruned)
+        return 1;
+    if (shard == NULL)
+        return -1;
+
+    // The watch goes on the inode behind dir_fd, which the caller checked;
+    // path may name another directory by now
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", dir_fd);
+    int wd = inotify_add_watch(shard->fd, fd_path, WATCH_EVENT_MASK | IN_ONLYDIR);
+    if (wd < 0 && errno == ENOENT)
+    {
+        // /proc may not be mounted; watch the path, then make sure it still
+        // named the directory behind dir_fd
+        wd = inotify_add_watch(shard->fd, path, WATCH_EVENT_MASK | IN_DONT_FOLLOW | IN_ONLYDIR);
+        struct stat fd_st, path_st;
+        if (wd >= 0 && (fstat(dir_fd, &fd_st) < 0 || lstat(path, &path_st) < 0 || fd_st.st_dev != path_st.st_dev ||
+                        fd_st.st_ino != path_st.st_ino))
+        {
+            // A wd we already hold belongs to another watched directory
+            pthread_rwlock_rdlock(&shard->lock);
+            int known = watch_table_find(&shard->watches, wd) != NULL;
+            pthread_rwlock_unlock(&shard->lock);
+            if (!known)
+                inotify_rm_watch(shard->fd, wd);
+            wd = -1;
+            errno = ESTALE;
+        }
+    }
+    if (wd < 0)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to add watch for %s: %s", path, strerror(errno));
+        log_message(log_buf);
+        return -1;
+    }
+
+    // Opened outside the lock; a node that already holds one for this
+    // inode keeps it
+    int watch_fd = watch_dir_fd_open(dir_fd);
+    pthread_rwlock_wrlock(&shard->lock);
+    WatchInfo *watch = watch_table_insert(&shard->watches, wd, path);
+    if (watch != NULL)
+    {
+        if (watch->dir_fd < 0 || watch->dev != st->st_dev || watch->ino != st->st_ino)
+        {
+            int stale = watch->dir_fd;
+            watch->dir_fd = watch_fd;
+            watch_fd = stale;
+        }
+        watch->dev = st->st_dev;
+        watch->ino = st->st_ino;
+        watch->inside_root = 1;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    watch_dir_fd_close(watch_fd);
+
+    if (watch == NULL)
+    {
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Failed to record watch for %s", path);
+        log_message(log_buf);
+        inotify_rm_watch(shard->fd, wd);
+        return -1;
+    }
+
+    fanotify_backend_add_directory(dir_fd, path);
+    state_index_record_directory(dir_fd, path, st);
+    return 0;
+}
+
+static int watch_directory(void *ctx, int dir_fd, const char *path, const struct stat *st)
+{
+    WatchWalk *watch_walk = ctx;
+    int ret = watch_directory_at(dir_fd, path, st);
+    if (ret == 0)
+    {
+        atomic_fetch_add(&watch_walk->watches, 1);
+    }
+    return ret > 0 ? -1 : 0;
+}
+
+static void watch_tree(const char *path, int threads, int report_progress)
+{
+    WatchWalk watch_walk;
+    atomic_init(&watch_walk.watches, 0);
+    TreeVisitor visitor = {
+        .label = "Installing watches",
+        .visit_directory = watch_directory,
+        .ctx = &watch_walk,
+    };
+
+    TreeWalkStats stats;
+    if (walk_tree(path, &visitor, threads, report_progress, &stats) < 0 || !report_progress)
+        return;
+
+    char log_buf[MAX_PATH_LEN + 200];
+    snprintf(log_buf, sizeof(log_buf),
+             "Watched %ld directories (%ld entries scanned, %ld failures) under %s in %.3fs with %d threads",
+             atomic_load(&watch_walk.watches), stats.entries, stats.failures, path, stats.elapsed, stats.threads);
+    log_message(log_buf);
+    printf("%s\n", log_buf);
+}
+
+// add_watch_recursive function to add a watch recursively on the calling thread
+void add_watch_recursive(const char *path)
+{
+    watch_tree(path, 1, 0);
+}
+
+// Function to install watches on a whole tree using the configured thread count
+void add_watch_tree(const char *path)
+{
+    watch_tree(path, tree_walk_threads(), 1);
+}
@@ -1,16 +1,22 @@
 #include "file_protection.h"
 
-void print_help()
+void print_help(FILE *out)
 {
-    printf("\n=== File Protection System ===\n");
-    printf("Available commands:\n");
-    printf("  help    - Show this help message\n");
-    printf("  enable  - Enable file protection\n");
-    printf("  disable - Disable file protection (requires password)\n");
-    printf("  change  - Change password\n");
-    printf("  status  - Show current protection status\n");
-    printf("  stop    - Stop the program\n");
-    printf("==============================\n\n");
+    fprintf(out, "\n=== File Protection System ===\n");
+    fprintf(out, "Available commands:\n");
+    fprintf(out, "  help    - Show this help message\n");
+    fprintf(out, "  enable  - Enable file protection and protect existing files\n");
+    fprintf(out, "  disable - Disable file protection (requires password)\n");
+    fprintf(out, "  cancel  - Cancel a running enable/disable sweep or verify\n");
+    fprintf(out, "  verify  - Check protected files against their recorded contents\n");
+    fprintf(out, "            ('verify restore' restores changed files from snapshots,\n");
+    fprintf(out, "             'verify accept' records the current contents, requires password)\n");
+    fprintf(out, "  change  - Change password\n");
+    fprintf(out, "  status  - Show current protection status\n");
+    fprintf(out, "  stats   - Show event counters and enforcement latency\n");
+    fprintf(out, "  reload  - Reload the protected directory and templates from %s\n", TEMPLATE_FILE);
+    fprintf(out, "  stop    - Stop the program\n");
+    fprintf(out, "==============================\n\n");
 }
 
 // Function to check if the provided password matches the stored hash
@@ -70,162 +76,469 @@ int change_password(const char *old_password, const char *new_password)
     return 0;
 }
 
-void handle_user_input()
+// Function to start a verify run and tell the operator where its result goes
+static void start_verify(VerifyMode mode, FILE *out)
 {
-    char cmd[20];
-    if (fgets(cmd, sizeof(cmd), stdin))
+    if (config.manifest_path == NULL)
     {
-        cmd[strcspn(cmd, "\n")] = 0; // Remove newline
-        if (strcmp(cmd, "help") == 0)
-        {
-            print_help();
-        }
-        else if (strcmp(cmd, "enable") == 0)
+        fprintf(out, "Integrity verification is off (--manifest none).\n");
+    }
+    else if (verify_start(mode) < 0)
+    {
+        fprintf(out, "Integrity verification is already running. Use 'cancel' to stop it.\n");
+    }
+    else
+    {
+        fprintf(out, "Verifying protected files against %s in the background. See 'status' for progress.\n",
+                config.manifest_path);
+    }
+}
+
+// Function to run one line of input from a session. Commands that ask for a
+// password keep their place in the session's state, so the next line is the
+// answer; nothing here waits for input.
+void handle_command(CommandSession *session, const char *line, FILE *out)
+{
+    switch (session->state)
+    {
+    case SESSION_DISABLE_PASSWORD:
+        session->state = SESSION_AUTHENTICATING;
+        if (auth_submit(session, AUTH_DISABLE, line, NULL) < 0)
         {
-            protection_enabled = 1;
-            printf("Protection enabled.\n");
-            log_message("Protection enabled");
+            session->state = SESSION_COMMAND;
+            fprintf(out, "Could not check the password.\n");
         }
-        else if (strcmp(cmd, "disable") == 0)
+        return;
+    case SESSION_ACCEPT_PASSWORD:
+        session->state = SESSION_AUTHENTICATING;
+        if (auth_submit(session, AUTH_VERIFY_ACCEPT, line, NULL) < 0)
         {
-            if (authenticate_user())
-            {
-                disable_protection();
-            }
+            session->state = SESSION_COMMAND;
+            fprintf(out, "Could not check the password.\n");
         }
-        else if (strcmp(cmd, "change") == 0)
+        return;
+    case SESSION_CHANGE_OLD:
+        snprintf(session->old_password, sizeof(session->old_password), "%s", line);
+        session->state = SESSION_CHANGE_NEW;
+        fprintf(out, "Enter new password: ");
+        return;
+    case SESSION_CHANGE_NEW:
+        session->state = SESSION_AUTHENTICATING;
+        if (auth_submit(session, AUTH_CHANGE, session->old_password, line) < 0)
         {
-            change_password_interactive();
+            session->state = SESSION_COMMAND;
+            fprintf(out, "Failed to change password.\n");
         }
-        else if (strcmp(cmd, "status") == 0)
+        explicit_bzero(session->old_password, sizeof(session->old_password));
+        return;
+    case SESSION_AUTHENTICATING:
+    case SESSION_COMMAND:
+        break;
+    }
+
+    if (strcmp(line, "help") == 0)
+    {
+        print_help(out);
+    }
+    else if (strcmp(line, "enable") == 0)
+    {
+        enable_protection(out);
+    }
+    else if (strcmp(line, "disable") == 0)
+    {
+        session->state = SESSION_DISABLE_PASSWORD;
+        fprintf(out, "Enter password: ");
+    }
+    else if (strcmp(line, "cancel") == 0)
+    {
+        SweepStatus sweep_status;
+        VerifyStatus verify_status;
+        int sweeping = sweep_get_status(&sweep_status) == 0 && sweep_status.running;
+        int verifying = verify_get_status(&verify_status) == 0 && verify_status.running;
+        if (sweeping)
         {
-            print_status();
+            sweep_cancel();
+            fprintf(out, "Cancelling protection sweep...\n");
+            log_message("Protection sweep cancellation requested");
         }
-        else if (strcmp(cmd, "stop") == 0)
+        if (verifying)
         {
-            printf("Stopping file protection system...\n");
-            log_message("Stopping file protection system");
-            exit(0);
+            verify_cancel();
+            fprintf(out, "Cancelling integrity verification...\n");
+            log_message("Integrity verification cancellation requested");
         }
-        else
+        if (!sweeping && !verifying)
         {
-            printf("Unknown command. Type 'help' for available commands.\n");
-            char log_buf[MAX_PATH_LEN + 100];
-            create_log_buffer(log_buf, sizeof(log_buf), "Unknown command entered: %s", cmd);
-            log_message(log_buf);
+            fprintf(out, "No protection sweep or verification is running.\n");
         }
     }
+    else if (strcmp(line, "verify") == 0 || strcmp(line, "verify restore") == 0)
+    {
+        start_verify(line[6] == '\0' ? VERIFY_REPORT : VERIFY_RESTORE, out);
+    }
+    else if (strcmp(line, "verify accept") == 0)
+    {
+        session->state = SESSION_ACCEPT_PASSWORD;
+        fprintf(out, "Enter password: ");
+    }
+    else if (strcmp(line, "change") == 0)
+    {
+        session->state = SESSION_CHANGE_OLD;
+        fprintf(out, "Enter old password: ");
+    }
+    else if (strcmp(line, "status") == 0)
+    {
+        print_status(out);
+    }
+    else if (strcmp(line, "stats") == 0)
+    {
+        print_stats(out);
+    }
+    else if (strcmp(line, "reload") == 0)
+    {
+        policy_request_reload("reload command");
+        fprintf(out, "Reloading %s in the background. See 'status' for the result.\n", TEMPLATE_FILE);
+    }
+    else if (strcmp(line, "stop") == 0)
+    {
+        // The main loop shuts down once this command's output is queued
+        fprintf(out, "Stopping file protection system...\n");
+        log_message("Stopping file protection system");
+        atomic_store(&stop_requested, 1);
+    }
+    else
+    {
+        fprintf(out, "Unknown command. Type 'help' for available commands.\n");
+        char log_buf[MAX_PATH_LEN + 100];
+        create_log_buffer(log_buf, sizeof(log_buf), "Unknown command entered: %.*s", MAX_FILENAME_LEN, line);
+        log_message(log_buf);
+    }
 }
 
-// Function to authenticate the user
-int authenticate_user()
+// Function to finish a password command once the auth thread has answered
+void handle_auth_result(CommandSession *session, AuthKind kind, int result, FILE *out)
 {
-    char password[256];
-    printf("Enter password: ");
-    if (fgets(password, sizeof(password), stdin))
+    session->state = SESSION_COMMAND;
+    if (kind == AUTH_DISABLE)
     {
-        password[strcspn(password, "\n")] = 0; // Remove newline
-        if (check_password(password))
+        if (result == 1)
         {
-            return 1;
+            disable_protection(out);
         }
         else
         {
-            printf("Incorrect password.\n");
+            fprintf(out, "Incorrect password.\n");
             log_message("Attempt to disable protection with incorrect password");
-            return 0;
         }
     }
-    return 0;
-}
-
-// Function to change password interactively
-void change_password_interactive()
-{
-    char old_password[256], new_password[256];
-    printf("Enter old password: ");
-    if (fgets(old_password, sizeof(old_password), stdin))
+    else if (kind == AUTH_VERIFY_ACCEPT)
     {
-        old_password[strcspn(old_password, "\n")] = 0;
-        printf("Enter new password: ");
-        if (fgets(new_password, sizeof(new_password), stdin))
+        if (result == 1)
+        {
+            start_verify(VERIFY_ACCEPT, out);
+        }
+        else
         {
-            new_password[strcspn(new_password, "\n")] = 0;
-            if (change_password(old_password, new_password) == 0)
-            {
-                printf("Password changed successfully.\n");
-                log_message("Password changed successfully");
-            }
-            else
-            {
-                printf("Failed to change password. Make sure the old password is correct.\n");
-                log_message("Failed attempt to change password");
-            }
+            fprintf(out, "Incorrect password.\n");
+            log_message("Attempt to accept file contents with incorrect password");
         }
     }
+    else if (result == 0)
+    {
+        fprintf(out, "Password changed successfully.\n");
+        log_message("Password changed successfully");
+    }
+    else
+    {
+        fprintf(out, "Failed to change password. Make sure the old password is correct.\n");
+        log_message("Failed attempt to change password");
+    }
 }
 
 // Function to print the current status of the protection system
-void print_status()
+void print_status(FILE *out)
 {
-    printf("Protection status: %s\n", protection_enabled ? "Enabled" : "Disabled");
-    printf("Protected directory: %s\n", protected_directory);
+    // The policy is read once, so the directories and template counts agree
+    char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+    int slots[POLICY_MAX_ROOTS];
+    int pattern_counts[POLICY_MAX_ROOTS];
+    int pattern_count = 0;
+    MatcherStats matcher_stats = {0};
+    size_t path_includes = 0, path_exclusions = 0, path_nodes = 0;
+    policy_read_lock();
+    const Policy *policy = policy_current();
+    int root_count = policy->root_count;
+    for (int r = 0; r < root_count; r++)
+    {
+        const PolicyRoot *root = &policy->roots[r];
+        MatcherStats root_stats;
+        matcher_get_stats(root->matcher, &root_stats);
+        matcher_stats.exact += root_stats.exact;
+        matcher_stats.suffixes += root_stats.suffixes;
+        matcher_stats.globs += root_stats.globs;
+        matcher_stats.fallback += root_stats.fallback;
+        matcher_stats.dfa_states += root_stats.dfa_states;
+        size_t includes, exclusions, nodes;
+        path_rules_get_stats(root->rules, &includes, &exclusions, &nodes);
+        path_includes += includes;
+        path_exclusions += exclusions;
+        path_nodes += nodes;
+        strcpy(roots[r], root->path);
+        slots[r] = root->slot;
+        pattern_counts[r] = root->pattern_count;
+        pattern_count += root->pattern_count;
+    }
+    policy_read_unlock();
+
+    fprintf(out, "Protection status: %s\n", protection_enabled ? "Enabled" : "Disabled");
+    for (int r = 0; r < root_count; r++)
+    {
+        size_t root_watched = 0;
+        int instances = 0;
+        for (int i = 0; i < inotify_shard_count; i++)
+        {
+            if (inotify_shards[i].root != slots[r])
+                continue;
+            root_watched += inotify_shards[i].watches.count;
+            instances++;
+        }
+        RootStats root_stats;
+        metrics_get_root(slots[r], &root_stats);
+        fprintf(out, "Protected directory: %s\n", roots[r]);
+        fprintf(out, "  %d templates, %zu watches on %d inotify instance(s), %d worker(s); %lu events, %lu actions, "
+               "enforcement p99 %.0f us\n",
+               pattern_counts[r], root_watched, instances, pipeline_root_workers(slots[r]), root_stats.events,
+               root_stats.actions, root_stats.enforce.p99_us);
+    }
+    size_t watched = 0;
+    for (int i = 0; i < inotify_shard_count; i++)
+    {
+        watched += inotify_shards[i].watches.count;
+    }
+    long dir_fds, dir_fd_limit;
+    watch_dir_fds_get_stats(&dir_fds, &dir_fd_limit);
+    fprintf(out, "Watched directories: %zu across %d inotify instance(s), %ld held open for enforcement (limit %ld)\n",
+           watched, inotify_shard_count, dir_fds, dir_fd_limit);
+    DirTreeStats tree;
+    dir_tree_get_stats(&tree);
+    fprintf(out, "  directory tree: %zu names (%zu bytes) in %zu KiB of arena, %zu KiB index\n", tree.nodes,
+           tree.name_bytes, tree.arena_bytes / 1024, tree.table_bytes / 1024);
+    for (int i = 0; i < inotify_shard_count; i++)
+    {
+        fprintf(out, "  instance %d: %zu watches (table capacity %zu, load factor %.2f)\n", i,
+               inotify_shards[i].watches.count, inotify_shards[i].watches.capacity,
+               watch_table_load_factor(&inotify_shards[i].watches));
+    }
+    WatchLifecycleStats lifecycle;
+    watch_lifecycle_get_stats(&lifecycle);
+    fprintf(out, "  directory renames: %lu paired (%lu moved in place, %lu rescanned), %lu moved out, %d pending; "
+           "%lu watches retired, %lu directories removed\n",
+           lifecycle.paired, lifecycle.reparented, lifecycle.rescanned, lifecycle.moved_out, lifecycle.pending,
+           lifecycle.retired, lifecycle.deleted);
+
+    if (fanotify_backend_active())
+    {
+        unsigned long fan_events, fan_denied, fan_hits, fan_marks;
+        fanotify_backend_get_stats(&fan_events, &fan_denied, &fan_hits, &fan_marks);
+        fprintf(out, "fanotify: %lu permission events, %lu denied, %lu verdict cache hits, %lu kernel ignore marks\n",
+               fan_events, fan_denied, fan_hits, fan_marks);
+    }
+
+    PipelineStats pipeline;
+    pipeline_get_stats(&pipeline);
+    fprintf(out, "Event pipeline: %lu events in %lu reads, %d worker(s), reader waited on a full queue %lu times\n",
+           pipeline.events, pipeline.reads, pipeline.workers, pipeline.stalls);
+    fprintf(out, "  read buffer %zu KiB, largest kernel backlog %zu bytes\n", pipeline.read_buffer / 1024,
+           pipeline.max_backlog);
+    for (int i = 0; i < pipeline.workers; i++)
+    {
+        fprintf(out, "  worker %d: %lu events handled, queue %zu/%d (peak %zu)\n", i, pipeline.processed[i],
+               pipeline.depth[i], PIPELINE_QUEUE_CAPACITY, pipeline.high_water[i]);
+    }
+    fprintf(out, "Event coalescing (%u us window): %lu events, %lu merged, %lu create/delete pairs cancelled, %lu dispatched from window\n",
+           config.coalesce_window_us, pipeline.coalesced_events, pipeline.merged, pipeline.cancelled,
+           pipeline.dispatched);
+    SelfEventStats self_events;
+    self_event_get_stats(&self_events);
+    AuditStats audit;
+    audit_log_get_stats(&audit);
+    if (audit.active)
+    {
+        fprintf(out, "Audit log: segment %08llu with %lu records and %lu paths; %lu records in %lu segments this run, "
+               "%lu failed writes\n",
+               audit.sequence, audit.records, audit.paths, audit.total_records, audit.segments, audit.failed_writes);
+    }
+    fprintf(out, "Self-generated events: %lu suppressed of %lu expected, %lu expired, %lu not tracked, %zu pending\n",
+           self_events.suppressed, self_events.expected, self_events.expired, self_events.dropped,
+           self_events.pending);
+
+    ResyncStats resync;
+    resync_get_stats(&resync);
+    if (resync.overflows > 0)
+    {
+        fprintf(out, "Queue overflows: %lu, resyncs: %lu%s (last %.3fs, longest %.3fs, total %.3fs)\n", resync.overflows,
+               resync.resyncs, resync.running ? " (one running)" : "", resync.last_duration, resync.longest_duration,
+               resync.total_duration);
+        fprintf(out, "  %ld directories rescanned, %ld files restored, %ld removed, %ld recreated, %ld failed, "
+                     "%ld new subtrees, %ld stale watches dropped\n",
+               resync.directories, resync.restored, resync.removed, resync.recreated, resync.failed,
+               resync.new_subtrees, resync.stale_watches);
+    }
+
+    size_t index_count, index_capacity;
+    state_index_get_stats(&index_count, &index_capacity);
+    if (index_capacity > 0)
+    {
+        fprintf(out, "State index: %zu entries (capacity %zu)\n", index_count, index_capacity);
+    }
+
+    if (snapshot_store_active())
+    {
+        SnapshotStats snapshots;
+        snapshot_get_stats(&snapshots);
+        fprintf(out, "Snapshots: %lu captured (%lu already stored, %llu bytes new), %lu reflinked, %lu copied in kernel, "
+               "%lu restored, %lu failed\n",
+               snapshots.captured, snapshots.deduplicated, snapshots.bytes, snapshots.reflinked, snapshots.copied,
+               snapshots.restored, snapshots.failed);
+    }
+
+    SweepStatus sweep_status;
+    if (sweep_get_status(&sweep_status) == 0)
+    {
+        fprintf(out, "Last sweep (%s): %s, %ld files matched, %ld changed, %ld already in state, %ld failed (%.1fs)\n",
+               sweep_status.mode == SWEEP_PROTECT ? "protect" : "unprotect",
+               sweep_status.running ? "running" : sweep_status.cancelled ? "cancelled" : "finished",
+               sweep_status.matched, sweep_status.changed, sweep_status.unchanged, sweep_status.failed,
+               sweep_status.elapsed);
+    }
+
+    VerifyStatus verify_status;
+    if (verify_get_status(&verify_status) == 0)
+    {
+        fprintf(out, "Last verify (%s): %s, %ld files, %ld hashed (%.1f MB), %ld unchanged, %ld new, %ld drifted, "
+               "%ld missing, %ld restored, %ld failed (%.1fs, %s SHA-256",
+               verify_status.mode == VERIFY_RESTORE ? "restore" : verify_status.mode == VERIFY_ACCEPT ? "accept" : "report",
+               verify_status.running ? "running" : verify_status.cancelled ? "cancelled" : "finished",
+               verify_status.files, verify_status.hashed, (double)verify_status.bytes / (1024.0 * 1024.0),
+               verify_status.unchanged, verify_status.added, verify_status.drifted, verify_status.missing,
+               verify_status.restored, verify_status.failed, verify_status.elapsed, sha256_implementation());
+        if (config.verify_mbps > 0)
+        {
+            fprintf(out, ", %u MB/s limit", config.verify_mbps);
+        }
+        fprintf(out, ")\n");
+    }
+
+    fprintf(out, "Templates: %d (%zu exact, %zu extensions, %zu globs, %zu fnmatch fallbacks, %zu cached DFA states)\n",
+           pattern_count, matcher_stats.exact, matcher_stats.suffixes, matcher_stats.globs,
+           matcher_stats.fallback, matcher_stats.dfa_states);
+    if (path_includes + path_exclusions > 0)
+    {
+        fprintf(out, "Path templates: %zu patterns, %zu exclusions (%zu trie nodes)\n", path_includes,
+               path_exclusions, path_nodes);
+    }
+
+    PolicyStats policy_stats;
+    policy_get_stats(&policy_stats);
+    fprintf(out, "Policy generation %lu: %lu reloads (%lu unchanged, %lu failed)%s\n", policy_stats.generation,
+           policy_stats.reloads, policy_stats.unchanged, policy_stats.failed,
+           policy_stats.running ? ", one running" : "");
+    if (policy_stats.reloads > policy_stats.unchanged + policy_stats.failed)
+    {
+        fprintf(out, "  last change: %ld files protected, %ld unprotected, %ld failed, %ld watches added, %ld removed (%.3fs)\n",
+               policy_stats.protected_files, policy_stats.unprotected_files, policy_stats.failed_files,
+               policy_stats.watches_added, policy_stats.watches_removed, policy_stats.last_duration);
+    }
+
+    size_t log_depth, log_capacity;
+    unsigned long log_dropped, log_written;
+    logger_get_stats(&log_depth, &log_capacity, &log_dropped, &log_written);
+    fprintf(out, "Log queue: %zu/%zu pending, %lu written, %lu dropped\n", log_depth, log_capacity, log_written, log_dropped);
     char log_buf[MAX_PATH_LEN + 100];
     create_log_buffer(log_buf, sizeof(log_buf), "Status checked. Protection: %s", protection_enabled ? "Enabled" : "Disabled");
     log_message(log_buf);
 }
 
-// Function to disable protection and restore file permissions
-void disable_protection()
+static void print_latency(FILE *out, const char *label, MetricHistogram histogram)
 {
-    protection_enabled = 0;
-    printf("Disabling protection...\n");
-    log_message("Disabling protection");
-
-    remove_protection_recursive(protected_directory);
-
-    printf("Protection disabled.\n");
-    log_message("Protection disabled");
+    LatencySummary summary;
+    metrics_get_latency(histogram, &summary);
+    fprintf(out, "  %-22s %8lu samples, p50 %.0f us, p90 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n", label,
+           summary.count, summary.p50_us, summary.p90_us, summary.p99_us, summary.p999_us, summary.max_us);
 }
 
-void remove_protection_recursive(const char *path)
+// Function to print the runtime counters and latency percentiles
+void print_stats(FILE *out)
 {
-    DIR *dir;
-    struct dirent *entry;
-    char full_path[MAX_PATH_LEN];
+    fprintf(out, "Events read: %lu (create %lu, delete %lu, modify %lu, moved from %lu, moved to %lu, move self %lu, "
+           "delete self %lu, ignored %lu, overflow %lu)\n",
+           metrics_counter_total(METRIC_EVENTS_READ), metrics_counter_total(METRIC_EVENT_CREATE),
+           metrics_counter_total(METRIC_EVENT_DELETE), metrics_counter_total(METRIC_EVENT_MODIFY),
+           metrics_counter_total(METRIC_EVENT_MOVED_FROM), metrics_counter_total(METRIC_EVENT_MOVED_TO),
+           metrics_counter_total(METRIC_EVENT_MOVE_SELF), metrics_counter_total(METRIC_EVENT_DELETE_SELF),
+           metrics_counter_total(METRIC_EVENT_IGNORED), metrics_counter_total(METRIC_EVENT_OVERFLOW));
+    fprintf(out, "Matcher: %lu hits, %lu misses\n", metrics_counter_total(METRIC_MATCHER_HIT),
+           metrics_counter_total(METRIC_MATCHER_MISS));
+    fprintf(out, "protect_file: %lu ok, %lu failed\n", metrics_counter_total(METRIC_PROTECT_OK),
+           metrics_counter_total(METRIC_PROTECT_FAILED));
+    fprintf(out, "Blocked creations: %lu unlinked, %lu unlink failures\n", metrics_counter_total(METRIC_UNLINK_OK),
+           metrics_counter_total(METRIC_UNLINK_FAILED));
+    fprintf(out, "Restores: %lu from snapshot, %lu recreated empty, %lu failed\n",
+           metrics_counter_total(METRIC_RESTORE_SNAPSHOT), metrics_counter_total(METRIC_RESTORE_EMPTY),
+           metrics_counter_total(METRIC_RESTORE_FAILED));
 
-    dir = opendir(path);
-    if (dir == NULL)
+    size_t watched = 0;
+    for (int i = 0; i < inotify_shard_count; i++)
     {
-        char log_buf[MAX_PATH_LEN + 100];
-        snprintf(log_buf, sizeof(log_buf), "Failed to open directory for removing protection: %s", path);
-        log_message(log_buf);
-        return;
+        watched += inotify_shards[i].watches.count;
     }
+    size_t log_depth, log_capacity;
+    unsigned long log_dropped, log_written;
+    logger_get_stats(&log_depth, &log_capacity, &log_dropped, &log_written);
+    fprintf(out, "Watches: %zu, log queue: %zu/%zu\n", watched, log_depth, log_capacity);
+
+    fprintf(out, "Latency:\n");
+    print_latency(out, "read to worker", METRIC_LATENCY_QUEUE);
+    print_latency(out, "read to enforcement", METRIC_LATENCY_ENFORCE);
+    print_latency(out, "protect_file", METRIC_LATENCY_PROTECT);
+    print_latency(out, "restore", METRIC_LATENCY_RESTORE);
 
-    while ((entry = readdir(dir)) != NULL)
+    char roots[POLICY_MAX_ROOTS][MAX_PATH_LEN];
+    int slots[POLICY_MAX_ROOTS];
+    int root_count = policy_copy_roots(roots, slots);
+    fprintf(out, "Read to enforcement by protected directory:\n");
+    for (int r = 0; r < root_count; r++)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+        RootStats stats;
+        metrics_get_root(slots[r], &stats);
+        fprintf(out, "  %s: %lu events, %lu actions, %lu timed, p50 %.0f us, p99 %.0f us, max %.0f us\n", roots[r],
+               stats.events, stats.actions, stats.enforce.count, stats.enforce.p50_us, stats.enforce.p99_us,
+               stats.enforce.max_us);
+    }
+    if (config.metrics_path != NULL)
+    {
+        fprintf(out, "Prometheus metrics: %s\n", config.metrics_path);
+    }
+}
 
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+// Function to enable protection and start protecting existing files
+void enable_protection(FILE *out)
+{
+    protection_enabled = 1;
+    fanotify_backend_invalidate();
+    fprintf(out, "Protection enabled. Protecting existing files in the background.\n");
+    log_message("Protection enabled");
 
-        if (entry->d_type == DT_DIR)
-        {
-            remove_protection_recursive(full_path);
-        }
-        else if (entry->d_type == DT_REG)
-        {
-            if (is_protected(full_path))
-            {
-                clear_immutable_flag(full_path);
-                restore_permissions(full_path);
-                char log_buf[MAX_PATH_LEN + 100];
-                snprintf(log_buf, sizeof(log_buf), "Removed protection from file: %s", full_path);
-                log_message(log_buf);
-            }
-        }
-    }
+    sweep_start(SWEEP_PROTECT);
+}
+
+// Function to disable protection and start restoring file permissions
+void disable_protection(FILE *out)
+{
+    protection_enabled = 0;
+    fanotify_backend_invalidate();
+    fprintf(out, "Protection disabled. Removing protection from files in the background.\n");
+    log_message("Protection disabled");
 
-    closedir(dir);
+    sweep_start(SWEEP_UNPROTECT);
 }
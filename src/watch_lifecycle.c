@@ -0,0 +1,307 @@
+#include "file_protection.h"
+
+// Directory renames and moves inside the protected trees. inotify reports a
+// rename as IN_MOVED_FROM on the old parent and IN_MOVED_TO on the new one,
+// paired by a cookie; the halves can reach different workers when the two
+// parents are watched by different instances, so either may be seen first.
+//
+// A directory moved within its tree keeps its inotify watch and the watches
+// of everything below it. When the IN_MOVED_FROM half is seen first, the
+// IN_MOVED_TO handler re-parents the directory's interned node, which fixes
+// the path of the whole subtree at once. When IN_MOVED_TO comes first it
+// rescans the new location as it always did, and the late IN_MOVED_FROM
+// only completes the pair. An IN_MOVED_FROM whose other half does not follow
+// within WATCH_MOVE_PAIR_MS moved the directory out of the tree: the watches
+// at or below its old path are retired, so events there are no longer
+// enforced under paths that no longer exist.
+
+#define MOVE_HALF_FROM 1
+#define MOVE_HALF_TO 2
+
+typedef struct
+{
+    uint32_t cookie;
+    int half; // Which half was seen first; 0 if the entry is free
+    int root;
+    uint64_t deadline_ns;
+    DirNode *from; // Node of the old path, referenced; NULL for a TO half
+} PendingMove;
+
+static PendingMove pending_moves[WATCH_MOVE_PENDING_MAX];
+static pthread_mutex_t move_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int moves_pending = 0;
+
+static atomic_ulong moves_paired = 0;
+static atomic_ulong moves_reparented = 0;
+static atomic_ulong moves_rescanned = 0;
+static atomic_ulong moves_out = 0;
+static atomic_ulong watches_retired = 0;
+static atomic_ulong directories_deleted = 0;
+
+static PendingMove *move_find(uint32_t cookie)
+{
+    for (int i = 0; i < WATCH_MOVE_PENDING_MAX; i++)
+    {
+        if (pending_moves[i].half != 0 && pending_moves[i].cookie == cookie)
+            return &pending_moves[i];
+    }
+    return NULL;
+}
+
+// Function to claim a free entry, or the one closest to expiring
+static PendingMove *move_claim(void)
+{
+    PendingMove *oldest = &pending_moves[0];
+    for (int i = 0; i < WATCH_MOVE_PENDING_MAX; i++)
+    {
+        if (pending_moves[i].half == 0)
+            return &pending_moves[i];
+        if (pending_moves[i].deadline_ns < oldest->deadline_ns)
+            oldest = &pending_moves[i];
+    }
+    // Its pair never came in time either; dropping it only skips a cleanup
+    dir_tree_release(oldest->from);
+    oldest->half = 0;
+    atomic_fetch_sub(&moves_pending, 1);
+    return oldest;
+}
+
+static void move_clear(PendingMove *move)
+{
+    move->half = 0;
+    move->from = NULL;
+    atomic_fetch_sub(&moves_pending, 1);
+}
+
+// Function to stop enforcing in, and remove the watches of, every directory
+// of a root at or below a node whose path has moved away. A watch whose
+// directory is still found at its recorded path belongs to a directory that
+// took the old name since, and is kept.
+static long watch_retire_below(int root, DirNode *node)
+{
+    long retired = 0;
+    int shard_count = atomic_load(&inotify_shard_count);
+    for (int i = 0; i < shard_count; i++)
+    {
+        InotifyShard *shard = &inotify_shards[i];
+        if (shard->root != root)
+            continue;
+
+        // Collect candidates under the lock, stat them without it
+        typedef struct
+        {
+            int wd;
+            dev_t dev;
+            ino_t ino;
+            char *path;
+        } Candidate;
+        Candidate *candidates = NULL;
+        size_t count = 0, capacity = 0;
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t slot = 0; slot < shard->watches.capacity; slot++)
+        {
+            WatchInfo *watch = &shard->watches.slots[slot];
+            if (watch->wd == 0 || !dir_tree_is_within(watch->dir, node))
+                continue;
+            char path[MAX_PATH_LEN];
+            if (dir_tree_path(watch->dir, path, sizeof(path)) < 0)
+                continue;
+            if (count == capacity)
+            {
+                size_t new_capacity = capacity ? capacity * 2 : 64;
+                Candidate *grown = realloc(candidates, new_capacity * sizeof(Candidate));
+                if (grown == NULL)
+                    break;
+                candidates = grown;
+                capacity = new_capacity;
+            }
+            char *copy = strdup(path);
+            if (copy == NULL)
+                break;
+            candidates[count++] = (Candidate){watch->wd, watch->dev, watch->ino, copy};
+        }
+        pthread_rwlock_unlock(&shard->lock);
+
+        for (size_t j = 0; j < count; j++)
+        {
+            struct stat st;
+            int still_there = stat(candidates[j].path, &st) == 0 && st.st_dev == candidates[j].dev &&
+                              st.st_ino == candidates[j].ino;
+            if (!still_there)
+            {
+                pthread_rwlock_wrlock(&shard->lock);
+                WatchInfo *watch = watch_table_find(&shard->watches, candidates[j].wd);
+                if (watch != NULL)
+                    watch->inside_root = 0;
+                pthread_rwlock_unlock(&shard->lock);
+                // The IN_IGNORED that follows releases the table slot
+                if (inotify_rm_watch(shard->fd, candidates[j].wd) == 0)
+                    retired++;
+            }
+            free(candidates[j].path);
+        }
+        free(candidates);
+    }
+    atomic_fetch_add(&watches_retired, (unsigned long)retired);
+    return retired;
+}
+
+// Function to retire the subtrees of directories whose IN_MOVED_FROM found
+// no IN_MOVED_TO in time
+void watch_moves_expire(void)
+{
+    if (atomic_load(&moves_pending) == 0)
+        return;
+
+    PendingMove expired[WATCH_MOVE_PENDING_MAX];
+    int count = 0;
+    uint64_t now = metrics_now_ns();
+    pthread_mutex_lock(&move_lock);
+    for (int i = 0; i < WATCH_MOVE_PENDING_MAX; i++)
+    {
+        PendingMove *move = &pending_moves[i];
+        if (move->half == 0 || move->deadline_ns > now)
+            continue;
+        if (move->half == MOVE_HALF_FROM)
+            expired[count++] = *move;
+        move_clear(move);
+    }
+    pthread_mutex_unlock(&move_lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        char path[MAX_PATH_LEN];
+        if (dir_tree_path(expired[i].from, path, sizeof(path)) < 0)
+            path[0] = '\0';
+        long retired = watch_retire_below(expired[i].root, expired[i].from);
+        atomic_fetch_add(&moves_out, 1);
+        dir_tree_release(expired[i].from);
+
+        char log_buf[MAX_PATH_LEN + 100];
+        snprintf(log_buf, sizeof(log_buf), "Directory moved out of protected tree: %s (%ld watches retired)", path,
+                 retired);
+        log_message(log_buf);
+    }
+}
+
+// Function to record the IN_MOVED_FROM half of a directory rename
+void watch_moved_from(InotifyShard *shard, const struct inotify_event *event)
+{
+    char path[MAX_PATH_LEN];
+    if (inotify_shard_file_path(shard, event->wd, event->name, path) < 0)
+        return;
+
+    // Only a directory we watch has anything to move or retire
+    DirNode *node = dir_tree_lookup(path);
+    pthread_mutex_lock(&move_lock);
+    PendingMove *move = move_find(event->cookie);
+    if (move != NULL && move->half == MOVE_HALF_TO)
+    {
+        // The new location was already rescanned
+        move_clear(move);
+        atomic_fetch_add(&moves_paired, 1);
+    }
+    else if (node != NULL)
+    {
+        move = move_claim();
+        *move = (PendingMove){event->cookie, MOVE_HALF_FROM, shard->root,
+                              metrics_now_ns() + (uint64_t)WATCH_MOVE_PAIR_MS * 1000000ULL, node};
+        atomic_fetch_add(&moves_pending, 1);
+        node = NULL;
+    }
+    pthread_mutex_unlock(&move_lock);
+    dir_tree_release(node);
+}
+
+// Function to handle the IN_MOVED_TO half of a directory rename. Returns 1 if
+// the watched subtree was moved to path in place, 0 if the caller should
+// watch path as a new subtree.
+int watch_moved_to(InotifyShard *shard, const struct inotify_event *event, const char *path)
+{
+    DirNode *from = NULL;
+    int from_root = -1;
+    pthread_mutex_lock(&move_lock);
+    PendingMove *move = move_find(event->cookie);
+    if (move != NULL && move->half == MOVE_HALF_FROM)
+    {
+        from = move->from;
+        from_root = move->root;
+        move_clear(move);
+        atomic_fetch_add(&moves_paired, 1);
+    }
+    else if (move == NULL)
+    {
+        move = move_claim();
+        *move = (PendingMove){event->cookie, MOVE_HALF_TO, shard->root,
+                              metrics_now_ns() + (uint64_t)WATCH_MOVE_PAIR_MS * 1000000ULL, NULL};
+        atomic_fetch_add(&moves_pending, 1);
+    }
+    pthread_mutex_unlock(&move_lock);
+
+    if (from == NULL)
+    {
+        atomic_fetch_add(&moves_rescanned, 1);
+        return 0;
+    }
+
+    // Moving the node is only right when the subtree stays under the same
+    // root and templates; path templates may prune it differently at its new
+    // place, so it is rescanned instead
+    policy_read_lock();
+    const PolicyRoot *root = policy_root_for_slot(policy_current(), shard->root);
+    int same_rules = from_root == shard->root && root != NULL && root->rules == NULL;
+    policy_read_unlock();
+
+    int moved = same_rules && dir_tree_move(from, path) == 0;
+    if (!moved)
+    {
+        watch_retire_below(from_root, from);
+        atomic_fetch_add(&moves_rescanned, 1);
+    }
+    else
+    {
+        atomic_fetch_add(&moves_reparented, 1);
+    }
+    dir_tree_release(from);
+    return moved;
+}
+
+// Function to retire the watch of a subdirectory removed from a watched
+// directory. The directory's O_PATH descriptor keeps its inode alive, so the
+// kernel would not report IN_DELETE_SELF until the descriptor is closed.
+void watch_subdir_removed(InotifyShard *shard, const struct inotify_event *event)
+{
+    char path[MAX_PATH_LEN];
+    if (inotify_shard_file_path(shard, event->wd, event->name, path) < 0)
+        return;
+
+    DirNode *node = dir_tree_lookup(path);
+    if (node == NULL)
+        return;
+    if (watch_retire_below(shard->root, node) > 0)
+        atomic_fetch_add(&directories_deleted, 1);
+    dir_tree_release(node);
+}
+
+// Function to stop enforcing in a directory the kernel reports deleted. Its
+// IN_IGNORED follows and releases the table slot.
+void watch_deleted(InotifyShard *shard, int wd)
+{
+    pthread_rwlock_wrlock(&shard->lock);
+    WatchInfo *watch = watch_table_find(&shard->watches, wd);
+    if (watch != NULL)
+        watch->inside_root = 0;
+    pthread_rwlock_unlock(&shard->lock);
+    atomic_fetch_add(&directories_deleted, 1);
+}
+
+void watch_lifecycle_get_stats(WatchLifecycleStats *stats)
+{
+    stats->paired = atomic_load(&moves_paired);
+    stats->reparented = atomic_load(&moves_reparented);
+    stats->rescanned = atomic_load(&moves_rescanned);
+    stats->moved_out = atomic_load(&moves_out);
+    stats->retired = atomic_load(&watches_retired);
+    stats->deleted = atomic_load(&directories_deleted);
+    stats->pending = atomic_load(&moves_pending);
+}
@@ -0,0 +1,239 @@
+#include "file_protection.h"
+#include <sys/resource.h>
+
+// Open-addressed (linear probing) hash map from inotify watch descriptor to
+// the directory node it watches, stored inline in the slots. A node keeps an
+// interned path (see dir_tree.c) rather than a full path buffer. Removal
+// uses backward-shift deletion, so the table never accumulates tombstones and
+// lookups stay O(1) as it grows.
+//
+// Each node can also hold an O_PATH descriptor of its directory, so
+// enforcement opens files by name relative to it instead of resolving the
+// full path again. These descriptors are budgeted against RLIMIT_NOFILE;
+// directories past the budget fall back to paths.
+
+static atomic_long dir_fds_open = 0;
+static long dir_fds_limit = 0;
+
+static size_t watch_table_slot(const WatchTable *table, int wd)
+{
+    uint64_t h = (uint64_t)(uint32_t)wd * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (table->capacity - 1);
+}
+
+static int watch_table_resize(WatchTable *table, size_t new_capacity)
+{
+    WatchInfo *new_slots = calloc(new_capacity, sizeof(WatchInfo));
+    if (new_slots == NULL)
+    {
+        log_message("Memory allocation failed while growing watch table");
+        return -1;
+    }
+
+    WatchInfo *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].wd == 0)
+            continue;
+
+        size_t slot = watch_table_slot(table, old_slots[i].wd);
+        while (table->slots[slot].wd != 0)
+        {
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+        table->slots[slot] = old_slots[i];
+    }
+
+    free(old_slots);
+    return 0;
+}
+
+int watch_table_init(WatchTable *table, size_t initial_capacity)
+{
+    size_t capacity = WATCH_TABLE_MIN_CAPACITY;
+    while (capacity < initial_capacity)
+    {
+        capacity <<= 1;
+    }
+
+    table->slots = calloc(capacity, sizeof(WatchInfo));
+    if (table->slots == NULL)
+    {
+        log_message("Memory allocation failed while creating watch table");
+        return -1;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    return 0;
+}
+
+void watch_table_destroy(WatchTable *table)
+{
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        if (table->slots[i].wd == 0)
+            continue;
+        watch_dir_fd_close(table->slots[i].dir_fd);
+        dir_tree_release(table->slots[i].dir);
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+// Nodes live in the table itself, so a returned pointer is only valid until
+// the next insertion or removal; callers hold the instance's lock.
+WatchInfo *watch_table_find(const WatchTable *table, int wd)
+{
+    if (table->count == 0 || wd <= 0)
+        return NULL;
+
+    size_t slot = watch_table_slot(table, wd);
+    while (table->slots[slot].wd != 0)
+    {
+        if (table->slots[slot].wd == wd)
+            return &table->slots[slot];
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+// Insert or update the node for a watch descriptor. inotify hands back the
+// same wd when an already-watched inode is added again, so an existing entry
+// is refreshed in place rather than duplicated.
+WatchInfo *watch_table_insert(WatchTable *table, int wd, const char *path)
+{
+    // Interned first, so a path that only moved keeps its shared prefix
+    DirNode *dir = dir_tree_intern(path);
+    if (dir == NULL)
+    {
+        log_message("Memory allocation failed for watch path");
+        return NULL;
+    }
+
+    WatchInfo *node = watch_table_find(table, wd);
+    if (node == NULL)
+    {
+        if ((table->count + 1) * 100 > table->capacity * WATCH_TABLE_MAX_LOAD_PERCENT)
+        {
+            if (watch_table_resize(table, table->capacity << 1) < 0)
+            {
+                dir_tree_release(dir);
+                return NULL;
+            }
+        }
+
+        size_t slot = watch_table_slot(table, wd);
+        while (table->slots[slot].wd != 0)
+        {
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+        node = &table->slots[slot];
+        memset(node, 0, sizeof(*node));
+        node->wd = wd;
+        node->dir_fd = -1;
+        table->count++;
+    }
+
+    dir_tree_release(node->dir);
+    node->dir = dir;
+    return node;
+}
+
+int watch_table_remove(WatchTable *table, int wd)
+{
+    if (table->count == 0 || wd <= 0)
+        return -1;
+
+    size_t mask = table->capacity - 1;
+    size_t slot = watch_table_slot(table, wd);
+    while (table->slots[slot].wd != 0 && table->slots[slot].wd != wd)
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (table->slots[slot].wd == 0)
+        return -1;
+
+    watch_dir_fd_close(table->slots[slot].dir_fd);
+    dir_tree_release(table->slots[slot].dir);
+    table->slots[slot].wd = 0;
+    table->count--;
+
+    // Backward-shift the rest of the probe run so no lookup chain is broken
+    size_t hole = slot;
+    size_t next = (slot + 1) & mask;
+    while (table->slots[next].wd != 0)
+    {
+        size_t home = watch_table_slot(table, table->slots[next].wd);
+        // Move the entry into the hole unless its home lies cyclically in (hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            table->slots[hole] = table->slots[next];
+            table->slots[next].wd = 0;
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    return 0;
+}
+
+double watch_table_load_factor(const WatchTable *table)
+{
+    if (table->capacity == 0)
+        return 0.0;
+    return (double)table->count / (double)table->capacity;
+}
+
+// Function to raise the open file limit to its hard maximum and size the
+// budget of directory descriptors from it
+void watch_dir_fds_init(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return;
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        struct rlimit raised = {limit.rlim_max, limit.rlim_max};
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+            limit = raised;
+    }
+    long budget = limit.rlim_cur == RLIM_INFINITY ? LONG_MAX : (long)limit.rlim_cur - WATCH_DIR_FD_RESERVE;
+    dir_fds_limit = budget > 0 ? budget : 0;
+}
+
+// Function to open the O_PATH descriptor kept for a watched directory.
+// Returns -1 once the budget is used up.
+int watch_dir_fd_open(int dir_fd)
+{
+    if (atomic_fetch_add(&dir_fds_open, 1) >= dir_fds_limit)
+    {
+        atomic_fetch_sub(&dir_fds_open, 1);
+        return -1;
+    }
+    int fd = openat(dir_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        atomic_fetch_sub(&dir_fds_open, 1);
+    }
+    return fd;
+}
+
+void watch_dir_fd_close(int fd)
+{
+    if (fd < 0)
+        return;
+    close(fd);
+    atomic_fetch_sub(&dir_fds_open, 1);
+}
+
+void watch_dir_fds_get_stats(long *open, long *limit)
+{
+    *open = atomic_load(&dir_fds_open);
+    *limit = dir_fds_limit;
+}
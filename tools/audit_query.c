@@ -0,0 +1,461 @@
+#include "file_protection.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+// Offline query tool for the daemon's binary audit log. Segments are mapped
+// read-only, so it can run while the daemon is still appending. A path prefix
+// is first resolved against each segment's path table; a segment with no
+// matching path is skipped whole, and the sparse index skips blocks whose
+// time range or path filter rules them out. Only the remaining records are
+// read.
+
+#define QUERY_BLOOM_MAX_IDS 64 // Beyond this many matching paths, blocks are not filtered by path
+
+typedef struct
+{
+    const char *dir;
+    const char *prefix;
+    unsigned int actions; // Bit per AuditAction; 0 means all
+    int failed_only;
+    int64_t since_ms;
+    int64_t until_ms;
+    long limit;
+    int count_only;
+    int stats;
+} QueryOptions;
+
+typedef struct
+{
+    const char *path;
+    uint32_t len;
+    int match;
+} QueryPath;
+
+typedef struct
+{
+    unsigned long segments;
+    unsigned long segments_skipped;
+    unsigned long records;
+    unsigned long records_read;
+    unsigned long blocks_skipped;
+    unsigned long matched;
+} QueryStats;
+
+static const char *action_names[AUDIT_ACTION_COUNT] = {
+    [AUDIT_BLOCK_CREATE] = "create",
+    [AUDIT_RESTORE_DELETE] = "delete",
+    [AUDIT_RESTORE_MOVE_FROM] = "move-from",
+    [AUDIT_RESTORE_MOVE_TO] = "move-to",
+    [AUDIT_BLOCK_MODIFY] = "modify",
+    [AUDIT_VERIFY_DRIFT] = "drift",
+    [AUDIT_VERIFY_RESTORE] = "restored",
+};
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  --dir PATH      Audit log directory (default %s)\n", AUDIT_LOG_DIR);
+    printf("  --path PREFIX   Only paths equal to or below PREFIX\n");
+    printf("  --action LIST   Comma-separated: create, delete, move-from, move-to, modify,\n                  drift, restored\n");
+    printf("  --failed        Only actions that failed\n");
+    printf("  --since MS      Records at or after MS milliseconds since the epoch; negative is relative to now\n");
+    printf("  --until MS      Records before MS, as for --since\n");
+    printf("  --limit N       Stop after N matching records\n");
+    printf("  --count         Print only the number of matching records\n");
+    printf("  --stats         Report how much of the log was skipped\n");
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int parse_time(const char *value, int64_t *out)
+{
+    char *end;
+    errno = 0;
+    long long parsed = strtoll(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0')
+        return -1;
+    *out = parsed < 0 ? now_ms() + parsed : parsed;
+    return 0;
+}
+
+static int parse_actions(const char *value, unsigned int *out)
+{
+    char list[256];
+    snprintf(list, sizeof(list), "%s", value);
+    char *save = NULL;
+    for (char *name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        int found = 0;
+        for (int i = 1; i < AUDIT_ACTION_COUNT; i++)
+        {
+            if (strcmp(name, action_names[i]) == 0)
+            {
+                *out |= 1u << i;
+                found = 1;
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "Unknown action: %s\n", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[], QueryOptions *opts)
+{
+    *opts = (QueryOptions){
+        .dir = AUDIT_LOG_DIR,
+        .since_ms = INT64_MIN,
+        .until_ms = INT64_MAX,
+        .limit = -1,
+    };
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--failed") == 0)
+        {
+            opts->failed_only = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--count") == 0)
+        {
+            opts->count_only = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0)
+        {
+            opts->stats = 1;
+            continue;
+        }
+        if (value == NULL)
+        {
+            usage(argv[0]);
+            return -1;
+        }
+        int bad = 0;
+        if (strcmp(argv[i], "--dir") == 0)
+            opts->dir = value;
+        else if (strcmp(argv[i], "--path") == 0)
+            opts->prefix = *value != '\0' ? value : NULL;
+        else if (strcmp(argv[i], "--action") == 0)
+            bad = parse_actions(value, &opts->actions) < 0;
+        else if (strcmp(argv[i], "--since") == 0)
+            bad = parse_time(value, &opts->since_ms) < 0;
+        else if (strcmp(argv[i], "--until") == 0)
+            bad = parse_time(value, &opts->until_ms) < 0;
+        else if (strcmp(argv[i], "--limit") == 0)
+            opts->limit = atol(value);
+        else
+            bad = 1;
+        if (bad)
+        {
+            usage(argv[0]);
+            return -1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+// Function to check a path against a prefix on a component boundary
+static int prefix_matches(const char *path, size_t len, const char *prefix, size_t prefix_len)
+{
+    if (len < prefix_len || memcmp(path, prefix, prefix_len) != 0)
+        return 0;
+    return len == prefix_len || prefix[prefix_len - 1] == '/' || path[prefix_len] == '/';
+}
+
+// Function to map a whole file read-only; an empty file maps to NULL
+static const void *map_file(int dir_fd, const char *name, size_t *size)
+{
+    *size = 0;
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    const void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        else
+            *size = (size_t)st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+// Function to read a segment's path table and mark the paths under prefix.
+// Returns the number of paths, or -1 on allocation failure.
+static long load_paths(const char *data, size_t size, const char *prefix, QueryPath **out, long *matched)
+{
+    size_t prefix_len = prefix != NULL ? strlen(prefix) : 0;
+    QueryPath *paths = NULL;
+    size_t count = 0, capacity = 0;
+    *matched = 0;
+    for (size_t offset = 0; offset + sizeof(AuditPathEntry) <= size;)
+    {
+        AuditPathEntry entry;
+        memcpy(&entry, data + offset, sizeof(entry));
+        offset += sizeof(entry);
+        // A torn or out-of-order tail ends the table
+        if (entry.id != count || entry.len > size - offset)
+            break;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            QueryPath *grown = realloc(paths, capacity * sizeof(QueryPath));
+            if (grown == NULL)
+            {
+                free(paths);
+                return -1;
+            }
+            paths = grown;
+        }
+        QueryPath *path = &paths[count++];
+        path->path = data + offset;
+        path->len = entry.len;
+        path->match = prefix == NULL || prefix_matches(path->path, entry.len, prefix, prefix_len);
+        *matched += path->match;
+        offset += entry.len;
+    }
+    *out = paths;
+    return (long)count;
+}
+
+static int record_matches(const QueryOptions *opts, const AuditRecord *record, const QueryPath *paths, long path_count)
+{
+    if ((int64_t)record->wall_ms < opts->since_ms || (int64_t)record->wall_ms >= opts->until_ms)
+        return 0;
+    if (record->path_id >= (uint64_t)path_count || !paths[record->path_id].match)
+        return 0;
+    if (opts->actions != 0 && (record->action >= AUDIT_ACTION_COUNT || !(opts->actions & (1u << record->action))))
+        return 0;
+    return !opts->failed_only || (record->flags & AUDIT_FLAG_FAILED);
+}
+
+static void print_record(const AuditRecord *record, const QueryPath *path)
+{
+    time_t seconds = (time_t)(record->wall_ms / 1000);
+    struct tm tm;
+    char when[32];
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    const char *action = record->action < AUDIT_ACTION_COUNT && action_names[record->action] != NULL
+                             ? action_names[record->action]
+                             : "unknown";
+    printf("%s.%03u  %-9s %s  %.*s", when, (unsigned)(record->wall_ms % 1000), action,
+           (record->flags & AUDIT_FLAG_FAILED) ? "failed " : "ok     ", (int)path->len, path->path);
+    if (record->count > 1)
+        printf("  (%u events)", record->count);
+    printf("\n");
+}
+
+// Function to check whether a block's Bloom filter may hold one of the ids
+static int block_may_match(const AuditIndexEntry *block, const uint32_t *ids, long id_count)
+{
+    for (long i = 0; i < id_count; i++)
+    {
+        unsigned a = AUDIT_BLOOM_BIT(ids[i], 0);
+        unsigned b = AUDIT_BLOOM_BIT(ids[i], 1);
+        if ((block->bloom[a / 64] >> (a % 64) & 1) && (block->bloom[b / 64] >> (b % 64) & 1))
+            return 1;
+    }
+    return 0;
+}
+
+// Function to scan one mapped segment's records. Returns 1 once the limit
+// is reached.
+static int scan_segment(unsigned long long sequence, const char *rec_data, size_t rec_size, const char *paths_data,
+                        size_t paths_size, const AuditIndexEntry *index, size_t idx_size, const QueryOptions *opts,
+                        QueryStats *stats)
+{
+    const AuditRecord *records = (const AuditRecord *)(rec_data + sizeof(AuditSegmentHeader));
+    uint64_t record_count = (rec_size - sizeof(AuditSegmentHeader)) / sizeof(AuditRecord);
+    stats->segments++;
+    stats->records += record_count;
+
+    QueryPath *paths = NULL;
+    long matched_paths = 0;
+    long path_count = load_paths(paths_data, paths_size, opts->prefix, &paths, &matched_paths);
+    if (path_count < 0)
+    {
+        fprintf(stderr, "Out of memory reading %08llu.paths\n", sequence);
+        return 0;
+    }
+    if (matched_paths == 0)
+    {
+        stats->segments_skipped++;
+        free(paths);
+        return 0;
+    }
+
+    // Few matching paths can be looked up in each block's filter
+    uint32_t ids[QUERY_BLOOM_MAX_IDS];
+    long id_count = 0;
+    if (opts->prefix != NULL && matched_paths <= QUERY_BLOOM_MAX_IDS)
+    {
+        for (long i = 0; i < path_count; i++)
+        {
+            if (paths[i].match)
+                ids[id_count++] = (uint32_t)i;
+        }
+    }
+
+    // Walk the indexed blocks, then the records past the last full block,
+    // which are not indexed yet
+    size_t index_count = idx_size / sizeof(AuditIndexEntry);
+    int done = 0;
+    uint64_t position = 0;
+    size_t b = 0;
+    while (position < record_count && !done)
+    {
+        uint64_t end = record_count;
+        if (b < index_count && index[b].first_record == position && position + AUDIT_INDEX_BLOCK <= record_count)
+        {
+            const AuditIndexEntry *block = &index[b++];
+            end = position + AUDIT_INDEX_BLOCK;
+            if ((int64_t)block->max_wall_ms < opts->since_ms || (int64_t)block->min_wall_ms >= opts->until_ms ||
+                (id_count > 0 && !block_may_match(block, ids, id_count)))
+            {
+                stats->blocks_skipped++;
+                position = end;
+                continue;
+            }
+        }
+        else
+        {
+            index_count = 0;
+        }
+
+        for (; position < end && !done; position++)
+        {
+            stats->records_read++;
+            if (record_matches(opts, &records[position], paths, path_count))
+            {
+                stats->matched++;
+                if (!opts->count_only)
+                    print_record(&records[position], &paths[records[position].path_id]);
+                done = opts->limit >= 0 && stats->matched >= (unsigned long)opts->limit;
+            }
+        }
+    }
+    free(paths);
+    return done;
+}
+
+// Function to query one segment. Returns 1 once the limit is reached.
+static int query_segment(int dir_fd, unsigned long long sequence, const QueryOptions *opts, QueryStats *stats)
+{
+    char name[32];
+    size_t rec_size, paths_size, idx_size;
+    // Records first: the daemon writes paths before the records using them
+    snprintf(name, sizeof(name), "%08llu.rec", sequence);
+    const char *rec_data = map_file(dir_fd, name, &rec_size);
+    snprintf(name, sizeof(name), "%08llu.paths", sequence);
+    const char *paths_data = map_file(dir_fd, name, &paths_size);
+    snprintf(name, sizeof(name), "%08llu.idx", sequence);
+    const AuditIndexEntry *index = map_file(dir_fd, name, &idx_size);
+
+    int done = 0;
+    const AuditSegmentHeader *header = (const AuditSegmentHeader *)rec_data;
+    if (rec_data != NULL && rec_size >= sizeof(*header) && memcmp(header->magic, AUDIT_MAGIC, 8) == 0 &&
+        header->version == AUDIT_VERSION && header->record_size == sizeof(AuditRecord))
+    {
+        done = scan_segment(sequence, rec_data, rec_size, paths_data, paths_size, index, idx_size, opts, stats);
+    }
+    else if (rec_data != NULL)
+    {
+        fprintf(stderr, "Skipping %08llu.rec: not an audit segment of this version\n", sequence);
+    }
+
+    if (rec_data != NULL)
+        munmap((void *)rec_data, rec_size);
+    if (paths_data != NULL)
+        munmap((void *)paths_data, paths_size);
+    if (index != NULL)
+        munmap((void *)index, idx_size);
+    return done;
+}
+
+static int compare_sequence(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    QueryOptions opts;
+    int ret = parse_options(argc, argv, &opts);
+    if (ret != 0)
+        return ret < 0 ? 1 : 0;
+
+    int dir_fd = open(opts.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dup(dir_fd)) : NULL;
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", opts.dir, strerror(errno));
+        return 1;
+    }
+
+    unsigned long long *sequences = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        unsigned long long sequence = strtoull(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".rec") != 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            unsigned long long *grown = realloc(sequences, capacity * sizeof(*sequences));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            sequences = grown;
+        }
+        sequences[count++] = sequence;
+    }
+    closedir(dir);
+    qsort(sequences, count, sizeof(*sequences), compare_sequence);
+
+    QueryStats stats = {0};
+    for (size_t i = 0; i < count; i++)
+    {
+        if (query_segment(dir_fd, sequences[i], &opts, &stats))
+            break;
+    }
+    free(sequences);
+    close(dir_fd);
+
+    if (opts.count_only)
+        printf("%lu\n", stats.matched);
+    if (opts.stats)
+    {
+        fprintf(stderr,
+                "%lu matching records; read %lu of %lu records in %lu segments (%lu segments and %lu blocks "
+                "skipped)\n",
+                stats.matched, stats.records_read, stats.records, stats.segments, stats.segments_skipped,
+                stats.blocks_skipped);
+    }
+    return 0;
+}